@@ -0,0 +1,86 @@
+// -*-tab-width:4;c++-*-
+//
+// パケットの定義
+//
+// src1〜src4で個別に定義していたPacketHeader/SubHeader/Packetを共通化したものです。
+// それぞれの構造体に対応するスキーマを定義し、構造体の配置とスキーマが一致することをコンパイル時に検査します。
+// パケットへのアクセスはreinterpret_castのかわりに、スキーマのビュー(packetView)を使います。
+
+#pragma once
+
+#include <assert.h>
+#include "PacketSchema.hpp"
+
+namespace ts {
+namespace packet {
+
+  struct PacketHeader {
+	uint32_t type;
+  };
+
+  struct SubHeader {
+	uint32_t length;
+	uint8_t body[];
+  };
+
+  template <size_t PayloadSize>
+  struct Packet {
+	PacketHeader header;
+	uint8_t payload[PayloadSize];
+  };
+
+  typedef Packet<512> Packet512;
+
+  // フィールド名のタグ
+  namespace tag {
+	struct Header {};
+	struct Type {};
+	struct Payload {};
+	struct Length {};
+	struct Body {};
+  }
+
+  using PacketHeaderSchema = Schema<Field<tag::Type, uint32_t>>;
+  using SubHeaderSchema = Schema<Field<tag::Length, uint32_t>, Tail<tag::Body>>;
+  // PayloadSizeの領域にPayloadSchemaを格納するパケット
+  // PayloadSchemaが領域に収まらない場合はコンパイルエラーになる
+  template <size_t PayloadSize, typename PayloadSchema = SubHeaderSchema>
+  using PacketSchema = Schema<Nested<tag::Header, PacketHeaderSchema>,
+							  Nested<tag::Payload, PayloadSchema, PayloadSize>>;
+  // 可変長のパケットの先頭部分(PacketHeader + SubHeader)。本体はこの後に続く
+  using PacketHeadSchema = PacketSchema<SubHeaderSchema::size>;
+
+  TS_PACKET_CHECK_SIZE(PacketHeader, PacketHeaderSchema);
+  TS_PACKET_CHECK_FIELD(PacketHeader, type, PacketHeaderSchema, tag::Type);
+  TS_PACKET_CHECK_SIZE(SubHeader, SubHeaderSchema);
+  TS_PACKET_CHECK_FIELD(SubHeader, length, SubHeaderSchema, tag::Length);
+  TS_PACKET_CHECK_FIELD(SubHeader, body, SubHeaderSchema, tag::Body);
+  TS_PACKET_CHECK_SIZE(Packet512, PacketSchema<512>);
+  TS_PACKET_CHECK_FIELD(Packet512, header, PacketSchema<512>, tag::Header);
+  TS_PACKET_CHECK_FIELD(Packet512, payload, PacketSchema<512>, tag::Payload);
+
+  // パケットのビューを作る
+  template <size_t N>
+  View<PacketSchema<N>> packetView(Packet<N>& pkt) {
+	return makeView<PacketSchema<N>>(&pkt);
+  }
+  template <size_t N>
+  View<PacketSchema<N>, const uint8_t> packetView(const Packet<N>& pkt) {
+	return makeView<PacketSchema<N>>(&pkt);
+  }
+
+  // パケットに格納できる本体の最大長
+  template <size_t N>
+  constexpr size_t maxBodyLength() { return N - SubHeaderSchema::size; }
+
+  // SubHeader付きのパケットを作る
+  template <size_t N>
+  void makePacket(Packet<N>& pkt, uint32_t type, const void* body, uint32_t length) {
+	assert(length <= maxBodyLength<N>());
+	auto v = packetView(pkt);
+	v.template set<tag::Header, tag::Type>(type);
+	v.template set<tag::Payload, tag::Length>(length);
+	memcpy(v.template at<tag::Payload, tag::Body>(), body, length);
+  }
+
+}} // ts::packet
@@ -0,0 +1,334 @@
+// -*-tab-width:4;c++-*-
+//
+// パケットのキャプチャファイル
+//
+// CaptureWriterは、パケットを追記専用でファイルに書き出すクラスです。
+// ファイルの先頭1ページはファイルヘッダで、以降はページ単位に並んだレコードの列です。
+// レコードはRecordHeader(長さ、時刻)の後にPacketHeader + SubHeader + 本体が続き、8バイト境界に揃えます。
+// レコードはページをまたがないように配置し、ページの残りに収まらない時は次のページから書きます。
+// 1ページより大きいレコードだけは、ページの先頭から複数ページにまたがって置きます。
+// CaptureReaderはファイルをmmapして、コピーせずにレコードを読み出します。
+// replay()はレコードをハンドラに渡すドライバで、記録時の間隔か最高速で再生します。
+
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "Packet.hpp"
+
+namespace ts {
+namespace packet {
+
+  constexpr size_t CapturePageSize = 4096;
+
+  // ファイルヘッダ。先頭の1ページを占める
+  struct CaptureFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t pageSize;
+  };
+
+  // レコードのヘッダ
+  struct RecordHeader {
+	uint32_t size;      // 続くパケットのバイト数
+	uint32_t flags;
+	uint64_t timestamp; // 記録開始からの経過時間(ns)
+  };
+
+  // 読み出したレコード。packetはmmapした領域を直接指している
+  struct CaptureRecord {
+	uint64_t timestamp;
+	uint32_t size;
+	const uint8_t* packet;
+
+	View<PacketHeadSchema, const uint8_t> view() const { return View<PacketHeadSchema, const uint8_t>(packet); }
+	uint32_t type() const { return view().get<tag::Header, tag::Type>(); }
+	uint32_t length() const { return view().get<tag::Payload, tag::Length>(); }
+	const uint8_t* body() const { return view().at<tag::Payload, tag::Body>(); }
+  };
+
+  namespace detail {
+	constexpr char CaptureMagic[8] = { 'T', 'S', 'P', 'C', 'A', 'P', '0', '1' };
+	constexpr uint32_t CaptureVersion = 1;
+	constexpr uint32_t PaddingRecord = 1; // ページの残りを埋めるレコード
+
+	inline std::system_error ioError(const std::string& what) {
+	  return std::system_error(errno, std::generic_category(), what);
+	}
+  }
+
+  class CaptureWriter {
+  public:
+	// bufferPages: まとめて書き出すページ数
+	explicit CaptureWriter(const std::string& path, size_t bufferPages = 64)
+	  : buffer_(bufferPages * CapturePageSize)
+	  , start_(std::chrono::steady_clock::now())
+	{
+	  fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	  if (fd_ < 0) throw detail::ioError("open " + path);
+	  CaptureFileHeader header = {};
+	  memcpy(header.magic, detail::CaptureMagic, sizeof(header.magic));
+	  header.version = detail::CaptureVersion;
+	  header.pageSize = CapturePageSize;
+	  memcpy(&buffer_[0], &header, sizeof(header));
+	  used_ = CapturePageSize;
+	}
+	CaptureWriter(const CaptureWriter&) = delete;
+	CaptureWriter& operator = (const CaptureWriter&) = delete;
+	~CaptureWriter() {
+	  if (fd_ >= 0) {
+		try { close(); } catch (...) {}
+	  }
+	}
+
+	// 記録開始からの経過時間(ns)
+	uint64_t now() const {
+	  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count();
+	}
+
+	// SubHeader付きのパケットを書き出す
+	template <size_t N>
+	void append(const Packet<N>& pkt) { append(pkt, now()); }
+	template <size_t N>
+	void append(const Packet<N>& pkt, uint64_t timestamp) {
+	  uint32_t length = packetView(pkt).template get<tag::Payload, tag::Length>();
+	  assert(length <= maxBodyLength<N>());
+	  append(&pkt, uint32_t(PacketHeadSchema::size + length), timestamp);
+	}
+
+	// sizeバイトのパケットを書き出す
+	void append(const void* packet, uint32_t size, uint64_t timestamp) {
+	  assert(size >= PacketHeadSchema::size);
+	  size_t total = alignUp(sizeof(RecordHeader) + size, 8);
+	  size_t room = CapturePageSize - pageOffset();
+	  if (total > room && room < CapturePageSize) {
+		// ページの残りに収まらないので次のページに送る
+		pad(room);
+	  }
+	  RecordHeader header = { size, 0, timestamp };
+	  write(&header, sizeof(header));
+	  write(packet, size);
+	  zero(total - sizeof(header) - size);
+	  ++records_;
+	}
+
+	// バッファの内容をファイルに書き出す。ページの途中で呼んでもよい
+	void flush() {
+	  size_t done = 0;
+	  while (done < used_) {
+		ssize_t n = ::write(fd_, &buffer_[done], used_ - done);
+		if (n < 0) {
+		  if (errno == EINTR) continue;
+		  throw detail::ioError("write");
+		}
+		done += size_t(n);
+	  }
+	  written_ += used_;
+	  used_ = 0;
+	}
+
+	// 最後のページを埋めて閉じる
+	void close() {
+	  size_t rest = pageOffset();
+	  if (rest != 0) pad(CapturePageSize - rest);
+	  flush();
+	  if (::close(fd_) != 0) {
+		fd_ = -1;
+		throw detail::ioError("close");
+	  }
+	  fd_ = -1;
+	}
+
+	uint64_t records() const { return records_; }
+
+  private:
+	// 次に書く位置のページ内のオフセット
+	size_t pageOffset() const { return size_t((written_ + used_) % CapturePageSize); }
+	// ページの残りを埋める。RecordHeaderが入る大きさならパディングのレコードにする
+	void pad(size_t room) {
+	  if (room >= sizeof(RecordHeader)) {
+		RecordHeader header = { uint32_t(room - sizeof(RecordHeader)), detail::PaddingRecord, 0 };
+		write(&header, sizeof(header));
+		room -= sizeof(header);
+	  }
+	  zero(room);
+	}
+	void write(const void* p, size_t size) {
+	  auto src = static_cast<const uint8_t*>(p);
+	  while (size > 0) {
+		if (used_ == buffer_.size()) flush();
+		size_t n = std::min(size, buffer_.size() - used_);
+		memcpy(&buffer_[used_], src, n);
+		used_ += n;
+		src += n;
+		size -= n;
+	  }
+	}
+	void zero(size_t size) {
+	  while (size > 0) {
+		if (used_ == buffer_.size()) flush();
+		size_t n = std::min(size, buffer_.size() - used_);
+		memset(&buffer_[used_], 0, n);
+		used_ += n;
+		size -= n;
+	  }
+	}
+
+	int fd_ = -1;
+	std::vector<uint8_t> buffer_;
+	size_t used_ = 0;      // バッファの使用量
+	uint64_t written_ = 0; // ファイルに書き出したバイト数。flush()はページの途中でも呼べるので、位置はこれと合わせて数える
+	uint64_t records_ = 0;
+	std::chrono::steady_clock::time_point start_;
+  };
+
+  class CaptureReader {
+  public:
+	explicit CaptureReader(const std::string& path) {
+	  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	  if (fd < 0) throw detail::ioError("open " + path);
+	  struct stat st;
+	  if (fstat(fd, &st) != 0) {
+		::close(fd);
+		throw detail::ioError("fstat " + path);
+	  }
+	  size_ = size_t(st.st_size);
+	  if (size_ < CapturePageSize) {
+		::close(fd);
+		throw std::runtime_error(path + ": not a capture file");
+	  }
+	  void* p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+	  ::close(fd);
+	  if (p == MAP_FAILED) throw detail::ioError("mmap " + path);
+	  data_ = static_cast<const uint8_t*>(p);
+	  madvise(p, size_, MADV_SEQUENTIAL);
+	  CaptureFileHeader header;
+	  memcpy(&header, data_, sizeof(header));
+	  if (memcmp(header.magic, detail::CaptureMagic, sizeof(header.magic)) != 0 ||
+		  header.version != detail::CaptureVersion || header.pageSize != CapturePageSize) {
+		munmap(p, size_);
+		throw std::runtime_error(path + ": not a capture file");
+	  }
+	}
+	CaptureReader(const CaptureReader&) = delete;
+	CaptureReader& operator = (const CaptureReader&) = delete;
+	~CaptureReader() { munmap(const_cast<uint8_t*>(data_), size_); }
+
+	// レコードを先頭から順にたどる
+	class iterator {
+	public:
+	  iterator(const uint8_t* data, size_t size, size_t pos) : data_(data), size_(size), pos_(pos) { settle(); }
+	  const CaptureRecord& operator * () const { return record_; }
+	  const CaptureRecord* operator -> () const { return &record_; }
+	  iterator& operator ++ () {
+		pos_ += alignUp(sizeof(RecordHeader) + record_.size, 8);
+		settle();
+		return *this;
+	  }
+	  bool operator == (const iterator& rhs) const { return pos_ == rhs.pos_; }
+	  bool operator != (const iterator& rhs) const { return pos_ != rhs.pos_; }
+	private:
+	  // パディングを飛ばして次のレコードに進む。壊れたレコードがあればそこで終わる
+	  void settle() {
+		while (pos_ < size_) {
+		  size_t room = CapturePageSize - pos_ % CapturePageSize;
+		  if (room < sizeof(RecordHeader)) {
+			pos_ += room;
+			continue;
+		  }
+		  RecordHeader header;
+		  memcpy(&header, data_ + pos_, sizeof(header));
+		  size_t total = alignUp(sizeof(RecordHeader) + header.size, 8);
+		  if (header.size == 0 && header.flags == 0) {
+			// 0で埋めた領域はページの残りを飛ばす
+			pos_ += room;
+			continue;
+		  }
+		  if (pos_ + total > size_) break;
+		  if (header.flags == detail::PaddingRecord) {
+			pos_ += total;
+			continue;
+		  }
+		  record_.timestamp = header.timestamp;
+		  record_.size = header.size;
+		  record_.packet = data_ + pos_ + sizeof(RecordHeader);
+		  if (header.size < PacketHeadSchema::size ||
+			  record_.length() > header.size - PacketHeadSchema::size) break;
+		  return;
+		}
+		pos_ = size_;
+	  }
+	  const uint8_t* data_;
+	  size_t size_;
+	  size_t pos_;
+	  CaptureRecord record_ = {};
+	};
+
+	iterator begin() const { return iterator(data_, size_, CapturePageSize); }
+	iterator end() const { return iterator(data_, size_, size_); }
+
+	size_t fileSize() const { return size_; }
+
+  private:
+	const uint8_t* data_ = nullptr;
+	size_t size_ = 0;
+  };
+
+  // 再生の速度
+  enum class ReplaySpeed {
+	Recorded, // 記録時の間隔で再生する
+	Maximum,  // 待たずに再生する
+  };
+
+  struct ReplayStats {
+	uint64_t packets = 0;
+	uint64_t bytes = 0;
+	double seconds = 0;
+	uint64_t maxLateNs = 0; // 記録時刻からの最大の遅れ(Recordedの時)
+  };
+
+  // [first, last)のレコードを順にハンドラ(void(const CaptureRecord&))に渡す
+  template <typename Handler>
+  ReplayStats replay(CaptureReader::iterator first, CaptureReader::iterator last,
+					 Handler&& handler, ReplaySpeed speed = ReplaySpeed::Maximum) {
+	using Clock = std::chrono::steady_clock;
+	ReplayStats stats;
+	auto start = Clock::now();
+	const uint64_t origin = first != last ? first->timestamp : 0;
+	for (; first != last; ++first) {
+	  const CaptureRecord& rec = *first;
+	  if (speed == ReplaySpeed::Recorded) {
+		auto due = start + std::chrono::nanoseconds(rec.timestamp - origin);
+		auto now = Clock::now();
+		if (now < due) {
+		  std::this_thread::sleep_until(due);
+		  now = Clock::now();
+		}
+		uint64_t late = std::chrono::duration_cast<std::chrono::nanoseconds>(now - due).count();
+		if (late > stats.maxLateNs) stats.maxLateNs = late;
+	  }
+	  handler(rec);
+	  ++stats.packets;
+	  stats.bytes += rec.size;
+	}
+	stats.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	return stats;
+  }
+
+  // キャプチャファイルのすべてのレコードを再生する
+  template <typename Handler>
+  ReplayStats replay(const CaptureReader& reader, Handler&& handler, ReplaySpeed speed = ReplaySpeed::Maximum) {
+	return replay(reader.begin(), reader.end(), std::forward<Handler>(handler), speed);
+  }
+
+}} // ts::packet
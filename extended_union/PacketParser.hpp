@@ -0,0 +1,200 @@
+// -*-tab-width:4;c++-*-
+//
+// パケット列のヘッダ解析と振り分け
+//
+// PacketDispatcherは、連続したバッファに並んだPacket<N>のヘッダを読み、
+// PacketHeader::typeごとのバッチにまとめてからハンドラを呼び出すクラスです。
+// typeとSubHeader::lengthの読み出しと検査は、AVX2ではgatherで8個ずつ、SSE4.1では4個ずつ行い、
+// 使えない環境ではスカラーで処理します。どの方式でも分岐はなく、
+// 範囲外のtypeや本体の長さが領域を超えているパケットは無効のバッチに入ります。
+// フィールドのオフセットはPacketSchemaから求めています。
+
+#pragma once
+
+#include <functional>
+#include "Packet.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TS_PACKET_X86 1
+#include <immintrin.h>
+#endif
+
+namespace ts {
+namespace packet {
+
+  // ヘッダ解析の方式
+  enum class ParseMode {
+	Auto,   // CPUに合わせて選ぶ
+	Scalar,
+	SSE41,
+	AVX2,
+  };
+
+  namespace detail {
+	// パケットごとの振り分け先を求める。振り分け先は有効ならtype、無効ならMaxTypes
+	// base: 最初のパケット  stride: パケットの間隔
+	template <size_t TypeOffset, size_t LengthOffset>
+	struct HeaderClassifier {
+	  static void scalar(const uint8_t* base, size_t stride, size_t n,
+						 uint32_t maxTypes, uint32_t maxLength, uint32_t* out) {
+		for (size_t i = 0; i < n; ++i) {
+		  const uint8_t* p = base + i * stride;
+		  uint32_t type, length;
+		  memcpy(&type, p + TypeOffset, sizeof(type));
+		  memcpy(&length, p + LengthOffset, sizeof(length));
+		  bool ok = (type < maxTypes) & (length <= maxLength);
+		  out[i] = ok ? type : maxTypes;
+		}
+	  }
+
+#if defined(TS_PACKET_X86)
+	  __attribute__((target("sse4.1")))
+	  static void sse41(const uint8_t* base, size_t stride, size_t n,
+						uint32_t maxTypes, uint32_t maxLength, uint32_t* out) {
+		const __m128i lastType = _mm_set1_epi32(int(maxTypes - 1));
+		const __m128i maxLen = _mm_set1_epi32(int(maxLength));
+		const __m128i invalid = _mm_set1_epi32(int(maxTypes));
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4) {
+		  const uint8_t* p = base + i * stride;
+		  // SSEにはgatherがないので4個のロードで組み立てる
+		  __m128i type = _mm_setr_epi32(load(p + TypeOffset), load(p + stride + TypeOffset),
+										load(p + 2 * stride + TypeOffset), load(p + 3 * stride + TypeOffset));
+		  __m128i length = _mm_setr_epi32(load(p + LengthOffset), load(p + stride + LengthOffset),
+										  load(p + 2 * stride + LengthOffset), load(p + 3 * stride + LengthOffset));
+		  // 符号なしの比較はminとの一致で行う
+		  __m128i ok = _mm_and_si128(_mm_cmpeq_epi32(_mm_min_epu32(type, lastType), type),
+									 _mm_cmpeq_epi32(_mm_min_epu32(length, maxLen), length));
+		  _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_blendv_epi8(invalid, type, ok));
+		}
+		scalar(base + i * stride, stride, n - i, maxTypes, maxLength, out + i);
+	  }
+
+	  __attribute__((target("avx2")))
+	  static void avx2(const uint8_t* base, size_t stride, size_t n,
+					   uint32_t maxTypes, uint32_t maxLength, uint32_t* out) {
+		const __m256i lastType = _mm256_set1_epi32(int(maxTypes - 1));
+		const __m256i maxLen = _mm256_set1_epi32(int(maxLength));
+		const __m256i invalid = _mm256_set1_epi32(int(maxTypes));
+		const __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+												 _mm256_set1_epi32(int(stride)));
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+		  const uint8_t* p = base + i * stride;
+		  __m256i type = _mm256_i32gather_epi32(reinterpret_cast<const int*>(p + TypeOffset), index, 1);
+		  __m256i length = _mm256_i32gather_epi32(reinterpret_cast<const int*>(p + LengthOffset), index, 1);
+		  __m256i ok = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_min_epu32(type, lastType), type),
+										_mm256_cmpeq_epi32(_mm256_min_epu32(length, maxLen), length));
+		  _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_blendv_epi8(invalid, type, ok));
+		}
+		scalar(base + i * stride, stride, n - i, maxTypes, maxLength, out + i);
+	  }
+
+	  static int load(const uint8_t* p) {
+		int v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	  }
+#endif
+	};
+
+	// 実行中のCPUで使える最速の方式
+	inline ParseMode bestParseMode() {
+#if defined(TS_PACKET_X86)
+	  static const ParseMode mode =
+		__builtin_cpu_supports("avx2") ? ParseMode::AVX2 :
+		__builtin_cpu_supports("sse4.1") ? ParseMode::SSE41 : ParseMode::Scalar;
+	  return mode;
+#else
+	  return ParseMode::Scalar;
+#endif
+	}
+  }
+
+  // Packet<N>の列をtypeごとのバッチに振り分けてハンドラを呼ぶ
+  // MaxTypes: 扱うtypeの数(0〜MaxTypes-1)  Chunk: 一度に振り分けるパケット数
+  template <size_t N, uint32_t MaxTypes = 16, size_t Chunk = 256>
+  class PacketDispatcher {
+  public:
+	using PacketType = Packet<N>;
+	// 同じtypeのパケットの配列を受け取るハンドラ
+	using Handler = std::function<void(const PacketType* const*, size_t)>;
+	static constexpr uint32_t Invalid = MaxTypes;
+
+	explicit PacketDispatcher(ParseMode mode = ParseMode::Auto) { setMode(mode); }
+
+	// 解析の方式を指定する。CPUが対応していない方式はAutoとして扱う
+	void setMode(ParseMode mode) {
+	  ParseMode best = detail::bestParseMode();
+	  if (mode == ParseMode::Auto || int(mode) > int(best)) mode = best;
+	  mode_ = mode;
+	}
+	ParseMode mode() const { return mode_; }
+
+	// typeに対応するハンドラを登録する
+	void setHandler(uint32_t type, Handler h) {
+	  assert(type < MaxTypes);
+	  handlers_[type] = std::move(h);
+	}
+	// 無効なパケットのハンドラを登録する
+	void setInvalidHandler(Handler h) { handlers_[Invalid] = std::move(h); }
+
+	// count個のパケットを振り分けて、typeごとにハンドラを呼ぶ
+	void process(const PacketType* pkts, size_t count) {
+	  for (size_t i = 0; i < count; i += Chunk) {
+		size_t n = count - i < Chunk ? count - i : Chunk;
+		parse(pkts + i, n);
+		dispatch();
+	  }
+	}
+
+	// 最大Chunk個のパケットを振り分ける
+	void parse(const PacketType* pkts, size_t n) {
+	  assert(n <= Chunk);
+	  classify(reinterpret_cast<const uint8_t*>(pkts), n);
+	  // 振り分け先の配列に詰める。ここも分岐はない
+	  for (size_t i = 0; i < n; ++i) {
+		uint32_t b = bucketOf_[i];
+		batches_[b][fill_[b]++] = pkts + i;
+	  }
+	}
+
+	// 振り分けたバッチをハンドラに渡して空にする
+	void dispatch() {
+	  for (uint32_t b = 0; b <= MaxTypes; ++b) {
+		if (fill_[b] == 0) continue;
+		if (handlers_[b]) handlers_[b](batches_[b], fill_[b]);
+		fill_[b] = 0;
+	  }
+	}
+
+  private:
+	using Schema = PacketSchema<N>;
+	using Classifier = detail::HeaderClassifier<Schema::template offset<tag::Header, tag::Type>(),
+												Schema::template offset<tag::Payload, tag::Length>()>;
+
+	void classify(const uint8_t* base, size_t n) {
+	  const uint32_t maxLength = uint32_t(maxBodyLength<N>());
+	  switch (mode_) {
+#if defined(TS_PACKET_X86)
+	  case ParseMode::AVX2:
+		Classifier::avx2(base, sizeof(PacketType), n, MaxTypes, maxLength, bucketOf_);
+		break;
+	  case ParseMode::SSE41:
+		Classifier::sse41(base, sizeof(PacketType), n, MaxTypes, maxLength, bucketOf_);
+		break;
+#endif
+	  default:
+		Classifier::scalar(base, sizeof(PacketType), n, MaxTypes, maxLength, bucketOf_);
+		break;
+	  }
+	}
+
+	ParseMode mode_ = ParseMode::Scalar;
+	Handler handlers_[MaxTypes + 1];
+	uint32_t bucketOf_[Chunk];
+	uint32_t fill_[MaxTypes + 1] = {};
+	const PacketType* batches_[MaxTypes + 1][Chunk];
+  };
+
+}} // ts::packet
@@ -0,0 +1,247 @@
+// -*-tab-width:4;c++-*-
+//
+// パケットプールとバッチ送受信
+//
+// BlockPoolは、固定長ブロックをあらかじめ確保しておき、ロックフリーのフリーリストで貸し出すプールです。
+// フリーリストはブロック番号のスタックで、先頭にタグを付けてABA問題を避けています。
+// 複数ブロックの取得・返却はCAS1回でまとめて行います。
+// PacketPoolはBlockPoolをPacket<N>用に型付けしたもので、PacketBatchを単位に取得・返却します。
+// LoopbackTransportは、送信側と受信側のスレッドの間でパケットのポインタを受け渡すSPSCのリングで、
+// ネットワークのかわりにローカルでスループットとレイテンシを測るために使います。
+// パケット本体はコピーせず、受信側が処理を終えたらプールに返却します。
+
+#pragma once
+
+#include <stdlib.h>
+#include <atomic>
+#include <memory>
+#include <new>
+#include "Packet.hpp"
+
+namespace ts {
+namespace packet {
+
+  // キャッシュラインの大きさ
+  constexpr size_t CacheLineSize = 64;
+
+  class BlockPool {
+  public:
+	// blockSize: ブロックの大きさ(キャッシュラインの倍数に切り上げる)  count: ブロック数
+	BlockPool(size_t blockSize, uint32_t count)
+	  : blockSize_(alignUp(blockSize, CacheLineSize))
+	  , count_(count)
+	  , next_(new std::atomic<uint32_t>[count])
+	{
+	  assert(count > 0 && count < Nil);
+	  void* p = nullptr;
+	  if (posix_memalign(&p, CacheLineSize, blockSize_ * count) != 0) {
+		throw std::bad_alloc();
+	  }
+	  storage_ = static_cast<uint8_t*>(p);
+	  // 最初は全部のブロックがフリーリストにつながっている
+	  for (uint32_t i = 0; i < count; ++i) {
+		next_[i].store(i + 1 < count ? i + 1 : Nil, std::memory_order_relaxed);
+	  }
+	  head_.store(pack(0, 0), std::memory_order_release);
+	}
+	BlockPool(const BlockPool&) = delete;
+	BlockPool& operator = (const BlockPool&) = delete;
+	~BlockPool() { free(storage_); }
+
+	size_t blockSize() const { return blockSize_; }
+	uint32_t capacity() const { return count_; }
+
+	// プールのブロックならtrue
+	bool contains(const void* p) const {
+	  auto b = static_cast<const uint8_t*>(p);
+	  return b >= storage_ && b < storage_ + blockSize_ * count_;
+	}
+
+	// ブロックを1個取得する。空ならnullptr
+	void* acquire() {
+	  void* p = nullptr;
+	  acquire(&p, 1);
+	  return p;
+	}
+
+	// 最大n個のブロックを取得してoutに格納する。取得できた数を返す
+	size_t acquire(void** out, size_t n) {
+	  if (n == 0) return 0;
+	  uint64_t head = head_.load(std::memory_order_acquire);
+	  for (;;) {
+		uint32_t first = index(head);
+		if (first == Nil) return 0;
+		// 先頭からn個たどる。headが変わっていなければ、たどったリストは変化していない
+		size_t got = 0;
+		uint32_t i = first;
+		while (i != Nil && got < n) {
+		  out[got++] = block(i);
+		  i = next_[i].load(std::memory_order_relaxed);
+		}
+		if (head_.compare_exchange_weak(head, pack(i, tag(head) + 1),
+										std::memory_order_acq_rel, std::memory_order_acquire)) {
+		  return got;
+		}
+	  }
+	}
+
+	// ブロックを返却する
+	void release(void* p) { release(&p, 1); }
+
+	// n個のブロックをまとめて返却する
+	void release(void* const* blocks, size_t n) {
+	  if (n == 0) return;
+	  // 返却するブロックを先につないでおき、CAS1回でリストの先頭に差し込む
+	  uint32_t first = indexOf(blocks[0]);
+	  uint32_t last = first;
+	  for (size_t k = 1; k < n; ++k) {
+		uint32_t b = indexOf(blocks[k]);
+		next_[last].store(b, std::memory_order_relaxed);
+		last = b;
+	  }
+	  uint64_t head = head_.load(std::memory_order_relaxed);
+	  do {
+		next_[last].store(index(head), std::memory_order_relaxed);
+	  } while (!head_.compare_exchange_weak(head, pack(first, tag(head) + 1),
+											std::memory_order_release, std::memory_order_relaxed));
+	}
+
+  private:
+	static constexpr uint32_t Nil = 0xffffffff;
+	static uint64_t pack(uint32_t index, uint32_t tag) { return (uint64_t(tag) << 32) | index; }
+	static uint32_t index(uint64_t head) { return uint32_t(head); }
+	static uint32_t tag(uint64_t head) { return uint32_t(head >> 32); }
+
+	void* block(uint32_t i) const { return storage_ + size_t(i) * blockSize_; }
+	uint32_t indexOf(const void* p) const {
+	  assert(contains(p));
+	  return uint32_t((static_cast<const uint8_t*>(p) - storage_) / blockSize_);
+	}
+
+	uint8_t* storage_ = nullptr;
+	size_t blockSize_;
+	uint32_t count_;
+	std::unique_ptr<std::atomic<uint32_t>[]> next_; // フリーリストの次のブロック番号
+	alignas(CacheLineSize) std::atomic<uint64_t> head_; // 先頭のブロック番号とタグ
+  };
+
+  // パケットをまとめて扱うための配列
+  template <size_t N, size_t Capacity = 32>
+  struct PacketBatch {
+	using PacketType = Packet<N>;
+	static constexpr size_t capacity = Capacity;
+	PacketType* packets[Capacity];
+	size_t count = 0;
+
+	PacketType** begin() { return packets; }
+	PacketType** end() { return packets + count; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	bool full() const { return count == Capacity; }
+  };
+
+  // Packet<N>のプール
+  template <size_t N>
+  class PacketPool {
+  public:
+	using PacketType = Packet<N>;
+	explicit PacketPool(uint32_t count) : pool_(sizeof(PacketType), count) {}
+
+	PacketType* acquire() { return static_cast<PacketType*>(pool_.acquire()); }
+	void release(PacketType* p) { pool_.release(p); }
+
+	// バッチの空きをプールのパケットで埋める。追加した数を返す
+	template <size_t C>
+	size_t fill(PacketBatch<N, C>& batch) {
+	  size_t n = pool_.acquire(reinterpret_cast<void**>(batch.packets + batch.count), C - batch.count);
+	  batch.count += n;
+	  return n;
+	}
+	// バッチのパケットをすべてプールに返却する
+	template <size_t C>
+	void drain(PacketBatch<N, C>& batch) {
+	  pool_.release(reinterpret_cast<void* const*>(batch.packets), batch.count);
+	  batch.count = 0;
+	}
+
+	uint32_t capacity() const { return pool_.capacity(); }
+
+  private:
+	BlockPool pool_;
+  };
+
+  // 1対1のスレッド間でパケットのポインタを受け渡すリング
+  template <size_t N>
+  class LoopbackTransport {
+  public:
+	using PacketType = Packet<N>;
+	// capacityは2のべき乗に切り上げる
+	explicit LoopbackTransport(size_t capacity)
+	  : mask_(roundUp(capacity) - 1)
+	  , ring_(new PacketType*[mask_ + 1])
+	{}
+
+	// 最大n個のパケットを送る。送れた数を返す
+	size_t send(PacketType* const* pkts, size_t n) {
+	  size_t tail = tail_.load(std::memory_order_relaxed);
+	  if (tail - headCache_ + n > mask_ + 1) {
+		headCache_ = head_.load(std::memory_order_acquire);
+	  }
+	  size_t room = mask_ + 1 - (tail - headCache_);
+	  if (n > room) n = room;
+	  for (size_t i = 0; i < n; ++i) {
+		ring_[(tail + i) & mask_] = pkts[i];
+	  }
+	  tail_.store(tail + n, std::memory_order_release);
+	  return n;
+	}
+	// バッチの先頭から送れるだけ送り、送ったパケットをバッチから取り除く
+	template <size_t C>
+	size_t send(PacketBatch<N, C>& batch) {
+	  size_t n = send(batch.packets, batch.count);
+	  for (size_t i = n; i < batch.count; ++i) {
+		batch.packets[i - n] = batch.packets[i];
+	  }
+	  batch.count -= n;
+	  return n;
+	}
+
+	// 最大n個のパケットを受け取る。受け取った数を返す
+	size_t receive(PacketType** out, size_t n) {
+	  size_t head = head_.load(std::memory_order_relaxed);
+	  if (tailCache_ - head < n) {
+		tailCache_ = tail_.load(std::memory_order_acquire);
+	  }
+	  size_t avail = tailCache_ - head;
+	  if (n > avail) n = avail;
+	  for (size_t i = 0; i < n; ++i) {
+		out[i] = ring_[(head + i) & mask_];
+	  }
+	  head_.store(head + n, std::memory_order_release);
+	  return n;
+	}
+	// バッチの空きに受け取る
+	template <size_t C>
+	size_t receive(PacketBatch<N, C>& batch) {
+	  size_t n = receive(batch.packets + batch.count, C - batch.count);
+	  batch.count += n;
+	  return n;
+	}
+
+  private:
+	static size_t roundUp(size_t n) {
+	  size_t r = 1;
+	  while (r < n) r <<= 1;
+	  return r;
+	}
+
+	size_t mask_;
+	std::unique_ptr<PacketType*[]> ring_;
+	// 送信側が使う変数と受信側が使う変数を別のキャッシュラインに置く
+	alignas(CacheLineSize) std::atomic<size_t> tail_{0};
+	size_t headCache_ = 0;
+	alignas(CacheLineSize) std::atomic<size_t> head_{0};
+	size_t tailCache_ = 0;
+  };
+
+}} // ts::packet
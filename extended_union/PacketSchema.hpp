@@ -0,0 +1,243 @@
+// -*-tab-width:4;c++-*-
+//
+// パケットのレイアウト定義(スキーマ)
+//
+// Schemaは、パケットのフィールドの配置(オフセット、サイズ、アライメント)をコンパイル時に計算するクラスです。
+// フィールドは以下の型を並べて宣言します。タグはフィールド名として使う空の構造体です。
+//   Field<タグ, 型>              スカラー値
+//   Bytes<タグ, 長さ>            固定長のバイト列
+//   Tail<タグ>                   末尾の可変長領域(フレキシブル配列メンバ相当)。最後のフィールドにだけ置ける
+//   Nested<タグ, スキーマ[, 領域]> 入れ子のスキーマ。領域を指定するとその大きさを確保する(ペイロード用)
+// オフセットはすべてコンパイル時の定数なので、View経由のアクセスやencode/decodeは
+// 固定オフセットのロード/ストアだけになり、実行時のチェックや分岐は入りません。
+// TS_PACKET_CHECK_SIZE/TS_PACKET_CHECK_FIELDで、既存の構造体とスキーマの配置が一致することを検査できます。
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include <tuple>
+#include <type_traits>
+
+namespace ts {
+namespace packet {
+
+  // nをaの倍数に切り上げる
+  constexpr size_t alignUp(size_t n, size_t a) { return (n + a - 1) / a * a; }
+
+  // 値を持たないフィールド(Tail)のための値型
+  struct NoValue {};
+
+  // スカラー値のフィールド
+  template <typename Tag, typename T>
+  struct Field {
+	static_assert(std::is_trivially_copyable<T>::value, "Field requires a trivially copyable type");
+	using tag = Tag;
+	using type = T;
+	using value_type = T;
+	static constexpr size_t size = sizeof(T);
+	static constexpr size_t align = alignof(T);
+	// memcpyは定数長なので、単純なmovになる
+	static void store(uint8_t* p, const value_type& v) { memcpy(p, &v, size); }
+	static void load(const uint8_t* p, value_type& v) { memcpy(&v, p, size); }
+  };
+
+  // 固定長のバイト列
+  template <typename Tag, size_t N>
+  struct Bytes {
+	using tag = Tag;
+	using type = uint8_t;
+	using value_type = std::array<uint8_t, N>;
+	static constexpr size_t size = N;
+	static constexpr size_t align = 1;
+	static void store(uint8_t* p, const value_type& v) { memcpy(p, v.data(), size); }
+	static void load(const uint8_t* p, value_type& v) { memcpy(v.data(), p, size); }
+  };
+
+  // 末尾の可変長領域。サイズ0で、encode/decodeの対象にならない
+  template <typename Tag, typename T = uint8_t>
+  struct Tail {
+	using tag = Tag;
+	using type = T;
+	using value_type = NoValue;
+	static constexpr size_t size = 0;
+	static constexpr size_t align = alignof(T);
+	static void store(uint8_t*, const value_type&) {}
+	static void load(const uint8_t*, value_type&) {}
+  };
+
+  // 入れ子のスキーマ
+  template <typename Tag, typename Inner, size_t Size = Inner::size>
+  struct Nested {
+	static_assert(Inner::size <= Size, "nested schema does not fit in its region");
+	using tag = Tag;
+	using schema = Inner;
+	using type = uint8_t;
+	using value_type = typename Inner::Values;
+	static constexpr size_t size = Size;
+	static constexpr size_t align = Inner::align;
+	static void store(uint8_t* p, const value_type& v) { Inner::encode(p, v); }
+	static void load(const uint8_t* p, value_type& v) { Inner::decode(p, v); }
+  };
+
+  namespace detail {
+	template <typename T> struct AlwaysFalse : std::false_type {};
+
+	template <typename F> struct IsTail : std::false_type {};
+	template <typename Tag, typename T> struct IsTail<Tail<Tag, T>> : std::true_type {};
+
+	// フィールドの配置を先頭から順に計算する
+	// I: フィールドの番号  Offset: 直前のフィールドの終端
+	template <size_t I, size_t Offset, typename... Fields>
+	struct Layout {
+	  static constexpr size_t end = Offset;
+	  static constexpr size_t align = 1;
+	  template <typename V> static void encode(uint8_t*, const V&) {}
+	  template <typename V> static void decode(const uint8_t*, V&) {}
+	};
+	template <size_t I, size_t Offset, typename F, typename... Rest>
+	struct Layout<I, Offset, F, Rest...> {
+	  static_assert(!IsTail<F>::value || sizeof...(Rest) == 0, "Tail must be the last field");
+	  static constexpr size_t offset = alignUp(Offset, F::align);
+	  using Next = Layout<I + 1, offset + F::size, Rest...>;
+	  static constexpr size_t end = Next::end;
+	  static constexpr size_t align = F::align > Next::align ? F::align : Next::align;
+
+	  template <typename V>
+	  static void encode(uint8_t* p, const V& v) {
+		F::store(p + offset, std::get<I>(v));
+		Next::encode(p, v);
+	  }
+	  template <typename V>
+	  static void decode(const uint8_t* p, V& v) {
+		F::load(p + offset, std::get<I>(v));
+		Next::decode(p, v);
+	  }
+	};
+
+	// タグからフィールドとそのオフセットを探す
+	template <typename F, size_t Offset>
+	struct Found {
+	  using field = F;
+	  static constexpr size_t offset = Offset;
+	};
+	template <typename Tag, size_t Offset, typename... Fields>
+	struct Find {
+	  static_assert(AlwaysFalse<Tag>::value, "no such field in schema");
+	};
+	template <typename Tag, size_t Offset, typename F, typename... Rest>
+	struct Find<Tag, Offset, F, Rest...>
+	  : std::conditional<std::is_same<Tag, typename F::tag>::value,
+						 Found<F, alignUp(Offset, F::align)>,
+						 Find<Tag, alignUp(Offset, F::align) + F::size, Rest...>>::type {};
+
+	// タグの並びで入れ子のフィールドをたどる
+	template <typename S, typename... Tags>
+	struct Resolve;
+	template <typename S, typename Tag>
+	struct Resolve<S, Tag> {
+	  using Hit = typename S::template Find<Tag>;
+	  using field = typename Hit::field;
+	  static constexpr size_t offset = Hit::offset;
+	};
+	template <typename S, typename Tag, typename Next, typename... Rest>
+	struct Resolve<S, Tag, Next, Rest...> {
+	  using Hit = typename S::template Find<Tag>;
+	  using Inner = Resolve<typename Hit::field::schema, Next, Rest...>;
+	  using field = typename Inner::field;
+	  static constexpr size_t offset = Hit::offset + Inner::offset;
+	};
+  }
+
+  // フィールドの並びからレイアウトを計算するスキーマ
+  template <typename... Fields>
+  struct Schema {
+	using Layout = detail::Layout<0, 0, Fields...>;
+	template <typename Tag>
+	using Find = detail::Find<Tag, 0, Fields...>;
+
+	static constexpr size_t align = Layout::align;
+	static constexpr size_t size = alignUp(Layout::end, align);
+
+	// encode/decodeで使う値の組。入れ子のフィールドは入れ子のtupleになる
+	using Values = std::tuple<typename Fields::value_type...>;
+
+	// タグの並びで指定したフィールドの型とオフセット
+	template <typename... Tags>
+	using field = typename detail::Resolve<Schema, Tags...>::field;
+	template <typename... Tags>
+	static constexpr size_t offset() { return detail::Resolve<Schema, Tags...>::offset; }
+
+	// 値の組をバッファに書き出す。フィールドごとに固定オフセットへのストアが並ぶだけになる
+	static void encode(uint8_t* p, const Values& v) { Layout::encode(p, v); }
+	// バッファから値の組を読み出す
+	static void decode(const uint8_t* p, Values& v) { Layout::decode(p, v); }
+	static Values decode(const uint8_t* p) {
+	  Values v;
+	  decode(p, v);
+	  return v;
+	}
+  };
+
+  // バッファ上のデータをスキーマ経由でアクセスするビュー
+  // Byteにはuint8_tかconst uint8_tを指定する
+  template <typename S, typename Byte = uint8_t>
+  class View {
+	Byte* data_;
+  public:
+	using schema = S;
+	// ビューのconst性に合わせたポインタ型
+	template <typename T>
+	using Pointer = typename std::conditional<std::is_const<Byte>::value, const T, T>::type*;
+
+	explicit View(Byte* data) : data_(data) {}
+
+	Byte* data() const { return data_; }
+
+	// フィールドの値を読む
+	template <typename... Tags>
+	typename S::template field<Tags...>::value_type get() const {
+	  using F = typename S::template field<Tags...>;
+	  typename F::value_type v;
+	  F::load(data_ + S::template offset<Tags...>(), v);
+	  return v;
+	}
+	// フィールドに値を書く
+	template <typename... Tags, typename T>
+	void set(const T& value) const {
+	  static_assert(!std::is_const<Byte>::value, "cannot write through a const view");
+	  using F = typename S::template field<Tags...>;
+	  typename F::value_type v(value);
+	  F::store(data_ + S::template offset<Tags...>(), v);
+	}
+	// フィールドの先頭アドレス(Bytes/Tailの参照用)
+	template <typename... Tags>
+	Pointer<typename S::template field<Tags...>::type> at() const {
+	  return reinterpret_cast<Pointer<typename S::template field<Tags...>::type>>(data_ + S::template offset<Tags...>());
+	}
+	// 入れ子のスキーマのビュー
+	template <typename... Tags>
+	View<typename S::template field<Tags...>::schema, Byte> nested() const {
+	  return View<typename S::template field<Tags...>::schema, Byte>(data_ + S::template offset<Tags...>());
+	}
+  };
+
+  template <typename S>
+  View<S> makeView(void* p) { return View<S>(static_cast<uint8_t*>(p)); }
+  template <typename S>
+  View<S, const uint8_t> makeView(const void* p) { return View<S, const uint8_t>(static_cast<const uint8_t*>(p)); }
+
+}} // ts::packet
+
+// 構造体の大きさとアライメントがスキーマと一致することを検査する
+#define TS_PACKET_CHECK_SIZE(Struct, S)									\
+  static_assert(sizeof(Struct) == S::size, #Struct ": size does not match the schema"); \
+  static_assert(alignof(Struct) == S::align, #Struct ": alignment does not match the schema")
+
+// 構造体のメンバのオフセットがスキーマと一致することを検査する
+// 可変引数にはスキーマのタグの並びを指定する
+#define TS_PACKET_CHECK_FIELD(Struct, member, S, ...)					\
+  static_assert(offsetof(Struct, member) == S::template offset<__VA_ARGS__>(), \
+				#Struct "::" #member ": offset does not match the schema")
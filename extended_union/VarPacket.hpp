@@ -0,0 +1,179 @@
+// -*-tab-width:4;c++-*-
+//
+// 可変長パケット
+//
+// Packet<PayloadSize>はペイロードの大きさがコンパイル時に決まるため、12バイトのメッセージでも
+// 512バイトを使い、512バイトを超えるメッセージは入りません。
+// VarPacketViewは、バイト列の上にPacketHeader + SubHeader + 本体を重ねる可変長パケットのビューです。
+// SubHeader::lengthはビューを作る時に一度だけバイト列の長さと照合するので、
+// 本体(フレキシブル配列メンバ)へのアクセスがバイト列の外にはみ出すことはありません。
+// VarPacketPoolは、64/256/1K/4Kのサイズクラスごとに BlockPool を持つプールで、
+// それより大きいパケット(ジャンボ)とクラスの空きが無くなった時はヒープから確保します。
+// VarPacketはプールから確保したパケットの所有権を持つハンドルで、破棄するとプールに返却します。
+
+#pragma once
+
+#include <stdlib.h>
+#include <utility>
+#include "PacketPool.hpp"
+
+namespace ts {
+namespace packet {
+
+  // バイト列の上の可変長パケット
+  // Byteにはuint8_tかconst uint8_tを指定する
+  template <typename Byte = const uint8_t>
+  class VarPacketView {
+  public:
+	using Head = View<PacketHeadSchema, Byte>;
+	static constexpr size_t headSize = PacketHeadSchema::size;
+
+	VarPacketView() = default;
+
+	// バイト列を可変長パケットとして解釈する。長さが合わなければ空のビューを返す
+	static VarPacketView parse(Byte* data, size_t size) {
+	  if (data == nullptr || size < headSize) return VarPacketView();
+	  uint32_t length = Head(data).template get<tag::Payload, tag::Length>();
+	  if (length > size - headSize) return VarPacketView();
+	  return VarPacketView(data, headSize + length);
+	}
+	// 本体の最大長がcapacityの領域に、新しいパケットを作る
+	static VarPacketView create(Byte* data, size_t capacity, uint32_t type, uint32_t length) {
+	  assert(capacity >= headSize + length);
+	  Head head(data);
+	  head.template set<tag::Header, tag::Type>(type);
+	  head.template set<tag::Payload, tag::Length>(length);
+	  return VarPacketView(data, headSize + length);
+	}
+
+	explicit operator bool () const { return data_ != nullptr; }
+
+	uint32_t type() const { return Head(data_).template get<tag::Header, tag::Type>(); }
+	uint32_t length() const { return uint32_t(size_ - headSize); }
+	Byte* body() const { return Head(data_).template at<tag::Payload, tag::Body>(); }
+	Byte* data() const { return data_; }
+	// パケット全体のバイト数
+	size_t size() const { return size_; }
+
+	operator VarPacketView<const uint8_t> () const { return VarPacketView<const uint8_t>::parse(data_, size_); }
+
+  private:
+	VarPacketView(Byte* data, size_t size) : data_(data), size_(size) {}
+
+	Byte* data_ = nullptr;
+	size_t size_ = 0;
+  };
+
+  class VarPacketPool;
+
+  // プールから確保した可変長パケット
+  class VarPacket {
+  public:
+	VarPacket() = default;
+	VarPacket(VarPacket&& rhs) noexcept { swap(rhs); }
+	VarPacket& operator = (VarPacket&& rhs) noexcept {
+	  VarPacket(std::move(rhs)).swap(*this);
+	  return *this;
+	}
+	VarPacket(const VarPacket&) = delete;
+	VarPacket& operator = (const VarPacket&) = delete;
+	inline ~VarPacket();
+
+	explicit operator bool () const { return data_ != nullptr; }
+
+	VarPacketView<uint8_t> view() { return VarPacketView<uint8_t>::parse(data_, size_); }
+	VarPacketView<const uint8_t> view() const { return VarPacketView<const uint8_t>::parse(data_, size_); }
+
+	uint32_t type() const { return view().type(); }
+	uint32_t length() const { return view().length(); }
+	uint8_t* body() { return view().body(); }
+	const uint8_t* body() const { return view().body(); }
+	// パケット全体のバイト数
+	size_t size() const { return size_; }
+	// サイズクラス(VarPacketPool::Jumboはヒープから確保したもの)
+	int sizeClass() const { return sizeClass_; }
+
+	void swap(VarPacket& rhs) noexcept {
+	  std::swap(data_, rhs.data_);
+	  std::swap(size_, rhs.size_);
+	  std::swap(sizeClass_, rhs.sizeClass_);
+	  std::swap(pool_, rhs.pool_);
+	}
+
+  private:
+	friend class VarPacketPool;
+	VarPacket(uint8_t* data, size_t size, int sizeClass, VarPacketPool* pool)
+	  : data_(data), size_(size), sizeClass_(sizeClass), pool_(pool) {}
+
+	uint8_t* data_ = nullptr;
+	size_t size_ = 0;
+	int sizeClass_ = 0;
+	VarPacketPool* pool_ = nullptr;
+  };
+
+  class VarPacketPool {
+  public:
+	// サイズクラスの数と大きさ(パケット全体のバイト数)
+	static constexpr int Classes = 4;
+	static constexpr size_t classSize(int c) { return size_t(64) << (2 * c); }
+	static constexpr int Jumbo = Classes;
+
+	// count: サイズクラスごとのブロック数
+	explicit VarPacketPool(uint32_t count = 1024)
+	  : VarPacketPool(count, count, count, count) {}
+	VarPacketPool(uint32_t count64, uint32_t count256, uint32_t count1k, uint32_t count4k)
+	  : pools_{ { classSize(0), count64 }, { classSize(1), count256 },
+				{ classSize(2), count1k }, { classSize(3), count4k } } {}
+	VarPacketPool(const VarPacketPool&) = delete;
+	VarPacketPool& operator = (const VarPacketPool&) = delete;
+
+	// 本体がlengthバイトのパケットを確保する
+	VarPacket allocate(uint32_t type, uint32_t length) {
+	  size_t size = PacketHeadSchema::size + length;
+	  int c = sizeClassOf(size);
+	  void* p = c < Classes ? pools_[c].acquire() : nullptr;
+	  size_t capacity = c < Classes ? classSize(c) : size;
+	  if (p == nullptr) {
+		// ジャンボか、クラスの空きがない
+		c = Jumbo;
+		capacity = size;
+		if (posix_memalign(&p, CacheLineSize, alignUp(size, CacheLineSize)) != 0) throw std::bad_alloc();
+	  }
+	  allocated_[c].fetch_add(1, std::memory_order_relaxed);
+	  auto data = static_cast<uint8_t*>(p);
+	  VarPacketView<uint8_t>::create(data, capacity, type, length);
+	  return VarPacket(data, PacketHeadSchema::size + length, c, this);
+	}
+	// 本体をコピーしてパケットを作る
+	VarPacket allocate(uint32_t type, const void* body, uint32_t length) {
+	  VarPacket pkt = allocate(type, length);
+	  memcpy(pkt.body(), body, length);
+	  return pkt;
+	}
+
+	// パケット全体がsizeバイトの時のサイズクラス
+	static int sizeClassOf(size_t size) {
+	  int c = 0;
+	  while (c < Classes && size > classSize(c)) ++c;
+	  return c;
+	}
+
+	// サイズクラスごとの確保数(Jumboはヒープから確保した数)
+	uint64_t allocated(int sizeClass) const { return allocated_[sizeClass].load(std::memory_order_relaxed); }
+
+  private:
+	friend class VarPacket;
+	void release(uint8_t* data, int sizeClass) {
+	  if (sizeClass == Jumbo) free(data);
+	  else pools_[sizeClass].release(data);
+	}
+
+	BlockPool pools_[Classes];
+	std::atomic<uint64_t> allocated_[Classes + 1] = {};
+  };
+
+  VarPacket::~VarPacket() {
+	if (data_) pool_->release(data_, sizeClass_);
+  }
+
+}} // ts::packet
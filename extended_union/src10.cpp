@@ -0,0 +1,82 @@
+// -*-tab-width:4-*-
+// g++ -std=c++14 -O2 -Wall src10.cpp
+// パケットを作って送り、受け取って返すまでに、ヒープからの確保が無いことを検査する
+// プールとリングは作る時にだけ確保する(ブロック自体はposix_memalignなので数えない)
+// ./src10
+#define TS_INSTRUMENT_NEW
+#include <stdio.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include "Packet.hpp"
+#include "PacketPool.hpp"
+#include "VarPacket.hpp"
+#include "../instrument/AllocCounter.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace ts::packet;
+using namespace ts::instrument;
+
+const int Rounds = 1000;
+static uint8_t source[16384];
+
+// 固定長のパケットをそのまま作る
+void checkMakePacket() {
+  AllocScope allocs;
+  Packet512 pkt;
+  for (int i = 0; i < Rounds; ++i) {
+	makePacket(pkt, uint32_t(i), source, uint32_t(i % maxBodyLength<512>()));
+  }
+  uint32_t length = packetView(pkt).get<tag::Payload, tag::Length>();
+  TS_CHECK_EQ(length, (Rounds - 1) % maxBodyLength<512>());
+  TS_CHECK_EQ(allocs.news(), 0);
+}
+
+// プールから取ってバッチで送り、受け取ってプールに返す
+void checkPoolAndTransport() {
+  AllocScope allocs;
+  PacketPool<512> pool(256);
+  LoopbackTransport<512> transport(256);
+  // 空きリストとリングで1回ずつ
+  TS_CHECK_EQ(allocs.news(), 2);
+
+  allocs.restart();
+  uint64_t received = 0;
+  for (int i = 0; i < Rounds; ++i) {
+	PacketBatch<512> out;
+	pool.fill(out);
+	for (auto pkt : out) makePacket(*pkt, uint32_t(i), source, 64);
+	transport.send(out);
+	PacketBatch<512> in;
+	transport.receive(in);
+	received += in.size();
+	pool.drain(in);
+	pool.drain(out);
+  }
+  TS_CHECK_EQ(received, uint64_t(Rounds) * PacketBatch<512>::capacity);
+  TS_CHECK_EQ(allocs.news(), 0);
+}
+
+// 可変長のパケット。ジャンボはposix_memalignで確保するのでoperator newは使わない
+// VarPacketはムーブしてもコピーしない
+void checkVarPacket() {
+  VarPacketPool pool(64, 64, 64, 64);
+  std::vector<VarPacket> packets;
+  packets.reserve(Rounds);
+  AllocScope allocs;
+  for (int i = 0; i < Rounds; ++i) {
+	packets.push_back(pool.allocate(uint32_t(i), source, uint32_t(i * 16 % sizeof(source))));
+	if (packets.size() == 32) packets.clear();
+  }
+  VarPacket moved(std::move(packets.front()));
+  packets.front() = std::move(moved);
+  TS_CHECK_EQ(allocs.news(), 0);
+  TS_CHECK(pool.allocated(VarPacketPool::Jumbo) > 0);
+}
+
+int main() {
+  checkMakePacket();
+  checkPoolAndTransport();
+  checkVarPacket();
+  return checkResult("src10");
+}
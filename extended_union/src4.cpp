@@ -18,7 +18,7 @@ typedef uint8_t NullData[0] ;
 
 template <size_t PayloadSize, typename PayloadType=NullData>
 struct Packet {
-  BOOST_STATIC_ASSERT(PayLoadSize <= sizeof(PayLoadType));
+  BOOST_STATIC_ASSERT(sizeof(PayloadType) <= PayloadSize);
   template <typename Extend>
   struct ExtendPayload : Packet<PayloadSize, Extend> {
 
@@ -45,7 +45,7 @@ struct PacketMaker {
 	uint8_t body[];
   };
 
-  typename PacketType::template ExtendPayload<SubHeader> PacketWidhSubHeader;
+  typedef typename PacketType::template ExtendPayload<SubHeader> PacketWidhSubHeader;
   PacketWidhSubHeader packetData;
 
   void makePacket(char* buffer, size_t size) {
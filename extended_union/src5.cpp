@@ -0,0 +1,52 @@
+// -*-tab-width:4-*-
+// g++ -std=c++14 -O2 -Wall src5.cpp
+// スキーマを使ったパケットの組み立てと読み出し
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "Packet.hpp"
+
+using namespace ts::packet;
+
+// src4のExtendPayloadのように、ペイロードに別の構造を重ねるパケット
+// レイアウトはスキーマから計算されるので、reinterpret_castせずにアクセスできる
+struct Sequence {};
+struct Checksum {};
+using SequencedSchema = Schema<Field<Sequence, uint64_t>,
+                               Field<Checksum, uint16_t>,
+                               Nested<tag::Payload, SubHeaderSchema>>;
+using SequencedPacketSchema = PacketSchema<512, SequencedSchema>;
+
+static_assert(SequencedPacketSchema::offset<tag::Payload, Sequence>() == 8,
+              "uint64_t is aligned to 8 bytes");
+static_assert(SequencedPacketSchema::offset<tag::Payload, tag::Payload, tag::Length>() == 20,
+              "nested subheader follows the checksum");
+// ペイロードが領域に収まらない場合はコンパイルエラーになる
+// using TooSmall = PacketSchema<8, SequencedSchema>;
+
+int main(int, char* av[]) {
+
+	Packet512 pkt1;
+	makePacket(pkt1, 1, av[0], strlen(av[0]));
+
+	auto v1 = packetView(static_cast<const Packet512&>(pkt1));
+	printf("type=%u length=%u body=%.*s\n",
+		   v1.get<tag::Header, tag::Type>(),
+		   v1.get<tag::Payload, tag::Length>(),
+		   int(v1.get<tag::Payload, tag::Length>()),
+		   reinterpret_cast<const char*>(v1.at<tag::Payload, tag::Body>()));
+
+	// 値の組でまとめて書き出す
+	uint8_t buffer[SequencedPacketSchema::size];
+	SequencedPacketSchema::encode(buffer, SequencedPacketSchema::Values{
+		std::make_tuple(2u),
+		std::make_tuple(uint64_t(1234), uint16_t(0xbeef), std::make_tuple(0u, NoValue()))});
+
+	auto values = SequencedPacketSchema::decode(buffer);
+	auto& payload = std::get<1>(values);
+	printf("type=%u sequence=%llu checksum=%04x length=%u\n",
+		   std::get<0>(std::get<0>(values)),
+		   (unsigned long long)std::get<0>(payload),
+		   std::get<1>(payload),
+		   std::get<0>(std::get<2>(payload)));
+}
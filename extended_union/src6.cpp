@@ -0,0 +1,89 @@
+// -*-tab-width:4-*-
+// g++ -std=c++14 -O2 -Wall -pthread src6.cpp
+// パケットプールとループバックのスループット/レイテンシ測定
+// ./src6 [パケット数]
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "PacketPool.hpp"
+
+using namespace ts::packet;
+using Clock = std::chrono::steady_clock;
+
+static uint64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// バッチの大きさを変えて、送信スレッド→受信スレッドのパケット転送を測る
+template <size_t BatchSize>
+void run(size_t total) {
+  using Batch = PacketBatch<512, BatchSize>;
+  PacketPool<512> pool(4096);
+  LoopbackTransport<512> transport(2048);
+  std::vector<uint32_t> latency;
+  latency.reserve(total);
+
+  auto start = Clock::now();
+  std::thread producer([&] {
+	  size_t sent = 0;
+	  Batch batch;
+	  while (sent < total) {
+		pool.fill(batch);
+		// バッチごとに送信時刻を入れる
+		uint64_t ts = nowNs();
+		for (size_t i = 0; i < batch.count; ++i) {
+		  makePacket(*batch.packets[i], uint32_t(sent + i), &ts, sizeof(ts));
+		}
+		size_t n = std::min(batch.count, total - sent);
+		while (n > 0) {
+		  size_t s = transport.send(batch.packets, n);
+		  if (s == 0) std::this_thread::yield();
+		  sent += s;
+		  n -= s;
+		  for (size_t i = s; i < batch.count; ++i) batch.packets[i - s] = batch.packets[i];
+		  batch.count -= s;
+		}
+		pool.drain(batch); // 送らなかった分を返却
+	  }
+	});
+
+  size_t received = 0;
+  uint64_t check = 0;
+  Batch batch;
+  while (received < total) {
+	if (transport.receive(batch) == 0) {
+	  std::this_thread::yield();
+	  continue;
+	}
+	uint64_t now = nowNs();
+	for (auto pkt : batch) {
+	  auto v = packetView(static_cast<const Packet512&>(*pkt));
+	  uint64_t ts;
+	  memcpy(&ts, v.at<tag::Payload, tag::Body>(), sizeof(ts));
+	  latency.push_back(uint32_t(std::min<uint64_t>(now - ts, UINT32_MAX)));
+	  check += v.get<tag::Header, tag::Type>();
+	}
+	received += batch.count;
+	pool.drain(batch);
+  }
+  producer.join();
+  double sec = std::chrono::duration<double>(Clock::now() - start).count();
+
+  std::sort(latency.begin(), latency.end());
+  auto pct = [&](double p) { return latency[size_t(p * (latency.size() - 1))] / 1000.0; };
+  printf("batch=%3zu packets=%zu %.2f Mpps  latency(us) p50=%.1f p99=%.1f p99.9=%.1f max=%.1f%s\n",
+		 BatchSize, total, total / sec / 1e6, pct(0.5), pct(0.99), pct(0.999), pct(1.0),
+		 check == uint64_t(total) * (total - 1) / 2 ? "" : " (check failed)");
+}
+
+int main(int ac, char* av[]) {
+  size_t total = ac > 1 ? strtoul(av[1], nullptr, 10) : 2000000;
+  run<1>(total);
+  run<8>(total);
+  run<32>(total);
+  run<128>(total);
+}
@@ -0,0 +1,104 @@
+// -*-tab-width:4-*-
+// g++ -std=c++14 -O2 -Wall src7.cpp
+// パケットのヘッダ解析と振り分けの速度をスカラーのループと比べる
+// ./src7 [パケット数]
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "PacketParser.hpp"
+
+using namespace ts::packet;
+using Clock = std::chrono::steady_clock;
+
+constexpr uint32_t Types = 8;
+
+// typeごとの集計。ハンドラはこれを更新するだけ
+struct Counter {
+  uint64_t packets[Types + 1] = {};
+  uint64_t bytes[Types + 1] = {};
+};
+
+// 1パケットずつtypeで分岐する従来の処理
+__attribute__((noinline))
+void scalarLoop(const Packet512* pkts, size_t count, Counter& c) {
+  for (size_t i = 0; i < count; ++i) {
+	const Packet512& pkt = pkts[i];
+	const SubHeader& sub = reinterpret_cast<const SubHeader&>(pkt.payload);
+	if (sub.length > maxBodyLength<512>()) {
+	  ++c.packets[Types];
+	  continue;
+	}
+	switch (pkt.header.type) {
+	case 0: ++c.packets[0]; c.bytes[0] += sub.length; break;
+	case 1: ++c.packets[1]; c.bytes[1] += sub.length; break;
+	case 2: ++c.packets[2]; c.bytes[2] += sub.length; break;
+	case 3: ++c.packets[3]; c.bytes[3] += sub.length; break;
+	case 4: ++c.packets[4]; c.bytes[4] += sub.length; break;
+	case 5: ++c.packets[5]; c.bytes[5] += sub.length; break;
+	case 6: ++c.packets[6]; c.bytes[6] += sub.length; break;
+	case 7: ++c.packets[7]; c.bytes[7] += sub.length; break;
+	default: ++c.packets[Types]; break;
+	}
+  }
+}
+
+template <typename F>
+double measure(const char* name, size_t count, int repeat, F f) {
+  auto start = Clock::now();
+  for (int r = 0; r < repeat; ++r) f();
+  double sec = std::chrono::duration<double>(Clock::now() - start).count();
+  printf("%-8s %7.1f Mpkt/s\n", name, count * double(repeat) / sec / 1e6);
+  return sec;
+}
+
+int main(int ac, char* av[]) {
+  size_t count = ac > 1 ? strtoul(av[1], nullptr, 10) : 200000;
+  const int repeat = 20;
+
+  // typeはランダム、1%は範囲外のtypeか長すぎる本体
+  std::vector<Packet512> pkts(count);
+  std::mt19937 rng(1);
+  for (auto& pkt : pkts) {
+	uint32_t type = rng() % Types;
+	uint32_t length = rng() % 64;
+	if (rng() % 100 == 0) {
+	  if (rng() & 1) type = 100;
+	  else length = 1000;
+	}
+	auto v = packetView(pkt);
+	v.set<tag::Header, tag::Type>(type);
+	v.set<tag::Payload, tag::Length>(length);
+  }
+
+  Counter expect;
+  measure("scalar", count, repeat, [&] { scalarLoop(pkts.data(), count, expect); });
+
+  const ParseMode modes[] = { ParseMode::Scalar, ParseMode::SSE41, ParseMode::AVX2 };
+  const char* names[] = { "batch", "sse4.1", "avx2" };
+  for (int m = 0; m < 3; ++m) {
+	PacketDispatcher<512, Types> dispatcher(modes[m]);
+	if (dispatcher.mode() != modes[m]) {
+	  printf("%-8s not supported\n", names[m]);
+	  continue;
+	}
+	Counter c;
+	for (uint32_t t = 0; t < Types; ++t) {
+	  dispatcher.setHandler(t, [&c, t](const Packet512* const* p, size_t n) {
+		  c.packets[t] += n;
+		  for (size_t i = 0; i < n; ++i) {
+			c.bytes[t] += packetView(*p[i]).get<tag::Payload, tag::Length>();
+		  }
+		});
+	}
+	dispatcher.setInvalidHandler([&c](const Packet512* const*, size_t n) { c.packets[Types] += n; });
+	measure(names[m], count, repeat, [&] { dispatcher.process(pkts.data(), count); });
+	bool same = true;
+	for (uint32_t t = 0; t <= Types; ++t) {
+	  same = same && c.packets[t] == expect.packets[t] && c.bytes[t] == expect.bytes[t];
+	}
+	if (!same) printf("%-8s result mismatch\n", names[m]);
+  }
+}
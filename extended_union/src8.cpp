@@ -0,0 +1,88 @@
+// -*-tab-width:4-*-
+// g++ -std=c++14 -O2 -Wall src8.cpp
+// パケットをキャプチャファイルに記録して再生する
+// 最後に、ページの途中でflush()しながら記録しても読み出せることを確かめる
+// ./src8 [ファイル名] [パケット数]
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <chrono>
+#include <random>
+#include "PacketCapture.hpp"
+
+using namespace ts::packet;
+using Clock = std::chrono::steady_clock;
+
+int main(int ac, char* av[]) {
+  std::string path = ac > 1 ? av[1] : "/tmp/src8.tspcap";
+  size_t count = ac > 2 ? strtoul(av[2], nullptr, 10) : 1000000;
+
+  // 記録。本体の長さはばらばらで、10us間隔で届いたことにする
+  std::mt19937 rng(1);
+  uint64_t sum = 0;
+  auto start = Clock::now();
+  {
+	CaptureWriter writer(path);
+	Packet512 pkt;
+	uint8_t body[maxBodyLength<512>()];
+	for (size_t i = 0; i < sizeof(body); ++i) body[i] = uint8_t(i);
+	for (size_t i = 0; i < count; ++i) {
+	  uint32_t length = rng() % 100 == 0 ? rng() % maxBodyLength<512>() : rng() % 64;
+	  makePacket(pkt, uint32_t(i % 8), body, length);
+	  writer.append(pkt, i * 10000);
+	  sum += length;
+	}
+	writer.close();
+  }
+  double sec = std::chrono::duration<double>(Clock::now() - start).count();
+  printf("write  %zu packets %.2f Mpkt/s\n", count, count / sec / 1e6);
+
+  CaptureReader reader(path);
+  printf("file   %zu bytes (%.1f bytes/packet)\n", reader.fileSize(), double(reader.fileSize()) / count);
+
+  // 最高速で再生して、内容を確かめる
+  uint64_t got = 0, bad = 0, index = 0;
+  auto stats = replay(reader, [&](const CaptureRecord& rec) {
+	  got += rec.length();
+	  bad += rec.type() != index % 8 || (rec.length() > 0 && rec.body()[rec.length() - 1] != uint8_t(rec.length() - 1));
+	  ++index;
+	});
+  printf("replay %llu packets %.2f Mpkt/s %.2f GB/s%s\n",
+		 (unsigned long long)stats.packets, stats.packets / stats.seconds / 1e6,
+		 stats.bytes / stats.seconds / 1e9,
+		 stats.packets == count && got == sum && bad == 0 ? "" : " (check failed)");
+
+  // 記録時の間隔で再生する(先頭の1000パケット = 10ms)
+  auto last = reader.begin();
+  for (int i = 0; i < 1000 && last != reader.end(); ++i) ++last;
+  auto paced = replay(reader.begin(), last, [](const CaptureRecord&) {}, ReplaySpeed::Recorded);
+  printf("paced  %llu packets in %.2f ms, max late %.1f us\n",
+		 (unsigned long long)paced.packets, paced.seconds * 1e3, paced.maxLateNs / 1e3);
+
+  // 7パケットごとにflush()する。レコードがページをまたがない配置は変わらない
+  std::string flushPath = path + ".flush";
+  size_t flushCount = count < 10000 ? count : 10000;
+  {
+	CaptureWriter writer(flushPath);
+	Packet512 pkt;
+	uint8_t body[64];
+	for (size_t i = 0; i < sizeof(body); ++i) body[i] = uint8_t(i);
+	for (size_t i = 0; i < flushCount; ++i) {
+	  makePacket(pkt, uint32_t(i % 8), body, uint32_t(i % sizeof(body)));
+	  writer.append(pkt, i * 10000);
+	  if (i % 7 == 6) writer.flush();
+	}
+	writer.close();
+  }
+  CaptureReader flushed(flushPath);
+  uint64_t flushedBad = 0, flushedIndex = 0;
+  auto flushedStats = replay(flushed, [&](const CaptureRecord& rec) {
+	  flushedBad += rec.type() != flushedIndex % 8 || rec.length() != flushedIndex % 64;
+	  ++flushedIndex;
+	});
+  printf("flush  %llu packets, %zu bytes%s\n",
+		 (unsigned long long)flushedStats.packets, flushed.fileSize(),
+		 flushedStats.packets == flushCount && flushedBad == 0 && flushed.fileSize() % CapturePageSize == 0
+		 ? "" : " (check failed)");
+  unlink(flushPath.c_str());
+}
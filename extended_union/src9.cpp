@@ -0,0 +1,147 @@
+// -*-tab-width:4-*-
+// g++ -std=c++14 -O2 -Wall src9.cpp
+// 大きさの混ざったメッセージを、固定長のPacket512と可変長パケットで保持した時のメモリ量と走査速度を比べる
+// ./src9 [メッセージ数]
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "VarPacket.hpp"
+
+using namespace ts::packet;
+using Clock = std::chrono::steady_clock;
+
+// 本体の長さの分布。小さいメッセージがほとんどで、たまに大きいものが混ざる
+uint32_t messageLength(std::mt19937& rng) {
+  uint32_t r = rng() % 1000;
+  if (r < 600) return 4 + rng() % 44;     // 64バイトクラス
+  if (r < 900) return 60 + rng() % 180;   // 256バイトクラス
+  if (r < 980) return 300 + rng() % 700;  // 1Kクラス
+  if (r < 999) return 1100 + rng() % 2900; // 4Kクラス
+  return 8000 + rng() % 8000;             // ジャンボ
+}
+
+template <typename F>
+double nsPerMessage(size_t count, int repeat, F f) {
+  auto start = Clock::now();
+  for (int r = 0; r < repeat; ++r) f();
+  return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / (double(count) * repeat);
+}
+
+int main(int ac, char* av[]) {
+  size_t count = ac > 1 ? strtoul(av[1], nullptr, 10) : 200000;
+  const int repeat = 10;
+
+  std::mt19937 rng(1);
+  std::vector<uint32_t> lengths(count);
+  for (auto& len : lengths) len = messageLength(rng);
+  static uint8_t source[16384];
+  for (size_t i = 0; i < sizeof(source); ++i) source[i] = uint8_t(i * 7);
+
+  // 固定長: Packet512に入らないメッセージは落とす
+  std::vector<Packet512> fixed(count);
+  size_t dropped = 0;
+  for (size_t i = 0; i < count; ++i) {
+	uint32_t len = lengths[i];
+	if (len > maxBodyLength<512>()) {
+	  ++dropped;
+	  len = 0;
+	}
+	makePacket(fixed[i], uint32_t(i), source, len);
+  }
+
+  // 可変長: サイズクラスのプールから確保する
+  VarPacketPool pool(uint32_t(count), uint32_t(count / 2), uint32_t(count / 8), uint32_t(count / 32));
+  std::vector<VarPacket> var;
+  var.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+	var.push_back(pool.allocate(uint32_t(i), source, lengths[i]));
+  }
+
+  size_t fixedBytes = count * sizeof(Packet512);
+  size_t varBytes = 0, payload = 0;
+  for (size_t i = 0; i < count; ++i) {
+	varBytes += var[i].sizeClass() == VarPacketPool::Jumbo ?
+	  alignUp(var[i].size(), CacheLineSize) : VarPacketPool::classSize(var[i].sizeClass());
+	payload += lengths[i];
+  }
+  printf("messages %zu, average body %.1f bytes\n", count, double(payload) / count);
+  printf("Packet512 %8.1f bytes/message, %zu messages did not fit\n", double(fixedBytes) / count, dropped);
+  printf("VarPacket %8.1f bytes/message (64:%llu 256:%llu 1K:%llu 4K:%llu jumbo:%llu)\n",
+		 double(varBytes) / count,
+		 (unsigned long long)pool.allocated(0), (unsigned long long)pool.allocated(1),
+		 (unsigned long long)pool.allocated(2), (unsigned long long)pool.allocated(3),
+		 (unsigned long long)pool.allocated(VarPacketPool::Jumbo));
+
+  // 可変長パケットを詰めて並べた受信バッファ(8バイト境界に揃える)
+  std::vector<uint8_t> packed;
+  for (auto& pkt : var) {
+	size_t pos = packed.size();
+	packed.resize(pos + alignUp(pkt.size(), 8));
+	memcpy(&packed[pos], pkt.view().data(), pkt.size());
+  }
+  printf("packed    %8.1f bytes/message\n", double(packed.size()) / count);
+
+  // ヘッダだけを走査する(typeの集計)
+  // 集計はローカル変数で行う(uint8_tのポインタ経由の読み出しとエイリアスしないように)
+  const uint8_t* buf = packed.data();
+  const size_t bufSize = packed.size();
+  uint64_t sum[3] = {};
+  double head[3];
+  head[0] = nsPerMessage(count, repeat, [&] {
+	  uint64_t s = 0;
+	  for (auto& pkt : fixed) s += packetView(static_cast<const Packet512&>(pkt)).get<tag::Header, tag::Type>();
+	  sum[0] += s;
+	});
+  head[1] = nsPerMessage(count, repeat, [&] {
+	  uint64_t s = 0;
+	  for (auto& pkt : var) s += pkt.type();
+	  sum[1] += s;
+	});
+  head[2] = nsPerMessage(count, repeat, [&] {
+	  uint64_t s = 0;
+	  for (size_t pos = 0; pos < bufSize; ) {
+		auto v = VarPacketView<>::parse(buf + pos, bufSize - pos);
+		s += v.type();
+		pos += alignUp(v.size(), 8);
+	  }
+	  sum[2] += s;
+	});
+  printf("header scan  Packet512 %6.2f  VarPacket %6.2f  packed %6.2f ns/message%s\n",
+		 head[0], head[1], head[2], sum[0] == sum[1] && sum[1] == sum[2] ? "" : " (check failed)");
+
+  // 本体まで読む(本体のバイトの合計)。Packet512は落としたメッセージの分だけ少ない
+  auto bodySum = [](const uint8_t* p, uint32_t n) {
+	uint64_t s = 0;
+	for (uint32_t i = 0; i < n; ++i) s += p[i];
+	return s;
+  };
+  uint64_t body[3] = {};
+  double full[3];
+  full[0] = nsPerMessage(count, repeat, [&] {
+	  uint64_t s = 0;
+	  for (auto& pkt : fixed) {
+		auto v = packetView(static_cast<const Packet512&>(pkt));
+		s += bodySum(v.at<tag::Payload, tag::Body>(), v.get<tag::Payload, tag::Length>());
+	  }
+	  body[0] += s;
+	});
+  full[1] = nsPerMessage(count, repeat, [&] {
+	  uint64_t s = 0;
+	  for (auto& pkt : var) s += bodySum(pkt.body(), pkt.length());
+	  body[1] += s;
+	});
+  full[2] = nsPerMessage(count, repeat, [&] {
+	  uint64_t s = 0;
+	  for (size_t pos = 0; pos < bufSize; ) {
+		auto v = VarPacketView<>::parse(buf + pos, bufSize - pos);
+		s += bodySum(v.body(), v.length());
+		pos += alignUp(v.size(), 8);
+	  }
+	  body[2] += s;
+	});
+  printf("body scan    Packet512 %6.2f  VarPacket %6.2f  packed %6.2f ns/message%s\n",
+		 full[0], full[1], full[2], body[1] == body[2] && body[0] <= body[1] ? "" : " (check failed)");
+}
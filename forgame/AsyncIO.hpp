@@ -0,0 +1,459 @@
+// -*-tab-width:4;c++-*-
+//
+// 非同期のファイル読み込み
+//
+// AsyncIOは、ファイルの読み込みをまとめて投入し、完了をポーリングで受け取るクラスです。
+// Linuxではio_uringを使います(liburingは使わず、システムコールを直接呼びます)。
+// io_uringが使えない環境(古いカーネルやseccompで禁止されている場合、IORING_OP_READの無い5.6より前のカーネル)では、
+// preadを呼ぶスレッドプールを使います。
+//
+// 読み込みはIoBatchにまとめ、submit()で投入します。バッチのすべての読み込みが終わると、poll()の中でonDoneを呼びます。
+// 投入はflush()までためておき、io_uringではflush()ごとに1回だけio_uring_enterを呼びます。
+// 完了の確認(poll)は、io_uringでは共有メモリのリングを読むだけで、システムコールは呼びません。
+// 同時に投入する数はリングの大きさまでで、溢れた読み込みは完了を待って順に投入します。
+//
+// TaskQueueはAsyncIOを持ち、update()の先頭でpoll()、最後にflush()を呼びます。
+// タスクからの使い方はTaskQueue::waitIO/awaitIOを見てください。
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+namespace ts {
+namespace namedobj {
+
+  class IoBatch;
+
+  // 1つの読み込み
+  struct IoRequest {
+	int fd;
+	void* buf;
+	uint32_t size;
+	uint64_t offset;
+	int32_t result;  // 読んだバイト数、または-errno
+	IoBatch* batch;
+  };
+
+  // まとめて完了を待つ読み込み
+  // 投入から完了まではAsyncIOが保持するので、投入した側が先に手放してもよい
+  class IoBatch {
+  public:
+	// 読み込みを追加し、番号を返す。submitの前に呼ぶこと
+	size_t read(int fd, void* buf, size_t size, uint64_t offset = 0) {
+	  assert(!submitted_);
+	  requests_.push_back({ fd, buf, uint32_t(size), offset, 0, this });
+	  return requests_.size() - 1;
+	}
+
+	size_t size() const { return requests_.size(); }
+	// 読み込みの結果。読んだバイト数、または-errno
+	int32_t result(size_t i) const { return requests_.at(i).result; }
+	// 失敗した読み込みの数
+	size_t failed() const {
+	  return size_t(std::count_if(requests_.begin(), requests_.end(), [](const IoRequest& r) { return r.result < 0; }));
+	}
+	size_t pending() const { return pending_; }
+	bool done() const { return submitted_ && pending_ == 0; }
+
+  private:
+	friend class AsyncIO;
+	std::vector<IoRequest> requests_;
+	size_t pending_ = 0;
+	bool submitted_ = false;
+	std::function<void()> onDone_;
+	std::shared_ptr<IoBatch> self_; // 完了まで自分を保持する
+  };
+
+  // 読み込みを実行する部分
+  class IoBackend {
+  public:
+	virtual ~IoBackend() = default;
+	virtual const char* name() const = 0;
+	// 同時に投入できる数
+	virtual size_t capacity() const = 0;
+	// 投入をためる。今は受け付けられなければfalse(後でやり直す)
+	virtual bool submit(IoRequest* r) = 0;
+	virtual void flush() = 0;
+	// 完了した読み込みをdoneに追加する。ブロックしない
+	virtual void reap(std::vector<IoRequest*>& done) = 0;
+	// 1つ以上完了するまで待つ
+	virtual void wait() = 0;
+	// reap()で取り出せる完了があるか。ブロックしない
+	virtual bool ready() const = 0;
+	// 読み込みが完了した時に、完了したスレッドでnotifyを呼ぶ。できない方式ならfalseを返す
+	virtual bool setNotify(std::function<void()> /*notify*/) { return false; }
+  };
+
+#ifdef __linux__
+  // io_uringによる読み込み
+  class IoUringBackend : public IoBackend {
+  public:
+	// 作れなければfalse
+	bool open(unsigned entries) {
+	  io_uring_params p;
+	  memset(&p, 0, sizeof(p));
+	  int fd = int(syscall(__NR_io_uring_setup, entries, &p));
+	  if (fd < 0) return false;
+	  fd_ = fd;
+	  if (!supportsRead()) { close(); return false; }
+	  sqRingSize_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	  cqRingSize_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	  bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	  if (single) sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+	  sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	  if (sqRing_ == MAP_FAILED) { sqRing_ = nullptr; close(); return false; }
+	  if (single) cqRing_ = sqRing_;
+	  else {
+		cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cqRing_ == MAP_FAILED) { cqRing_ = nullptr; close(); return false; }
+	  }
+	  sqesSize_ = p.sq_entries * sizeof(io_uring_sqe);
+	  void* sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	  if (sqes == MAP_FAILED) { close(); return false; }
+	  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+	  char* sq = static_cast<char*>(sqRing_);
+	  sqHead_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+	  sqTail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+	  sqMask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+	  sqArray_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+	  sqEntries_ = p.sq_entries;
+	  char* cq = static_cast<char*>(cqRing_);
+	  cqHead_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+	  cqTail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+	  cqMask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+	  cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+	  cqEntries_ = p.cq_entries;
+	  return true;
+	}
+	~IoUringBackend() { close(); }
+
+	const char* name() const override { return "io_uring"; }
+	// 完了キューが溢れないように、完了キューの大きさまでにする
+	size_t capacity() const override { return cqEntries_; }
+
+	// 投入キューが一杯の時は1回だけflush()し、それでも空かなければ(io_uring_enterが失敗し続けるなど)falseを返す
+	bool submit(IoRequest* r) override {
+	  unsigned tail = *sqTail_;
+	  if (tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_) {
+		flush();
+		if (tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_) return false;
+	  }
+	  unsigned index = tail & sqMask_;
+	  io_uring_sqe* sqe = &sqes_[index];
+	  memset(sqe, 0, sizeof(*sqe));
+	  sqe->opcode = IORING_OP_READ;
+	  sqe->fd = r->fd;
+	  sqe->addr = reinterpret_cast<uint64_t>(r->buf);
+	  sqe->len = r->size;
+	  sqe->off = r->offset;
+	  sqe->user_data = reinterpret_cast<uint64_t>(r);
+	  sqArray_[index] = index;
+	  __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+	  ++unsubmitted_;
+	  return true;
+	}
+	void flush() override {
+	  while (unsubmitted_ > 0) {
+		long n = syscall(__NR_io_uring_enter, fd_, unsubmitted_, 0, 0, nullptr, 0);
+		if (n < 0) {
+		  if (errno == EINTR) continue;
+		  // EAGAIN/EBUSYは、次のflush()でやり直す
+		  return;
+		}
+		unsubmitted_ -= unsigned(n);
+	  }
+	}
+	void reap(std::vector<IoRequest*>& done) override {
+	  unsigned head = *cqHead_;
+	  unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+	  for (; head != tail; ++head) {
+		const io_uring_cqe& cqe = cqes_[head & cqMask_];
+		IoRequest* r = reinterpret_cast<IoRequest*>(cqe.user_data);
+		r->result = cqe.res;
+		done.push_back(r);
+	  }
+	  __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+	}
+	// ためている投入も同じ呼び出しで渡す。投入できていない読み込みだけを待って眠らないように
+	void wait() override {
+	  long n = syscall(__NR_io_uring_enter, fd_, unsubmitted_, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+	  if (n > 0) unsubmitted_ -= unsigned(n);
+	}
+	bool ready() const override {
+	  return *cqHead_ != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+	}
+	int fd() const { return fd_; }
+
+  private:
+	// IORING_OP_READはカーネル5.6から。io_uring_setupができても使えないことがあるので、
+	// IORING_REGISTER_PROBEで確かめる(probe自体も5.6からなので、失敗すれば使えない)
+	bool supportsRead() const {
+	  const unsigned ops = 256;
+	  std::vector<char> buf(sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op), 0);
+	  io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buf.data());
+	  if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, ops) < 0) return false;
+	  return probe->last_op >= IORING_OP_READ && IORING_OP_READ < probe->ops_len &&
+		(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) != 0;
+	}
+	void close() {
+	  if (sqes_) munmap(sqes_, sqesSize_);
+	  if (cqRing_ && cqRing_ != sqRing_) munmap(cqRing_, cqRingSize_);
+	  if (sqRing_) munmap(sqRing_, sqRingSize_);
+	  if (fd_ >= 0) ::close(fd_);
+	  sqes_ = nullptr;
+	  sqRing_ = cqRing_ = nullptr;
+	  fd_ = -1;
+	}
+
+	int fd_ = -1;
+	void* sqRing_ = nullptr;
+	void* cqRing_ = nullptr;
+	size_t sqRingSize_ = 0, cqRingSize_ = 0, sqesSize_ = 0;
+	io_uring_sqe* sqes_ = nullptr;
+	unsigned* sqHead_ = nullptr;
+	unsigned* sqTail_ = nullptr;
+	unsigned* sqArray_ = nullptr;
+	unsigned sqMask_ = 0, sqEntries_ = 0;
+	unsigned* cqHead_ = nullptr;
+	unsigned* cqTail_ = nullptr;
+	io_uring_cqe* cqes_ = nullptr;
+	unsigned cqMask_ = 0, cqEntries_ = 0;
+	unsigned unsubmitted_ = 0;
+  };
+#endif
+
+  // preadを呼ぶスレッドプールによる読み込み
+  class ThreadPoolIoBackend : public IoBackend {
+  public:
+	explicit ThreadPoolIoBackend(unsigned threads = 4, size_t capacity = 256) : capacity_(capacity) {
+	  for (unsigned i = 0; i < std::max(threads, 1u); ++i) threads_.emplace_back([this] { run(); });
+	}
+	~ThreadPoolIoBackend() {
+	  {
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	  }
+	  work_.notify_all();
+	  for (auto& t : threads_) t.join();
+	}
+
+	const char* name() const override { return "thread pool"; }
+	size_t capacity() const override { return capacity_; }
+
+	bool submit(IoRequest* r) override {
+	  unsubmitted_.push_back(r);
+	  return true;
+	}
+	void flush() override {
+	  if (unsubmitted_.empty()) return;
+	  {
+		std::lock_guard<std::mutex> lock(mutex_);
+		queue_.insert(queue_.end(), unsubmitted_.begin(), unsubmitted_.end());
+	  }
+	  unsubmitted_.clear();
+	  work_.notify_all();
+	}
+	void reap(std::vector<IoRequest*>& done) override {
+	  // 完了が無ければロックを取らない
+	  if (doneCount_.load(std::memory_order_acquire) == 0) return;
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  done.insert(done.end(), done_.begin(), done_.end());
+	  done_.clear();
+	  doneCount_.store(0, std::memory_order_relaxed);
+	}
+	void wait() override {
+	  flush();
+	  std::unique_lock<std::mutex> lock(mutex_);
+	  finished_.wait(lock, [this] { return !done_.empty(); });
+	}
+	bool ready() const override { return doneCount_.load(std::memory_order_acquire) != 0; }
+	bool setNotify(std::function<void()> notify) override {
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  notify_ = std::move(notify);
+	  return true;
+	}
+
+  private:
+	void run() {
+	  std::unique_lock<std::mutex> lock(mutex_);
+	  for (;;) {
+		work_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+		if (stop_) return;
+		IoRequest* r = queue_.front();
+		queue_.pop_front();
+		lock.unlock();
+		ssize_t n;
+		do {
+		  n = pread(r->fd, r->buf, r->size, off_t(r->offset));
+		} while (n < 0 && errno == EINTR);
+		r->result = n < 0 ? -errno : int32_t(n);
+		lock.lock();
+		done_.push_back(r);
+		doneCount_.store(done_.size(), std::memory_order_release);
+		finished_.notify_one();
+		if (notify_) notify_();
+	  }
+	}
+
+	size_t capacity_;
+	std::vector<IoRequest*> unsubmitted_;
+	std::mutex mutex_;
+	std::condition_variable work_;
+	std::condition_variable finished_;
+	std::deque<IoRequest*> queue_;
+	std::vector<IoRequest*> done_;
+	std::atomic<size_t> doneCount_{ 0 };
+	bool stop_ = false;
+	std::function<void()> notify_;
+	std::vector<std::thread> threads_;
+  };
+
+  class AsyncIO {
+  public:
+	enum class Backend {
+	  Auto,       // io_uringが使えなければスレッドプール
+	  ThreadPool, // 常にスレッドプール
+	};
+
+	// entries: io_uringのリングの大きさ。threads: スレッドプールのスレッド数
+	explicit AsyncIO(Backend backend = Backend::Auto, unsigned entries = 256, unsigned threads = 4) {
+#ifdef __linux__
+	  if (backend != Backend::ThreadPool) {
+		std::unique_ptr<IoUringBackend> uring(new IoUringBackend);
+		if (uring->open(entries)) backend_ = std::move(uring);
+	  }
+#endif
+	  if (!backend_) backend_.reset(new ThreadPoolIoBackend(threads, entries));
+	}
+	// 投入済みの読み込みは、バッファが使われなくなるまで完了を待つ。onDoneは呼ばない
+	// 溢れて待っていた読み込みは投入せず、結果を-ECANCELEDにする
+	// 完了していないバッチが自分を保持しているのを外す(外さないとリークする)
+	~AsyncIO() {
+	  std::vector<std::shared_ptr<IoBatch>> batches;
+	  auto release = [&batches](IoBatch& b) {
+		b.onDone_ = nullptr;
+		if (b.self_) batches.push_back(std::move(b.self_));
+	  };
+	  for (auto r : backlog_) {
+		r->result = -ECANCELED;
+		--r->batch->pending_;
+		release(*r->batch);
+	  }
+	  backlog_.clear();
+	  for (auto b : empty_) release(*b);
+	  empty_.clear();
+	  // 完了済みでpoll()を待っていたものと、これから完了するもの
+	  done_.clear();
+	  for (;;) {
+		backend_->reap(done_);
+		inFlight_ -= done_.size();
+		for (auto r : done_) {
+		  --r->batch->pending_;
+		  release(*r->batch);
+		}
+		done_.clear();
+		if (inFlight_ == 0) break;
+		backend_->wait();
+	  }
+	  // すべての読み込みが終わってから手放す
+	  batches.clear();
+	}
+	AsyncIO(const AsyncIO&) = delete;
+	AsyncIO& operator = (const AsyncIO&) = delete;
+
+	// batchの読み込みを投入する。すべて完了したら、poll()の中でonDoneを呼ぶ
+	void submit(std::shared_ptr<IoBatch> batch, std::function<void()> onDone = nullptr) {
+	  assert(batch && !batch->submitted_);
+	  IoBatch& b = *batch;
+	  b.submitted_ = true;
+	  b.pending_ = b.requests_.size();
+	  b.onDone_ = std::move(onDone);
+	  b.self_ = std::move(batch);
+	  if (b.pending_ == 0) {
+		empty_.push_back(&b);
+		return;
+	  }
+	  for (auto& r : b.requests_) {
+		// 先に溢れているものがあれば、順番を守って後ろに並べる
+		if (backlog_.empty() && inFlight_ < backend_->capacity() && backend_->submit(&r)) ++inFlight_;
+		else backlog_.push_back(&r);
+	  }
+	}
+	// ためた投入を実行する
+	void flush() { backend_->flush(); }
+
+	// 完了した読み込みを処理し、完了したバッチのonDoneを呼ぶ。ブロックしない
+	// 戻り値は完了した読み込みの数
+	size_t poll() {
+	  done_.clear();
+	  backend_->reap(done_);
+	  inFlight_ -= done_.size();
+	  // 空いた分だけ、溢れていた読み込みを投入する
+	  bool refilled = false;
+	  // 受け付けられなければ、次のpoll()でやり直す
+	  while (!backlog_.empty() && inFlight_ < backend_->capacity() && backend_->submit(backlog_.front())) {
+		backlog_.pop_front();
+		++inFlight_;
+		refilled = true;
+	  }
+	  if (refilled) backend_->flush();
+	  for (auto r : done_) {
+		if (--r->batch->pending_ == 0) complete(*r->batch);
+	  }
+	  while (!empty_.empty()) {
+		IoBatch* b = empty_.back();
+		empty_.pop_back();
+		complete(*b);
+	  }
+	  return done_.size();
+	}
+	// 1つ以上完了するまで待つ。読み込み中でなければすぐに戻る
+	void wait() {
+	  if (inFlight_ > 0) backend_->wait();
+	}
+
+	// 投入して完了していない読み込みの数(溢れて待っているものを含む)
+	size_t inFlight() const { return inFlight_ + backlog_.size(); }
+	bool idle() const { return inFlight() == 0 && empty_.empty(); }
+	// 次のpoll()で完了を処理できるか
+	bool ready() const { return !empty_.empty() || backend_->ready(); }
+	// 読み込みが完了した時に、完了したスレッドでnotifyを呼ぶ(TaskQueueが眠っている時に起こすため)
+	// io_uringではできないのでfalseを返す。その時は、読み込み中はready()を調べに起きること
+	bool setNotify(std::function<void()> notify) { return backend_->setNotify(std::move(notify)); }
+	const char* backendName() const { return backend_->name(); }
+
+  private:
+	static void complete(IoBatch& b) {
+	  // onDoneの中でバッチを破棄しないように、呼び終わるまで保持する
+	  std::shared_ptr<IoBatch> self = std::move(b.self_);
+	  auto onDone = std::move(b.onDone_);
+	  if (onDone) onDone();
+	}
+
+	std::unique_ptr<IoBackend> backend_;
+	std::deque<IoRequest*> backlog_;
+	std::vector<IoRequest*> done_;
+	std::vector<IoBatch*> empty_;
+	size_t inFlight_ = 0;
+  };
+
+}} // ts::namedobj
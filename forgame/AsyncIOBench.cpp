@@ -0,0 +1,211 @@
+// -*-tab-width:4-*-
+//
+// 非同期の読み込みと、ブロックする読み込みの比較
+// 小さなファイルをたくさん作り、ページキャッシュから追い出してから、次の方法で全部読む
+//   blocking        : タスクの中でpreadを順に呼ぶ
+//   io_uring        : タスクがawaitIOで読み込みを投入し、完了まで待つ
+//   io_uring fiber  : ファイバーのタスクがfiberAwaitIOで待つ
+//   thread pool     : awaitIOと同じ処理を、スレッドプールで行う
+// 読み終わるまでの時間と、最も長かったフレームの時間を表示する
+// 最初に、完了を待たずにAsyncIOを破棄しても、バッチが残らないことを確かめる
+// ./t8 [ファイル数] [ディレクトリ]
+//
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "NamedObject.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "FiberTask.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using ts::instrument::checkResult;
+using Clock = chrono::steady_clock;
+
+const size_t FileSize = 4096;
+
+static vector<string> files;
+static vector<int> fds;
+static vector<char> buffer;
+
+void createFiles(const string& dir, size_t count) {
+  mkdir(dir.c_str(), 0755);
+  vector<char> data(FileSize);
+  for (size_t i = 0; i < count; ++i) {
+	string path = dir + "/f" + to_string(i);
+	for (size_t j = 0; j < FileSize; ++j) data[j] = char(i + j);
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, data.data(), FileSize) != ssize_t(FileSize)) {
+	  cerr << "cannot write " << path << endl;
+	  exit(1);
+	}
+	fdatasync(fd);
+	close(fd);
+	files.push_back(path);
+  }
+}
+
+// ページキャッシュから追い出して開き直す
+void reopen() {
+  for (auto fd : fds) close(fd);
+  fds.clear();
+  for (auto& path : files) {
+	int fd = open(path.c_str(), O_RDONLY);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	fds.push_back(fd);
+  }
+  buffer.assign(files.size() * FileSize, 0);
+}
+
+bool verify() {
+  for (size_t i = 0; i < files.size(); ++i) {
+	for (size_t j = 0; j < FileSize; j += 512) {
+	  if (buffer[i * FileSize + j] != char(i + j)) return false;
+	}
+  }
+  return true;
+}
+
+shared_ptr<IoBatch> makeBatch() {
+  auto batch = make_shared<IoBatch>();
+  for (size_t i = 0; i < fds.size(); ++i) batch->read(fds[i], &buffer[i * FileSize], FileSize);
+  return batch;
+}
+
+// taskが終わるまでupdate()を呼び、全体の時間と最も長いフレームの時間を表示する
+void run(const char* label, TaskQueue& tq, Task&& task) {
+  tq.run(move(task));
+  tq.update();
+  int64_t maxFrame = 0;
+  size_t frames = 0;
+  auto start = Clock::now();
+  while (!tq.finished()) {
+	auto t = Clock::now();
+	tq.update();
+	++frames;
+	maxFrame = max<int64_t>(maxFrame, chrono::duration_cast<chrono::microseconds>(Clock::now() - t).count());
+  }
+  auto total = chrono::duration_cast<chrono::microseconds>(Clock::now() - start).count();
+  cout << label << total << " us total, max frame " << maxFrame << " us, " << frames << " frames"
+	   << (verify() ? "" : "  DATA MISMATCH") << endl;
+}
+
+void check() {
+  int fd = open("/dev/zero", O_RDONLY);
+  TS_CHECK(fd >= 0);
+  for (auto backend : { AsyncIO::Backend::Auto, AsyncIO::Backend::ThreadPool }) {
+	// リングより多く投入して、溢れた読み込みを残したまま破棄する
+	vector<char> buf(64 * 512);
+	weak_ptr<IoBatch> overflowed, empty;
+	bool called = false;
+	{
+	  AsyncIO io(backend, 4, 2);
+	  auto batch = make_shared<IoBatch>();
+	  for (size_t i = 0; i < 64; ++i) batch->read(fd, &buf[i * 512], 512);
+	  overflowed = batch;
+	  io.submit(move(batch), [&called] { called = true; });
+	  io.flush();
+	  TS_CHECK(io.inFlight() > 0);
+	  auto none = make_shared<IoBatch>();
+	  empty = none;
+	  io.submit(move(none));
+	}
+	TS_CHECK(overflowed.expired());
+	TS_CHECK(empty.expired());
+	TS_CHECK(!called);
+
+	// 溢れた読み込みも、空いた分から順に投入して終わる
+	{
+	  AsyncIO io(backend, 4, 2);
+	  auto batch = make_shared<IoBatch>();
+	  for (size_t i = 0; i < 64; ++i) batch->read(fd, &buf[i * 512], 512);
+	  io.submit(batch, [&called] { called = true; });
+	  io.flush();
+	  while (!io.idle()) {
+		io.wait();
+		io.poll();
+	  }
+	  TS_CHECK(called);
+	  TS_CHECK(batch->done());
+	  TS_CHECK_EQ(batch->failed(), 0u);
+	  TS_CHECK_EQ(batch->result(63), 512);
+	}
+  }
+  close(fd);
+}
+
+int main(int ac, char* av[]) {
+  check();
+  size_t count = ac > 1 ? size_t(atol(av[1])) : 2000;
+  string dir = ac > 2 ? av[2] : "asyncio_bench";
+  createFiles(dir, count);
+  cout << count << " files x " << FileSize << " bytes" << endl;
+
+  reopen();
+  {
+	TaskQueue blocking;
+	run("blocking        ", blocking, Task([](TaskQueue& tq, TaskArgs&) {
+		  for (size_t i = 0; i < fds.size(); ++i) {
+			if (pread(fds[i], &buffer[i * FileSize], FileSize, 0) != ssize_t(FileSize)) cerr << "read error" << endl;
+		  }
+		  tq.finish();
+		  return TaskStatus::RemoveTask;
+		}));
+  }
+
+  // 1回目は読み込みを投入して待ち、完了すると2回目が呼ばれる
+  auto awaitTask = [] {
+	auto submitted = make_shared<bool>(false);
+	return [submitted](TaskQueue& tq, TaskArgs&) {
+	  if (!*submitted) {
+		*submitted = true;
+		tq.awaitIO(makeBatch());
+		return TaskStatus::ContinueTask;
+	  }
+	  tq.finish();
+	  return TaskStatus::RemoveTask;
+	};
+  };
+
+  reopen();
+  {
+	TaskQueue uring;
+	cout << "backend: " << uring.io().backendName() << endl;
+	run("io_uring        ", uring, Task(awaitTask()));
+  }
+
+  reopen();
+  {
+	TaskQueue fiber;
+	run("io_uring fiber  ", fiber, Task(fiberTask([](TaskQueue& tq, TaskArgs&) {
+			auto batch = makeBatch();
+			fiberAwaitIO(tq, batch);
+			if (batch->failed()) cerr << batch->failed() << " reads failed" << endl;
+			tq.finish();
+			return TaskStatus::RemoveTask;
+		  })));
+  }
+
+  reopen();
+  {
+	TaskQueue pool;
+	pool.setIO(unique_ptr<AsyncIO>(new AsyncIO(AsyncIO::Backend::ThreadPool)));
+	run("thread pool     ", pool, Task(awaitTask()));
+  }
+
+  for (auto fd : fds) close(fd);
+  for (auto& path : files) unlink(path.c_str());
+  rmdir(dir.c_str());
+  return checkResult("asyncio");
+}
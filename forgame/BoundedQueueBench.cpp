@@ -0,0 +1,184 @@
+// -*-tab-width:4-*-
+//
+// 有界モードのTaskQueueの過負荷試験
+// ネットワークのスレッドのかわりに、別のスレッドが1msごとにrate個、50msごとにstorm個のタスクをpost()する。
+// タスクはそれぞれ約1usの処理をする。メインスレッドはupdate()の後に1ms待つ(垂直同期のかわり)
+//   unbounded  : 無制限(これまでの動作)
+//   reject     : 上限を超えたタスクを捨てる
+//   dropoldest : 上限を超えたら古いタスクを捨てる
+//   block      : 上限を超えたらpost()したスレッドを待たせる
+// update()の時間のp50/p99/最大、フレームの先頭のキューの長さ(TaskMetrics)のp99/最大、受け付けた数などを表示する
+// 最初に、それぞれの動作と優先度の順番を確かめる
+// ./t18 [フレーム数] [上限] [rate] [storm]
+//
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+#include "NamedObject.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using ts::instrument::checkResult;
+using Clock = chrono::steady_clock;
+using Overflow = TaskQueue::Overflow;
+using Priority = TaskQueue::Priority;
+
+static volatile uint64_t sink;
+
+// 約1usの処理
+TaskStatus work(TaskQueue&, TaskArgs&) {
+  uint64_t x = sink;
+  for (int i = 0; i < 300; ++i) x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+  sink = x;
+  return TaskStatus::RemoveTask;
+}
+
+void check() {
+  auto mark = [](string& order, char c) {
+	return Task([&order, c](TaskQueue&, TaskArgs&) {
+		order += c;
+		return TaskStatus::RemoveTask;
+	  });
+  };
+  // 一杯なら捨てる
+  {
+	TaskQueue tq;
+	tq.setCapacity(4, Overflow::Reject);
+	int added = 0;
+	for (int i = 0; i < 6; ++i) added += tq.addTask(Task(work));
+	TS_CHECK_EQ(added, 4);
+	TS_CHECK_EQ(tq.depth(), 4u);
+	TS_CHECK_EQ(tq.admissionStats().rejected, 2u);
+	tq.update();
+	TS_CHECK_EQ(tq.depth(), 4u);
+	tq.update();
+	TS_CHECK_EQ(tq.depth(), 0u);
+  }
+  // 優先度が同じか低い最も古いタスクを捨て、高いものから実行する
+  {
+	TaskQueue tq;
+	tq.setCapacity(3, Overflow::DropOldest);
+	string order;
+	tq.addTask(mark(order, 'a'), Priority::Low);
+	tq.addTask(mark(order, 'b'));
+	tq.addTask(mark(order, 'c'));
+	TS_CHECK(tq.addTask(mark(order, 'd'), Priority::High));  // aを捨てる
+	TS_CHECK(!tq.addTask(mark(order, 'e'), Priority::Low));  // Low以下が無いので捨てる
+	TS_CHECK(tq.addTask(mark(order, 'f')));                  // bを捨てる
+	tq.update();
+	tq.update();
+	TS_CHECK(order == "dcf");
+	TS_CHECK_EQ(tq.admissionStats().dropped, 2u);
+	TS_CHECK_EQ(tq.admissionStats().rejected, 1u);
+  }
+  // post()したタスクは、次のupdate()で実行する(次のフレームに回さない)
+  for (size_t capacity : { size_t(0), size_t(4) }) {
+	TaskQueue tq;
+	tq.setCapacity(capacity, Overflow::Reject);
+	int ran = 0;
+	for (int i = 0; i < 6; ++i) {
+	  tq.post([&ran] {
+		  return Task([&ran](TaskQueue&, TaskArgs&) {
+			  ++ran;
+			  return TaskStatus::RemoveTask;
+			});
+		});
+	}
+	tq.update();
+	TS_CHECK_EQ(ran, capacity ? 4 : 6);
+	TS_CHECK_EQ(tq.depth(), 0u);
+  }
+  // post()したスレッドは空きができるまで待つ。上限は超えない
+  {
+	TaskQueue tq;
+	tq.setCapacity(4, Overflow::Block);
+	atomic<int> ran{ 0 };
+	thread producer([&] {
+		for (int i = 0; i < 20; ++i) {
+		  tq.post([&ran] {
+			  return Task([&ran](TaskQueue&, TaskArgs&) {
+				  ++ran;
+				  return TaskStatus::RemoveTask;
+				});
+			});
+		}
+	  });
+	size_t maxDepth = 0;
+	for (int f = 0; f < 1000 && ran < 20; ++f) {
+	  tq.update();
+	  maxDepth = max(maxDepth, tq.depth());
+	  this_thread::sleep_for(chrono::microseconds(100));
+	}
+	producer.join();
+	TS_CHECK_EQ(ran.load(), 20);
+	TS_CHECK_LE(maxDepth, 4u);
+	TS_CHECK(tq.admissionStats().blocked > 0);
+  }
+}
+
+void run(const char* label, size_t capacity, Overflow overflow, int frames, int rate, int storm) {
+  TaskQueue tq;
+  TaskMetrics* metrics = new TaskMetrics;
+  tq.setMetrics(metrics);
+  tq.setCapacity(capacity, overflow);
+  tq.setReclaim(TaskQueue::Reclaim::Inline);
+  atomic<bool> stop{ false };
+  atomic<bool> done{ false };
+  thread producer([&] {
+	  for (int ms = 1; !stop; ++ms) {
+		int n = ms % 50 == 0 ? storm : rate;
+		for (int i = 0; i < n && !stop; ++i) tq.post([] { return Task(work); });
+		this_thread::sleep_for(chrono::milliseconds(1));
+	  }
+	  done = true;
+	});
+  vector<double> us;
+  us.reserve(frames);
+  for (int f = 0; f < frames; ++f) {
+	auto start = Clock::now();
+	tq.update();
+	us.push_back(chrono::duration<double, micro>(Clock::now() - start).count());
+	this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  stop = true;
+  // Blockで待っているpost()が終わるまでupdate()を続ける
+  while (!done) {
+	tq.update();
+	this_thread::yield();
+  }
+  producer.join();
+  tq.setMetrics(nullptr);
+  sort(us.begin(), us.end());
+  auto depth = metrics->queueDepth();
+  auto s = tq.admissionStats();
+  printf("  %-10s p50 %8.1f us  p99 %8.1f us  max %8.1f us  depth p99 %6llu max %6llu  "
+		 "accepted %llu rejected %llu dropped %llu blocked %llu\n",
+		 label, us[us.size() / 2], us[us.size() * 99 / 100], us.back(),
+		 (unsigned long long)depth.percentile(0.99), (unsigned long long)depth.max,
+		 (unsigned long long)s.accepted, (unsigned long long)s.rejected,
+		 (unsigned long long)s.dropped, (unsigned long long)s.blocked);
+  delete metrics;
+}
+
+int main(int ac, char* av[]) {
+  int frames = ac > 1 ? atoi(av[1]) : 300;
+  size_t capacity = ac > 2 ? size_t(atoi(av[2])) : 500;
+  int rate = ac > 3 ? atoi(av[3]) : 100;
+  int storm = ac > 4 ? atoi(av[4]) : 10000;
+  check();
+  printf("%d frames, capacity %zu, %d tasks posted per ms, %d every 50 ms\n", frames, capacity, rate, storm);
+  run("unbounded", 0, Overflow::Reject, frames, rate, storm);
+  run("reject", capacity, Overflow::Reject, frames, rate, storm);
+  run("dropoldest", capacity, Overflow::DropOldest, frames, rate, storm);
+  run("block", capacity, Overflow::Block, frames, rate, storm);
+  return checkResult("bounded");
+}
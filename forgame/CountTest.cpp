@@ -0,0 +1,227 @@
+// -*-tab-width:4-*-
+//
+// メモリ確保とコピー・ムーブの回数の検査
+//   Text/Text11 : c++11forGamePrograming.cppの第1章の「newが4回」「newが3回」を実際に数える
+//   addTask     : タスクを作ってキューに入れるまでの確保回数と、関数オブジェクトのコピー・ムーブ回数
+//   Holder      : 実体を持つHolderと参照のHolderのムーブ
+// 回数はlibstdc++での値です。変更で確保やコピーが増えると失敗します
+// make countでは、-fno-elide-constructors(TS_NO_ELIDE)を付けたものも実行します
+//
+#define TS_INSTRUMENT_NEW
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <utility>
+#include <vector>
+#include "NamedObject.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "Holder.hpp"
+#include "../instrument/AllocCounter.hpp"
+#include "../instrument/Counted.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using namespace ts::instrument;
+
+// 第1章のText(コピーのみ)とText11(ムーブ付き)を、コンパイルできるように直したもの
+struct Text {
+  char* text_ = nullptr;
+  size_t length_ = 0;
+  Counted<Text> counted_;
+  Text() = default;
+  template <size_t N>
+  Text(const char (&src)[N]) : text_(new char[N]), length_(N) { memcpy(text_, src, N); }
+  Text(const Text& src) : text_(new char[src.length_]), length_(src.length_), counted_(src.counted_) {
+	memcpy(text_, src.text_, length_);
+  }
+  void swap(Text& src) {
+	std::swap(text_, src.text_);
+	std::swap(length_, src.length_);
+  }
+  Text& operator = (Text src) {
+	swap(src);
+	return *this;
+  }
+  Text operator + (const Text& src) const {
+	Text val;
+	val.text_ = new char[length_ + src.length_];
+	memcpy(val.text_, text_, length_);
+	memcpy(val.text_ + length_, src.text_, src.length_);
+	val.length_ = length_ + src.length_;
+	return val;
+  }
+  ~Text() { delete [] text_; }
+};
+
+struct Text11 {
+  char* text_ = nullptr;
+  size_t length_ = 0;
+  Counted<Text11> counted_;
+  Text11() = default;
+  template <size_t N>
+  Text11(const char (&src)[N]) : text_(new char[N]), length_(N) { memcpy(text_, src, N); }
+  Text11(const Text11& src) : text_(new char[src.length_]), length_(src.length_), counted_(src.counted_) {
+	memcpy(text_, src.text_, length_);
+  }
+  Text11(Text11&& src) noexcept : text_(src.text_), length_(src.length_), counted_(std::move(src.counted_)) {
+	src.text_ = nullptr;
+	src.length_ = 0;
+  }
+  void swap(Text11& src) {
+	std::swap(text_, src.text_);
+	std::swap(length_, src.length_);
+  }
+  Text11& operator = (Text11 src) {
+	swap(src);
+	return *this;
+  }
+  Text11 operator + (const Text11& src) const {
+	Text11 val;
+	val.text_ = new char[length_ + src.length_];
+	memcpy(val.text_, text_, length_);
+	memcpy(val.text_ + length_, src.text_, src.length_);
+	val.length_ = length_ + src.length_;
+	return val;
+  }
+  ~Text11() { delete [] text_; }
+};
+
+Text addHoge(const Text& src) {
+  Text hoge("hoge");
+  return src + hoge;
+}
+Text11 addHoge11(const Text11& src) {
+  Text11 hoge("hoge");
+  return src + hoge;
+}
+
+#ifdef TS_NO_ELIDE
+// コピーの省略が無い場合(第1章のc++03の説明に近い)
+// Textはreturnのたびにコピーするのでnewが6回、Text11はコピーのかわりにムーブする
+const int TextNews = 6, TextCopies = 3, Text11Moves = 3, Text11MovedMoves = 3;
+#else
+// コピーの省略(RVO)があれば、Textもコピーしない
+// std::move(addHoge11(...))と書くと省略できなくなり、ムーブが1回増える
+const int TextNews = 3, TextCopies = 0, Text11Moves = 0, Text11MovedMoves = 1;
+#endif
+
+void checkText() {
+  {
+	AllocScope allocs;
+	CountedScope<Text> counts;
+	Text fuga = addHoge("fuga");
+	TS_CHECK_EQ(allocs.news(), TextNews);
+	TS_CHECK_EQ(counts.copies(), TextCopies);
+	TS_CHECK_EQ(fuga.length_, 10u);
+  }
+  {
+	AllocScope allocs;
+	CountedScope<Text11> counts;
+	Text11 fuga = addHoge11("fuga");
+	TS_CHECK_EQ(allocs.news(), 3);
+	TS_CHECK_EQ(counts.copies(), 0);
+	TS_CHECK_EQ(counts.moves(), Text11Moves);
+  }
+  {
+	AllocScope allocs;
+	CountedScope<Text11> counts;
+	Text11 fuga = std::move(addHoge11("fuga"));
+	TS_CHECK_EQ(allocs.news(), 3);
+	TS_CHECK_EQ(counts.moves(), Text11MovedMoves);
+  }
+}
+
+using Task = TaskT<TaskQueue, TaskQueue::TaskName>;
+using TaskArgs = Task::TaskArgs;
+struct Closure {};
+
+void checkAddTask() {
+  // Taskを作る時は、無名のタスクにも名前を付けてレジストリに登録するので1回確保する
+  // キャプチャの無いラムダ式はstd::functionの中に入るので確保しない
+  {
+	AllocScope allocs;
+	Task t([](TaskQueue&, TaskArgs&) { return TaskStatus::RemoveTask; });
+	TS_CHECK_EQ(allocs.news(), 1);
+	t.retire(); // キューに渡さないので、自分で登録を外す
+  }
+  {
+	AllocScope allocs;
+	Task t("counted", [](TaskQueue&, TaskArgs&) { return TaskStatus::RemoveTask; });
+	TS_CHECK_EQ(allocs.news(), 1);
+	t.retire();
+  }
+  // コピーが必要なキャプチャがあると、std::functionがもう1回確保する
+  // キャプチャの1回と、ラムダ式からstd::functionへのムーブの1回以外に、コピーもムーブもしない
+  Counted<Closure> c;
+  {
+	AllocScope allocs;
+	CountedScope<Closure> counts;
+	Task t([c](TaskQueue&, TaskArgs&) { return TaskStatus::RemoveTask; });
+	TS_CHECK_EQ(allocs.news(), 2);
+	TS_CHECK_EQ(counts.copies(), 1);
+	TS_CHECK_EQ(counts.moves(), 1);
+	t.retire();
+  }
+
+  // addTaskはTaskをムーブするだけで、関数オブジェクトはコピーもムーブもしない
+  // 確保するのはキューのdequeのブロックと、ブロックの表を広げる分だけ
+  TaskQueue tq;
+  const size_t Tasks = 64;
+  const size_t PerBlock = sizeof(Task) < 512 ? 512 / sizeof(Task) : 1;
+  vector<Task> tasks;
+  tasks.reserve(Tasks);
+  for (size_t i = 0; i < Tasks; ++i) {
+	tasks.emplace_back([c](TaskQueue&, TaskArgs&) { return TaskStatus::RemoveTask; });
+  }
+  {
+	AllocScope allocs;
+	CountedScope<Closure> counts;
+	for (auto& t : tasks) tq.addTask(std::move(t));
+	TS_CHECK_LE(allocs.news(), Tasks / PerBlock + 4);
+	TS_CHECK_EQ(counts.copies(), 0);
+	TS_CHECK_EQ(counts.moves(), 0);
+  }
+  // update()で実行して消すまで、関数オブジェクトはコピーもムーブもされない
+  {
+	CountedScope<Closure> counts;
+	tq.update();
+	TS_CHECK_EQ(counts.copies(), 0);
+	TS_CHECK_EQ(counts.moves(), 0);
+  }
+}
+
+struct Body {
+  Counted<Body> counted_;
+};
+
+void checkHolder() {
+  AllocScope allocs;
+  CountedScope<Body> counts;
+  // 実体を持つHolderは、作る時とムーブする時に中身をムーブする
+  Holder<Body> h1{ Body() };
+  TS_CHECK_EQ(counts.moves(), 1);
+  Holder<Body> h2(std::move(h1));
+  TS_CHECK_EQ(counts.moves(), 2);
+  TS_CHECK(h2.hasBody() && !h1.hasBody());
+  // 参照のHolderはポインタをコピーするだけ
+  Body body;
+  counts.restart();
+  Holder<Body> r1(&body);
+  Holder<Body> r2(std::move(r1));
+  TS_CHECK_EQ(counts.moves(), 0);
+  TS_CHECK(&r2.get() == &body);
+  TS_CHECK_EQ(allocs.news(), 0);
+}
+
+int main() {
+  checkText();
+  checkAddTask();
+  checkHolder();
+#ifdef TS_NO_ELIDE
+  return checkResult("count (no elide)");
+#else
+  return checkResult("count");
+#endif
+}
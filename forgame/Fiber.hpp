@@ -0,0 +1,302 @@
+// -*-tab-width:4;c++-*-
+//
+// ファイバー(ユーザーモードのコンテキスト切り替え)
+//
+// Fiberは自分のスタックを持つ関数で、yield()で途中から呼び出し元に戻り、resume()で続きから再開します。
+// x86-64のLinuxでは、callee-savedのレジスタとスタックポインタだけを保存する手書きの切り替えを使います。
+// それ以外の環境、またはTS_FIBER_UCONTEXTを定義した時はucontext(swapcontext)を使います。
+// swapcontextはシグナルマスクを保存するためにシステムコールを呼ぶので、手書きの切り替えより遅くなります。
+//
+// スタックは固定長で、FiberStackPoolがmmapで確保し、終わったファイバーのスタックを使い回します。
+// スタックの下端にはアクセスできないガードページを置き、スタックの溢れはSIGSEGVになります。
+// プールはスレッドごとにあり(FiberStackPool::local())、ファイバーは作ったスレッドで動かしてください。
+//
+// 実行中のファイバーを破棄すると、yield()からFiberCancelを投げて、スタック上のオブジェクトを破棄してから終わります。
+// 本体がFiberCancelを捕まえて握りつぶしてはいけません。
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <new>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined(__x86_64__) || !defined(__linux__)
+#define TS_FIBER_UCONTEXT
+#endif
+#ifdef TS_FIBER_UCONTEXT
+#include <ucontext.h>
+#endif
+
+namespace ts {
+namespace namedobj {
+
+  // 固定長のスタックのプール
+  class FiberStackPool {
+  public:
+	struct Stack {
+	  void* base = nullptr; // ガードページを含む先頭
+	  size_t size = 0;      // ガードページを含む大きさ
+	  void* bottom() const { return static_cast<char*>(base) + pageSize(); }
+	  void* top() const { return static_cast<char*>(base) + size; }
+	};
+
+	// stackSize: 1つのスタックの大きさ(ページの倍数に切り上げる)。maxFree: 使い回すために残す数
+	explicit FiberStackPool(size_t stackSize = 64 * 1024, size_t maxFree = 64)
+	  : size_((stackSize + pageSize() - 1) / pageSize() * pageSize() + pageSize()), maxFree_(maxFree)
+	{}
+	~FiberStackPool() {
+	  for (auto& s : free_) munmap(s.base, s.size);
+	}
+	FiberStackPool(const FiberStackPool&) = delete;
+	FiberStackPool& operator = (const FiberStackPool&) = delete;
+
+	// 確保できなければstd::bad_allocを投げる
+	Stack acquire() {
+	  if (!free_.empty()) {
+		Stack s = free_.back();
+		free_.pop_back();
+		return s;
+	  }
+	  void* p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	  if (p == MAP_FAILED) throw std::bad_alloc();
+	  if (mprotect(p, pageSize(), PROT_NONE) != 0) {
+		munmap(p, size_);
+		throw std::bad_alloc();
+	  }
+	  ++allocated_;
+	  Stack s;
+	  s.base = p;
+	  s.size = size_;
+	  return s;
+	}
+	void release(Stack s) {
+	  if (free_.size() < maxFree_) free_.push_back(s);
+	  else {
+		munmap(s.base, s.size);
+		--allocated_;
+	  }
+	}
+
+	// 使えるスタックの大きさ(ガードページを除く)
+	size_t stackSize() const { return size_ - pageSize(); }
+	// mmapで確保して、まだ解放していないスタックの数
+	size_t allocated() const { return allocated_; }
+	size_t freeCount() const { return free_.size(); }
+
+	// スレッドごとの既定のプール
+	static FiberStackPool& local() {
+	  thread_local FiberStackPool pool;
+	  return pool;
+	}
+	static size_t pageSize() {
+	  static const size_t size = size_t(sysconf(_SC_PAGESIZE));
+	  return size;
+	}
+
+  private:
+	size_t size_;
+	size_t maxFree_;
+	size_t allocated_ = 0;
+	std::vector<Stack> free_;
+  };
+
+  // 実行中のファイバーを破棄する時にyield()から投げる
+  struct FiberCancel {};
+
+#ifndef TS_FIBER_UCONTEXT
+  namespace detail {
+	// 現在のスタックポインタを*fromに保存し、toのスタックに切り替える
+	// 保存するのはSystem V ABIのcallee-savedのレジスタと、MXCSR、x87の制御ワード
+	__attribute__((naked, noinline, unused))
+	static void fiberSwitch(void** /*from*/, void* /*to*/) {
+	  asm volatile(
+		"pushq %rbp\n\t"
+		"pushq %rbx\n\t"
+		"pushq %r12\n\t"
+		"pushq %r13\n\t"
+		"pushq %r14\n\t"
+		"pushq %r15\n\t"
+		"subq $8, %rsp\n\t"
+		"stmxcsr (%rsp)\n\t"
+		"fnstcw 4(%rsp)\n\t"
+		"movq %rsp, (%rdi)\n\t"
+		"movq %rsi, %rsp\n\t"
+		"ldmxcsr (%rsp)\n\t"
+		"fldcw 4(%rsp)\n\t"
+		"addq $8, %rsp\n\t"
+		"popq %r15\n\t"
+		"popq %r14\n\t"
+		"popq %r13\n\t"
+		"popq %r12\n\t"
+		"popq %rbx\n\t"
+		"popq %rbp\n\t"
+		// retだと戻り先の予測(リターンスタック)が毎回外れるので、間接ジャンプで戻る
+		"popq %rax\n\t"
+		"jmpq *%rax\n\t");
+	}
+	// 新しいファイバーの最初の切り替え先。r12の引数でr13の関数を呼ぶ(戻ってこない)
+	__attribute__((naked, noinline, unused))
+	static void fiberTrampoline() {
+	  asm volatile(
+		"movq %r12, %rdi\n\t"
+		"callq *%r13\n\t"
+		"ud2\n\t");
+	}
+  }
+#endif
+
+  class Fiber {
+  public:
+	using Body = std::function<void()>;
+	enum class State { Ready, Running, Suspended, Finished };
+
+	explicit Fiber(Body body, FiberStackPool& pool = FiberStackPool::local())
+	  : body_(std::move(body)), pool_(pool), stack_(pool.acquire())
+	{
+	  initialize();
+	  ++created();
+	}
+	~Fiber() {
+	  // 途中で止まっているファイバーは、FiberCancelでスタックを巻き戻してから終わらせる
+	  if (state_ == State::Suspended) {
+		cancel_ = true;
+		switchIn();
+	  }
+	  pool_.release(stack_);
+	  ++destroyed();
+	}
+	Fiber(const Fiber&) = delete;
+	Fiber& operator = (const Fiber&) = delete;
+
+	// 続きを実行する。yield()で戻ればtrue、終わればfalse
+	// 本体が例外を投げて終わった場合は、ここで投げ直す
+	bool resume() {
+	  if (state_ == State::Finished) return false;
+	  switchIn();
+	  if (exception_) {
+		std::exception_ptr e = std::move(exception_);
+		exception_ = nullptr;
+		std::rethrow_exception(e);
+	  }
+	  return state_ != State::Finished;
+	}
+
+	// 実行中のファイバーから呼び出し元に戻る。ファイバーの外で呼ぶと何もしない
+	static void yield() {
+	  Fiber* f = current();
+	  if (!f) return;
+	  f->state_ = State::Suspended;
+	  f->switchOut();
+	  if (f->cancel_) throw FiberCancel();
+	}
+
+	// 実行中のファイバー。ファイバーの外ではnullptr
+	static Fiber*& current() {
+	  thread_local Fiber* fiber = nullptr;
+	  return fiber;
+	}
+
+	State state() const { return state_; }
+	bool finished() const { return state_ == State::Finished; }
+
+	// このスレッドで作ったファイバーと、このスレッドで破棄したファイバーの数
+	// ある処理の前後の差から、その処理が作ってまだ破棄していないファイバーの数が分かる(SessionRuntimeが使う)
+	static uint64_t& created() {
+	  thread_local uint64_t count = 0;
+	  return count;
+	}
+	static uint64_t& destroyed() {
+	  thread_local uint64_t count = 0;
+	  return count;
+	}
+
+  private:
+	// ファイバーの本体を実行する。戻らずに呼び出し元に切り替える
+	static void entry(Fiber* f) {
+	  try {
+		f->body_();
+	  }
+	  catch (FiberCancel&) {
+	  }
+	  catch (...) {
+		f->exception_ = std::current_exception();
+	  }
+	  f->state_ = State::Finished;
+	  f->switchOut();
+	}
+
+	void switchIn() {
+	  previous_ = current();
+	  current() = this;
+	  state_ = State::Running;
+#ifndef TS_FIBER_UCONTEXT
+	  detail::fiberSwitch(&callerSp_, sp_);
+#else
+	  swapcontext(&caller_, &context_);
+#endif
+	  current() = previous_;
+	}
+	void switchOut() {
+#ifndef TS_FIBER_UCONTEXT
+	  detail::fiberSwitch(&sp_, callerSp_);
+#else
+	  swapcontext(&context_, &caller_);
+#endif
+	}
+
+#ifndef TS_FIBER_UCONTEXT
+	// fiberSwitchがpopする順に初期値を積む
+	void initialize() {
+	  uintptr_t top = reinterpret_cast<uintptr_t>(stack_.top()) & ~uintptr_t(15);
+	  void** p = reinterpret_cast<void**>(top - 16); // fiberTrampolineでcallする時に16バイト境界になる位置
+	  *--p = reinterpret_cast<void*>(&detail::fiberTrampoline); // ret
+	  *--p = nullptr; // rbp
+	  *--p = nullptr; // rbx
+	  *--p = this;    // r12
+	  *--p = reinterpret_cast<void*>(&Fiber::entry); // r13
+	  *--p = nullptr; // r14
+	  *--p = nullptr; // r15
+	  --p;
+	  uint32_t* ctrl = reinterpret_cast<uint32_t*>(p);
+	  asm volatile("stmxcsr %0" : "=m"(ctrl[0]));
+	  asm volatile("fnstcw %0" : "=m"(ctrl[1]));
+	  sp_ = p;
+	}
+
+	void* sp_ = nullptr;
+	void* callerSp_ = nullptr;
+#else
+	void initialize() {
+	  getcontext(&context_);
+	  context_.uc_stack.ss_sp = stack_.bottom();
+	  context_.uc_stack.ss_size = stack_.size - FiberStackPool::pageSize();
+	  context_.uc_link = nullptr;
+	  uintptr_t p = reinterpret_cast<uintptr_t>(this);
+	  makecontext(&context_, reinterpret_cast<void (*)()>(&Fiber::start), 2,
+				  unsigned(p & 0xffffffffu), unsigned(uint64_t(p) >> 32));
+	}
+	// makecontextの引数はintなので、ポインタを2つに分けて渡す
+	static void start(unsigned lo, unsigned hi) {
+	  entry(reinterpret_cast<Fiber*>(uintptr_t(lo) | (uintptr_t(uint64_t(hi) << 32))));
+	}
+
+	ucontext_t context_;
+	ucontext_t caller_;
+#endif
+
+	Body body_;
+	FiberStackPool& pool_;
+	FiberStackPool::Stack stack_;
+	State state_ = State::Ready;
+	bool cancel_ = false;
+	Fiber* previous_ = nullptr;
+	std::exception_ptr exception_;
+  };
+
+}} // ts::namedobj
@@ -0,0 +1,155 @@
+// -*-tab-width:4-*-
+//
+// コンテキスト切り替えのコストの比較
+//   fiber      : Fiberのresume/yieldの往復(x86-64では手書きの切り替え)
+//   ucontext   : swapcontextの往復
+//   coroutine  : boost::contextのcontinuationの往復
+//   callback   : 処理を段階に分けてstd::functionで呼ぶ(タスクを分割する方法)
+// 最後に、TaskQueue上でフレームごとにyieldするファイバーのタスクと、ContinueTaskを返す通常のタスクを比べる
+// 最初に、実行中のファイバーのタスクを名前で引けることを確かめる
+// ./t7 [回数]
+//
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <ucontext.h>
+#include <boost/context/continuation.hpp>
+#include "NamedObject.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "FiberTask.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using ts::instrument::checkResult;
+using Clock = chrono::steady_clock;
+namespace ctx = boost::context;
+
+static volatile uint64_t sink;
+
+template <typename F>
+double measure(const char* label, long n, F f) {
+  auto start = Clock::now();
+  f();
+  double ns = double(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count()) / double(n);
+  cout << label << ns << " ns" << endl;
+  return ns;
+}
+
+// ucontextの往復
+static ucontext_t mainContext, loopContext;
+static long ucontextCount;
+static void ucontextLoop() {
+  for (;;) {
+	++ucontextCount;
+	swapcontext(&loopContext, &mainContext);
+  }
+}
+
+void check() {
+  // yieldをまたいでも、実行中のタスクは自分と親の名前を持ち続ける
+  TaskQueue tq;
+  int frames = 0;
+  bool named = true;
+  tq.addTask(Task("fiber-self", fiberTask([&](TaskQueue&, TaskArgs& args) {
+		for (; frames < 3; ++frames) {
+		  Task self(args.self_);
+		  named = named && self.valid("check") && args.self_.str() == "fiber-self" && args.size() == 1;
+		  Fiber::yield();
+		}
+		return TaskStatus::RemoveTask;
+	  }), Task("fiber-child", [](TaskQueue&, TaskArgs&) { return TaskStatus::RemoveTask; })));
+  for (int f = 0; f < 5; ++f) tq.update();
+  TS_CHECK_EQ(frames, 3);
+  TS_CHECK(named);
+}
+
+int main(int ac, char* av[]) {
+  long n = ac > 1 ? atol(av[1]) : 2000000;
+  check();
+
+  cout << "round trip (resume + yield), " << n << " times" << endl;
+  measure("fiber      ", n, [n] {
+	  long count = 0;
+	  Fiber f([&count] {
+		  for (;;) {
+			++count;
+			Fiber::yield();
+		  }
+		});
+	  for (long i = 0; i < n; ++i) f.resume();
+	  sink = uint64_t(count);
+	});
+
+  measure("ucontext   ", n, [n] {
+	  FiberStackPool::Stack stack = FiberStackPool::local().acquire();
+	  getcontext(&loopContext);
+	  loopContext.uc_stack.ss_sp = stack.bottom();
+	  loopContext.uc_stack.ss_size = FiberStackPool::local().stackSize();
+	  loopContext.uc_link = nullptr;
+	  makecontext(&loopContext, ucontextLoop, 0);
+	  for (long i = 0; i < n; ++i) swapcontext(&mainContext, &loopContext);
+	  sink = uint64_t(ucontextCount);
+	  FiberStackPool::local().release(stack);
+	});
+
+  measure("coroutine  ", n, [n] {
+	  long count = 0;
+	  ctx::continuation c = ctx::callcc([&count](ctx::continuation&& caller) {
+		  for (;;) {
+			++count;
+			caller = caller.resume();
+		  }
+		  return std::move(caller);
+		});
+	  for (long i = 1; i < n; ++i) c = c.resume();
+	  sink = uint64_t(count);
+	});
+
+  measure("callback   ", n, [n] {
+	  long count = 0;
+	  int stage = 0;
+	  std::function<bool()> step = [&count, &stage] {
+		++count;
+		stage = (stage + 1) & 3;
+		return stage != 0;
+	  };
+	  for (long i = 0; i < n; ++i) step();
+	  sink = uint64_t(count);
+	});
+
+  // TaskQueue上で、1フレームごとに1回yieldするタスクを100個動かす
+  const int Tasks = 100;
+  long frames = n / Tasks;
+  cout << "TaskQueue, " << Tasks << " tasks x " << frames << " frames (per task per frame)" << endl;
+  auto runQueue = [frames](bool fiber) {
+	TaskQueue tq;
+	for (int i = 0; i < Tasks; ++i) {
+	  if (fiber) {
+		tq.addTask(Task(fiberTask([frames](TaskQueue&, TaskArgs&) {
+				for (long f = 1; f < frames; ++f) Fiber::yield();
+				return TaskStatus::RemoveTask;
+			  })));
+	  }
+	  else {
+		long f = 0;
+		tq.addTask(Task([frames, f](TaskQueue&, TaskArgs&) mutable {
+			  return ++f < frames ? TaskStatus::ContinueTask : TaskStatus::RemoveTask;
+			}));
+	  }
+	}
+	tq.update();
+	for (long f = 0; f < frames; ++f) tq.update();
+  };
+  measure("fiber task ", frames * Tasks, [&] { runQueue(true); });
+  measure("plain task ", frames * Tasks, [&] { runQueue(false); });
+
+  cout << "stacks allocated " << FiberStackPool::local().allocated()
+	   << ", pooled " << FiberStackPool::local().freeCount() << endl;
+  return checkResult("fiber");
+}
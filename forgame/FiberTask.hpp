@@ -0,0 +1,78 @@
+// -*-tab-width:4;c++-*-
+//
+// ファイバーで動くタスク
+//
+// fiberTask(body)は、bodyをファイバーの中で実行するタスクの関数を作ります。
+// bodyの中でFiber::yield()を呼ぶと、そのフレームの処理をそこで終え、次のフレームのupdate()で続きから実行します。
+// これにより、読み込みの完了待ちのような処理を、タスクを分割したりwaitPredを使ったりせずに書けます。
+// bodyが戻るとファイバーは終わり、戻り値がタスクの戻り値になります。
+// ContinueTaskを返した場合は、次のフレームで新しいファイバーでbodyを最初から実行します。
+//
+// タスクはフレームごとにキューの間をムーブで移動するため、bodyに渡すTaskArgsは関数の側で保持し、
+// 実行する間だけ子供のリストをタスクと入れ替えます。bodyがyieldをまたいでTaskArgsを参照しても問題ありません。
+// 自分と親の名前はタスクに残したままコピーするので、実行中にbodyから名前で自分を引いても正しいタスクが見えます。
+// ファイバーの状態は関数のコピーの間で共有されるので、同じ関数を持つタスクを同時に動かさないでください。
+
+#pragma once
+
+#include <cassert>
+#include <functional>
+#include <memory>
+#include <utility>
+#include "Fiber.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+
+namespace ts {
+namespace namedobj {
+
+  inline Task::TaskFunc fiberTask(Task::TaskFunc body, FiberStackPool& pool = FiberStackPool::local()) {
+	struct State {
+	  Task::TaskFunc body;
+	  FiberStackPool& pool;
+	  TaskArgs args;
+	  TaskStatus result;
+	  std::unique_ptr<Fiber> fiber; // argsより先に破棄する
+	};
+	auto st = std::make_shared<State>(State{ std::move(body), pool, TaskArgs(), TaskStatus::RemoveTask, nullptr });
+	return [st](TaskQueue& tq, TaskArgs& ar) {
+	  if (!st->fiber) {
+		State* s = st.get();
+		TaskQueue* q = &tq;
+		st->fiber.reset(new Fiber([s, q] { s->result = s->body(*q, s->args); }, st->pool));
+	  }
+	  st->args.self_ = ar.self_;
+	  st->args.parent_ = ar.parent_;
+	  std::swap(st->args.args_, ar.args_);
+	  bool alive;
+	  try {
+		alive = st->fiber->resume();
+	  }
+	  catch (...) {
+		std::swap(st->args.args_, ar.args_);
+		st->fiber.reset();
+		throw;
+	  }
+	  std::swap(st->args.args_, ar.args_);
+	  if (alive) return TaskStatus::ContinueTask;
+	  st->fiber.reset();
+	  return st->result;
+	};
+  }
+
+  // ファイバーの中で、predがtrueになるまでフレームごとにyieldする
+  // 条件はTaskQueue::evalPredで評価するので、記録・再生の対象になる
+  inline void fiberWait(TaskQueue& tq, const std::function<bool()>& pred) {
+	assert(Fiber::current());
+	while (!tq.evalPred(pred)) Fiber::yield();
+  }
+
+  // ファイバーの中で、batchの読み込みがすべて終わるまで待つ
+  // タスクはキューから外れて待つので、待っている間のフレームでは呼ばれない
+  inline void fiberAwaitIO(TaskQueue& tq, std::shared_ptr<IoBatch> batch) {
+	assert(Fiber::current());
+	tq.awaitIO(std::move(batch));
+	Fiber::yield();
+  }
+
+}} // ts::namedobj
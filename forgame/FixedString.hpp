@@ -0,0 +1,204 @@
+// -*-tab-width:4;c++-*-
+//
+// 固定長文字列クラス
+//
+// FixedString<N>は、最大N文字の文字列を内部のバッファに持つクラスです。
+// 文字列リテラルからconstexprで構築でき、ハッシュ値(FNV-1a)も構築時に計算して保持します。
+// constexprな定数として作った名前は、比較や検索の時に実行時のハッシュ計算が入りません。
+// NamedObjectのNameTypeとして使えるように、empty()、+=、+、ストリーム入出力、順序比較を用意しています。
+// 順序はハッシュ値を先に比べ、ハッシュが等しい時だけ文字列を比べます。
+// 容量を超える文字列からの構築や連結はstd::length_errorを投げます。
+// 切り詰めると、先頭のN文字が同じ別の名前が同じキーになってしまうためです。
+// 切り詰めてよい時(ムーブ元の名前に"@moved"を付ける時など)は、truncated()とappendTruncated()を使います。
+//
+// StaticString<'a','b',...>は、文字列をテンプレート引数として使うための型です。
+// tips/constexpr.cppで試していた、文字列リテラルを文字のパラメータパックに変換する処理を
+// TS_STATIC_STRING("titleLogo")マクロとして用意しています(最大32文字)。
+// NameConstant<NameType, StaticString<...>>::valueは、その文字列のNameType型の定数です。
+// NameTypeがFixedStringなら定数初期化されるので、ハッシュもコンパイル時に決まります。
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+namespace ts {
+namespace namedobj {
+
+  // FNV-1aハッシュ(constexpr版)
+  constexpr uint32_t fnv1a(const char* s, size_t n, uint32_t h = 2166136261u) {
+	return n == 0 ? h : fnv1a(s + 1, n - 1, (h ^ uint8_t(*s)) * 16777619u);
+  }
+  // FNV-1aハッシュ(実行時用)
+  inline uint32_t hashString(const char* s, size_t n) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < n; ++i) {
+	  h = (h ^ uint8_t(s[i])) * 16777619u;
+	}
+	return h;
+  }
+
+  template <size_t N>
+  class FixedString {
+  public:
+	static constexpr size_t capacity = N;
+
+	constexpr FixedString() : FixedString("", 0) {}
+	// 文字列リテラルから構築する
+	template <size_t M>
+	constexpr FixedString(const char (&s)[M]) : FixedString(s, M - 1) {
+	  static_assert(M - 1 <= N, "string literal is longer than the FixedString capacity");
+	}
+	// 先頭からn文字で構築する。nが容量を超えたらstd::length_errorを投げる
+	constexpr FixedString(const char* s, size_t n)
+	  : FixedString(s, n <= N ? n : throw std::length_error("FixedString: too long"), Truncate()) {}
+	explicit FixedString(const std::string& s) : FixedString(s.data(), s.size()) {}
+	// 容量を超える分は切り詰めて構築する
+	static FixedString truncated(const char* s, size_t n) { return FixedString(s, n, Truncate()); }
+
+	constexpr size_t size() const { return size_; }
+	constexpr size_t length() const { return size_; }
+	constexpr bool empty() const { return size_ == 0; }
+	constexpr uint32_t hash() const { return hash_; }
+	constexpr const char* c_str() const { return str_; }
+	constexpr const char* data() const { return str_; }
+	constexpr char operator [] (size_t n) const { return str_[n]; }
+	const char* begin() const { return str_; }
+	const char* end() const { return str_ + size_; }
+	std::string str() const { return std::string(str_, size_); }
+
+	// 連結。容量を超えたらstd::length_errorを投げ、何も変えない
+	FixedString& append(const char* s, size_t n) {
+	  if (n > N - size_) throw std::length_error("FixedString: too long");
+	  return appendTruncated(s, n);
+	}
+	// 連結。容量を超える分は切り詰める
+	FixedString& appendTruncated(const char* s, size_t n) {
+	  if (n > N - size_) n = N - size_;
+	  std::memcpy(str_ + size_, s, n);
+	  size_ += n;
+	  str_[size_] = '\0';
+	  hash_ = hashString(str_, size_);
+	  return *this;
+	}
+	FixedString& operator += (const char* s) { return append(s, std::strlen(s)); }
+	FixedString& operator += (const std::string& s) { return append(s.data(), s.size()); }
+	template <size_t M>
+	FixedString& operator += (const FixedString<M>& s) { return append(s.data(), s.size()); }
+
+	void clear() {
+	  size_ = 0;
+	  str_[0] = '\0';
+	  hash_ = hashString(str_, 0);
+	}
+
+	// 比較はハッシュ値を先に行う
+	template <size_t M>
+	bool operator == (const FixedString<M>& rhs) const {
+	  return hash_ == rhs.hash() && size_ == rhs.size() && std::memcmp(str_, rhs.data(), size_) == 0;
+	}
+	template <size_t M>
+	bool operator != (const FixedString<M>& rhs) const { return !(*this == rhs); }
+	template <size_t M>
+	bool operator < (const FixedString<M>& rhs) const {
+	  if (hash_ != rhs.hash()) return hash_ < rhs.hash();
+	  int c = std::memcmp(str_, rhs.data(), size_ < rhs.size() ? size_ : rhs.size());
+	  return c < 0 || (c == 0 && size_ < rhs.size());
+	}
+
+  private:
+	struct Truncate {};
+	constexpr FixedString(const char* s, size_t n, Truncate)
+	  : str_{}
+	  , size_(n < N ? n : N)
+	  , hash_(2166136261u)
+	{
+	  for (size_t i = 0; i < size_; ++i) {
+		str_[i] = s[i];
+		hash_ = (hash_ ^ uint8_t(s[i])) * 16777619u;
+	  }
+	}
+
+	char str_[N + 1];
+	size_t size_;
+	uint32_t hash_;
+  };
+
+  template <size_t N>
+  FixedString<N> operator + (FixedString<N> lhs, const char* rhs) { return lhs += rhs; }
+  template <size_t N, size_t M>
+  FixedString<N> operator + (FixedString<N> lhs, const FixedString<M>& rhs) { return lhs += rhs; }
+
+  template <size_t N>
+  std::ostream& operator << (std::ostream& os, const FixedString<N>& s) {
+	return os.write(s.data(), s.size());
+  }
+  template <size_t N>
+  std::istream& operator >> (std::istream& is, FixedString<N>& s) {
+	std::string str;
+	if (!(is >> str)) return is;
+	// 容量を超える名前は読まない
+	if (str.size() > N) is.setstate(std::ios::failbit);
+	else s = FixedString<N>(str);
+	return is;
+  }
+
+  // テンプレート引数として使う文字列
+  template <char... Cs>
+  struct StaticString {
+	static constexpr size_t size = sizeof...(Cs);
+	static constexpr char value[sizeof...(Cs) + 1] = { Cs..., '\0' };
+  };
+  template <char... Cs>
+  constexpr char StaticString<Cs...>::value[];
+
+  // StaticStringをNameType型の定数にする
+  template <typename NameType, typename S>
+  struct NameConstant {
+	static const NameType value;
+  };
+  template <typename NameType, typename S>
+  const NameType NameConstant<NameType, S>::value(S::value, S::size);
+
+  namespace detail {
+	// 文字列リテラルのi文字目。範囲外は'\0'
+	template <size_t M>
+	constexpr char charAt(const char (&s)[M], size_t i) { return i < M ? s[i] : '\0'; }
+
+	// 先頭のLen文字でStaticStringを作る
+	template <size_t Len, typename Result, char... Cs>
+	struct TakeChars;
+	template <char... Out, char C, char... Cs>
+	struct TakeChars<0, StaticString<Out...>, C, Cs...> { using type = StaticString<Out...>; };
+	template <char... Out>
+	struct TakeChars<0, StaticString<Out...>> { using type = StaticString<Out...>; };
+	template <size_t Len, char... Out, char C, char... Cs>
+	struct TakeChars<Len, StaticString<Out...>, C, Cs...> : TakeChars<Len - 1, StaticString<Out..., C>, Cs...> {};
+  }
+
+}} // ts::namedobj
+
+namespace std {
+  template <size_t N>
+  struct hash<ts::namedobj::FixedString<N>> {
+	size_t operator () (const ts::namedobj::FixedString<N>& s) const { return s.hash(); }
+  };
+}
+
+#define TS_STRING_CHARS4(s, i)											\
+  ::ts::namedobj::detail::charAt(s, i), ::ts::namedobj::detail::charAt(s, i + 1), \
+  ::ts::namedobj::detail::charAt(s, i + 2), ::ts::namedobj::detail::charAt(s, i + 3)
+#define TS_STRING_CHARS16(s, i)											\
+  TS_STRING_CHARS4(s, i), TS_STRING_CHARS4(s, i + 4), TS_STRING_CHARS4(s, i + 8), TS_STRING_CHARS4(s, i + 12)
+
+// 文字列リテラルからStaticStringの型を作る
+#define TS_STATIC_STRING(s)												\
+  ::ts::namedobj::detail::TakeChars<(sizeof(s) - 1 <= 32 ? sizeof(s) - 1 : 33), ::ts::namedobj::StaticString<>, \
+									TS_STRING_CHARS16(s, 0), TS_STRING_CHARS16(s, 16)>::type
@@ -0,0 +1,80 @@
+// -*-tab-width:4-*-
+//
+// FixedStringとStaticStringのサンプル
+//
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <boost/lexical_cast.hpp>
+#include "NamedObject.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using ts::instrument::checkResult;
+
+using Name = FixedString<31>;
+
+// 名前のハッシュはコンパイル時に計算される
+constexpr Name titleLogo("titleLogo");
+static_assert(titleLogo.hash() == fnv1a("titleLogo", 9), "hash is computed at compile time");
+static_assert(titleLogo.size() == 9, "size");
+
+// 文字列をテンプレート引数にする
+template <typename S>
+struct Scene {
+  static const char* name() { return S::value; }
+};
+using MainName = TS_STATIC_STRING("main");
+static_assert(MainName::size == 4, "StaticString size");
+
+struct Object : NamedObject<Object, Name> {
+  int value;
+  Object(const Name& n, int v) : NamedObject<Object, Name>(n), value(v) {}
+};
+
+int main() {
+  Object title(titleLogo, 1);
+  Object menu("main", 2);
+
+  // constexprの名前とStaticStringで検索する
+  if (auto f = Object::lookup(titleLogo)) cout << f->name() << " " << f->value << endl;
+  if (auto f = Object::lookup(MainName())) cout << Scene<MainName>::name() << " " << f->value << endl;
+  if (!Object::lookup(TS_STATIC_STRING("ending")())) cout << "ending not found" << endl;
+
+  // 容量を超える連結は例外になる。切り詰めてよい時はappendTruncatedを使う
+  Name moved = titleLogo;
+  moved.appendTruncated("@moved@moved@moved@moved", 24);
+  cout << moved << " (" << moved.size() << ")" << endl;
+  bool thrown = false;
+  try {
+	moved = titleLogo + "@moved@moved@moved@moved";
+  }
+  catch (const std::length_error&) {
+	thrown = true;
+  }
+  TS_CHECK(thrown);
+
+  // 先頭の31文字が同じ実行時の名前は、切り詰めて同じキーにせず、長すぎる方を拒む
+  string prefix(31, 'x');
+  string longName = prefix + "-long";
+  Object shortOne(Name(prefix), 3);
+  thrown = false;
+  try {
+	Object longOne(Name(longName), 4);
+  }
+  catch (const std::length_error&) {
+	thrown = true;
+  }
+  TS_CHECK(thrown);
+  auto found = Object::lookup(Name(prefix));
+  TS_CHECK(found && found->value == 3);
+  TS_CHECK(!Object::lookup(boost::string_view(longName)));
+  Name read;
+  TS_CHECK(!(boost::conversion::try_lexical_convert(longName, read)));
+  shortOne.retire();
+
+  // lexical_castで数値から名前を作る
+  cout << boost::lexical_cast<Name>(42) << endl;
+  return checkResult("fixedstring");
+}
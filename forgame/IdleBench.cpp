@@ -0,0 +1,241 @@
+// -*-tab-width:4-*-
+//
+// 仕事が無い時のCPU使用率と、起きるまでの時間の比較
+// ほとんどの時間、タスクは待っているだけの状況。別のスレッドがgap msごとに1つタスクをpost()し、
+// 5msごとにsleepFor()で起きるタスクが1つある
+//   spin     : while (!tq.finished()) tq.update();
+//   sleep    : tq.runUntilFinished()
+//   paced    : tq.runUntilFinished()で、フレームの間隔を16.7msにする
+// post()してからタスクが実行されるまでの時間と、sleepFor()の時刻からの遅れのp50/p99/最大、
+// プロセスのCPU時間を経過時間で割った使用率、眠った回数を表示する
+// 最初に、post()、sleepFor()、sleepFrames()、入力イベント、読み込みの完了で起きることを確かめる
+// ./t19 [post数] [gap(ms)]
+//
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "NamedObject.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "InputEvents.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using ts::instrument::checkResult;
+using Clock = chrono::steady_clock;
+
+double msSince(Clock::time_point t) {
+  return chrono::duration<double, milli>(Clock::now() - t).count();
+}
+
+double cpuSeconds() {
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return double(ts.tv_sec) + double(ts.tv_nsec) * 1e-9;
+}
+
+void check() {
+  // 時刻まで眠る
+  {
+	TaskQueue tq;
+	bool slept = false;
+	auto start = Clock::now();
+	tq.addTask(Task([&slept](TaskQueue& tq, TaskArgs&) {
+		if (!slept) {
+		  slept = true;
+		  tq.sleepFor(20000000);
+		  return TaskStatus::ContinueTask;
+		}
+		tq.finish();
+		return TaskStatus::RemoveTask;
+	  }));
+	tq.runUntilFinished();
+	TS_CHECK(msSince(start) >= 20.0);
+	TS_CHECK(tq.idleStats().timeouts >= 1);
+	TS_CHECK(tq.idleStats().sleptNs >= 15000000);
+  }
+  // 他のスレッドからのpost()で起きる
+  {
+	TaskQueue tq;
+	thread producer([&tq] {
+		this_thread::sleep_for(chrono::milliseconds(10));
+		tq.post([] {
+			return Task([](TaskQueue& tq, TaskArgs&) {
+				tq.finish();
+				return TaskStatus::RemoveTask;
+			  });
+		  });
+	  });
+	tq.runUntilFinished();
+	producer.join();
+	TS_CHECK(tq.idleStats().notified >= 1);
+	TS_CHECK_EQ(tq.idleStats().timeouts, 0u);
+  }
+  // sleepFrames()は、フレームの間隔で数える
+  {
+	TaskQueue tq;
+	TaskQueue::RunOptions options;
+	options.frameNs = 5000000;
+	Clock::time_point start;
+	tq.addTask(Task([&start](TaskQueue& tq, TaskArgs&) {
+		if (start == Clock::time_point()) {
+		  start = Clock::now();
+		  tq.sleepFrames(3);
+		  return TaskStatus::ContinueTask;
+		}
+		tq.finish();
+		return TaskStatus::RemoveTask;
+	  }));
+	tq.runUntilFinished(options);
+	TS_CHECK(msSince(start) >= 10.0);
+	TS_CHECK(tq.idleStats().sleeps >= 1);
+  }
+  // 入力イベントで起きる
+  {
+	TaskQueue tq;
+	InputEvents input;
+	tq.setInput(&input);
+	bool waiting = false;
+	InputEvent event;
+	tq.addTask(Task([&](TaskQueue& tq, TaskArgs&) {
+		if (!waiting) {
+		  waiting = true;
+		  tq.awaitInput(InputEdge::press(7), &event);
+		  return TaskStatus::ContinueTask;
+		}
+		tq.finish();
+		return TaskStatus::RemoveTask;
+	  }));
+	thread inputThread([&input] {
+		this_thread::sleep_for(chrono::milliseconds(10));
+		input.press(7);
+	  });
+	tq.runUntilFinished();
+	inputThread.join();
+	tq.setInput(nullptr);
+	TS_CHECK_EQ(event.key, 7);
+	TS_CHECK(tq.idleStats().sleeps >= 1);
+	TS_CHECK_EQ(tq.idleStats().timeouts, 0u);
+  }
+  // 読み込みの完了で起きる。io_uringは完了を通知できないので、ioPollNsごとに調べに起きる
+  for (auto backend : { AsyncIO::Backend::ThreadPool, AsyncIO::Backend::Auto }) {
+	TaskQueue tq;
+	tq.setIO(unique_ptr<AsyncIO>(new AsyncIO(backend)));
+	// どのディレクトリから実行しても読めるように、一時ファイルを作って読む
+	char path[] = "/tmp/idlebenchXXXXXX";
+	int fd = mkstemp(path);
+	TS_CHECK(fd >= 0);
+	char buf[64];
+	memset(buf, 'x', sizeof(buf));
+	TS_CHECK_EQ(write(fd, buf, sizeof(buf)), ssize_t(sizeof(buf)));
+	unlink(path);
+	auto batch = make_shared<IoBatch>();
+	batch->read(fd, buf, sizeof(buf));
+	bool submitted = false;
+	tq.addTask(Task([&](TaskQueue& tq, TaskArgs&) {
+		if (!submitted) {
+		  submitted = true;
+		  tq.awaitIO(batch);
+		  return TaskStatus::ContinueTask;
+		}
+		tq.finish();
+		return TaskStatus::RemoveTask;
+	  }));
+	tq.runUntilFinished();
+	TS_CHECK_EQ(batch->result(0), int32_t(sizeof(buf)));
+	close(fd);
+  }
+}
+
+struct Percentiles {
+  double p50, p99, max;
+};
+Percentiles percentiles(vector<double>& v) {
+  if (v.empty()) return { 0, 0, 0 };
+  sort(v.begin(), v.end());
+  return { v[v.size() / 2], v[v.size() * 99 / 100], v.back() };
+}
+
+enum class Driver { Spin, Sleep, Paced };
+
+void run(const char* label, Driver driver, int posts, int gapMs) {
+  TaskQueue tq;
+  vector<double> latency;  // post()してから実行されるまで(us)
+  vector<double> late;     // sleepFor()の時刻からの遅れ(us)
+  latency.reserve(posts);
+  // 5msごとに起きるタスク
+  const uint64_t period = 5000000;
+  Clock::time_point due;
+  tq.addTask(Task([&](TaskQueue& tq, TaskArgs&) {
+	  auto now = Clock::now();
+	  if (due != Clock::time_point()) late.push_back(chrono::duration<double, micro>(now - due).count());
+	  due = now + chrono::nanoseconds(period);
+	  tq.sleepFor(period);
+	  return TaskStatus::ContinueTask;
+	}));
+  thread producer([&] {
+	  for (int i = 0; i < posts; ++i) {
+		this_thread::sleep_for(chrono::milliseconds(gapMs));
+		auto posted = Clock::now();
+		tq.post([&latency, posted] {
+			return Task([&latency, posted](TaskQueue&, TaskArgs&) {
+				latency.push_back(chrono::duration<double, micro>(Clock::now() - posted).count());
+				return TaskStatus::RemoveTask;
+			  });
+		  });
+	  }
+	  this_thread::sleep_for(chrono::milliseconds(gapMs));
+	  tq.post([] {
+		  return Task([](TaskQueue& tq, TaskArgs&) {
+			  tq.finish();
+			  return TaskStatus::RemoveTask;
+			});
+		});
+	});
+  auto start = Clock::now();
+  double cpu = cpuSeconds();
+  switch (driver) {
+  case Driver::Spin:
+	while (!tq.finished()) tq.update();
+	break;
+  case Driver::Sleep:
+	tq.runUntilFinished();
+	break;
+  case Driver::Paced: {
+	TaskQueue::RunOptions options;
+	options.frameNs = 16666667;
+	tq.runUntilFinished(options);
+	break;
+  }
+  }
+  double usage = (cpuSeconds() - cpu) / (msSince(start) / 1000.0) * 100.0;
+  producer.join();
+  auto l = percentiles(latency);
+  auto t = percentiles(late);
+  printf("  %-6s wake p50 %8.1f us  p99 %8.1f us  max %8.1f us  timer late p50 %7.1f us  p99 %7.1f us  "
+		 "cpu %5.1f%%  frames %8llu  sleeps %llu\n",
+		 label, l.p50, l.p99, l.max, t.p50, t.p99, usage,
+		 (unsigned long long)tq.frame(), (unsigned long long)tq.idleStats().sleeps);
+  TS_CHECK_EQ(latency.size(), size_t(posts));
+}
+
+int main(int ac, char* av[]) {
+  int posts = ac > 1 ? atoi(av[1]) : 200;
+  int gapMs = ac > 2 ? atoi(av[2]) : 3;
+  check();
+  printf("%d posts every %d ms, a 5 ms timer\n", posts, gapMs);
+  run("spin", Driver::Spin, posts, gapMs);
+  run("sleep", Driver::Sleep, posts, gapMs);
+  run("paced", Driver::Paced, posts, gapMs);
+  return checkResult("idle");
+}
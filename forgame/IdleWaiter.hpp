@@ -0,0 +1,139 @@
+// -*-tab-width:4;c++-*-
+//
+// 仕事が無い間、スレッドを眠らせる
+//
+// IdleWaiterは、TaskQueue::runUntilFinished()が、実行できるタスクも近い期限も無い時に眠るためのものです。
+// 眠るのはfutexで、ファイルディスクリプタを使わないので、TaskQueueごとに持っても資源を消費しません。
+// Linux以外では、futexのかわりにmutexとcondition_variableで眠ります。
+//   - 眠る側(TaskQueueのスレッド)は、眠ると宣言してから仕事が無いことを確かめ、それからfutexで待ちます
+//   - 起こす側(post()や入力のスレッド)は、仕事を置いてからnotify()を呼びます
+//     眠っていなければ、フェンスとロード1回だけで戻り、システムコールは呼びません
+// 宣言と確認の順番を両側で守るので、仕事を置いたのに眠り続けることはありません。
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+
+namespace ts {
+namespace namedobj {
+
+  class IdleWaiter {
+  public:
+	// wait()から戻った理由
+	enum class Wake {
+	  Work,     // 眠る前に仕事があった
+	  Notified, // notify()で起こされた
+	  Timeout,  // 期限が来た
+	};
+	struct Stats {
+	  uint64_t sleeps = 0;   // 眠った回数
+	  uint64_t notified = 0; // notify()で起こされた回数
+	  uint64_t timeouts = 0; // 期限で起きた回数
+	  uint64_t sleptNs = 0;  // 眠っていた時間の合計
+	};
+
+	IdleWaiter() = default;
+	IdleWaiter(const IdleWaiter&) = delete;
+	IdleWaiter& operator = (const IdleWaiter&) = delete;
+
+	// 仕事を置いた後に、どのスレッドからでも呼べる。眠っている時だけ起こす
+	void notify() {
+	  // 仕事を置いた書き込みと、sleeping_の読み込みの順番を入れ替えない
+	  std::atomic_thread_fence(std::memory_order_seq_cst);
+	  if (!sleeping_.load(std::memory_order_relaxed)) return;
+	  seq_.fetch_add(1, std::memory_order_release);
+	  wakeOne();
+	}
+
+	// hasWork()がfalseなら、notify()か、timeoutNs経つまで眠る。timeoutNsが負なら期限なし
+	// hasWorkは眠ると宣言した後で呼ぶので、その前に置かれた仕事も見落とさない
+	template <typename HasWork>
+	Wake wait(HasWork&& hasWork, int64_t timeoutNs) {
+	  using Clock = std::chrono::steady_clock;
+	  uint32_t seq = seq_.load(std::memory_order_acquire);
+	  sleeping_.store(true, std::memory_order_seq_cst);
+	  if (hasWork()) {
+		sleeping_.store(false, std::memory_order_relaxed);
+		return Wake::Work;
+	  }
+	  auto start = Clock::now();
+	  auto deadline = start + std::chrono::nanoseconds(timeoutNs);
+	  Wake wake;
+	  for (;;) {
+		if (seq_.load(std::memory_order_acquire) != seq) {
+		  wake = Wake::Notified;
+		  break;
+		}
+		if (timeoutNs < 0) block(seq, -1);
+		else {
+		  int64_t left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - Clock::now()).count();
+		  if (left <= 0) {
+			wake = Wake::Timeout;
+			break;
+		  }
+		  block(seq, left);
+		}
+	  }
+	  sleeping_.store(false, std::memory_order_relaxed);
+	  ++stats_.sleeps;
+	  if (wake == Wake::Notified) ++stats_.notified;
+	  else ++stats_.timeouts;
+	  stats_.sleptNs += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+	  return wake;
+	}
+
+	// 眠った側のスレッドで読む
+	const Stats& stats() const { return stats_; }
+
+  private:
+	// seq_がseqのままなら、起こされるかleftNs経つまで眠る(leftNsが負なら期限なし)。早く戻ってもよい
+	// wakeOne()は眠っているスレッドを1つ起こす
+#ifdef __linux__
+	void block(uint32_t seq, int64_t leftNs) {
+	  if (leftNs < 0) {
+		futex(FUTEX_WAIT_PRIVATE, seq, nullptr);
+		return;
+	  }
+	  timespec ts;
+	  ts.tv_sec = time_t(leftNs / 1000000000);
+	  ts.tv_nsec = long(leftNs % 1000000000);
+	  futex(FUTEX_WAIT_PRIVATE, seq, &ts);
+	}
+	void wakeOne() { futex(FUTEX_WAKE_PRIVATE, 1, nullptr); }
+	long futex(int op, uint32_t val, const timespec* timeout) {
+	  return syscall(SYS_futex, reinterpret_cast<uint32_t*>(&seq_), op, val, timeout, nullptr, 0);
+	}
+#else
+	void block(uint32_t seq, int64_t leftNs) {
+	  std::unique_lock<std::mutex> lock(mutex_);
+	  auto changed = [this, seq] { return seq_.load(std::memory_order_acquire) != seq; };
+	  if (leftNs < 0) cv_.wait(lock, changed);
+	  else cv_.wait_for(lock, std::chrono::nanoseconds(leftNs), changed);
+	}
+	void wakeOne() {
+	  // seq_を増やした後にmutex_を通るので、確かめてから眠るまでの間に起こしても見落とさない
+	  { std::lock_guard<std::mutex> lock(mutex_); }
+	  cv_.notify_one();
+	}
+	std::mutex mutex_;
+	std::condition_variable cv_;
+#endif
+
+	// notify()ごとに増やす。眠る側が待つ値
+	std::atomic<uint32_t> seq_{ 0 };
+	std::atomic<bool> sleeping_{ false };
+	Stats stats_;
+  };
+
+}} // ts::namedobj
@@ -0,0 +1,233 @@
+// -*-tab-width:4-*-
+//
+// 入力を毎フレーム調べるタスクと、入力イベントを待つタスクの比較
+// 待っているタスク(キーは16種類)に、入力スレッドから時々キーを押す。
+// 押したキーは2フレーム後に離すが、50回に1回はフレームの間に押して離す(短く叩く)
+//   polling : タスクが毎フレーム、入力スレッドが書くキーの状態を調べ、離れていた状態から押された状態になったら反応する
+//   events  : タスクはawaitInput()で押されるのを待つ
+// フレームの処理時間、キーを調べた回数、反応した回数(取りこぼし)を表示する
+// 最初に、入力を外したキューの登録が残らないことを確かめ、
+// waitInput()でキーを待ってメニューに進み、awaitInput()でメニューの選択を受け取る例を動かす
+// ./t15 [タスク数] [フレーム数]
+//
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "NamedObject.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "InputEvents.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using ts::instrument::checkResult;
+using Clock = chrono::steady_clock;
+
+const int Keys = 16;
+
+// 入力スレッド。メインスレッドがフレームを進めるたびに、そのフレームの入力を書き込む
+class InputThread {
+public:
+  InputThread(InputEvents& events, atomic<bool>* down) : events_(events), down_(down), thread_([this] { run(); }) {}
+  ~InputThread() {
+	stop_ = true;
+	thread_.join();
+  }
+  // frameの入力を書き込ませて、終わるまで待つ
+  void frame(int f) {
+	request_.store(f, memory_order_release);
+	while (done_.load(memory_order_acquire) != f) this_thread::yield();
+  }
+  int presses = 0;
+
+private:
+  void run() {
+	int seen = 0;
+	while (!stop_) {
+	  int f = request_.load(memory_order_acquire);
+	  if (f == seen) {
+		this_thread::yield();
+		continue;
+	  }
+	  seen = f;
+	  // 4フレームごとにキーを押し、2フレーム後に離す
+	  if (f % 4 == 0) {
+		int key = (f / 4) % Keys;
+		bool tap = (f / 4) % 50 == 0;
+		set(key, true);
+		if (tap) set(key, false);
+		else pendingRelease_ = key;
+		++presses;
+	  }
+	  if (f % 4 == 2 && pendingRelease_ >= 0) {
+		set(pendingRelease_, false);
+		pendingRelease_ = -1;
+	  }
+	  done_.store(f, memory_order_release);
+	}
+  }
+  void set(int key, bool press) {
+	down_[key].store(press, memory_order_relaxed);
+	if (press) events_.press(uint16_t(key));
+	else events_.release(uint16_t(key));
+  }
+
+  InputEvents& events_;
+  atomic<bool>* down_;
+  atomic<int> request_{ 0 };
+  atomic<int> done_{ 0 };
+  atomic<bool> stop_{ false };
+  int pendingRelease_ = -1;
+  thread thread_;
+};
+
+struct Result {
+  double usPerFrame;
+  long checks = 0;
+  long reactions = 0;
+  int presses = 0;
+};
+
+Result run(bool events, int tasks, int frames) {
+  TaskQueue tq;
+  InputEvents input;
+  atomic<bool> down[Keys];
+  for (auto& d : down) d = false;
+  Result r;
+  if (events) {
+	tq.setInput(&input);
+	for (int i = 0; i < tasks; ++i) {
+	  uint16_t key = uint16_t(i % Keys);
+	  bool waiting = false;
+	  tq.addTask(Task([&r, key, waiting](TaskQueue& q, TaskArgs&) mutable {
+		  if (waiting) ++r.reactions;
+		  waiting = true;
+		  q.awaitInput(InputEdge::press(key));
+		  return TaskStatus::ContinueTask;
+		}));
+	}
+  }
+  else {
+	for (int i = 0; i < tasks; ++i) {
+	  int key = i % Keys;
+	  bool was = false;
+	  tq.addTask(Task([&r, &down, key, was](TaskQueue&, TaskArgs&) mutable {
+		  ++r.checks;
+		  bool now = down[key].load(memory_order_relaxed);
+		  if (now && !was) ++r.reactions;
+		  was = now;
+		  return TaskStatus::ContinueTask;
+		}));
+	}
+  }
+  // 最初のフレームでタスクが待ち始める
+  tq.update();
+  r.checks = 0;
+
+  InputThread producer(input, down);
+  double ns = 0;
+  for (int f = 1; f <= frames; ++f) {
+	producer.frame(f);
+	auto start = Clock::now();
+	tq.update();
+	ns += chrono::duration<double, nano>(Clock::now() - start).count();
+  }
+  r.usPerFrame = ns / frames / 1000;
+  r.presses = producer.presses;
+  tq.setInput(nullptr);
+  return r;
+}
+
+// 破棄したキューや入力を外したキューの登録は、後から同じInputEventsを使うキューに影響しない
+void check() {
+  InputEvents input;
+  // 待っているタスクを残したままキューを破棄する。eventはタスクと一緒に無くなる
+  {
+	TaskQueue old;
+	old.setInput(&input);
+	auto event = make_shared<InputEvent>();
+	old.addTask(Task([event](TaskQueue& q, TaskArgs&) {
+		q.awaitInput(InputEdge::press(1), event.get());
+		return TaskStatus::ContinueTask;
+	  }));
+	old.update();
+	old.update();
+	TS_CHECK_EQ(input.waiting(), 1u);
+  }
+  TS_CHECK_EQ(input.waiting(), 0u);
+  // 別のキューで待つ。park()の番号は前のキューと同じになる
+  TaskQueue tq;
+  tq.setInput(&input);
+  int woken = 0;
+  bool waiting = false;
+  tq.addTask(Task([&](TaskQueue& q, TaskArgs&) {
+	  if (waiting) ++woken;
+	  waiting = true;
+	  q.awaitInput(InputEdge::press(2));
+	  return TaskStatus::ContinueTask;
+	}));
+  tq.update();
+  tq.update();
+  // 前のキューが待っていたキーでは起きない
+  input.press(1);
+  tq.update();
+  TS_CHECK_EQ(woken, 0);
+  input.press(2);
+  tq.update();
+  TS_CHECK_EQ(woken, 1);
+  // 入力を外すと登録も外れる
+  tq.setInput(nullptr);
+  TS_CHECK_EQ(input.waiting(), 0u);
+}
+
+// タイトルでキーを待ち、メニューで選択を待つ
+void menuDemo() {
+  TaskQueue tq;
+  InputEvents input;
+  tq.setInput(&input);
+  int frame = 0;
+  InputEvent selected;
+  // waitInputは名前で参照するので、終わるまでここに置き、最後に登録を外す
+  Task menu("menu", [&](TaskQueue& q, TaskArgs&) {
+	  if (selected.kind != InputEvent::MenuSelect) {
+		printf("  frame %d: menu opened\n", frame);
+		q.awaitInput(InputEdge::menu(), &selected);
+		return TaskStatus::ContinueTask;
+	  }
+	  printf("  frame %d: menu %d selected\n", frame, selected.value);
+	  q.finish();
+	  return TaskStatus::RemoveTask;
+	});
+  printf("  frame %d: title, press any key\n", frame);
+  tq.waitInput(menu, InputEdge::press());
+  while (!tq.finished()) {
+	++frame;
+	// このサンプルではメインスレッドが入力スレッドのかわりに書く
+	if (frame == 3) input.press(7);
+	if (frame == 6) input.selectMenu(2);
+	tq.update();
+  }
+  tq.setInput(nullptr);
+  menu.retire();
+}
+
+int main(int ac, char* av[]) {
+  int tasks = ac > 1 ? atoi(av[1]) : 2000;
+  int frames = ac > 2 ? atoi(av[2]) : 2000;
+  check();
+  menuDemo();
+  printf("%d tasks waiting on %d keys, %d frames\n", tasks, Keys, frames);
+  for (bool events : { false, true }) {
+	Result r = run(events, tasks, frames);
+	long expected = long(r.presses) * (tasks / Keys);
+	printf("  %-8s %8.1f us/frame, %8ld checks, %7ld of %ld reactions\n",
+		   events ? "events" : "polling", r.usPerFrame, r.checks, r.reactions, expected);
+  }
+  return checkResult("input");
+}
@@ -0,0 +1,186 @@
+// -*-tab-width:4;c++-*-
+//
+// 入力イベント
+//
+// TaskTest.cppのkeyWait()やselectedMenu()は、待っているタスクがwaitPredで毎フレーム呼んで調べています。
+// 待つタスクが増えるほどupdate()が重くなり、フレームの間に押して離したキーは見逃します。
+// InputEventsは、入力スレッドが書き込むイベントをSPSCのリングに貯め、TaskQueue::update()の始めにまとめて取り出します。
+// タスクは押した・離した・メニューを選んだといった変化(InputEdge)を待ち、合うイベントが来た時だけ起こされます。
+// 待っているタスクはキューから外れているので、イベントが無いフレームのコストは、リングが空かどうかを見るだけです。
+//
+//   input.press(key) / release(key) / selectMenu(n) : 入力スレッドから呼ぶ(1つのスレッドだけ)
+//   tq.setInput(&input)                               : update()でイベントを配る
+//   tq.awaitInput(InputEdge::press(key), &event)      : 実行中のタスクを、イベントが来るまで待たせる
+//   tq.waitInput(next, InputEdge::press())            : イベントが来たらnextを実行する(waitPredのかわり)
+//
+// キーの押下状態はupdate()で取り出したイベントから作るので、isPressed()は入力スレッドと同期せずに読めます。
+// 待っている登録は、登録したキュー(owner)ごとに分かれています。dispatch()は自分の登録だけを起こし、
+// キューはsetInput(nullptr)と破棄の時にunsubscribe()で自分の登録を外します。
+// イベントはTaskReplayでは記録されません。
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "IdleWaiter.hpp"
+
+namespace ts {
+namespace namedobj {
+
+  struct InputEvent {
+	enum Kind : uint8_t { Press, Release, MenuSelect, KindCount };
+	Kind kind = Press;
+	uint16_t key = 0;    // Press, Releaseのキー番号
+	int32_t value = 0;   // MenuSelectのメニュー番号
+  };
+
+  // 待つイベントの種類とキー
+  struct InputEdge {
+	static constexpr uint16_t AnyKey = 0xffff;
+	InputEvent::Kind kind;
+	uint16_t key;
+
+	static InputEdge press(uint16_t key = AnyKey) { return { InputEvent::Press, key }; }
+	static InputEdge release(uint16_t key = AnyKey) { return { InputEvent::Release, key }; }
+	static InputEdge menu() { return { InputEvent::MenuSelect, AnyKey }; }
+	bool matches(const InputEvent& e) const {
+	  return e.kind == kind && (key == AnyKey || e.key == key);
+	}
+  };
+
+  // 1つのスレッドが書き、1つのスレッドが読むリング
+  template <typename T, size_t Capacity>
+  class SpscRing {
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+  public:
+	// 書く側。一杯ならfalseを返す
+	bool push(const T& v) {
+	  size_t tail = tail_.load(std::memory_order_relaxed);
+	  if (tail - headCache_ == Capacity) {
+		headCache_ = head_.load(std::memory_order_acquire);
+		if (tail - headCache_ == Capacity) return false;
+	  }
+	  buf_[tail & (Capacity - 1)] = v;
+	  tail_.store(tail + 1, std::memory_order_release);
+	  return true;
+	}
+	// 読む側。空ならfalseを返す
+	bool pop(T& v) {
+	  size_t head = head_.load(std::memory_order_relaxed);
+	  if (head == tailCache_) {
+		tailCache_ = tail_.load(std::memory_order_acquire);
+		if (head == tailCache_) return false;
+	  }
+	  v = buf_[head & (Capacity - 1)];
+	  head_.store(head + 1, std::memory_order_release);
+	  return true;
+	}
+	bool empty() const {
+	  return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+	}
+
+  private:
+	// 読む側と書く側の変数を別のキャッシュラインに置く
+	alignas(64) std::atomic<size_t> head_{ 0 };
+	size_t tailCache_ = 0;
+	alignas(64) std::atomic<size_t> tail_{ 0 };
+	size_t headCache_ = 0;
+	alignas(64) T buf_[Capacity];
+  };
+
+  class InputEvents {
+  public:
+	static constexpr size_t Capacity = 1024;
+	static constexpr size_t KeyCount = 512;
+
+	// 入力スレッドから呼ぶ。リングが一杯の時はイベントを捨ててfalseを返す
+	bool post(const InputEvent& e) {
+	  if (ring_.push(e)) {
+		if (IdleWaiter* w = waiter_.load(std::memory_order_acquire)) w->notify();
+		return true;
+	  }
+	  dropped_.fetch_add(1, std::memory_order_relaxed);
+	  return false;
+	}
+	bool press(uint16_t key) { return post({ InputEvent::Press, key, 0 }); }
+	bool release(uint16_t key) { return post({ InputEvent::Release, key, 0 }); }
+	bool selectMenu(int32_t n) { return post({ InputEvent::MenuSelect, 0, n }); }
+	// 一杯で捨てたイベントの数
+	uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+	// 以下はTaskQueueのスレッドから呼ぶ
+
+	// post()した時に起こす。TaskQueue::setInput()が設定する
+	void setWaiter(IdleWaiter* waiter) { waiter_.store(waiter, std::memory_order_release); }
+	// 取り出していないイベントがあるか
+	bool pending() const { return !ring_.empty(); }
+
+	// edgeに合うイベントが来たら、ownerのdispatch()でtokenを渡してwakeを呼ぶ。outがあればイベントを書く。1回だけ
+	// tokenとoutはownerのものなので、ownerを破棄する前にunsubscribe()すること
+	void subscribe(const void* owner, const InputEdge& edge, uint64_t token, InputEvent* out = nullptr) {
+	  subscribers_[edge.kind].push_back({ owner, edge, token, out });
+	}
+	// ownerの登録をすべて外す。外した数を返す
+	size_t unsubscribe(const void* owner) {
+	  size_t n = 0;
+	  for (auto& subs : subscribers_) {
+		auto end = std::remove_if(subs.begin(), subs.end(), [owner](const Subscriber& s) { return s.owner == owner; });
+		n += size_t(subs.end() - end);
+		subs.erase(end, subs.end());
+	  }
+	  return n;
+	}
+	// イベントを取り出し、ownerの登録のうち待っているものを起こす。取り出したイベントの数を返す
+	template <typename Wake>
+	size_t dispatch(const void* owner, Wake&& wake) {
+	  size_t n = 0;
+	  InputEvent e;
+	  while (ring_.pop(e)) {
+		++n;
+		if (e.kind == InputEvent::Press && e.key < KeyCount) pressed_.set(e.key);
+		if (e.kind == InputEvent::Release && e.key < KeyCount) pressed_.reset(e.key);
+		auto& subs = subscribers_[e.kind];
+		for (size_t i = 0; i < subs.size();) {
+		  if (subs[i].owner != owner || !subs[i].edge.matches(e)) {
+			++i;
+			continue;
+		  }
+		  Subscriber s = subs[i];
+		  subs[i] = subs.back();
+		  subs.pop_back();
+		  if (s.out) *s.out = e;
+		  wake(s.token);
+		}
+	  }
+	  return n;
+	}
+
+	// 取り出したイベントでのキーの状態
+	bool isPressed(uint16_t key) const { return key < KeyCount && pressed_.test(key); }
+	// イベントを待っている数
+	size_t waiting() const {
+	  size_t n = 0;
+	  for (auto& subs : subscribers_) n += subs.size();
+	  return n;
+	}
+
+  private:
+	struct Subscriber {
+	  const void* owner;
+	  InputEdge edge;
+	  uint64_t token;
+	  InputEvent* out;
+	};
+
+	SpscRing<InputEvent, Capacity> ring_;
+	std::atomic<uint64_t> dropped_{ 0 };
+	std::atomic<IdleWaiter*> waiter_{ nullptr };
+	std::vector<Subscriber> subscribers_[InputEvent::KindCount];
+	std::bitset<KeyCount> pressed_;
+  };
+
+}} // ts::namedobj
@@ -0,0 +1,112 @@
+// -*-tab-width:4;c++-*-
+//
+// 遅延評価する値
+//
+// c++11forGamePrograming.cppの「ラムダ式による遅延評価」では、引数をstd::function<int()>で受け取っていますが、
+// 呼ぶたびに評価し直し、キャプチャが大きいと引数ごとにstd::functionがメモリを確保します。
+// Lazy<T, F>は、関数Fを自分の中に持ち、最初にget()した時に1回だけ評価して値を保持します。
+// 最初の評価は複数のスレッドから同時に呼んでも1回だけで、評価後のget()はアトミック変数を1回読むだけです。
+//
+// LazyEpochを渡すと、エポックが進んだ後の最初のget()で評価し直します。
+// TaskQueueはupdate()ごとにエポックを進めるので、tq.epoch()を渡せば、フレームごとに1回だけ評価する値になります。
+// エポックが進んで評価し直すと前の値は破棄されるので、get()で得た参照はそのエポックの間だけ使ってください。
+//
+//   auto nearest = makeLazy([&] { return findNearestEnemy(); }, tq.epoch());
+//   if (nearest.get() ...)
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace ts {
+namespace namedobj {
+
+  // 評価し直す区切り。advance()で進める
+  class LazyEpoch {
+  public:
+	uint64_t current() const { return value_.load(std::memory_order_acquire); }
+	void advance() { value_.fetch_add(1, std::memory_order_acq_rel); }
+  private:
+	std::atomic<uint64_t> value_{ 1 };
+  };
+
+  template <typename T, typename F>
+  class Lazy {
+  public:
+	using value_type = T;
+
+	explicit Lazy(F f, const LazyEpoch* epoch = nullptr) : f_(std::move(f)), epoch_(epoch) {}
+	Lazy(F f, const LazyEpoch& epoch) : Lazy(std::move(f), &epoch) {}
+	// 評価済みの値も移す。評価中のLazyを移動してはいけない
+	Lazy(Lazy&& other) : f_(std::move(other.f_)), epoch_(other.epoch_) {
+	  uint64_t e = other.valueEpoch_.load(std::memory_order_acquire);
+	  if (e != 0) {
+		new (&storage_) T(std::move(*other.ptr()));
+		valueEpoch_.store(e, std::memory_order_release);
+	  }
+	}
+	Lazy(const Lazy&) = delete;
+	Lazy& operator = (const Lazy&) = delete;
+	~Lazy() { reset(); }
+
+	// 値を返す。まだ評価していないか、エポックが進んでいれば評価する
+	// 関数が例外を投げた場合は、値を持たないまま例外を投げる(次のget()で評価し直す)
+	const T& get() const {
+	  uint64_t want = epoch_ ? epoch_->current() : 1;
+	  if (valueEpoch_.load(std::memory_order_acquire) == want) return *ptr();
+	  return evaluate(want);
+	}
+	const T& operator * () const { return get(); }
+	const T* operator -> () const { return &get(); }
+
+	// 今のエポックで評価済み
+	bool ready() const {
+	  uint64_t want = epoch_ ? epoch_->current() : 1;
+	  return valueEpoch_.load(std::memory_order_acquire) == want;
+	}
+	// 値を捨てて、次のget()で評価し直す。get()と同時に呼んではいけない
+	void reset() {
+	  if (valueEpoch_.load(std::memory_order_acquire) != 0) {
+		ptr()->~T();
+		valueEpoch_.store(0, std::memory_order_release);
+	  }
+	}
+
+  private:
+	const T& evaluate(uint64_t want) const {
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  uint64_t e = valueEpoch_.load(std::memory_order_relaxed);
+	  if (e == want) return *ptr();
+	  if (e != 0) {
+		ptr()->~T();
+		valueEpoch_.store(0, std::memory_order_relaxed);
+	  }
+	  new (&storage_) T(f_());
+	  valueEpoch_.store(want, std::memory_order_release);
+	  return *ptr();
+	}
+	T* ptr() const { return reinterpret_cast<T*>(&storage_); }
+
+	mutable F f_;
+	const LazyEpoch* epoch_;
+	// 値を評価したエポック。0は値が無い
+	mutable std::atomic<uint64_t> valueEpoch_{ 0 };
+	mutable std::mutex mutex_;
+	mutable typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+  };
+
+  template <typename F>
+  Lazy<typename std::decay<decltype(std::declval<F&>()())>::type, F> makeLazy(F f) {
+	return Lazy<typename std::decay<decltype(std::declval<F&>()())>::type, F>(std::move(f));
+  }
+  template <typename F>
+  Lazy<typename std::decay<decltype(std::declval<F&>()())>::type, F> makeLazy(F f, const LazyEpoch& epoch) {
+	return Lazy<typename std::decay<decltype(std::declval<F&>()())>::type, F>(std::move(f), epoch);
+  }
+
+}} // ts::namedobj
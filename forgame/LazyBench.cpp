@@ -0,0 +1,133 @@
+// -*-tab-width:4-*-
+//
+// Lazyとstd::functionによる遅延評価の比較
+//   add        : c++11forGamePrograming.cppのadd(std::function<int()>, std::function<int()>)と、Lazyを受け取るadd
+//   get        : 評価済みの値の取得と、std::functionの呼び出し
+//   frame      : 8個のタスクが毎フレーム同じ重い値を使う。std::functionは使うたびに、Lazyはフレームに1回評価する
+//   threads    : 複数のスレッドが同時に最初のget()を呼んでも、評価が1回だけであることを確かめる
+// ./t11 [回数]
+//
+#define TS_INSTRUMENT_NEW
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "NamedObject.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "Lazy.hpp"
+#include "../instrument/AllocCounter.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using ts::instrument::AllocScope;
+using Clock = chrono::steady_clock;
+
+static volatile int sink;
+
+// fをn回呼び、1回あたりの時間と確保回数を表示する
+template <typename F>
+void measure(const char* label, long n, F f) {
+  AllocScope allocs;
+  auto start = Clock::now();
+  for (long i = 0; i < n; ++i) f(i);
+  double ns = double(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count()) / double(n);
+  cout << label << ns << " ns, " << double(allocs.news()) / double(n) << " allocs" << endl;
+}
+
+// キャプチャが大きく、std::functionの内部のバッファに入らない値
+struct Params {
+  int v[6];
+};
+
+int add(std::function<int()> fa, std::function<int()> fb) {
+  return fa() + fb();
+}
+template <typename A, typename B>
+int add(const Lazy<int, A>& a, const Lazy<int, B>& b) {
+  return a.get() + b.get();
+}
+
+// 重い計算のかわり
+static vector<int> entities(4096, 1);
+static long evaluations = 0;
+int heavy() {
+  ++evaluations;
+  int sum = 0;
+  for (int e : entities) sum += e;
+  return sum;
+}
+
+int main(int ac, char* av[]) {
+  long n = ac > 1 ? atol(av[1]) : 2000000;
+
+  cout << "add, " << n << " calls" << endl;
+  Params p = { { 1, 2, 3, 4, 5, 6 } };
+  measure("  std::function ", n, [&](long i) {
+	  sink = add([p, i] { return p.v[0] + int(i); }, [p] { return p.v[1]; });
+	});
+  measure("  Lazy          ", n, [&](long i) {
+	  sink = add(makeLazy([p, i] { return p.v[0] + int(i); }), makeLazy([p] { return p.v[1]; }));
+	});
+
+  cout << "get after evaluation, " << n << " calls" << endl;
+  std::function<int()> fn = [p] { return p.v[2]; };
+  auto lazy = makeLazy([p] { return p.v[2]; });
+  measure("  std::function ", n, [&](long) { sink = fn(); });
+  measure("  Lazy          ", n, [&](long) { sink = lazy.get(); });
+
+  // 8個のタスクが毎フレーム同じ値を使う
+  const int Users = 8;
+  long frames = n / 1000;
+  cout << "frame, " << Users << " users x " << frames << " frames" << endl;
+  {
+	TaskQueue tq;
+	std::function<int()> value = heavy;
+	for (int i = 0; i < Users; ++i) {
+	  tq.addTask(Task([&value](TaskQueue&, TaskArgs&) { sink = value(); return TaskStatus::ContinueTask; }));
+	}
+	tq.update();
+	evaluations = 0;
+	measure("  std::function ", frames, [&](long) { tq.update(); });
+	cout << "    evaluations per frame " << double(evaluations) / double(frames) << endl;
+  }
+  {
+	TaskQueue tq;
+	auto value = makeLazy(heavy, tq.epoch());
+	for (int i = 0; i < Users; ++i) {
+	  tq.addTask(Task([&value](TaskQueue&, TaskArgs&) { sink = value.get(); return TaskStatus::ContinueTask; }));
+	}
+	tq.update();
+	evaluations = 0;
+	measure("  Lazy          ", frames, [&](long) { tq.update(); });
+	cout << "    evaluations per frame " << double(evaluations) / double(frames) << endl;
+  }
+
+  // 同時に最初のget()を呼ぶ
+  const int Threads = 4;
+  const int Rounds = 1000;
+  atomic<int> calls{ 0 };
+  int bad = 0;
+  for (int r = 0; r < Rounds; ++r) {
+	calls = 0;
+	auto shared = makeLazy([&calls] { ++calls; this_thread::yield(); return 42; });
+	atomic<bool> go{ false };
+	vector<thread> threads;
+	for (int t = 0; t < Threads; ++t) {
+	  threads.emplace_back([&] {
+		  while (!go) {}
+		  if (shared.get() != 42) abort();
+		});
+	}
+	go = true;
+	for (auto& t : threads) t.join();
+	if (calls != 1) ++bad;
+  }
+  cout << "threads, " << Threads << " threads x " << Rounds << " rounds: "
+	   << (bad == 0 ? "evaluated once every round" : "EVALUATED MORE THAN ONCE") << endl;
+  return bad == 0 ? 0 : 1;
+}
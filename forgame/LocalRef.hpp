@@ -0,0 +1,228 @@
+// -*-tab-width:4;c++-*-
+//
+// 1つのスレッドで共有するオブジェクトの参照カウント
+//
+// c++11forGamePrograming.cppの「ラムダ式を使う時の注意点」のとおり、std::shared_ptrをラムダ式にキャプチャすると、
+// コピーと破棄のたびに参照カウントをアトミックに増減します。タスクのラムダ式は同じTaskQueueのスレッドでしか動かないので、
+// アトミックである必要はありません。
+//
+// RefCountedを継承したオブジェクトを、LocalRef<T>で共有します。
+//   - LocalRefのコピーと破棄は、オブジェクトの中のカウントを普通に増減するだけです(同じスレッドだけで使うこと)
+//   - 最後のLocalRefが外れた時、RefReleaserを指定していればそこに貯め、flush()でまとめて破棄します
+//     TaskQueueはupdate()の終わりにflush()するので、tq.refs()を渡すとフレームの終わりに破棄されます
+//     (タスクの途中で外しても、そのフレームの間はオブジェクトが残ります)
+//   - 他のスレッドに渡す時は、SharedRef<T>に明示的に変換します。SharedRefのカウントはアトミックです
+//     すべてのLocalRefはまとめてSharedRefの1つ分として数えるので、他のスレッドに渡していなければアトミック操作はしません
+//   - 他のスレッドで最後のSharedRefが外れた時は、そのスレッドですぐに破棄します(RefReleaserには貯めません)
+//   - スレッドごとに、LocalRefで持たれているオブジェクトの数を数えます(localRefObjects())
+//     TaskQueueのReclaim::Backgroundは、これが0でない間は終わったタスクをReclaimerに渡さず、自分のスレッドで破棄します
+//     タスクのキャプチャにLocalRefがあるかは型からは分からないので、印を付け忘れても別のスレッドで破棄しないためです
+//     (Reclaimerのスレッドでは、LocalRefに触れるとassertで止まります)
+//
+//   struct Texture : RefCounted { ... };
+//   auto tex = makeLocalRef<Texture>(&tq.refs(), "title.png");
+//   tq.addTask(Task([tex](TaskQueue&, TaskArgs&) { draw(*tex); return TaskStatus::ContinueTask; }));
+//   worker.post([t = SharedRef<Texture>(tex)] { upload(*t); });
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace ts {
+namespace namedobj {
+
+  class RefCounted;
+  class RefReleaser;
+  template <typename T> class LocalRef;
+  template <typename T> class SharedRef;
+  template <typename T, typename... Args>
+  LocalRef<T> makeLocalRef(RefReleaser* releaser, Args&&... args);
+
+  // LocalRefに触れてはいけないスレッドで立てる(Reclaimerのスレッドなど)
+  inline bool& localRefsForbidden() {
+	thread_local bool forbidden = false;
+	return forbidden;
+  }
+
+  // このスレッドでLocalRefに持たれているオブジェクトの数
+  // LocalRefは作ったスレッドだけで使うので、増減は同じスレッドで起こる
+  inline size_t& localRefObjects() {
+	thread_local size_t count = 0;
+	return count;
+  }
+
+  // 参照が無くなったオブジェクトを貯めて、まとめて破棄する
+  class RefReleaser {
+  public:
+	RefReleaser() = default;
+	RefReleaser(const RefReleaser&) = delete;
+	RefReleaser& operator = (const RefReleaser&) = delete;
+	~RefReleaser() { flush(); }
+
+	// 貯めたオブジェクトを破棄する。破棄したオブジェクトの数を返す
+	// 破棄したオブジェクトが持っていた参照で、さらに貯まった分も破棄する
+	inline size_t flush();
+	// 貯めているオブジェクトの数
+	size_t pending() const { return pending_.size(); }
+
+  private:
+	friend class RefCounted;
+	void defer(RefCounted* p) { pending_.push_back(p); }
+
+	std::vector<RefCounted*> pending_;
+	std::vector<RefCounted*> flushing_;
+  };
+
+  // LocalRef, SharedRefで共有するオブジェクトの基底クラス
+  class RefCounted {
+  public:
+	RefCounted(const RefCounted&) = delete;
+	RefCounted& operator = (const RefCounted&) = delete;
+
+	// LocalRefの数
+	uint32_t localCount() const { return local_; }
+	// SharedRefの数(LocalRefがあれば、まとめて1つと数える)
+	uint32_t sharedCount() const { return shared_.load(std::memory_order_acquire); }
+
+  protected:
+	RefCounted() = default;
+	virtual ~RefCounted() = default;
+
+  private:
+	template <typename> friend class LocalRef;
+	template <typename> friend class SharedRef;
+	friend class RefReleaser;
+	template <typename T, typename... Args>
+	friend LocalRef<T> makeLocalRef(RefReleaser* releaser, Args&&... args);
+
+	void addLocal() {
+	  assert(!localRefsForbidden());
+	  if (local_++ == 0) {
+		++localRefObjects();
+		addShared();
+	  }
+	}
+	void releaseLocal() {
+	  assert(!localRefsForbidden());
+	  assert(local_ > 0);
+	  if (--local_ != 0) return;
+	  --localRefObjects();
+	  // 他のスレッドに渡していなければ、残っている参照は自分だけなので、アトミックに減らさなくてよい
+	  if (shared_.load(std::memory_order_acquire) == 1) shared_.store(0, std::memory_order_relaxed);
+	  else if (shared_.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+	  if (releaser_) releaser_->defer(this);
+	  else delete this;
+	}
+	void addShared() { shared_.fetch_add(1, std::memory_order_relaxed); }
+	void releaseShared() {
+	  if (shared_.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+	}
+
+	uint32_t local_ = 0;
+	std::atomic<uint32_t> shared_{ 0 };
+	RefReleaser* releaser_ = nullptr;
+  };
+
+  inline size_t RefReleaser::flush() {
+	size_t n = 0;
+	while (!pending_.empty()) {
+	  // 破棄中に貯まる分はpending_に入る
+	  flushing_.swap(pending_);
+	  for (RefCounted* p : flushing_) delete p;
+	  n += flushing_.size();
+	  flushing_.clear();
+	}
+	return n;
+  }
+
+  // アトミックでない参照カウントのポインタ。作ったスレッドだけで使う
+  template <typename T>
+  class LocalRef {
+	static_assert(std::is_base_of<RefCounted, T>::value, "T must derive from RefCounted");
+  public:
+	LocalRef() = default;
+	LocalRef(std::nullptr_t) {}
+	LocalRef(const LocalRef& r) : p_(r.p_) { if (p_) p_->addLocal(); }
+	LocalRef(LocalRef&& r) noexcept : p_(r.p_) { r.p_ = nullptr; }
+	template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+	LocalRef(const LocalRef<U>& r) : p_(r.get()) { if (p_) p_->addLocal(); }
+	~LocalRef() { if (p_) p_->releaseLocal(); }
+
+	LocalRef& operator = (LocalRef r) noexcept {
+	  std::swap(p_, r.p_);
+	  return *this;
+	}
+	void reset() { LocalRef().swap(*this); }
+	void swap(LocalRef& r) noexcept { std::swap(p_, r.p_); }
+
+	T* get() const { return p_; }
+	T& operator * () const { return *p_; }
+	T* operator -> () const { return p_; }
+	explicit operator bool () const { return p_ != nullptr; }
+	uint32_t use_count() const { return p_ ? p_->localCount() : 0; }
+
+  private:
+	template <typename> friend class SharedRef;
+	template <typename U, typename... Args>
+	friend LocalRef<U> makeLocalRef(RefReleaser* releaser, Args&&... args);
+	// 参照を増やさずに持つ
+	struct Adopt {};
+	LocalRef(T* p, Adopt) : p_(p) {}
+
+	T* p_ = nullptr;
+  };
+
+  // アトミックな参照カウントのポインタ。スレッドをまたいで渡す時に使う
+  template <typename T>
+  class SharedRef {
+	static_assert(std::is_base_of<RefCounted, T>::value, "T must derive from RefCounted");
+  public:
+	SharedRef() = default;
+	SharedRef(std::nullptr_t) {}
+	// LocalRefを作ったスレッドで変換する
+	explicit SharedRef(const LocalRef<T>& r) : p_(r.get()) { if (p_) p_->addShared(); }
+	SharedRef(const SharedRef& r) : p_(r.p_) { if (p_) p_->addShared(); }
+	SharedRef(SharedRef&& r) noexcept : p_(r.p_) { r.p_ = nullptr; }
+	~SharedRef() { if (p_) p_->releaseShared(); }
+
+	SharedRef& operator = (SharedRef r) noexcept {
+	  std::swap(p_, r.p_);
+	  return *this;
+	}
+	void reset() { SharedRef().swap(*this); }
+	void swap(SharedRef& r) noexcept { std::swap(p_, r.p_); }
+
+	// LocalRefに戻す。オブジェクトを作ったスレッドで呼ぶこと
+	LocalRef<T> local() const {
+	  if (p_) p_->addLocal();
+	  return LocalRef<T>(p_, typename LocalRef<T>::Adopt());
+	}
+
+	T* get() const { return p_; }
+	T& operator * () const { return *p_; }
+	T* operator -> () const { return p_; }
+	explicit operator bool () const { return p_ != nullptr; }
+
+  private:
+	T* p_ = nullptr;
+  };
+
+  // Tを作る。releaserがnullptrなら、最後のLocalRefが外れた時にすぐ破棄する
+  template <typename T, typename... Args>
+  LocalRef<T> makeLocalRef(RefReleaser* releaser, Args&&... args) {
+	T* p = new T(std::forward<Args>(args)...);
+	RefCounted* base = p;
+	base->releaser_ = releaser;
+	base->local_ = 1;
+	++localRefObjects();
+	base->shared_.store(1, std::memory_order_relaxed);
+	return LocalRef<T>(p, typename LocalRef<T>::Adopt());
+  }
+
+}} // ts::namedobj
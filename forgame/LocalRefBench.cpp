@@ -0,0 +1,176 @@
+// -*-tab-width:4-*-
+//
+// LocalRef, SharedRef, std::shared_ptrの比較
+// 1回あたりの時間と確保回数
+//   copy    : 値渡しでコピーして破棄する
+//   capture : ラムダ式にキャプチャしてstd::functionに入れ、呼んで破棄する
+//   create  : 作って破棄する。LocalRef(deferred)はRefReleaserに貯めて、1024個ごとにflush()する
+// 最初に、破棄のタイミングとスレッドをまたいだ受け渡しを確かめる
+// ./t16 [回数]
+//
+#define TS_INSTRUMENT_NEW
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <thread>
+#include "NamedObject.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "LocalRef.hpp"
+#include "../instrument/AllocCounter.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using namespace ts::instrument;
+using Clock = chrono::steady_clock;
+
+static int alive = 0;
+
+struct Resource : RefCounted {
+  Resource(int v = 0) : value(v) { ++alive; }
+  ~Resource() { --alive; }
+  int value;
+};
+struct PlainResource {
+  PlainResource(int v = 0) : value(v) {}
+  int value;
+};
+
+// 破棄した時に、持っている参照も外れる
+struct Owner : RefCounted {
+  explicit Owner(LocalRef<Resource> r) : child(std::move(r)) { ++alive; }
+  ~Owner() { --alive; }
+  LocalRef<Resource> child;
+};
+
+static volatile long sink;
+
+// 値渡しで受け取るので、呼び出しごとにコピーと破棄が起こる
+template <typename P>
+__attribute__((noinline)) void consume(P p) { sink = sink + p->value; }
+
+template <typename F>
+void measure(const char* label, long n, F f) {
+  AllocScope allocs;
+  auto start = Clock::now();
+  for (long i = 0; i < n; ++i) f(i);
+  double ns = chrono::duration<double, nano>(Clock::now() - start).count() / double(n);
+  printf("    %-20s %6.2f ns %5.2f allocs\n", label, ns, double(allocs.news()) / double(n));
+}
+
+template <typename P>
+void copyAndCapture(const char* name, const P& p, long n) {
+  char label[64];
+  snprintf(label, sizeof(label), "copy %s", name);
+  measure(label, n, [&](long) { consume(p); });
+  snprintf(label, sizeof(label), "capture %s", name);
+  measure(label, n, [&](long) {
+	  function<void()> f = [p] { sink = sink + p->value; };
+	  f();
+	});
+}
+
+void check() {
+  // すぐに破棄する
+  {
+	auto a = makeLocalRef<Resource>(nullptr, 1);
+	auto b = a;
+	TS_CHECK_EQ(a.use_count(), 2u);
+	TS_CHECK_EQ(a->sharedCount(), 1u);
+	a.reset();
+	TS_CHECK_EQ(alive, 1);
+	b.reset();
+	TS_CHECK_EQ(alive, 0);
+  }
+  // flush()まで残し、破棄で外れた参照もまとめて破棄する
+  {
+	RefReleaser releaser;
+	auto r = makeLocalRef<Resource>(&releaser, 2);
+	auto o = makeLocalRef<Owner>(&releaser, r);
+	r.reset();
+	o.reset();
+	TS_CHECK_EQ(alive, 2);
+	TS_CHECK_EQ(releaser.pending(), 1u);
+	TS_CHECK_EQ(releaser.flush(), 2u);
+	TS_CHECK_EQ(alive, 0);
+  }
+  // 他のスレッドに渡し、そのスレッドで最後の参照が外れる
+  {
+	RefReleaser releaser;
+	auto r = makeLocalRef<Resource>(&releaser, 3);
+	SharedRef<Resource> s(r);
+	TS_CHECK_EQ(r->sharedCount(), 2u);
+	r.reset();
+	TS_CHECK_EQ(alive, 1);
+	// 戻してから外すと、再び貯まる
+	r = s.local();
+	int seen = 0;
+	thread t([&seen, s2 = std::move(s)]() mutable {
+		seen = s2->value;
+		s2.reset();
+	  });
+	t.join();
+	TS_CHECK_EQ(seen, 3);
+	TS_CHECK_EQ(r->sharedCount(), 1u);
+	r.reset();
+	TS_CHECK_EQ(releaser.pending(), 1u);
+	releaser.flush();
+	TS_CHECK_EQ(alive, 0);
+
+	r = makeLocalRef<Resource>(&releaser, 4);
+	thread t2([s3 = SharedRef<Resource>(r)]() mutable { s3.reset(); });
+	r.reset();
+	t2.join();
+	// どちらが最後に外しても、破棄は1回
+	releaser.flush();
+	TS_CHECK_EQ(alive, 0);
+  }
+  // タスクで外した参照は、そのフレームの終わりに破棄する
+  {
+	TaskQueue tq;
+	auto r = makeLocalRef<Resource>(&tq.refs(), 5);
+	int during = -1;
+	tq.addTask(Task([r, &during](TaskQueue&, TaskArgs&) mutable {
+		r.reset();
+		during = alive;
+		return TaskStatus::ContinueTask;
+	  }));
+	r.reset();
+	tq.update();  // 次のフレームから実行する
+	tq.update();
+	TS_CHECK_EQ(during, 1);
+	TS_CHECK_EQ(alive, 0);
+  }
+}
+
+int main(int ac, char* av[]) {
+  long n = ac > 1 ? atol(av[1]) : 10000000;
+  check();
+
+  printf("  copy and capture\n");
+  {
+	auto sp = make_shared<PlainResource>(1);
+	auto lr = makeLocalRef<Resource>(nullptr, 1);
+	SharedRef<Resource> sr(lr);
+	copyAndCapture("shared_ptr", sp, n);
+	copyAndCapture("LocalRef", lr, n);
+	copyAndCapture("SharedRef", sr, n);
+  }
+
+  printf("  create and destroy\n");
+  measure("shared_ptr", n, [](long i) { consume(make_shared<PlainResource>(int(i))); });
+  measure("LocalRef", n, [](long i) { consume(makeLocalRef<Resource>(nullptr, int(i))); });
+  {
+	RefReleaser releaser;
+	measure("LocalRef(deferred)", n, [&](long i) {
+		consume(makeLocalRef<Resource>(&releaser, int(i)));
+		if ((i & 1023) == 1023) releaser.flush();
+	  });
+  }
+  TS_CHECK_EQ(alive, 0);
+  return checkResult("localref");
+}
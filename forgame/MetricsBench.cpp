@@ -0,0 +1,81 @@
+// -*-tab-width:4-*-
+//
+// TaskMetricsのオーバーヘッドの計測
+// 処理の軽いタスクを毎フレーム実行し、計測なしと計測ありのupdate()の時間を比べる
+// 計測ありの間はMetricsReporterが一定間隔でJSONを出力する
+// ./t6 [フレーム数]
+//
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "NamedObject.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using Clock = chrono::steady_clock;
+
+static volatile uint64_t sink;
+void simulate(int n) {
+  uint64_t x = 1;
+  for (int i = 0; i < n; ++i) x = x * 6364136223846793005ull + 1442695040888963407ull;
+  sink = x;
+}
+
+const int Workers = 200;
+
+// Workers個のタスクを登録し、framesフレーム動かした時間(ns)を返す
+int64_t runFrames(TaskQueue& tq, int frames) {
+  static const char* names[] = { "physics", "ai", "sound", "effect", "ui", "network", "camera", "script" };
+  for (int i = 0; i < Workers; ++i) {
+	tq.addTask(Task(TaskQueue::TaskName(names[i % 8]), [i](TaskQueue&, TaskArgs&) {
+		  simulate(i % 8 * 4);
+		  return TaskStatus::ContinueTask;
+		}));
+  }
+  int frame = 0;
+  tq.addTask(Task(TaskQueue::TaskName("frameCounter"), [&frame, frames](TaskQueue& tq, TaskArgs&) {
+		if (++frame < frames) return TaskStatus::ContinueTask;
+		tq.finish();
+		return TaskStatus::RemoveTask;
+	  }));
+  tq.update(); // 登録したタスクをキューに移す
+  auto start = Clock::now();
+  while (!tq.finished()) tq.update();
+  return chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+int main(int ac, char* av[]) {
+  int frames = ac > 1 ? atoi(av[1]) : 5000;
+  size_t tasks = size_t(frames) * (Workers + 1);
+
+  int64_t plainNs;
+  {
+	TaskQueue plain;
+	plainNs = runFrames(plain, frames);
+  }
+
+  auto metrics = make_unique<TaskMetrics>();
+  string last;
+  int64_t measuredNs;
+  {
+	MetricsReporter reporter(*metrics, chrono::milliseconds(100), [&last](const string& s) { last = s; },
+							 MetricsReporter::Format::Json);
+	TaskQueue measured;
+	measured.setMetrics(metrics.get());
+	measuredNs = runFrames(measured, frames);
+	measured.setMetrics(nullptr);
+  }
+
+  cout << frames << " frames, " << tasks << " tasks" << endl;
+  cout << "without metrics: " << double(plainNs) / double(tasks) << " ns/task" << endl;
+  cout << "with metrics:    " << double(measuredNs) / double(tasks) << " ns/task" << endl;
+  metrics->writeText(cout);
+  cout << "last report: " << last;
+}
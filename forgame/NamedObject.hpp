@@ -5,15 +5,24 @@
 // Created by TECHNICAL ARTS h.godai 2014
 //
 // NamedObjectは、名前付きオブジェクトクラスです。~
-// 名前で検索するためのDB(unorderdmap)を保持しています。~
+// 名前で検索するためのDB(Registry)を保持しています。~
 // NamedObjectは、インスタンスを保持する実体としてのクラスと、インスタンスへの参照をもつ参照クラスの２つの形態があります。
 // NamedObjectはコピー不可、ムーブ可能なクラスで、クラスインスタンスの型をとるCRTPの形式となっています。
-// 名前の型は指定可能ですが、初期値はstd::stringです。std::unorderedmapのキーに利用できる型ならOKです。
+// 名前の型は指定可能ですが、初期値はstd::stringです。RegistryKeyで検索方法が定義された文字列型ならOKです。
+// FixedString<N>を名前の型にすると、名前のハッシュはコンパイル時に計算されます。
+// TS_STATIC_STRING("name")で作った型をlookupに渡すと、名前は一度だけ作られた定数を使います。
+// 名前の登録先は、RegistryScopeでスレッドごとに切り替えられます(既定はプロセスで1つの登録先)。
+// 登録先は同期しないので、複数のスレッドでオブジェクトを作る場合は、スレッドごとに登録先を分けてください。
 
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <iostream>
 #include <boost/optional.hpp>
-#include <boost/lexical_cast.hpp>
+#include "FixedString.hpp"
+#include "Registry.hpp"
+#include "StrCat.hpp"
 
 namespace ts {
 namespace namedobj {
@@ -25,10 +34,27 @@ namespace namedobj {
   public:
 	using name_type = NameType;
 	using value_type = ValueType;
+	using registry_type = Registry<name_type, value_type*>;
+
+	// 生存している間、このスレッドの名前の登録先をregistryにする
+	class RegistryScope {
+	public:
+	  explicit RegistryScope(registry_type& registry) : prev_(current()) { current() = &registry; }
+	  ~RegistryScope() { current() = prev_; }
+	  RegistryScope(const RegistryScope&) = delete;
+	  RegistryScope& operator = (const RegistryScope&) = delete;
+	private:
+	  registry_type* prev_;
+	};
+	// このスレッドの名前の登録先
+	static registry_type& registry() {
+	  registry_type* r = current();
+	  return r ? *r : namedList_;
+	}
 	// default constructor
 	NamedObject() {}
 	NamedObject(name_type&& n, bool ref = false)
-	  : name_(move(n))
+	  : name_(std::move(n))
 	  , reference_(ref)
 	{ regist(); }
 	NamedObject(const name_type& n, bool ref=false)
@@ -37,27 +63,30 @@ namespace namedobj {
 	{ regist(); }
 	// move constructor
 	NamedObject(NamedObject&& n)
-	  : name_(move(n.name_))
-	  , reference_(n.reference_) {
+	  : name_(std::move(n.name_))
+	  , reference_(n.reference_)
+	  , retired_(n.retired_) {
 	  regist();
-	  n.name_ += name_ + "@moved";
+	  // デバッグ出力用の名前なので、容量を超える分は切り詰める
+	  strCat(name_, "@moved").truncateTo(n.name_);
 	  n.moved_ = true;
 	}
 	// コピーコンストラクタは使用禁止
 	NamedObject(const NamedObject&) = delete;
 	// デストラクタではmoveされずに破棄されるオブジェクトをチェック
 	~NamedObject() {
-	  if (!(reference_ || moved_)) {
+	  if (!(reference_ || moved_ || retired_)) {
 		std::cerr << "destruct: " << name_ << " has not moved" << std::endl;
 	  }
 	}
 
 	// 代入はmoveのみ可
 	NamedObject& operator = (NamedObject&& n) {
-	  name_ = move(n.name_);
+	  name_ = std::move(n.name_);
 	  reference_ = n.reference_;
+	  retired_ = n.retired_;
 	  regist();
-	  n.name_ = name_ + "@moved";
+	  strCat(name_, "@moved").truncateTo(n.name_);
 	  n.moved_ = true;
 	  return *this;
 	}
@@ -87,24 +116,45 @@ namespace namedobj {
 	name_type& nameRef() { return name_; }
 	
 	// 名前からオブジェクトを検索する
-	static boost::optional<value_type&> lookup(const name_type& name) {
-	  auto found = namedList_.find(name);
-	  if (found != namedList_.end()) {
-		return *found->second;
+	// 名前はname_typeのほか、const char*やstring_viewでもよい(一時的な名前は作らない)
+	template <typename K>
+	static boost::optional<value_type&> lookup(const K& name) {
+	  if (auto found = registry().find(name)) {
+		return **found;
 	  }
 	  else {
 		return boost::none;
 	  }
 	}
+	// コンパイル時に決まる名前で検索する
+	template <char... Cs>
+	static boost::optional<value_type&> lookup(StaticString<Cs...>) {
+	  return lookup(NameConstant<name_type, StaticString<Cs...>>::value);
+	}
+	// スナップショットからの復元用。名前と参照の区別を設定するだけで、登録はしない
+	void restoreName(const name_type& n, bool ref) {
+	  name_ = n;
+	  reference_ = ref;
+	}
+	// 実体のオブジェクトをまとめて登録する。登録後の検索は整列した配列の二分探索になる
+	static void registerAll(std::vector<std::pair<name_type, value_type*>>&& entries) {
+	  registry().bulkLoad(std::move(entries));
+	}
+	// 名前の登録がほぼ終わった後に呼ぶと、以後の検索は整列した配列の二分探索になる
+	static void freezeRegistry() { registry().freeze(); }
 	// 無名のオブジェクトに参照用のユニークな名前を付ける
+	// retire()で登録が減っても前に付けた番号から探すので、使用中の番号を先頭から調べ直すことはない
 	void setUniqName() const {
 	  if (name_.empty()) {
-		size_t n = namedList_.size();
+		size_t& next = nextUniq();
+		size_t n = std::max(next, registry().size());
 		for(;;) {
-		  name_type name = boost::lexical_cast<name_type>(n);
-		  if (namedList_.find(name) == namedList_.end()) {
-			name_ = name;
+		  char buf[24];
+		  boost::string_view name(buf, strCat(n).writeTo(buf, sizeof(buf)));
+		  if (!registry().contains(name)) {
+			name_ = RegistryKey<name_type>::make(name);
 			regist();
+			next = n + 1;
 			return;
 		  }
 		  ++n;
@@ -115,16 +165,27 @@ namespace namedobj {
 	// 参照オブジェクトの場合はtrue
 	bool isReferenceObject() const { return reference_; }
 
+	// 役目を終えたオブジェクトの登録を外す。以後はmoveしても登録せず、デストラクタでも警告しない
+	// 登録したスレッドで呼ぶこと。破棄は別のスレッドで行ってもよい
+	void retire() {
+	  if (retired_) return;
+	  retired_ = true;
+	  if (reference_ || moved_ || name_.empty()) return;
+	  auto found = registry().find(name_);
+	  if (found && *found == static_cast<value_type*>(this)) registry().erase(name_);
+	}
+	bool isRetired() const { return retired_; }
+
 
   private:
 	// 名前から実体を検索するDBに登録する
 	void regist() const {
+	  if (retired_) return;
 	  if (!reference_) {
 		// 実体だったら
 		if (!name_.empty()) {
 		  //std::cerr << "regist:" << name_ << ": " << this << std::endl;
-		  namedList_[name_] =
-			const_cast<value_type*>(static_cast<const value_type*>(this));
+		  registry().assign(name_, const_cast<value_type*>(static_cast<const value_type*>(this)));
 		}
 	  }
 	  else {
@@ -132,12 +193,22 @@ namespace namedobj {
 		assert(!name_.empty());
 	  }
 	}
+	static registry_type*& current() {
+	  thread_local registry_type* r = nullptr;
+	  return r;
+	}
+	// setUniqName()が次に試す番号
+	static size_t& nextUniq() {
+	  thread_local size_t n = 0;
+	  return n;
+	}
   private:
-	using NamedListType = std::map<name_type, value_type*>;
+	using NamedListType = registry_type;
 	static NamedListType namedList_;
 	mutable name_type name_;
 	bool reference_ = false; // 参照オブジェクトの場合はtrue
 	bool moved_ = false; // moveされたオブジェクト(for debug)
+	bool retired_ = false; // retire()で登録を外したオブジェクト
 	
 
   };
@@ -0,0 +1,139 @@
+// -*-tab-width:4-*-
+//
+// 終わったタスクの破棄の方法(TaskQueue::Reclaim)による、フレームの処理時間の比較
+// 毎フレーム、大きなキャプチャ(文字列のvector)と引数のタスクを持つタスクを追加し、1回実行して終わらせる。
+// 30フレームに1回は、まとめて多くのタスクを終わらせる(シーンの切り替えなど)
+//   keep        : trash_に残す(破棄しないが、メモリが増え続ける)
+//   inline      : タスクが終わった時に破棄する
+//   endofframe  : update()の終わりに、1フレームあたりの予算の範囲で破棄する
+//   background  : 別のスレッドで破棄する
+// update()の時間のp50/p99/最大と、最後に残った破棄待ちのタスクの数を表示する
+// 最初に、破棄したタスクの名前の登録が外れることと、
+// LocalRefを持つTaskGroupのタスクや、印を付けずにLocalRefをキャプチャしたタスクが
+// Backgroundでも親のスレッドで破棄されることを確かめる
+// ./t17 [フレーム数] [予算(us)]
+//
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+#include "NamedObject.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "TaskGroup.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using ts::instrument::checkResult;
+using Clock = chrono::steady_clock;
+using Reclaim = TaskQueue::Reclaim;
+
+static volatile size_t sink;
+
+// 破棄したスレッドを覚える
+struct Marker : RefCounted {
+  explicit Marker(thread::id* where) : where_(where) {}
+  ~Marker() { *where_ = this_thread::get_id(); }
+  thread::id* where_;
+};
+
+// 破棄に時間がかかるタスク
+Task heavyTask(int strings) {
+  vector<string> payload;
+  payload.reserve(strings);
+  for (int i = 0; i < strings; ++i) payload.emplace_back(40, char('a' + i % 26));
+  auto noop = [](TaskQueue&, TaskArgs&) { return TaskStatus::RemoveTask; };
+  return Task([payload](TaskQueue&, TaskArgs& args) {
+	  sink = payload.size() + args.size();
+	  return TaskStatus::RemoveTask;
+	}, TaskArgs(Task(noop), Task(noop)));
+}
+
+void check() {
+  for (Reclaim r : { Reclaim::Keep, Reclaim::Inline, Reclaim::EndOfFrame, Reclaim::Background }) {
+	TaskQueue tq;
+	tq.setReclaim(r);
+	auto noop = [](TaskQueue&, TaskArgs&) { return TaskStatus::RemoveTask; };
+	tq.addTask(Task("probe", noop, Task("probe-child", noop)));
+	TS_CHECK(bool(Task::lookup("probe")));
+	tq.update();
+	tq.update();
+	tq.drainReclaimer();
+	// Keepだけは終わったタスクを残すので、名前で引ける
+	bool kept = r == Reclaim::Keep;
+	TS_CHECK_EQ(bool(Task::lookup("probe")), kept);
+	TS_CHECK_EQ(bool(Task::lookup("probe-child")), kept);
+	TS_CHECK_EQ(tq.trashSize(), kept ? 1u : 0u);
+  }
+  // TaskGroupのタスクは状態をLocalRefで持つので、Reclaimerのスレッドに渡すとassertで止まる
+  {
+	TaskQueue tq;
+	tq.setReclaim(Reclaim::Background);
+	{
+	  TaskGroup group(tq, "group");
+	  group.addTask(Task("group-child", [](TaskQueue&, TaskArgs&) { return TaskStatus::ContinueTask; }));
+	  for (int i = 0; i < 3; ++i) tq.update();
+	  TS_CHECK(bool(Task::lookup("group-child")));
+	}
+	// グループのタスクが終わったフレームの終わりに、状態とグループのキューを親のスレッドで破棄する
+	tq.update();
+	tq.drainReclaimer();
+	TS_CHECK(!Task::lookup("group-child"));
+	TS_CHECK_EQ(tq.refs().pending(), 0u);
+	TS_CHECK_EQ(tq.trashSize(), 0u);
+  }
+  // bindToThread()を忘れても、LocalRefが残っている間はReclaimerに渡さない
+  {
+	TaskQueue tq;
+	tq.setReclaim(Reclaim::Background);
+	thread::id where;
+	{
+	  auto marker = makeLocalRef<Marker>(nullptr, &where);
+	  tq.addTask(Task("captures-ref", [marker](TaskQueue&, TaskArgs&) { return TaskStatus::RemoveTask; }));
+	}
+	TS_CHECK_EQ(localRefObjects(), 1u);
+	tq.update();
+	tq.update();
+	tq.drainReclaimer();
+	TS_CHECK(where == this_thread::get_id());
+	TS_CHECK_EQ(localRefObjects(), 0u);
+	TS_CHECK_EQ(tq.trashSize(), 0u);
+  }
+}
+
+void run(const char* label, Reclaim r, int frames, uint64_t budgetNs) {
+  TaskQueue tq;
+  tq.setReclaim(r, budgetNs);
+  vector<double> us;
+  us.reserve(frames);
+  for (int f = 0; f < frames; ++f) {
+	// タスクを作る時間は計らない
+	int n = f % 30 == 29 ? 200 : 8;
+	for (int i = 0; i < n; ++i) tq.addTask(heavyTask(200));
+	auto start = Clock::now();
+	tq.update();
+	us.push_back(chrono::duration<double, micro>(Clock::now() - start).count());
+  }
+  size_t pending = tq.trashSize();
+  tq.drainReclaimer();
+  sort(us.begin(), us.end());
+  printf("  %-11s p50 %7.1f us  p99 %7.1f us  max %7.1f us  pending %zu\n", label,
+		 us[us.size() / 2], us[us.size() * 99 / 100], us.back(), pending);
+}
+
+int main(int ac, char* av[]) {
+  int frames = ac > 1 ? atoi(av[1]) : 600;
+  uint64_t budgetNs = uint64_t(ac > 2 ? atoi(av[2]) : 200) * 1000;
+  check();
+  printf("%d frames, endofframe budget %llu us\n", frames, (unsigned long long)(budgetNs / 1000));
+  run("keep", Reclaim::Keep, frames, 0);
+  run("inline", Reclaim::Inline, frames, 0);
+  run("endofframe", Reclaim::EndOfFrame, frames, budgetNs);
+  run("background", Reclaim::Background, frames, 0);
+  return checkResult("reclaim");
+}
@@ -0,0 +1,104 @@
+// -*-tab-width:4;c++-*-
+//
+// 別のスレッドでオブジェクトを破棄する
+//
+// キャプチャの大きいラムダ式や、引数のタスクの木を持つタスクは、破棄にも時間がかかります。
+// Reclaimer<T>は、post()で渡された要素を自分のスレッドで破棄し、フレームの処理から破棄の時間を取り除きます。
+// post()は要素の入ったvectorを受け取り、前に破棄を終えたvectorの領域を返すので、定常状態ではメモリを確保しません。
+// 要素は、別のスレッドで破棄しても安全なものに限ります(名前の登録先やLocalRefなど、スレッドに属するものに触れないこと)。
+// LocalRefに触れると、assertで止まります。
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "LocalRef.hpp"
+
+namespace ts {
+namespace namedobj {
+
+  template <typename T>
+  class Reclaimer {
+  public:
+	Reclaimer() : thread_([this] { run(); }) {}
+	// 渡された要素をすべて破棄してから終わる
+	~Reclaimer() {
+	  {
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	  }
+	  wake_.notify_one();
+	  thread_.join();
+	}
+	Reclaimer(const Reclaimer&) = delete;
+	Reclaimer& operator = (const Reclaimer&) = delete;
+
+	// batchの要素を破棄するために受け取る。batchは空になって戻る
+	void post(std::vector<T>& batch) {
+	  if (batch.empty()) return;
+	  {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (incoming_.empty()) incoming_.swap(batch);
+		else {
+		  for (auto& v : batch) incoming_.emplace_back(std::move(v));
+		}
+	  }
+	  batch.clear();
+	  wake_.notify_one();
+	}
+	// 受け取った要素をすべて破棄するまで待つ
+	void drain() {
+	  std::unique_lock<std::mutex> lock(mutex_);
+	  idle_.wait(lock, [this] { return incoming_.empty() && !busy_; });
+	}
+	// 破棄した要素の数
+	uint64_t reclaimed() const { return reclaimed_.load(std::memory_order_relaxed); }
+
+  private:
+	void run() {
+	  // フレームを処理するスレッドとCPUを取り合う時は、そちらを優先させる
+	  // スレッドごとに設定できるのはLinuxだけなので、他の環境では変えない
+#ifdef __linux__
+	  setpriority(PRIO_PROCESS, id_t(syscall(SYS_gettid)), 19);
+#endif
+	  localRefsForbidden() = true;
+	  std::vector<T> working;
+	  std::unique_lock<std::mutex> lock(mutex_);
+	  for (;;) {
+		wake_.wait(lock, [this] { return stop_ || !incoming_.empty(); });
+		if (incoming_.empty()) break;
+		// 破棄を終えたworkingの領域は、次のpost()でbatchに戻る
+		working.swap(incoming_);
+		busy_ = true;
+		lock.unlock();
+		size_t n = working.size();
+		working.clear();
+		reclaimed_.fetch_add(n, std::memory_order_relaxed);
+		lock.lock();
+		busy_ = false;
+		idle_.notify_all();
+	  }
+	}
+
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable idle_;
+	std::vector<T> incoming_;
+	bool busy_ = false;
+	bool stop_ = false;
+	std::atomic<uint64_t> reclaimed_{ 0 };
+	std::thread thread_;
+  };
+
+}} // ts::namedobj
@@ -0,0 +1,319 @@
+// -*-tab-width:4;c++-*-
+//
+// 名前から値を引くレジストリ
+//
+// std::map<std::string, T>は、const char*やstring_viewで検索するたびに一時的なstd::stringを作り、
+// 長い名前ではそのたびにメモリを確保します。
+// また、値のコンストラクタの引数が2個以上の場合は、tips/emplace.cppのように
+// piecewise_constructとforward_as_tupleを使う必要があり、既にキーがあってもpairを作ってしまいます。
+// Registryは、std::mapに透過的な比較関数(is_transparent)を与え、
+// 検索はstring_view/const char*/FixedStringのまま行います。
+// tryEmplaceはキーが無い時だけキーと値をその場で構築し、キーがあれば何も作りません。
+// キーの型ごとの検索用の表現と構築方法はRegistryKeyで定義します。
+// FixedStringのキーに容量より長い文字列を渡すと、切り詰めると別のキーに一致してしまうので、
+// 検索と削除は見つからなかったものとし、tryEmplace/assignは登録せずに{nullptr, false}を返します。
+//
+// 起動後に登録がほとんど無くなったら、freeze()で登録済みの要素を整列した配列に移します。
+// 以後の検索は配列上の分岐の無い二分探索で行い、std::mapのノードを辿りません。
+// キーの型がハッシュ値を持つ場合は、配列を(ハッシュ値, キー)の順に並べ、
+// ハッシュ値だけを並べた配列を探索して、ハッシュ値が等しい範囲だけキーを比較します。
+// freeze()の後の既存のキーへの代入は配列の値を書き換え、新しいキーはstd::map(オーバーフロー)に入ります。
+// もう一度freeze()を呼ぶと、オーバーフローの要素も配列に移ります。
+// 配列の要素のerase()は削除の印を付けるだけで、配列を詰めるのは次のfreeze()か、半分以上が削除された時です。
+// 大きな木のタスクが終わって名前の登録をまとめて外しても、1回ごとに配列を動かしません。
+// 要素は配列とstd::mapのどちらかにあるため、検索の結果はイテレータではなく値へのポインタで返します。
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <utility>
+#include <boost/utility/string_view.hpp>
+#include "FixedString.hpp"
+
+namespace ts {
+namespace namedobj {
+
+  // 文字列の透過的な比較
+  struct StringLess {
+	using is_transparent = void;
+	bool operator () (boost::string_view lhs, boost::string_view rhs) const { return lhs < rhs; }
+  };
+
+  // キーの型ごとの検索用の表現(lookup)と、キーの構築(make)
+  // 汎用の定義は、キーの型に変換して検索する
+  // hash(k)は、freeze()した配列の整列と検索に使うハッシュ値
+  template <typename Key>
+  struct RegistryKey {
+	using Compare = std::less<Key>;
+	static constexpr bool hasHash = false;
+	template <typename K>
+	static uint32_t hash(const K&) { return 0; }
+	// kをキーとして切り詰めずに表せるか
+	template <typename K>
+	static bool fits(const K&) { return true; }
+	static const Key& lookup(const Key& k) { return k; }
+	template <typename K>
+	static Key lookup(const K& k) { return Key(k); }
+	template <typename K>
+	static Key make(K&& k) { return Key(std::forward<K>(k)); }
+  };
+
+  // std::stringのキーはstring_viewのまま比較する
+  template <>
+  struct RegistryKey<std::string> {
+	using Compare = StringLess;
+	static constexpr bool hasHash = true;
+	static uint32_t hash(boost::string_view k) { return hashString(k.data(), k.size()); }
+	static bool fits(boost::string_view) { return true; }
+	static boost::string_view lookup(boost::string_view k) { return k; }
+	static std::string make(std::string&& k) { return std::move(k); }
+	static std::string make(boost::string_view k) { return std::string(k.data(), k.size()); }
+	static std::string make(const char* k) { return std::string(k); } // const char*は上の2つのどちらにも変換できて曖昧になるので、別に受ける
+  };
+
+  // FixedStringのキーは、検索する文字列をスタック上のFixedStringにして比較する(メモリの確保はない)
+  template <size_t N>
+  struct RegistryKey<FixedString<N>> {
+	using Compare = std::less<FixedString<N>>;
+	// FixedStringは構築時に計算したハッシュ値を使う
+	static constexpr bool hasHash = true;
+	static uint32_t hash(const FixedString<N>& k) { return k.hash(); }
+	static bool fits(const FixedString<N>&) { return true; }
+	template <size_t M>
+	static bool fits(const char (&)[M]) { return true; } // 長い文字列リテラルはlookupで静的に弾く
+	static bool fits(boost::string_view k) { return k.size() <= N; }
+	static const FixedString<N>& lookup(const FixedString<N>& k) { return k; }
+	template <size_t M>
+	static FixedString<N> lookup(const char (&k)[M]) { return FixedString<N>(k); }
+	static FixedString<N> lookup(boost::string_view k) { return FixedString<N>(k.data(), k.size()); }
+	template <typename K>
+	static FixedString<N> make(K&& k) { return lookup(k); }
+  };
+
+  template <typename Key, typename Value>
+  class Registry {
+	using Traits = RegistryKey<Key>;
+	using Compare = typename Traits::Compare;
+	using Map = std::map<Key, Value, Compare>;
+	using Flat = std::vector<std::pair<Key, Value>>;
+  public:
+	using key_type = Key;
+	using mapped_type = Value;
+
+	// 検索。見つからなければnullptr。キーの一時オブジェクトは作らない
+	template <typename K>
+	Value* find(const K& k) {
+	  if (!Traits::fits(k)) return nullptr;
+	  auto&& key = Traits::lookup(k);
+	  if (auto p = findFlat(key)) return p;
+	  auto it = map_.find(key);
+	  return it != map_.end() ? &it->second : nullptr;
+	}
+	template <typename K>
+	const Value* find(const K& k) const { return const_cast<Registry*>(this)->find(k); }
+	template <typename K>
+	bool contains(const K& k) const { return find(k) != nullptr; }
+
+	// キーが無ければ、argsで値をその場で構築する。キーがあれば何もしない
+	template <typename K, typename... Args>
+	std::pair<Value*, bool> tryEmplace(K&& k, Args&&... args) {
+	  if (!Traits::fits(k)) return std::make_pair(static_cast<Value*>(nullptr), false);
+	  typename Map::iterator hint;
+	  if (auto p = locate(Traits::lookup(k), hint)) return std::make_pair(p, false);
+	  auto it = map_.emplace_hint(hint, std::piecewise_construct,
+								  std::forward_as_tuple(Traits::make(std::forward<K>(k))),
+								  std::forward_as_tuple(std::forward<Args>(args)...));
+	  return std::make_pair(&it->second, true);
+	}
+	// キーが無ければ追加し、あれば値を置き換える
+	// 先に探してから、どちらか一方にだけvを渡す
+	template <typename K, typename V>
+	std::pair<Value*, bool> assign(K&& k, V&& v) {
+	  if (!Traits::fits(k)) return std::make_pair(static_cast<Value*>(nullptr), false);
+	  typename Map::iterator hint;
+	  if (auto p = locate(Traits::lookup(k), hint)) {
+		*p = std::forward<V>(v);
+		return std::make_pair(p, false);
+	  }
+	  auto it = map_.emplace_hint(hint, std::piecewise_construct,
+								  std::forward_as_tuple(Traits::make(std::forward<K>(k))),
+								  std::forward_as_tuple(std::forward<V>(v)));
+	  return std::make_pair(&it->second, true);
+	}
+
+	template <typename K>
+	size_t erase(const K& k) {
+	  if (!Traits::fits(k)) return 0;
+	  auto&& key = Traits::lookup(k);
+	  size_t i = lowerBound(key);
+	  if (flatEqual(i, key) && !dead_[i]) {
+		dead_[i] = 1;
+		++deadCount_;
+		if (deadCount_ * 2 > flat_.size()) compactFlat();
+		return 1;
+	  }
+	  auto it = map_.find(key);
+	  if (it == map_.end()) return 0;
+	  map_.erase(it);
+	  return 1;
+	}
+	void clear() {
+	  hash_.clear();
+	  flat_.clear();
+	  dead_.clear();
+	  deadCount_ = 0;
+	  map_.clear();
+	}
+
+	// 登録済みの要素を整列した配列に移す
+	void freeze() {
+	  compactFlat();
+	  flat_.reserve(flat_.size() + map_.size());
+	  for (auto& e : map_) flat_.emplace_back(e.first, std::move(e.second));
+	  map_.clear();
+	  sortFlat();
+	}
+	// まとめて登録し、freeze()と同じく整列した配列にする。既にあるキーは値を置き換える
+	void bulkLoad(std::vector<std::pair<Key, Value>>&& entries) {
+	  compactFlat();
+	  flat_.reserve(flat_.size() + map_.size() + entries.size());
+	  for (auto& e : map_) flat_.emplace_back(e.first, std::move(e.second));
+	  map_.clear();
+	  for (auto& e : entries) flat_.emplace_back(std::move(e));
+	  entries.clear();
+	  sortFlat();
+	}
+	// 配列に入っている要素数と、freeze()の後に追加された要素数
+	size_t frozenSize() const { return flat_.size() - deadCount_; }
+	size_t overflowSize() const { return map_.size(); }
+
+	size_t size() const { return frozenSize() + map_.size(); }
+	bool empty() const { return size() == 0; }
+
+	// すべての要素に対してf(key, value)を呼ぶ(順序は不定)
+	template <typename F>
+	void forEach(F f) {
+	  for (size_t i = 0; i < flat_.size(); ++i) {
+		if (!dead_[i]) f(static_cast<const Key&>(flat_[i].first), flat_[i].second);
+	  }
+	  for (auto& e : map_) f(e.first, e.second);
+	}
+
+  private:
+	// 配列の並び順。ハッシュ値があればハッシュ値を先に比較する
+	bool flatLess(const std::pair<Key, Value>& a, const std::pair<Key, Value>& b) const {
+	  if (Traits::hasHash) {
+		uint32_t ha = Traits::hash(a.first), hb = Traits::hash(b.first);
+		if (ha != hb) return ha < hb;
+	  }
+	  return comp_(a.first, b.first);
+	}
+	// 配列を整列する。同じキーが複数あれば後から追加したものを残す
+	void sortFlat() {
+	  std::stable_sort(flat_.begin(), flat_.end(), [this](const std::pair<Key, Value>& a, const std::pair<Key, Value>& b) {
+		  return flatLess(a, b);
+		});
+	  size_t n = 0;
+	  for (size_t i = 0; i < flat_.size(); ++i) {
+		if (i + 1 < flat_.size() && !flatLess(flat_[i], flat_[i + 1])) continue;
+		if (n != i) flat_[n] = std::move(flat_[i]);
+		++n;
+	  }
+	  flat_.erase(flat_.begin() + n, flat_.end());
+	  dead_.assign(flat_.size(), 0);
+	  hash_.clear();
+	  if (Traits::hasHash) {
+		hash_.reserve(flat_.size());
+		for (auto& e : flat_) hash_.push_back(Traits::hash(e.first));
+	  }
+	}
+
+	// 分岐の無い二分探索。keyより小さくない最初の要素の位置
+	template <typename L>
+	size_t lowerBound(const L& key) const {
+	  if (hash_.empty()) return lowerBound(key, 0, flat_.size());
+	  // ハッシュ値の配列で範囲を絞り、ハッシュ値が等しい範囲だけキーで探す
+	  uint32_t h = Traits::hash(key);
+	  size_t first = hashBound(h);
+	  size_t last = first;
+	  // ハッシュ値が等しい要素はほとんどの場合1個なので、少ない時は二分探索をしない
+	  while (last < hash_.size() && hash_[last] == h && last - first < 4) ++last;
+	  if (last - first == 4) {
+		last = h == UINT32_MAX ? hash_.size() : hashBound(h + 1);
+	  }
+	  return lowerBound(key, first, last - first);
+	}
+	size_t hashBound(uint32_t h) const {
+	  size_t n = hash_.size();
+	  if (n == 0) return 0;
+	  const uint32_t* base = hash_.data();
+	  while (n > 1) {
+		size_t half = n / 2;
+		base = base[half - 1] < h ? base + half : base;
+		n -= half;
+	  }
+	  return size_t(base - hash_.data()) + (*base < h);
+	}
+	template <typename L>
+	size_t lowerBound(const L& key, size_t first, size_t n) const {
+	  if (n == 0) return first;
+	  const std::pair<Key, Value>* base = flat_.data() + first;
+	  while (n > 1) {
+		size_t half = n / 2;
+		base = comp_(base[half - 1].first, key) ? base + half : base;
+		n -= half;
+	  }
+	  return size_t(base - flat_.data()) + comp_(base->first, key);
+	}
+	template <typename L>
+	Value* findFlat(const L& key) {
+	  if (flat_.empty()) return nullptr;
+	  size_t i = lowerBound(key);
+	  return flatEqual(i, key) && !dead_[i] ? &flat_[i].second : nullptr;
+	}
+	// 値へのポインタを返す。無ければnullptrを返し、hintにstd::mapへ追加する位置を入れる
+	template <typename L>
+	Value* locate(const L& key, typename Map::iterator& hint) {
+	  if (auto p = findFlat(key)) return p;
+	  hint = map_.lower_bound(key);
+	  if (hint != map_.end() && !map_.key_comp()(key, hint->first)) return &hint->second;
+	  return nullptr;
+	}
+	// 削除の印を付けた要素を取り除く。並び順は変わらない
+	void compactFlat() {
+	  if (!deadCount_) return;
+	  size_t n = 0;
+	  for (size_t i = 0; i < flat_.size(); ++i) {
+		if (dead_[i]) continue;
+		if (n != i) {
+		  flat_[n] = std::move(flat_[i]);
+		  if (!hash_.empty()) hash_[n] = hash_[i];
+		}
+		++n;
+	  }
+	  flat_.erase(flat_.begin() + n, flat_.end());
+	  if (!hash_.empty()) hash_.resize(n);
+	  dead_.assign(n, 0);
+	  deadCount_ = 0;
+	}
+	// 配列はハッシュ値の順なので、両方向に比較して一致を確かめる
+	template <typename L>
+	bool flatEqual(size_t i, const L& key) const {
+	  return i < flat_.size() && !comp_(key, flat_[i].first) && !comp_(flat_[i].first, key);
+	}
+
+	Compare comp_;
+	std::vector<uint32_t> hash_;
+	Flat flat_;
+	std::vector<uint8_t> dead_; // flat_の要素ごとの削除の印
+	size_t deadCount_ = 0;
+	Map map_;
+  };
+
+}} // ts::namedobj
@@ -0,0 +1,218 @@
+// -*-tab-width:4-*-
+//
+// Registryと std::map<std::string, T> の挿入・検索時のメモリ確保回数と時間の比較
+// 検索は std::unordered_map と、freeze()した Registry とも比べる
+// 最初に、FixedStringのキーで容量を超える名前を渡しても別のキーに一致しないことと、
+// std::stringのキーにconst char*で登録できることを確かめる
+// ./t3 [名前の数]
+//
+#define TS_INSTRUMENT_NEW
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <random>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Registry.hpp"
+#include "../instrument/AllocCounter.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace ts::namedobj;
+using ts::instrument::AllocScope;
+using ts::instrument::checkResult;
+using Clock = std::chrono::steady_clock;
+
+struct Point {
+  int x_;
+  int y_;
+  Point(int x, int y) : x_(x), y_(y) {}
+};
+
+// fを名前ごとにrepeat回ずつ呼び、1回あたりの確保回数と時間を表示する
+template <typename F>
+void measure(const char* label, const std::vector<const char*>& names, F f, size_t repeat = 1) {
+  AllocScope allocs;
+  auto start = Clock::now();
+  long sum = 0;
+  for (size_t r = 0; r < repeat; ++r) {
+	for (auto name : names) sum += f(name);
+  }
+  double ops = double(names.size()) * repeat;
+  double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / ops;
+  printf("  %-44s %5.2f allocs/op %7.1f ns/op (%ld)\n", label, double(allocs.news()) / ops, ns, sum);
+}
+
+void check() {
+  // 先頭の8文字が同じで、長い方は容量を超える
+  Registry<FixedString<8>, int> reg;
+  TS_CHECK(reg.tryEmplace(boost::string_view("abcdefgh"), 1).second);
+  std::string longName = "abcdefgh_long";
+  for (int frozen = 0; frozen < 2; ++frozen) {
+	TS_CHECK(!reg.find(boost::string_view(longName)));
+	TS_CHECK(!reg.contains(longName));
+	TS_CHECK(!reg.tryEmplace(longName, 2).first);
+	TS_CHECK(!reg.assign(boost::string_view(longName), 3).first);
+	TS_CHECK_EQ(reg.erase(longName), 0u);
+	TS_CHECK_EQ(reg.size(), 1u);
+	TS_CHECK_EQ(*reg.find("abcdefgh"), 1);
+	reg.freeze();
+  }
+  // const char*と文字列リテラルのキー
+  Registry<std::string, int> strReg;
+  const char* name = "enemy";
+  TS_CHECK(strReg.tryEmplace(name, 1).second);
+  TS_CHECK(!strReg.assign(name, 2).second);
+  TS_CHECK(strReg.tryEmplace("boss", 3).second);
+  TS_CHECK(!strReg.assign("boss", 4).second);
+  TS_CHECK_EQ(*strReg.find(name), 2);
+  TS_CHECK_EQ(*strReg.find("boss"), 4);
+
+  // freeze()した配列からの削除は印を付けるだけで、半分を超えるか次のfreeze()で詰める
+  Registry<std::string, int> frozen;
+  char key[16];
+  for (int i = 0; i < 100; ++i) {
+	snprintf(key, sizeof(key), "k%d", i);
+	frozen.assign(boost::string_view(key), i);
+  }
+  frozen.freeze();
+  for (int i = 0; i < 40; ++i) {
+	snprintf(key, sizeof(key), "k%d", i);
+	TS_CHECK_EQ(frozen.erase(boost::string_view(key)), 1u);
+	TS_CHECK_EQ(frozen.erase(boost::string_view(key)), 0u);
+  }
+  TS_CHECK_EQ(frozen.size(), 60u);
+  TS_CHECK(!frozen.find("k0"));
+  TS_CHECK_EQ(*frozen.find("k40"), 40);
+  // 削除したキーをもう一度登録すると、オーバーフローに入る
+  TS_CHECK(frozen.tryEmplace("k0", 100).second);
+  TS_CHECK_EQ(*frozen.find("k0"), 100);
+  TS_CHECK_EQ(frozen.overflowSize(), 1u);
+  int visited = 0;
+  frozen.forEach([&visited](const std::string&, int) { ++visited; });
+  TS_CHECK_EQ(visited, 61);
+  frozen.freeze();
+  TS_CHECK_EQ(frozen.frozenSize(), 61u);
+  TS_CHECK_EQ(*frozen.find("k0"), 100);
+  // 半分を超えて削除すると詰める
+  for (int i = 0; i < 100; ++i) {
+	snprintf(key, sizeof(key), "k%d", i);
+	frozen.erase(boost::string_view(key));
+  }
+  TS_CHECK(frozen.empty());
+
+  // assignはvを一度だけ渡す。追加でも置き換えでも、ムーブした値が入る
+  Registry<std::string, std::unique_ptr<int>> owners;
+  TS_CHECK(owners.assign("a", std::unique_ptr<int>(new int(1))).second);
+  TS_CHECK(!owners.assign("a", std::unique_ptr<int>(new int(2))).second);
+  TS_CHECK(*owners.find("a") && **owners.find("a") == 2);
+  owners.freeze();
+  TS_CHECK(!owners.assign("a", std::unique_ptr<int>(new int(3))).second);
+  TS_CHECK_EQ(**owners.find("a"), 3);
+}
+
+void run(size_t count) {
+
+  // SSOに収まらない長さの名前
+  std::vector<std::string> storage;
+  storage.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "enemy_spawner_%08u", unsigned(i));
+	storage.emplace_back(buf);
+  }
+  std::vector<const char*> names;
+  for (auto& s : storage) names.push_back(s.c_str());
+  // 名前順に並んでいると木の同じ経路を辿るのでばらばらにする
+  std::shuffle(names.begin(), names.end(), std::mt19937(1));
+
+  std::map<std::string, Point> stdMap;
+  std::map<std::string, int> stdMap2;
+  Registry<std::string, Point> strReg;
+  Registry<FixedString<31>, Point> fixedReg;
+
+  printf("insert (%zu names)\n", count);
+  measure("map::emplace(piecewise_construct)", names, [&](const char* n) {
+	  return long(stdMap.emplace(std::piecewise_construct, std::forward_as_tuple(n), std::forward_as_tuple(1, 2)).second);
+	});
+  measure("map<string, int>::operator[]", names, [&](const char* n) {
+	  return long(stdMap2[n] = 1);
+	});
+  measure("Registry<string>::tryEmplace", names, [&](const char* n) {
+	  return long(strReg.tryEmplace(boost::string_view(n), 1, 2).second);
+	});
+  measure("Registry<FixedString<31>>::tryEmplace", names, [&](const char* n) {
+	  return long(fixedReg.tryEmplace(boost::string_view(n), 1, 2).second);
+	});
+
+  printf("insert existing key\n");
+  measure("map::emplace(piecewise_construct)", names, [&](const char* n) {
+	  return long(stdMap.emplace(std::piecewise_construct, std::forward_as_tuple(n), std::forward_as_tuple(1, 2)).second);
+	});
+  measure("Registry<string>::tryEmplace", names, [&](const char* n) {
+	  return long(strReg.tryEmplace(boost::string_view(n), 1, 2).second);
+	});
+  measure("Registry<FixedString<31>>::tryEmplace", names, [&](const char* n) {
+	  return long(fixedReg.tryEmplace(boost::string_view(n), 1, 2).second);
+	});
+
+  std::unordered_map<std::string, Point> hashMap;
+  std::unordered_map<FixedString<31>, Point> fixedHashMap;
+  for (auto n : names) {
+	hashMap.emplace(std::piecewise_construct, std::forward_as_tuple(n), std::forward_as_tuple(1, 2));
+	fixedHashMap.emplace(std::piecewise_construct, std::forward_as_tuple(n, strlen(n)), std::forward_as_tuple(1, 2));
+  }
+
+  // 検索は100万回以上になるまで繰り返す
+  size_t repeat = count < 1000000 ? 1000000 / count : 1;
+  printf("lookup by const char*\n");
+  measure("map::find", names, [&](const char* n) {
+	  return long(stdMap.find(n)->second.y_);
+	}, repeat);
+  measure("unordered_map<string>::find", names, [&](const char* n) {
+	  return long(hashMap.find(n)->second.y_);
+	}, repeat);
+  measure("unordered_map<FixedString<31>>::find", names, [&](const char* n) {
+	  return long(fixedHashMap.find(FixedString<31>(n, strlen(n)))->second.y_);
+	}, repeat);
+  measure("Registry<string>::find", names, [&](const char* n) {
+	  return long(strReg.find(boost::string_view(n))->y_);
+	}, repeat);
+  measure("Registry<FixedString<31>>::find", names, [&](const char* n) {
+	  return long(fixedReg.find(boost::string_view(n))->y_);
+	}, repeat);
+  strReg.freeze();
+  fixedReg.freeze();
+  measure("Registry<string>::find (frozen)", names, [&](const char* n) {
+	  return long(strReg.find(boost::string_view(n))->y_);
+	}, repeat);
+  measure("Registry<FixedString<31>>::find (frozen)", names, [&](const char* n) {
+	  return long(fixedReg.find(boost::string_view(n))->y_);
+	}, repeat);
+
+  // 終わったタスクの登録をまとめて外す時
+  printf("erase all (frozen)\n");
+  measure("Registry<string>::erase", names, [&](const char* n) {
+	  return long(strReg.erase(boost::string_view(n)));
+	});
+  measure("Registry<FixedString<31>>::erase", names, [&](const char* n) {
+	  return long(fixedReg.erase(boost::string_view(n)));
+	});
+}
+
+int main(int ac, char* av[]) {
+  check();
+  if (ac > 1) {
+	run(strtoul(av[1], nullptr, 10));
+  }
+  else {
+	// 実際のタスク数程度と、キャッシュに収まらない数
+	run(1000);
+	run(100000);
+  }
+  return checkResult("registry");
+}
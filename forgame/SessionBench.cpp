@@ -0,0 +1,227 @@
+// -*-tab-width:4-*-
+//
+// SessionRuntimeで多数のセッションを動かした時のtick()の時間と、負荷の偏り
+// セッションごとにtitleLogo -> main の木を動かす。mainは毎フレーム約0.5usの処理をするが、
+// 10個に1個のセッションは約10usの重い処理をする。重いセッションは50フレームごとに入れ替わる
+// セッションは順に割り振るので、重いセッションは一部のワーカーに偏る
+//   balance : tick()の間にセッションを移して負荷を均す
+//   static  : 最初に割り振ったワーカーで動かし続ける
+// tick()の時間のp50/p99、ワーカーのコストの合計の最大/平均(偏り。1が均等)の平均、移したセッションの数、
+// 1秒あたりに進めたセッションのフレーム数を表示する
+// 最初に、名前の登録先がセッションごとに分かれること、移しても止まらずに動くこと、post()、終わったセッションを閉じること、
+// ファイバーが途中のセッションは移さないことを確かめる
+// ./t20 [セッション数] [tick数] [最大ワーカー数]
+//
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "NamedObject.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "SessionRuntime.hpp"
+#include "FiberTask.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using ts::instrument::checkResult;
+using Clock = chrono::steady_clock;
+
+static volatile uint64_t sink;
+
+// 約iterations/300 usの処理
+void burn(int iterations) {
+  uint64_t x = sink;
+  for (int i = 0; i < iterations; ++i) x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+  sink = x;
+}
+
+// セッションごとの記録。セッションのタスクだけが書く
+struct Record {
+  bool ownTitle = false; // 最初のタスクを登録した時に、自分のtitleLogoが見えた
+  bool ownEnding = false;
+  int frames = 0;        // mainを実行した回数
+  int endings = 0;
+  bool posted = false;
+};
+
+// 重いセッションが入れ替わる周期の番号
+static atomic<int> phase{ 0 };
+
+// titleLogoを数フレーム表示してmainに進む。mainはmainFramesフレーム動いたらendingに進み、endingで終わる
+// mainFramesが負なら終わらない
+Task sessionTree(int session, Record* rec, int mainFrames) {
+  auto ending = [rec](TaskQueue& tq, TaskArgs&) {
+	// 同じ名前のタスクが他のセッションにもあるが、自分の登録先から引ける
+	rec->ownEnding = bool(Task::lookup("ending"));
+	++rec->endings;
+	tq.finish();
+	return TaskStatus::RemoveTask;
+  };
+  auto mainLoop = [session, rec, mainFrames](TaskQueue& tq, TaskArgs& ar) {
+	++rec->frames;
+	burn((session + phase.load(memory_order_relaxed)) % 10 == 0 ? 3000 : 150);
+	if (mainFrames >= 0 && rec->frames >= mainFrames) {
+	  tq.addTask(ar.at(0).clone());
+	  return TaskStatus::RemoveTask;
+	}
+	return TaskStatus::ContinueTask;
+  };
+  bool shown = false;
+  auto titleLogo = [shown](TaskQueue& tq, TaskArgs& ar) mutable {
+	if (!shown) {
+	  shown = true;
+	  tq.sleepFrames(2);
+	  return TaskStatus::ContinueTask;
+	}
+	// 名前で参照するので、セッションごとに登録先が分かれていないと他のセッションのmainを動かしてしまう
+	tq.addTask(ar.at(0).clone());
+	return TaskStatus::RemoveTask;
+  };
+  return Task("titleLogo", titleLogo, Task("main", mainLoop, Task("ending", ending)));
+}
+
+SessionRuntime::Start starter(int session, Record* rec, int mainFrames) {
+  return [session, rec, mainFrames](TaskQueue& tq) {
+	tq.run(sessionTree(session, rec, mainFrames));
+	rec->ownTitle = bool(Task::lookup("titleLogo"));
+  };
+}
+
+void check() {
+  // 同じ名前のタスクの木を動かし、終わったら閉じる
+  {
+	SessionRuntime runtime(vector<WorkerConfig>(2));
+	vector<Record> recs(50);
+	for (int i = 0; i < 50; ++i) runtime.open(starter(i, &recs[i], 5 + i % 3));
+	for (int t = 0; t < 20; ++t) runtime.tick();
+	TS_CHECK_EQ(runtime.size(), 0u);
+	TS_CHECK_EQ(runtime.stats().closed, 50u);
+	int ok = 0;
+	for (int i = 0; i < 50; ++i) {
+	  auto& r = recs[i];
+	  ok += r.ownTitle && r.ownEnding && r.endings == 1 && r.frames == 5 + i % 3;
+	}
+	TS_CHECK_EQ(ok, 50);
+	// tick()を呼んだスレッドの登録先には残らない
+	TS_CHECK(!Task::lookup("titleLogo"));
+  }
+  // すべて1つのワーカーに置いても、均されて、移したセッションもフレームを落とさずに動く
+  {
+	SessionRuntime runtime(vector<WorkerConfig>(4));
+	vector<Record> recs(40);
+	vector<uint64_t> ids;
+	for (int i = 0; i < 40; ++i) ids.push_back(runtime.open(starter(i, &recs[i], -1), 0));
+	const int ticks = 60;
+	for (int t = 0; t < ticks; ++t) runtime.tick();
+	TS_CHECK(runtime.stats().migrations > 0);
+	size_t used = 0;
+	for (size_t w = 0; w < runtime.workers(); ++w) used += runtime.workerStats(w).sessions > 0;
+	TS_CHECK_EQ(used, runtime.workers());
+	// titleLogoで3フレーム、mainに進むのに1フレームかかる
+	int ok = 0;
+	for (auto& r : recs) ok += r.frames == ticks - 4;
+	TS_CHECK_EQ(ok, 40);
+	// 他のスレッドからpost()する
+	uint64_t target = ids[7];
+	int worker = runtime.workerOf(target);
+	TS_CHECK(worker >= 0);
+	thread poster([&] {
+		runtime.post(target, [&recs] {
+			return Task([&recs](TaskQueue&, TaskArgs&) {
+				recs[7].posted = true;
+				return TaskStatus::RemoveTask;
+			  });
+		  });
+	  });
+	poster.join();
+	runtime.tick();
+	runtime.tick();
+	TS_CHECK(recs[7].posted);
+	TS_CHECK(!runtime.post(12345, [] { return Task([](TaskQueue&, TaskArgs&) { return TaskStatus::RemoveTask; }); }));
+  }
+  // ファイバーが途中のセッションは、ずっと同じスレッドで動く
+  {
+	SessionRuntime runtime(vector<WorkerConfig>(4));
+	const int count = 16, ticks = 40;
+	vector<int> moved(count, 0), frames(count, 0);
+	for (int i = 0; i < count; ++i) {
+	  int* m = &moved[i];
+	  int* f = &frames[i];
+	  runtime.open([m, f](TaskQueue& tq) {
+		  tq.run(Task(fiberTask([m, f](TaskQueue&, TaskArgs&) {
+				  auto self = this_thread::get_id();
+				  for (;;) {
+					burn(1500);
+					++*f;
+					if (this_thread::get_id() != self) ++*m;
+					Fiber::yield();
+				  }
+				  return TaskStatus::RemoveTask;
+				})));
+		}, 0);
+	}
+	for (int t = 0; t < ticks; ++t) runtime.tick();
+	// ファイバーを作る前の最初のフレームの後では移すことがある
+	TS_CHECK(runtime.stats().migrations < uint64_t(count));
+	TS_CHECK_EQ(count_if(moved.begin(), moved.end(), [](int m) { return m != 0; }), 0);
+	TS_CHECK_EQ(count_if(frames.begin(), frames.end(), [ticks](int f) { return f != ticks - 1; }), 0);
+  }
+}
+
+void run(const char* label, size_t workers, int sessions, int ticks, bool balance) {
+  SessionRuntime::Balance b;
+  b.enabled = balance;
+  vector<Record> recs(sessions);
+  double imbalance = 0;
+  uint64_t migrations = 0;
+  vector<double> ms;
+  ms.reserve(ticks);
+  Clock::duration total{};
+  {
+	SessionRuntime runtime(vector<WorkerConfig>(workers), b);
+	for (int i = 0; i < sessions; ++i) runtime.open(starter(i, &recs[i], -1));
+	for (int t = 0; t < ticks; ++t) {
+	  phase = t / 50;
+	  auto start = Clock::now();
+	  runtime.tick();
+	  auto d = Clock::now() - start;
+	  total += d;
+	  ms.push_back(chrono::duration<double, milli>(d).count());
+	  uint64_t sum = 0, top = 0;
+	  for (size_t w = 0; w < workers; ++w) {
+		uint64_t c = runtime.workerStats(w).costNs;
+		sum += c;
+		top = max(top, c);
+	  }
+	  if (sum) imbalance += double(top) * double(workers) / double(sum);
+	}
+	migrations = runtime.stats().migrations;
+  }
+  sort(ms.begin(), ms.end());
+  double seconds = chrono::duration<double>(total).count();
+  printf("  %-8s %zu workers %6d sessions  tick p50 %7.2f ms  p99 %7.2f ms  imbalance %5.2f  "
+		 "migrations %7llu  %6.2f M frames/s\n",
+		 label, workers, sessions, ms[ms.size() / 2], ms[ms.size() * 99 / 100], imbalance / ticks,
+		 (unsigned long long)migrations, double(sessions) * ticks / seconds / 1e6);
+}
+
+int main(int ac, char* av[]) {
+  int sessions = ac > 1 ? atoi(av[1]) : 10000;
+  int ticks = ac > 2 ? atoi(av[2]) : 200;
+  size_t maxWorkers = ac > 3 ? size_t(atoi(av[3])) : 4;
+  check();
+  printf("%d ticks, %u cpus\n", ticks, thread::hardware_concurrency());
+  for (size_t w = 1; w <= maxWorkers; w *= 2) {
+	if (w > 1) run("static", w, sessions, ticks, false);
+	run("balance", w, sessions, ticks, true);
+  }
+  run("balance", maxWorkers, sessions / 10, ticks, true);
+  return checkResult("session");
+}
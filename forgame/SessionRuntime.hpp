@@ -0,0 +1,334 @@
+// -*-tab-width:4;c++-*-
+//
+// 多数のセッションのTaskQueueを、スレッドのプールで動かす
+//
+// サーバーでは、クライアントのセッションごとに、TaskTest.cppのtitleLogo/main/endingのようなタスクの木を1つ動かします。
+// SessionRuntimeは、セッションごとにTaskQueueと名前の登録先(Registry)を持ち、ワーカーのスレッドに割り当てて動かします。
+//   - tick()で、すべてのセッションのupdate()を1回ずつ呼びます。ワーカーは割り当てられたセッションを並行して進め、
+//     tick()はすべてのワーカーが終わるまで待ちます
+//   - update()の時間をセッションごとに測り、その指数移動平均をセッションのコストとします
+//   - tick()の終わり(フレームの間)に、ワーカーのコストの合計の差が大きければ、重いワーカーから軽いワーカーへセッションを移します
+//     移すのはセッションへのポインタだけで、タスクやキューのメモリはそのまま使います
+//   - セッションを動かす間は、名前の登録先をそのセッションのものに切り替えます(RegistryScope)
+//     どのスレッドで動いても同じ登録先を使い、セッションどうしで同じ名前のタスクを使えます
+//   - finish()したセッションは、tick()の終わりに閉じて破棄します
+//
+// WorkerPoolはワーカーごとに1つのTaskQueueを持ち、タスクはワーカーの間を移りません。
+// SessionRuntimeのタスクは、フレームの間に別のスレッドに移ることがあります。
+// セッションの中でLocalRefを使うのはかまいませんが、thread_localの変数や、WorkerPool::arena()のような
+// スレッドに属するものをタスクに持たせてはいけません。
+// ファイバー(fiberTask)のスタックはスレッドごとのFiberStackPoolのもので、Fiber::current()もthread_localなので、
+// 作って終わっていないファイバーがあるセッションは移しません。すべて終わると、また移せるようになります。
+// (終わったセッションは、tick()を呼んだスレッドで破棄するので、途中のファイバーはそのスレッドで巻き戻します)
+//
+//   SessionRuntime runtime(WorkerPool::pinned(CpuTopology::detect(), 4));
+//   auto id = runtime.open([](TaskQueue& tq) { tq.run(Task("titleLogo", titleLogo, { ... })); });
+//   runtime.post(id, [] { return Task(onPacket); });  // 他のスレッドから
+//   for (;;) runtime.tick();
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Fiber.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "WorkerPool.hpp"
+
+namespace ts {
+namespace namedobj {
+
+  class SessionRuntime {
+  public:
+	using Factory = std::function<Task()>;
+	// セッションの最初のフレームの前に、ワーカーのスレッドで呼ばれる。最初のタスクを登録する
+	using Start = std::function<void(TaskQueue&)>;
+
+	// 負荷の均し方
+	struct Balance {
+	  bool enabled = true;
+	  double threshold = 0.1; // ワーカーのコストの最大と最小の差が、平均のこの割合を超えたら移す
+	  size_t maxMoves = 16;   // 1回のtick()で移すセッションの上限
+	};
+	struct WorkerStats {
+	  size_t sessions = 0; // 割り当てられたセッションの数
+	  uint64_t costNs = 0; // セッションのコストの合計
+	  uint64_t busyNs = 0; // 直前のtick()で、セッションを進めていた時間
+	  bool pinned = false; // CPUの固定に成功した
+	};
+	struct Stats {
+	  uint64_t ticks = 0;
+	  uint64_t opened = 0;
+	  uint64_t closed = 0;     // finish()して閉じたセッションの数
+	  uint64_t migrations = 0; // 別のワーカーに移したセッションの数
+	};
+
+	explicit SessionRuntime(std::vector<WorkerConfig> config) : SessionRuntime(std::move(config), Balance()) {}
+	SessionRuntime(std::vector<WorkerConfig> config, const Balance& balance) : balance_(balance) {
+	  if (config.empty()) config.resize(1);
+	  for (auto& c : config) workers_.emplace_back(new Worker(c));
+	  for (size_t i = 0; i < workers_.size(); ++i) {
+		workers_[i]->thread = std::thread([this, i] { run(i); });
+	  }
+	}
+	// 残っているセッションは、実行せずに破棄する
+	~SessionRuntime() {
+	  {
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	  }
+	  start_.notify_all();
+	  for (auto& w : workers_) w->thread.join();
+	  for (auto& w : workers_) {
+		for (Session* s : w->sessions) destroy(s);
+		for (Session* s : w->finished) destroy(s);
+	  }
+	  for (Session* s : opening_) destroy(s);
+	}
+	SessionRuntime(const SessionRuntime&) = delete;
+	SessionRuntime& operator = (const SessionRuntime&) = delete;
+
+	// セッションを作り、番号を返す。workerが負なら順に割り振る。どのスレッドからでも呼べる
+	// 次のtick()から動く
+	uint64_t open(Start start, int worker = -1) {
+	  std::unique_ptr<Session> s(new Session(std::move(start)));
+	  std::lock_guard<std::mutex> lock(indexMutex_);
+	  s->id = ++lastId_;
+	  s->worker = worker >= 0 ? size_t(worker) % workers_.size() : next_++ % workers_.size();
+	  index_.emplace(s->id, s.get());
+	  opening_.push_back(s.release());
+	  return opening_.back()->id;
+	}
+	// セッションにタスクを追加する(TaskQueue::post)。閉じたセッションならfalseを返す。どのスレッドからでも呼べる
+	// 登録先を探すロックを持ったまま呼ぶので、セッションのキューをOverflow::Blockにしてはいけない
+	bool post(uint64_t session, Factory make, TaskQueue::Priority priority = TaskQueue::Priority::Normal) {
+	  std::lock_guard<std::mutex> lock(indexMutex_);
+	  auto it = index_.find(session);
+	  return it != index_.end() && it->second->queue->post(std::move(make), priority);
+	}
+	// セッションを動かしているワーカー。閉じたセッションなら-1
+	int workerOf(uint64_t session) const {
+	  std::lock_guard<std::mutex> lock(indexMutex_);
+	  auto it = index_.find(session);
+	  return it == index_.end() ? -1 : int(it->second->worker);
+	}
+	// 閉じていないセッションの数
+	size_t size() const {
+	  std::lock_guard<std::mutex> lock(indexMutex_);
+	  return index_.size();
+	}
+
+	// すべてのセッションを1フレーム進め、終わったセッションを閉じて、負荷を均す
+	// tick()と以下の関数は、1つのスレッドから呼ぶ
+	void tick() {
+	  admitOpened();
+	  {
+		std::lock_guard<std::mutex> lock(mutex_);
+		running_ = workers_.size();
+		++tick_;
+	  }
+	  start_.notify_all();
+	  {
+		std::unique_lock<std::mutex> lock(mutex_);
+		done_.wait(lock, [this] { return running_ == 0; });
+	  }
+	  ++stats_.ticks;
+	  closeFinished();
+	  if (balance_.enabled) rebalance();
+	}
+
+	void setBalance(const Balance& balance) { balance_ = balance; }
+	const Stats& stats() const { return stats_; }
+	size_t workers() const { return workers_.size(); }
+	WorkerStats workerStats(size_t worker) const {
+	  const Worker& w = *workers_.at(worker);
+	  WorkerStats s;
+	  s.sessions = w.sessions.size();
+	  s.costNs = w.costNs;
+	  s.busyNs = w.busyNs;
+	  s.pinned = w.pinned;
+	  return s;
+	}
+
+  private:
+	struct Session {
+	  explicit Session(Start s) : queue(new TaskQueue), start(std::move(s)) {}
+	  uint64_t id = 0;
+	  size_t worker = 0;
+	  uint64_t costNs = 0; // update()の時間の指数移動平均
+	  uint64_t fibers = 0; // 作って、まだ終わっていないファイバーの数。0でなければ移さない
+	  Task::registry_type registry;
+	  std::unique_ptr<TaskQueue> queue;
+	  Start start;
+	};
+	struct Worker {
+	  explicit Worker(const WorkerConfig& c) : config(c) {}
+	  WorkerConfig config;
+	  std::thread thread;
+	  bool pinned = false;
+	  // 以下はtick()の間はワーカーが、tick()の外ではtick()を呼ぶスレッドが触る
+	  std::vector<Session*> sessions;
+	  std::vector<Session*> finished;
+	  uint64_t costNs = 0;
+	  uint64_t busyNs = 0;
+	};
+
+	template <typename D>
+	static uint64_t nanoseconds(D d) {
+	  return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+	}
+
+	void run(size_t index) {
+	  Worker& w = *workers_[index];
+	  w.pinned = WorkerPool::pin(w.config.cpu);
+	  uint64_t seen = 0;
+	  for (;;) {
+		{
+		  std::unique_lock<std::mutex> lock(mutex_);
+		  start_.wait(lock, [&] { return stop_ || tick_ != seen; });
+		  if (stop_) return;
+		  seen = tick_;
+		}
+		step(w);
+		{
+		  std::lock_guard<std::mutex> lock(mutex_);
+		  if (--running_ == 0) done_.notify_one();
+		}
+	  }
+	}
+	// ワーカーのセッションを1フレームずつ進める
+	void step(Worker& w) {
+	  using Clock = std::chrono::steady_clock;
+	  // 前のセッションの終わりを次のセッションの始まりとして、時刻の取得をセッションごとに1回にする
+	  auto begin = Clock::now();
+	  auto last = begin;
+	  uint64_t cost = 0;
+	  for (size_t i = 0; i < w.sessions.size();) {
+		Session* s = w.sessions[i];
+		{
+		  Task::RegistryScope scope(s->registry);
+		  // セッションは1つずつ動かすので、前後の差がこのセッションのファイバーの増減になる
+		  uint64_t created = Fiber::created(), destroyed = Fiber::destroyed();
+		  if (s->start) {
+			Start start(std::move(s->start));
+			s->start = nullptr;
+			start(*s->queue);
+		  }
+		  s->queue->update();
+		  s->fibers += (Fiber::created() - created) - (Fiber::destroyed() - destroyed);
+		}
+		auto now = Clock::now();
+		int64_t sample = int64_t(nanoseconds(now - last));
+		last = now;
+		// 最初のフレームはそのまま、以後は1/8ずつ近づける
+		s->costNs = s->costNs ? uint64_t(int64_t(s->costNs) + (sample - int64_t(s->costNs)) / 8) : uint64_t(sample);
+		if (s->queue->finished()) {
+		  w.finished.push_back(s);
+		  w.sessions[i] = w.sessions.back();
+		  w.sessions.pop_back();
+		  continue;
+		}
+		cost += s->costNs;
+		++i;
+	  }
+	  w.costNs = cost;
+	  w.busyNs = nanoseconds(last - begin);
+	}
+
+	// open()されたセッションをワーカーに渡す
+	void admitOpened() {
+	  std::lock_guard<std::mutex> lock(indexMutex_);
+	  for (Session* s : opening_) workers_[s->worker]->sessions.push_back(s);
+	  stats_.opened += opening_.size();
+	  opening_.clear();
+	}
+	void closeFinished() {
+	  for (auto& w : workers_) {
+		if (w->finished.empty()) continue;
+		{
+		  std::lock_guard<std::mutex> lock(indexMutex_);
+		  for (Session* s : w->finished) index_.erase(s->id);
+		}
+		for (Session* s : w->finished) destroy(s);
+		stats_.closed += w->finished.size();
+		w->finished.clear();
+	  }
+	}
+	// タスクの登録は、セッションの登録先を切り替えている間に外す
+	static void destroy(Session* s) {
+	  {
+		Task::RegistryScope scope(s->registry);
+		s->queue.reset();
+	  }
+	  delete s;
+	}
+
+	// 最も重いワーカーから最も軽いワーカーへ、コストが差の半分に近いセッションを移す
+	// 差より軽いセッションだけを選ぶので、移すたびに差は縮む。ファイバーが残っているセッションは選ばない
+	void rebalance() {
+	  if (workers_.size() < 2) return;
+	  uint64_t total = 0;
+	  for (auto& w : workers_) total += w->costNs;
+	  double mean = double(total) / double(workers_.size());
+	  if (mean <= 0) return;
+	  auto byCost = [](const std::unique_ptr<Worker>& a, const std::unique_ptr<Worker>& b) { return a->costNs < b->costNs; };
+	  std::lock_guard<std::mutex> lock(indexMutex_);
+	  for (size_t moves = 0; moves < balance_.maxMoves; ++moves) {
+		auto light = std::min_element(workers_.begin(), workers_.end(), byCost);
+		auto heavy = std::max_element(workers_.begin(), workers_.end(), byCost);
+		uint64_t gap = (*heavy)->costNs - (*light)->costNs;
+		if (double(gap) <= balance_.threshold * mean) break;
+		auto& from = (*heavy)->sessions;
+		uint64_t half = gap / 2;
+		size_t best = from.size();
+		uint64_t bestDistance = std::numeric_limits<uint64_t>::max();
+		for (size_t i = 0; i < from.size(); ++i) {
+		  uint64_t c = from[i]->costNs;
+		  if (c == 0 || c >= gap || from[i]->fibers) continue;
+		  uint64_t d = c > half ? c - half : half - c;
+		  if (d < bestDistance) {
+			bestDistance = d;
+			best = i;
+		  }
+		}
+		if (best == from.size()) break;
+		Session* s = from[best];
+		from[best] = from.back();
+		from.pop_back();
+		(*light)->sessions.push_back(s);
+		(*heavy)->costNs -= s->costNs;
+		(*light)->costNs += s->costNs;
+		s->worker = size_t(light - workers_.begin());
+		++stats_.migrations;
+	  }
+	}
+
+	Balance balance_;
+	Stats stats_;
+	std::vector<std::unique_ptr<Worker>> workers_;
+	// tick()とワーカーの同期
+	std::mutex mutex_;
+	std::condition_variable start_;
+	std::condition_variable done_;
+	uint64_t tick_ = 0;
+	size_t running_ = 0;
+	bool stop_ = false;
+	// 番号からセッションを引く。open(), post()は他のスレッドからも呼ばれる
+	mutable std::mutex indexMutex_;
+	std::unordered_map<uint64_t, Session*> index_;
+	std::vector<Session*> opening_;
+	uint64_t lastId_ = 0;
+	size_t next_ = 0;
+  };
+
+}} // ts::namedobj
@@ -0,0 +1,251 @@
+// -*-tab-width:4;c++-*-
+//
+// シグナルとスロット
+//
+// c++11forGamePrograming.cppの#if 0のButton1/Button2で書きかけていた、Signal sig; sig.connect(...)の実装です。
+// Signal<void(Args...)>は、接続した関数(スロット)をemit()ですべて呼びます。
+//   - スロットの関数オブジェクトは、InlineSizeバイトまで配列の中に直接置きます(大きいとコンパイルエラー)
+//     スロットは隙間無く並べるので、emit()は配列を順に呼ぶだけで、メモリの確保もしません
+//   - connect()が返すConnectionで、disconnect()は番号から位置を引いて最後のスロットと入れ替えるだけです
+//   - emit()中にconnect()したスロットはemit()が終わってから加わり、その回には呼ばれません
+//     emit()中にdisconnect()したスロットは、まだ呼んでいなければその回にも呼ばれません
+//     (入れ替えはemit()が終わってから行うので、呼び出し中のスロットが動くことはありません)
+//   - 呼ぶ順番は、接続した順とは限りません
+// スレッドセーフではありません。1つのスレッドで使ってください。
+//
+//   Signal<void(bool)> clicked;
+//   auto c = clicked.connect([&](bool press) { button.onClick(press); });
+//   clicked.emit(true);
+//   clicked.disconnect(c);
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace ts {
+namespace namedobj {
+
+  // connect()の戻り値。disconnect()に渡す
+  struct Connection {
+	uint32_t id = UINT32_MAX;
+	uint32_t generation = 0;
+	bool valid() const { return id != UINT32_MAX; }
+  };
+
+  template <typename Signature, size_t InlineSize = 32>
+  class Signal;
+
+  template <typename... Args, size_t InlineSize>
+  class Signal<void(Args...), InlineSize> {
+  public:
+	Signal() = default;
+	Signal(const Signal&) = delete;
+	Signal& operator = (const Signal&) = delete;
+
+	template <typename F>
+	Connection connect(F f) {
+	  using Func = typename std::decay<F>::type;
+	  static_assert(sizeof(Func) <= InlineSize, "slot is larger than InlineSize; capture less or raise InlineSize");
+	  static_assert(alignof(Func) <= alignof(std::max_align_t), "slot is over-aligned");
+	  static_assert(std::is_nothrow_move_constructible<Func>::value, "slot must be nothrow move constructible");
+
+	  uint32_t id;
+	  if (!freeIds_.empty()) {
+		id = freeIds_.back();
+		freeIds_.pop_back();
+	  }
+	  else {
+		id = uint32_t(handles_.size());
+		handles_.push_back(Handle());
+	  }
+	  Handle& h = handles_[id];
+	  // emit()中は、呼び出し中のスロットが動かないようにpending_に置く
+	  std::vector<Slot>& to = emitting_ ? pending_ : slots_;
+	  h.index = uint32_t(to.size());
+	  h.pending = emitting_ > 0;
+	  h.connected = true;
+	  to.emplace_back(id, std::move(f));
+	  return Connection{ id, h.generation };
+	}
+
+	// 接続していたらtrueを返す。同じConnectionを2回渡してもよい
+	bool disconnect(Connection c) {
+	  if (!connected(c)) return false;
+	  Handle& h = handles_[c.id];
+	  std::vector<Slot>& from = h.pending ? pending_ : slots_;
+	  if (emitting_) {
+		// 呼ばないようにして、emit()が終わってから取り除く
+		from[h.index].kill();
+		removed_ = true;
+		release(h);
+		return true;
+	  }
+	  remove(from, h.index);
+	  return true;
+	}
+	bool connected(Connection c) const {
+	  return c.id < handles_.size() && handles_[c.id].generation == c.generation && handles_[c.id].connected;
+	}
+
+	// すべてのスロットを呼ぶ
+	void emit(Args... args) {
+	  EmitGuard guard(*this);
+	  // 途中でconnect()されても、この回に呼ぶのは始めにあった分だけ
+	  size_t n = slots_.size();
+	  for (size_t i = 0; i < n; ++i) {
+		Slot& s = slots_[i];
+		s.invoke(&s.storage, args...);
+	  }
+	}
+	void operator () (Args... args) { emit(args...); }
+
+	// 接続しているスロットの数
+	size_t size() const { return slots_.size() + pending_.size() - deadCount(); }
+	bool empty() const { return size() == 0; }
+	void clear() {
+	  for (auto& h : handles_) {
+		if (h.connected) release(h);
+	  }
+	  if (emitting_) {
+		for (auto& s : slots_) s.kill();
+		for (auto& s : pending_) s.kill();
+		removed_ = true;
+	  }
+	  else {
+		slots_.clear();
+		pending_.clear();
+	  }
+	}
+	void reserve(size_t n) {
+	  slots_.reserve(n);
+	  handles_.reserve(n);
+	}
+
+  private:
+	using Storage = typename std::aligned_storage<InlineSize, alignof(std::max_align_t)>::type;
+	using Invoke = void (*)(void*, Args&...);
+	// 移動(dstがnullptrでなければ)と破棄
+	using Relocate = void (*)(void*, void*);
+
+	struct Slot {
+	  template <typename F>
+	  Slot(uint32_t i, F&& f) : invoke(&call<typename std::decay<F>::type>),
+								relocate(&move<typename std::decay<F>::type>), id(i) {
+		new (&storage) typename std::decay<F>::type(std::forward<F>(f));
+	  }
+	  Slot(Slot&& s) noexcept : invoke(s.invoke), relocate(s.relocate), id(s.id) {
+		relocate(&s.storage, &storage);
+		s.relocate = nullptr;
+	  }
+	  Slot& operator = (Slot&& s) noexcept {
+		if (this != &s) {
+		  this->~Slot();
+		  new (this) Slot(std::move(s));
+		}
+		return *this;
+	  }
+	  ~Slot() {
+		if (relocate) relocate(&storage, nullptr);
+	  }
+
+	  // 外したスロットは、emit()で分岐しなくていいように何もしない関数に替える
+	  void kill() { invoke = &skip; }
+	  bool dead() const { return invoke == &skip; }
+
+	  template <typename F>
+	  static void call(void* p, Args&... args) { (*static_cast<F*>(p))(args...); }
+	  static void skip(void*, Args&...) {}
+	  template <typename F>
+	  static void move(void* src, void* dst) {
+		F* f = static_cast<F*>(src);
+		if (dst) new (dst) F(std::move(*f));
+		f->~F();
+	  }
+
+	  Storage storage;
+	  Invoke invoke;
+	  Relocate relocate;
+	  uint32_t id;
+	};
+
+	struct Handle {
+	  uint32_t index = 0;
+	  uint32_t generation = 0;
+	  bool pending = false;
+	  bool connected = false;
+	};
+
+	struct EmitGuard {
+	  explicit EmitGuard(Signal& s) : sig(s) { ++sig.emitting_; }
+	  ~EmitGuard() {
+		if (--sig.emitting_ == 0 && (sig.removed_ || !sig.pending_.empty())) sig.settle();
+	  }
+	  Signal& sig;
+	};
+
+	// 最後のスロットを空いた場所に移す
+	void remove(std::vector<Slot>& from, uint32_t index) {
+	  release(handles_[from[index].id]);
+	  if (index + 1 != from.size()) {
+		from[index] = std::move(from.back());
+		handles_[from[index].id].index = index;
+	  }
+	  from.pop_back();
+	}
+	void release(Handle& h) {
+	  uint32_t id = uint32_t(&h - handles_.data());
+	  h.connected = false;
+	  ++h.generation;
+	  freeIds_.push_back(id);
+	}
+
+	// emit()が終わったら、取り除いたスロットを詰め、emit()中に加わったスロットを移す
+	void settle() {
+	  if (removed_) {
+		removed_ = false;
+		for (auto* v : { &slots_, &pending_ }) {
+		  for (size_t i = 0; i < v->size();) {
+			Slot& s = (*v)[i];
+			if (s.dead()) {
+			  // 番号はdisconnect()かclear()の時点で返しているので、ここでは詰めるだけ
+			  if (i + 1 != v->size()) {
+				s = std::move(v->back());
+				handles_[s.id].index = uint32_t(i);
+			  }
+			  v->pop_back();
+			}
+			else ++i;
+		  }
+		}
+	  }
+	  for (auto& s : pending_) {
+		Handle& h = handles_[s.id];
+		h.index = uint32_t(slots_.size());
+		h.pending = false;
+		slots_.push_back(std::move(s));
+	  }
+	  pending_.clear();
+	}
+	size_t deadCount() const {
+	  if (!removed_) return 0;
+	  size_t n = 0;
+	  for (auto& s : slots_) n += s.dead();
+	  for (auto& s : pending_) n += s.dead();
+	  return n;
+	}
+
+	std::vector<Slot> slots_;
+	std::vector<Slot> pending_;
+	std::vector<Handle> handles_;
+	std::vector<uint32_t> freeIds_;
+	int emitting_ = 0;
+	bool removed_ = false;
+  };
+
+}} // ts::namedobj
@@ -0,0 +1,130 @@
+// -*-tab-width:4-*-
+//
+// Signalとstd::vector<std::function>の比較
+// 1〜10000個のスロットにemitする時の、スロット1つあたりの時間とemit 1回あたりの確保回数
+// 接続する時の確保回数も表示する
+//   small : ポインタと整数をキャプチャする(std::functionの中に入る)
+//   large : 32バイトをキャプチャする(std::functionはヒープに置く)
+// 最初に、emit中のconnect/disconnectと、番号でのdisconnectの動作を確かめる
+// ./t14 [呼び出し回数]
+//
+#define TS_INSTRUMENT_NEW
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+#include "Signal.hpp"
+#include "../instrument/AllocCounter.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using namespace ts::instrument;
+using Clock = chrono::steady_clock;
+
+static long total = 0;
+
+struct Small {
+  long* sum;
+  int k;
+  void operator () (int v) const { *sum += v + k; }
+};
+struct Large {
+  long* sum;
+  int k;
+  long pad[2];
+  void operator () (int v) const { *sum += v + k + pad[0]; }
+};
+
+template <typename F>
+void measure(const char* label, size_t slots, long calls, F emit) {
+  long emits = calls / long(slots) + 1;
+  AllocScope allocs;
+  auto start = Clock::now();
+  for (long i = 0; i < emits; ++i) emit(int(i));
+  double ns = chrono::duration<double, nano>(Clock::now() - start).count() / double(emits * long(slots));
+  printf("    %-22s %6.2f ns/slot %5.2f allocs/emit\n", label, ns, double(allocs.news()) / double(emits));
+}
+
+// 残りのメンバ(Largeのpad)は0にする
+template <typename Closure>
+Closure makeClosure(int k) {
+  Closure c{};
+  c.sum = &total;
+  c.k = k;
+  return c;
+}
+
+template <typename Closure>
+void run(const char* name, size_t slots, long calls) {
+  vector<function<void(int)>> funcs;
+  Signal<void(int)> sig;
+  funcs.reserve(slots);
+  sig.reserve(slots);
+  // 接続する時の確保回数
+  AllocScope funcAllocs;
+  for (size_t i = 0; i < slots; ++i) funcs.push_back(makeClosure<Closure>(int(i)));
+  uint64_t funcNews = funcAllocs.news();
+  AllocScope sigAllocs;
+  for (size_t i = 0; i < slots; ++i) sig.connect(makeClosure<Closure>(int(i)));
+  printf("    %s connect: vector<function> %.2f allocs/slot, Signal %.2f allocs/slot\n", name,
+		 double(funcNews) / double(slots), double(sigAllocs.news()) / double(slots));
+  char label[64];
+  snprintf(label, sizeof(label), "vector<function> %s", name);
+  measure(label, slots, calls, [&](int v) { for (auto& f : funcs) f(v); });
+  snprintf(label, sizeof(label), "Signal %s", name);
+  measure(label, slots, calls, [&](int v) { sig.emit(v); });
+}
+
+void check() {
+  Signal<void(int)> sig;
+  vector<int> called;
+  Connection self, added, b;
+  // 後ろのスロットを外す。まだ呼んでいないので、この回にはもう呼ばれない
+  sig.connect([&](int) { sig.disconnect(b); });
+  auto a = sig.connect([&](int) { called.push_back(1); });
+  b = sig.connect([&](int) { called.push_back(2); });
+  // 自分を外し、新しいスロットをつなぐ。新しいスロットは次のemitから呼ばれる
+  self = sig.connect([&](int) {
+	  called.push_back(3);
+	  sig.disconnect(self);
+	  added = sig.connect([&](int) { called.push_back(4); });
+	});
+
+  sig.emit(0);
+  TS_CHECK_EQ(called.size(), 2u);  // 1と3
+  TS_CHECK(!sig.connected(self) && !sig.connected(b) && sig.connected(added));
+  TS_CHECK_EQ(sig.size(), 3u);      // 外すスロット、a、added
+
+  called.clear();
+  sig.emit(0);
+  TS_CHECK_EQ(called.size(), 2u);  // 1と4
+  TS_CHECK(!sig.disconnect(b));
+  TS_CHECK(sig.disconnect(a));
+  TS_CHECK(!sig.connected(a));
+  // 外した番号を別のスロットが使っても、古いConnectionでは外れない
+  auto c = sig.connect([&](int) { called.push_back(5); });
+  TS_CHECK(!sig.disconnect(a));
+  TS_CHECK(sig.connected(c));
+
+  // emitは確保しない
+  called.reserve(1000);
+  AllocScope allocs;
+  for (int i = 0; i < 100; ++i) sig.emit(i);
+  TS_CHECK_EQ(allocs.news(), 0);
+
+  sig.clear();
+  TS_CHECK(sig.empty());
+}
+
+int main(int ac, char* av[]) {
+  long calls = ac > 1 ? atol(av[1]) : 20000000;
+  check();
+  for (size_t slots : { 1, 10, 100, 1000, 10000 }) {
+	printf("  %zu slots\n", slots);
+	run<Small>("small", slots, calls);
+	run<Large>("large", slots, calls);
+  }
+  return checkResult("signal");
+}
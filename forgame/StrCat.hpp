@@ -0,0 +1,177 @@
+// -*-tab-width:4;c++-*-
+//
+// 文字列の連結
+//
+// std::stringのa + b + cは、+のたびに一時的な文字列を作り、長ければそのたびにメモリを確保します。
+// strCat(a, b, c)は連結する文字列への参照だけを持つ式で、書き出す時に全体の長さを先に求めて1回で書きます。
+//   str()              : 1回だけ確保してstd::stringを作る
+//   appendTo/+=        : 既存のstd::stringやFixedStringの後ろに足す(std::stringは1回だけ広げる)
+//                        FixedStringの容量を超えたらstd::length_errorを投げる
+//   truncateTo         : 置き換える。FixedStringの容量を超える分は切り詰める
+//   writeTo(buf, size) : 呼び出し元のバッファに書く(確保しない。入らない分は切り詰める)
+//   writeTo(arena)     : allocate(size, align)を持つアリーナ(WorkerArenaなど)に書く
+// 引数には、const char*、std::string、FixedString、string_view、char、整数が使えます。
+// 式は引数を参照するので、string_viewと同じように、作った式の中ですぐに使ってください。
+//
+//   throw std::runtime_error(strCat("task '", name, "' not found").str());
+//   strCat(name_, "@moved").truncateTo(n.name_);
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <boost/utility/string_view.hpp>
+#include "FixedString.hpp"
+
+namespace ts {
+namespace namedobj {
+
+  // 連結する文字列の1つ。charと整数は自分の中に文字列にして持つ
+  class StrPiece {
+  public:
+	StrPiece(const char* s) : data_(s), size_(std::strlen(s)) {}
+	StrPiece(const std::string& s) : data_(s.data()), size_(s.size()) {}
+	StrPiece(boost::string_view s) : data_(s.data()), size_(s.size()) {}
+	template <size_t N>
+	StrPiece(const FixedString<N>& s) : data_(s.data()), size_(s.size()) {}
+	StrPiece(char c) : size_(1), inline_(true) { buf_[0] = c; }
+	template <typename T,
+			  typename = typename std::enable_if<std::is_integral<T>::value &&
+												 !std::is_same<T, char>::value &&
+												 !std::is_same<T, bool>::value>::type>
+	StrPiece(T v) : inline_(true) {
+	  // 後ろから書いて前に詰める
+	  char tmp[sizeof(buf_)];
+	  char* p = tmp + sizeof(tmp);
+	  bool negative = v < 0;
+	  typename std::make_unsigned<T>::type u = negative ? 0 - typename std::make_unsigned<T>::type(v) : v;
+	  do {
+		*--p = char('0' + u % 10);
+		u /= 10;
+	  } while (u != 0);
+	  if (negative) *--p = '-';
+	  size_ = size_t(tmp + sizeof(tmp) - p);
+	  std::memcpy(buf_, p, size_);
+	}
+
+	const char* data() const { return inline_ ? buf_ : data_; }
+	size_t size() const { return size_; }
+
+  private:
+	const char* data_ = nullptr;
+	size_t size_ = 0;
+	bool inline_ = false;
+	char buf_[20];
+  };
+
+  template <size_t N>
+  class StrCat {
+  public:
+	explicit StrCat(const std::array<StrPiece, N>& pieces) : pieces_(pieces) {}
+
+	// 連結した文字列の長さ
+	size_t size() const {
+	  size_t n = 0;
+	  for (auto& p : pieces_) n += p.size();
+	  return n;
+	}
+
+	std::string str() const {
+	  std::string s;
+	  appendTo(s);
+	  return s;
+	}
+	void appendTo(std::string& s) const {
+	  size_t at = s.size(), n = size();
+	  if (at + n > s.capacity()) {
+		// 引数がsを指していても壊さないように、新しい領域に書いてから入れ替える
+		std::string t;
+		t.reserve(at + n);
+		t.append(s);
+		t.resize(at + n);
+		copy(&t[at]);
+		s.swap(t);
+		return;
+	  }
+	  s.resize(at + n);
+	  copy(&s[at]);
+	}
+	// FixedStringの容量を超えたらstd::length_errorを投げ、sは変えない
+	template <size_t M>
+	void appendTo(FixedString<M>& s) const {
+	  if (size() > M - s.size()) throw std::length_error("FixedString: too long");
+	  // ハッシュの計算を1回にするため、まとめてから足す
+	  char buf[M + 1];
+	  s.append(buf, writeTo(buf, sizeof(buf)));
+	}
+	// 置き換える。FixedStringの容量を超える分は切り詰める(デバッグ用の名前など)
+	void truncateTo(std::string& s) const { assignTo(s); }
+	template <size_t M>
+	void truncateTo(FixedString<M>& s) const {
+	  char buf[M + 1];
+	  s = FixedString<M>::truncated(buf, writeTo(buf, sizeof(buf)));
+	}
+	// 既存の文字列を置き換える。std::stringは確保済みの領域を使い回す
+	template <typename S>
+	void assignTo(S& s) const {
+	  s.clear();
+	  appendTo(s);
+	}
+
+	// bufに'\0'付きで書き、書いた文字数を返す。入らない分は切り詰める
+	size_t writeTo(char* buf, size_t capacity) const {
+	  if (capacity == 0) return 0;
+	  size_t left = capacity - 1;
+	  char* p = buf;
+	  for (auto& piece : pieces_) {
+		size_t n = piece.size() < left ? piece.size() : left;
+		std::memcpy(p, piece.data(), n);
+		p += n;
+		left -= n;
+	  }
+	  *p = '\0';
+	  return size_t(p - buf);
+	}
+	// アリーナに'\0'付きで書く。アリーナが一杯ならnullptrを指す空のstring_viewを返す
+	template <typename Arena>
+	boost::string_view writeTo(Arena& arena) const {
+	  size_t n = size();
+	  char* p = static_cast<char*>(arena.allocate(n + 1, 1));
+	  if (p == nullptr) return boost::string_view();
+	  copy(p);
+	  p[n] = '\0';
+	  return boost::string_view(p, n);
+	}
+
+  private:
+	void copy(char* p) const {
+	  for (auto& piece : pieces_) {
+		std::memcpy(p, piece.data(), piece.size());
+		p += piece.size();
+	  }
+	}
+
+	std::array<StrPiece, N> pieces_;
+  };
+
+  template <typename... Args>
+  StrCat<sizeof...(Args)> strCat(const Args&... args) {
+	return StrCat<sizeof...(Args)>(std::array<StrPiece, sizeof...(Args)>{ { StrPiece(args)... } });
+  }
+
+  template <size_t N>
+  std::string& operator += (std::string& s, const StrCat<N>& cat) {
+	cat.appendTo(s);
+	return s;
+  }
+  template <size_t M, size_t N>
+  FixedString<M>& operator += (FixedString<M>& s, const StrCat<N>& cat) {
+	cat.appendTo(s);
+	return s;
+  }
+
+}} // ts::namedobj
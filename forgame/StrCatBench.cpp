@@ -0,0 +1,141 @@
+// -*-tab-width:4-*-
+//
+// 文字列の連結の比較
+// 2, 4, 8個の文字列(1つの長さは4, 16, 64文字)を連結する時の、1回あたりの時間と確保回数
+//   operator +      : a + b + c + ...
+//   +=              : std::string s; s += a; s += b; ...
+//   strCat().str()  : 全体の長さを求めて1回で確保する
+//   strCat(buf)     : 呼び出し元のバッファに書く
+//   strCat(arena)   : アリーナに書く
+// 最初に結果が同じになることを確かめる
+// ./t13 [回数]
+//
+#define TS_INSTRUMENT_NEW
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "StrCat.hpp"
+#include "../instrument/AllocCounter.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using namespace ts::instrument;
+using Clock = chrono::steady_clock;
+
+// 使い切ったら先頭に戻るだけのアリーナ
+struct BumpArena {
+  vector<char> buf = vector<char>(1 << 16);
+  size_t used = 0;
+  void* allocate(size_t size, size_t) {
+	if (used + size > buf.size()) used = 0;
+	void* p = &buf[used];
+	used += size;
+	return p;
+  }
+};
+
+// a + b + c + ... と同じ順で連結する
+string plusRest(string&& acc) { return std::move(acc); }
+template <typename... R>
+string plusRest(string&& acc, const string& b, const R&... rest) {
+  return plusRest(std::move(acc) + b, rest...);
+}
+template <typename... R>
+string plusAll(const string& a, const string& b, const R&... rest) {
+  return plusRest(a + b, rest...);
+}
+
+void appendRest(string&) {}
+template <typename... R>
+void appendRest(string& s, const string& b, const R&... rest) {
+  s += b;
+  appendRest(s, rest...);
+}
+
+static volatile size_t sink;
+
+template <typename F>
+void measure(const char* label, long n, F f) {
+  AllocScope allocs;
+  auto start = Clock::now();
+  for (long i = 0; i < n; ++i) f();
+  double ns = chrono::duration<double, nano>(Clock::now() - start).count() / double(n);
+  printf("    %-16s %7.1f ns %5.2f allocs\n", label, ns, double(allocs.news()) / double(n));
+}
+
+template <size_t... I>
+void run(const vector<string>& p, long n, index_sequence<I...>) {
+  printf("  %zu parts x %zu chars\n", sizeof...(I), p[0].size());
+  BumpArena arena;
+  char buf[1024];
+  measure("operator +", n, [&] { sink = plusAll(p[I]...).size(); });
+  measure("+=", n, [&] {
+	  string s;
+	  appendRest(s, p[I]...);
+	  sink = s.size();
+	});
+  measure("strCat().str()", n, [&] { sink = strCat(p[I]...).str().size(); });
+  measure("strCat(buf)", n, [&] { sink = strCat(p[I]...).writeTo(buf, sizeof(buf)); });
+  measure("strCat(arena)", n, [&] { sink = strCat(p[I]...).writeTo(arena).size(); });
+}
+
+void check() {
+  string a = "first-", b = "second-", c = "third";
+  TS_CHECK(strCat(a, b, c).str() == a + b + c);
+  TS_CHECK_EQ(strCat(a, b, c).size(), a.size() + b.size() + c.size());
+  TS_CHECK(strCat("id:", 42, ',', -7, ',', 0u, ',', LLONG_MIN).str() == "id:42,-7,0," + to_string(LLONG_MIN));
+
+  // バッファに入らない分は切り詰める
+  char buf[8];
+  TS_CHECK_EQ(strCat(a, b).writeTo(buf, sizeof(buf)), 7u);
+  TS_CHECK(string(buf) == "first-s");
+
+  // 自分自身を連結しても壊れない
+  string s = "0123456789abcdef";
+  s += strCat(s, '/', s);
+  TS_CHECK(s == "0123456789abcdef0123456789abcdef/0123456789abcdef");
+
+  // FixedStringの容量を超える連結は例外になり、元の値は変わらない。truncateToは切り詰める
+  FixedString<8> f("ab");
+  bool thrown = false;
+  try {
+	f += strCat(f, "cdefghij");
+  }
+  catch (const std::length_error&) {
+	thrown = true;
+  }
+  TS_CHECK(thrown);
+  TS_CHECK(f == FixedString<8>("ab"));
+  strCat(f, "cdefghij").truncateTo(f);
+  TS_CHECK(f == FixedString<8>("abcdefgh"));
+
+  // 1回で確保する
+  string longA(40, 'a'), longB(40, 'b');
+  AllocScope allocs;
+  string joined = strCat(longA, longB, longA).str();
+  TS_CHECK_EQ(allocs.news(), 1);
+  BumpArena arena;
+  string expected = longA + longB;
+  allocs.restart();
+  TS_CHECK(strCat(longA, longB).writeTo(arena) == expected);
+  TS_CHECK_EQ(allocs.news(), 0);
+}
+
+int main(int ac, char* av[]) {
+  long n = ac > 1 ? atol(av[1]) : 200000;
+  check();
+  for (size_t len : { 4, 16, 64 }) {
+	vector<string> p;
+	for (int i = 0; i < 8; ++i) p.push_back(string(len, char('a' + i)));
+	run(p, n, make_index_sequence<2>());
+	run(p, n, make_index_sequence<4>());
+	run(p, n, make_index_sequence<8>());
+  }
+  return checkResult("strcat");
+}
@@ -11,11 +11,19 @@
 // となっています、名前はタスクの名前で、他のタスクからは名前で参照ができるようになっています。
 // 引数リストは、タスクのリストです。タスクは、連携するタスクのリストを引数として受け取るようになっています。
 // 引数で指定するタスクは、タスクの関数か、名称（文字列）が使用できます。
+// 名前の型はNameTypeで指定します(TaskQueueではFixedStringを使っています)。
 
 #pragma once
 
 #include "NamedObject.hpp"
 
+// タスクの動作のログ。TS_TASK_DEBUGを定義した時だけcerrに出力する
+#ifdef TS_TASK_DEBUG
+#define TS_TASK_LOG(x) (std::cerr << x << std::endl)
+#else
+#define TS_TASK_LOG(x) ((void)0)
+#endif
+
 namespace ts {
 namespace namedobj {
   using std::string;
@@ -71,10 +79,11 @@ namespace namedobj {
 
   // タスククラスの定義
   // タスクは、定義を記述した関数TaskFuncと、その引数TaskArgsを保持するクラス
-  template<typename TaskMgr>
-  struct TaskT : NamedObject<TaskT<TaskMgr>> {
-	using Task = TaskT<TaskMgr>;
-	using Super = NamedObject<Task>;
+  template<typename TaskMgr, typename NameType = string>
+  struct TaskT : NamedObject<TaskT<TaskMgr, NameType>, NameType> {
+	using Task = TaskT<TaskMgr, NameType>;
+	using Super = NamedObject<Task, NameType>;
+	using name_type = NameType;
 	using Super::name;
 	using Super::isReferenceObject;
 	using Super::setUniqName;
@@ -86,25 +95,28 @@ namespace namedobj {
 	TaskFunc func_;
 	// タスクのリスト
 	TaskArgs args_;
+	// 作ったスレッドで破棄しなければならない(LocalRefなどをキャプチャしている)
+	bool threadBound_ = false;
 
 	// コンストラクタ
 	TaskT() noexcept {}
 	TaskT(const Task& t) = delete; // コピーコンストラクタは廃止
 	
-	TaskT(TaskFunc f)                   noexcept : Super(), func_(f) { initialize(); }
-	TaskT(TaskFunc f, Task&& t)         noexcept : Super(), func_(f), args_(move(t)) { initialize();  }
-	TaskT(TaskFunc f, TaskArgs&& tasks) noexcept : Super(), func_(f), args_(move(tasks)) {	initialize(); }
+	TaskT(TaskFunc f)                   noexcept : Super(), func_(move(f)) { initialize(); }
+	TaskT(TaskFunc f, Task&& t)         noexcept : Super(), func_(move(f)), args_(move(t)) { initialize();  }
+	TaskT(TaskFunc f, TaskArgs&& tasks) noexcept : Super(), func_(move(f)), args_(move(tasks)) {	initialize(); }
 	
-	TaskT(const string& n)                               noexcept : Super(n, true) {}
-	TaskT(const string& n, TaskFunc f)                   noexcept : Super(n), func_(f) { initialize(); }
-	TaskT(const string& n, TaskFunc f, Task&& t)         noexcept : Super(n), func_(f), args_(move(t)) { initialize();  }
-	TaskT(const string& n, TaskFunc f, TaskArgs&& tasks) noexcept : Super(n), func_(f), args_(move(tasks))  {	initialize();  }
+	TaskT(const name_type& n)                               noexcept : Super(n, true) {}
+	TaskT(const name_type& n, TaskFunc f)                   noexcept : Super(n), func_(move(f)) { initialize(); }
+	TaskT(const name_type& n, TaskFunc f, Task&& t)         noexcept : Super(n), func_(move(f)), args_(move(t)) { initialize();  }
+	TaskT(const name_type& n, TaskFunc f, TaskArgs&& tasks) noexcept : Super(n), func_(move(f)), args_(move(tasks))  {	initialize();  }
 
 	// ムーブコンストラクタ
 	TaskT(Task&& t) noexcept
 	  : Super(move(static_cast<Super&&>(t)))
 	  , func_(move(t.func_))
 	  , args_(move(t.args_))
+	  , threadBound_(t.threadBound_)
 	{
 	  valid("move constructor");
 	}
@@ -120,7 +132,7 @@ namespace namedobj {
 
 	// cloneは参照型のタスクを作る
 	Task clone() const {
-	  cerr << "CloneTask: " << name() << endl;
+	  TS_TASK_LOG("CloneTask: " << name());
 	  return makeReference();
 	}
 
@@ -132,6 +144,7 @@ namespace namedobj {
 	  Super::operator = (move(static_cast<Super&&>(t)));
 	  func_ = move(t.func_);
 	  args_ = move(t.args_);
+	  threadBound_ = t.threadBound_;
 	  valid("operator = ");
 	}
 
@@ -143,13 +156,32 @@ namespace namedobj {
 	  return func_(mgr, args_);
 	}
 	
+	// 自分と引数のタスクの登録を外す。TaskQueueが終わったタスクを破棄する前に呼ぶ
+	void retire() {
+	  Super::retire();
+	  for (auto& a : args_) a.retire();
+	}
+
+	// 作ったスレッドで破棄するタスクにする
+	// LocalRefのように、作ったスレッドでしか触れないものをキャプチャしたタスクに設定する
+	// TaskQueue::Reclaim::Backgroundでも、このタスクは別のスレッドに渡さない
+	void bindToThread() { threadBound_ = true; }
+	// 自分か引数のタスクが、作ったスレッドで破棄するタスク
+	bool threadBound() const {
+	  if (threadBound_) return true;
+	  for (auto& a : args_) {
+		if (a.threadBound()) return true;
+	  }
+	  return false;
+	}
+
 	// 正当性のチェックmsgはデバッグ出力用
 	bool valid(const char* msg = "") const {
 	  if (isReferenceObject() && !name().empty()) {
-		string msg2(msg);
-		msg2 += "+ref";
+		char msg2[64];
+		strCat(msg, "+ref").writeTo(msg2, sizeof(msg2));
 		auto found = getBody();
-		if (found) found->valid(msg2.c_str());
+		if (found) found->valid(msg2);
 		else {
 		  //cerr << msg2 << " not found" << endl;
 		}
@@ -0,0 +1,142 @@
+// -*-tab-width:4;c++-*-
+//
+// タスクのグループ
+//
+// TaskGroupは、サブシステムごとのタスクを自分のTaskQueueに持ち、親のTaskQueueから1つのタスクとして実行されます。
+// グループのキューは、親のフレームごとに予算(TaskQueue::Budget)の範囲でupdate()され、
+// 予算を超えたタスクは次のフレームに回るので、ContinueTaskを繰り返すサブシステムが他のグループを遅くしません。
+// 1つのタスクが長くて予算を大きく超えた場合は、超えた時間に応じたフレーム数(最大MaxPenalty)だけ休みます。
+// グループの中にTaskGroupを作れば(親にグループのキューを渡す)、入れ子にできます。
+//
+// 一時停止中、予算超過で休んでいる間、タスクが無い間は、親のキューからpark()で外れるので、フレームごとのコストはありません。
+// 外からタスクを追加する時は、休んでいるグループを起こすため、queue().addTask()ではなくTaskGroup::addTask()を使ってください。
+//
+// グループの状態は親のタスクとLocalRefで共有するので、TaskGroupを破棄しても親のキューは壊れません(次のフレームでタスクが消えます)。
+// ただし、TaskGroupは親のキューより先に破棄してください。
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include "LocalRef.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+
+namespace ts {
+namespace namedobj {
+
+  class TaskGroup {
+  public:
+	using Budget = TaskQueue::Budget;
+	// 予算超過で休む最大のフレーム数
+	static constexpr uint64_t MaxPenalty = 8;
+
+	struct Stats {
+	  uint64_t frames = 0;      // グループのキューをupdate()した回数
+	  uint64_t tasks = 0;       // 実行したタスクの数
+	  uint64_t ns = 0;          // 使った時間の合計
+	  uint64_t maxNs = 0;       // 1フレームで使った最大の時間
+	  uint64_t overBudget = 0;  // 予算を超えたフレームの数
+	  uint64_t deferred = 0;    // 次のフレームに回したタスクの数の合計
+	  uint64_t skipped = 0;     // 予算超過で休んだフレームの数
+	};
+
+	// parentのタスクとして、nameの名前で登録する
+	TaskGroup(TaskQueue& parent, const TaskQueue::TaskName& name, Budget budget = Budget())
+	  : state_(makeLocalRef<State>(&parent.refs(), parent, budget))
+	{
+	  LocalRef<State> st = state_;
+	  Task driver(name, [st](TaskQueue& tq, TaskArgs&) { return st->run(tq); });
+	  // LocalRefを持つので、親のキューがReclaim::Backgroundでも親のスレッドで破棄する
+	  driver.bindToThread();
+	  parent.addTask(std::move(driver));
+	}
+	~TaskGroup() {
+	  state_->alive = false;
+	  state_->wake();
+	}
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator = (const TaskGroup&) = delete;
+
+	// グループのキュー。グループのタスクには、update()でこのキューが渡される
+	TaskQueue& queue() { return state_->queue; }
+	void addTask(Task&& task) {
+	  state_->queue.addTask(std::move(task));
+	  if (state_->idle) {
+		state_->idle = false;
+		state_->wake();
+	  }
+	}
+
+	void pause() { state_->paused = true; }
+	void resume() {
+	  if (!state_->paused) return;
+	  state_->paused = false;
+	  state_->wake();
+	}
+	bool paused() const { return state_->paused; }
+
+	void setBudget(Budget budget) { state_->budget = budget; }
+	const Budget& budget() const { return state_->budget; }
+	const Stats& stats() const { return state_->stats; }
+	// 親のキューから外れている(一時停止中、休んでいる、タスクが無い)
+	bool sleeping() const { return state_->token != 0; }
+
+  private:
+	struct State : RefCounted {
+	  State(TaskQueue& p, Budget b) : parent(p), budget(b) {}
+
+	  // 親のキューから呼ばれる
+	  TaskStatus run(TaskQueue& tq) {
+		token = 0;
+		if (!alive) return TaskStatus::RemoveTask;
+		if (paused) {
+		  token = tq.park();
+		  return TaskStatus::ContinueTask;
+		}
+		if (queue.empty() && queue.parkedCount() == 0) {
+		  idle = true;
+		  token = tq.park();
+		  return TaskStatus::ContinueTask;
+		}
+		using Clock = std::chrono::steady_clock;
+		auto start = Clock::now();
+		TaskQueue::FrameResult r = queue.update(budget);
+		uint64_t ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+		++stats.frames;
+		stats.tasks += r.ran;
+		stats.ns += ns;
+		stats.maxNs = std::max(stats.maxNs, ns);
+		stats.deferred += r.deferred;
+		if (r.deferred > 0 || (budget.ns && ns > budget.ns)) ++stats.overBudget;
+		// 予算を1フレーム分以上超えたら、超えた分だけ休む
+		if (budget.ns && ns >= 2 * budget.ns) {
+		  uint64_t penalty = std::min<uint64_t>((ns - budget.ns) / budget.ns, MaxPenalty);
+		  stats.skipped += penalty;
+		  token = tq.sleepFrames(penalty + 1);
+		}
+		return TaskStatus::ContinueTask;
+	  }
+	  void wake() {
+		if (token) {
+		  uint64_t t = token;
+		  token = 0;
+		  parent.wake(t);
+		}
+	  }
+
+	  TaskQueue& parent;
+	  TaskQueue queue;
+	  Budget budget;
+	  Stats stats;
+	  bool paused = false;
+	  bool idle = false;
+	  bool alive = true;
+	  uint64_t token = 0; // 親のキューでpark()している時の番号
+	};
+
+	LocalRef<State> state_;
+  };
+
+}} // ts::namedobj
@@ -0,0 +1,108 @@
+// -*-tab-width:4-*-
+//
+// TaskGroupのサンプル
+// 暴走したサブシステム(毎フレームContinueTaskを返す重いタスクが大量にある)を、
+// 1つのキューに入れた場合と、予算付きのグループに入れた場合で、フレーム時間と他のサブシステムの実行回数を比べる
+// 途中でグループを一時停止・再開し、停止中はフレームのコストがかからないことを確かめる
+// ./t10 [フレーム数]
+//
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <vector>
+#include "NamedObject.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "TaskGroup.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using Clock = chrono::steady_clock;
+
+static volatile uint64_t sink;
+void simulate(int n) {
+  uint64_t x = 1;
+  for (int i = 0; i < n; ++i) x = x * 6364136223846793005ull + 1442695040888963407ull;
+  sink = x;
+}
+
+const int RunawayTasks = 500;
+const int RenderTasks = 5;
+static long renderRuns = 0;
+
+Task runaway() {
+  return Task([](TaskQueue&, TaskArgs&) {
+	  simulate(2000);
+	  return TaskStatus::ContinueTask;
+	});
+}
+Task render() {
+  return Task([](TaskQueue&, TaskArgs&) {
+	  simulate(500);
+	  ++renderRuns;
+	  return TaskStatus::ContinueTask;
+	});
+}
+
+// framesフレーム動かし、フレーム時間の中央値と最大値を表示する
+template <typename F>
+void runFrames(const char* label, TaskQueue& tq, int frames, F everyFrame) {
+  vector<int64_t> ns;
+  renderRuns = 0;
+  for (int f = 0; f < frames; ++f) {
+	everyFrame(f);
+	auto start = Clock::now();
+	tq.update();
+	ns.push_back(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count());
+  }
+  sort(ns.begin(), ns.end());
+  cout << label << "frame p50 " << ns[ns.size() / 2] / 1000 << " us, max " << ns.back() / 1000
+	   << " us, render ran " << renderRuns << " times" << endl;
+}
+
+void printStats(const char* name, const TaskGroup& g) {
+  auto& s = g.stats();
+  cout << "  " << name << ": frames " << s.frames << ", tasks " << s.tasks << ", "
+	   << s.ns / 1000 << " us (max " << s.maxNs / 1000 << " us), over budget " << s.overBudget
+	   << ", deferred " << s.deferred << ", skipped " << s.skipped << endl;
+}
+
+int main(int ac, char* av[]) {
+  int frames = ac > 1 ? atoi(av[1]) : 300;
+
+  // すべてを1つのキューに入れる
+  {
+	TaskQueue flat;
+	for (int i = 0; i < RunawayTasks; ++i) flat.addTask(runaway());
+	for (int i = 0; i < RenderTasks; ++i) flat.addTask(render());
+	runFrames("single queue  ", flat, frames, [](int) {});
+  }
+
+  // サブシステムごとのグループにする。aiは1フレーム1msまで
+  // グループは親のキューより先に破棄する
+  TaskQueue root;
+  TaskGroup renderGroup(root, "render");
+  TaskGroup ai(root, "ai", { 1000000, 0 });
+  // aiの中の経路探索は、aiの予算とは別に1フレーム50タスクまで
+  TaskGroup path(ai.queue(), "path", { 0, 50 });
+  TaskGroup audio(root, "audio");
+  for (int i = 0; i < RunawayTasks; ++i) ai.addTask(runaway());
+  for (int i = 0; i < RunawayTasks / 5; ++i) path.addTask(runaway());
+  for (int i = 0; i < RenderTasks; ++i) renderGroup.addTask(render());
+  audio.pause();
+  runFrames("grouped       ", root, frames, [](int) {});
+  printStats("render", renderGroup);
+  printStats("ai    ", ai);
+  printStats("path  ", path);
+  printStats("audio ", audio);
+
+  // aiを途中で止めて再開する
+  uint64_t aiFrames = ai.stats().frames;
+  runFrames("ai paused 1/2 ", root, frames, [&](int f) {
+	  if (f == 0) ai.pause();
+	  if (f == frames / 2) ai.resume();
+	});
+  cout << "  ai ran " << ai.stats().frames - aiFrames << " of " << frames << " frames while paused for half" << endl;
+}
@@ -0,0 +1,324 @@
+// -*-tab-width:4;c++-*-
+//
+// タスクキューの計測
+//
+// TaskMetricsは、TaskQueue::update()の処理時間、タスク名ごとの処理時間、フレームの先頭のキューの長さ、
+// 有界モードのTaskQueueで捨てた・待たせたタスクの数、
+// ContinueTaskで次のフレームに回された回数を集計するクラスです。
+// 処理時間はHDR Histogramと同じ対数線形のバケット(2の累乗の区間を16等分、相対誤差は約6%)に数えます。
+// 記録はrelaxedのアトミック変数の加算だけで行い、ロックは使いません。
+// タスク名の表は固定長(Capacity)のオープンアドレス法で、名前の追加もCASで行います。
+// 表が一杯になった後の新しい名前は"(other)"にまとめます。
+// 1つのTaskMetricsはCapacity個のヒストグラムを持つため、大きさは数百KBになります。ヒープに確保してください。
+//
+// 値の取得は、snapshot()でヒストグラムの写しを取るプル型のAPIと、
+// テキスト/JSONの出力(writeText/writeJson)、それを一定間隔で出力するMetricsReporterで行います。
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FixedString.hpp"
+
+namespace ts {
+namespace namedobj {
+
+  // 対数線形のバケットの番号と値の対応
+  struct HistogramBuckets {
+	static constexpr int SubBits = 4;
+	static constexpr uint64_t SubCount = uint64_t(1) << SubBits;
+	// 2^MaxBits以上の値は最後のバケットに数える
+	static constexpr int MaxBits = 40;
+	static constexpr size_t Count = size_t(MaxBits - SubBits + 1) * SubCount;
+
+	static size_t index(uint64_t v) {
+	  if (v >= (uint64_t(1) << MaxBits)) v = (uint64_t(1) << MaxBits) - 1;
+	  if (v < SubCount) return size_t(v);
+	  int shift = 63 - __builtin_clzll(v) - SubBits;
+	  return size_t(shift + 1) * SubCount + size_t((v >> shift) - SubCount);
+	}
+	// バケットiに入る最大の値
+	static uint64_t upper(size_t i) {
+	  if (i < SubCount) return i;
+	  size_t shift = i / SubCount - 1;
+	  uint64_t sub = i % SubCount + SubCount;
+	  return ((sub + 1) << shift) - 1;
+	}
+  };
+
+  // ヒストグラムの写し
+  struct HistogramSnapshot {
+	std::vector<uint64_t> counts;
+	uint64_t count = 0;
+	uint64_t sum = 0;
+	uint64_t max = 0;
+
+	double mean() const { return count ? double(sum) / double(count) : 0.0; }
+	// p(0〜1)の位置の値。バケットの上限を返すが、最大値は超えない
+	uint64_t percentile(double p) const {
+	  if (count == 0) return 0;
+	  uint64_t rank = uint64_t(p * double(count));
+	  if (rank >= count) rank = count - 1;
+	  uint64_t seen = 0;
+	  for (size_t i = 0; i < counts.size(); ++i) {
+		seen += counts[i];
+		if (seen > rank) return std::min(HistogramBuckets::upper(i), max);
+	  }
+	  return max;
+	}
+	// prevからの増分。maxは区間の値が分からないので累積の値のまま
+	HistogramSnapshot since(const HistogramSnapshot& prev) const {
+	  HistogramSnapshot d = *this;
+	  if (prev.counts.size() == counts.size()) {
+		for (size_t i = 0; i < counts.size(); ++i) d.counts[i] -= prev.counts[i];
+	  }
+	  d.count -= prev.count;
+	  d.sum -= prev.sum;
+	  return d;
+	}
+  };
+
+  // ロックを使わないヒストグラム
+  class LatencyHistogram {
+  public:
+	void record(uint64_t v) {
+	  counts_[HistogramBuckets::index(v)].fetch_add(1, std::memory_order_relaxed);
+	  count_.fetch_add(1, std::memory_order_relaxed);
+	  sum_.fetch_add(v, std::memory_order_relaxed);
+	  uint64_t m = max_.load(std::memory_order_relaxed);
+	  while (v > m && !max_.compare_exchange_weak(m, v, std::memory_order_relaxed)) {}
+	}
+	uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+	// 記録中に取った写しは、バケットの合計とcountが少しずれることがある
+	HistogramSnapshot snapshot() const {
+	  HistogramSnapshot s;
+	  s.counts.resize(HistogramBuckets::Count);
+	  for (size_t i = 0; i < HistogramBuckets::Count; ++i) s.counts[i] = counts_[i].load(std::memory_order_relaxed);
+	  s.count = count_.load(std::memory_order_relaxed);
+	  s.sum = sum_.load(std::memory_order_relaxed);
+	  s.max = max_.load(std::memory_order_relaxed);
+	  return s;
+	}
+
+  private:
+	std::atomic<uint64_t> counts_[HistogramBuckets::Count] = {};
+	std::atomic<uint64_t> count_{ 0 };
+	std::atomic<uint64_t> sum_{ 0 };
+	std::atomic<uint64_t> max_{ 0 };
+  };
+
+  class TaskMetrics {
+  public:
+	using Name = FixedString<31>;
+	// タスク名の表の大きさ(2の累乗)
+	static constexpr size_t Capacity = 128;
+
+	TaskMetrics() { other_.name = "(other)"; }
+	TaskMetrics(const TaskMetrics&) = delete;
+	TaskMetrics& operator = (const TaskMetrics&) = delete;
+
+	// 1フレーム(update()の1回)を記録する
+	void recordFrame(uint64_t ns, size_t queueDepth) {
+	  frameTime_.record(ns);
+	  queueDepth_.record(queueDepth);
+	}
+	// 有界モードのTaskQueueが一杯だった時に記録する
+	enum class Overflow { Rejected, Dropped, Blocked };
+	void recordOverflow(Overflow kind) {
+	  overflows_[size_t(kind)].fetch_add(1, std::memory_order_relaxed);
+	}
+	// タスクの実行を1回記録する。requeued: ContinueTaskで次のフレームに回された
+	void recordTask(const Name& name, uint64_t ns, bool requeued) {
+	  TaskSlot& s = slot(name);
+	  s.time.record(ns);
+	  if (requeued) {
+		s.requeues.fetch_add(1, std::memory_order_relaxed);
+		requeues_.fetch_add(1, std::memory_order_relaxed);
+	  }
+	}
+
+	// プル型のAPI
+	HistogramSnapshot frameTime() const { return frameTime_.snapshot(); }
+	HistogramSnapshot queueDepth() const { return queueDepth_.snapshot(); }
+	uint64_t requeues() const { return requeues_.load(std::memory_order_relaxed); }
+	uint64_t overflows(Overflow kind) const { return overflows_[size_t(kind)].load(std::memory_order_relaxed); }
+	// 記録のあるタスクごとにf(名前, 処理時間のヒストグラム, 次のフレームに回された回数)を呼ぶ
+	template <typename F>
+	void forEachTask(F f) const {
+	  for (auto& s : slots_) {
+		if (s.state.load(std::memory_order_acquire) == Ready) {
+		  f(s.name, s.time.snapshot(), s.requeues.load(std::memory_order_relaxed));
+		}
+	  }
+	  if (other_.time.count() > 0) f(other_.name, other_.time.snapshot(), other_.requeues.load(std::memory_order_relaxed));
+	}
+
+	// テキストで出力する
+	void writeText(std::ostream& os) const {
+	  char buf[160];
+	  auto line = [&](const char* label, const HistogramSnapshot& h, const char* extra) {
+		snprintf(buf, sizeof(buf), "%-24s %10llu %10.0f %10llu %10llu %10llu %10llu%s\n", label,
+				 (unsigned long long)h.count, h.mean(), (unsigned long long)h.percentile(0.5),
+				 (unsigned long long)h.percentile(0.99), (unsigned long long)h.percentile(0.999),
+				 (unsigned long long)h.max, extra);
+		os << buf;
+	  };
+	  os << "                              count       mean        p50        p99      p99.9        max\n";
+	  line("update (ns)", frameTime(), "");
+	  line("queue depth", queueDepth(), "");
+	  forEachTask([&](const Name& name, const HistogramSnapshot& h, uint64_t requeues) {
+		  char extra[48];
+		  snprintf(extra, sizeof(extra), "  requeue %llu", (unsigned long long)requeues);
+		  line(name.c_str(), h, extra);
+		});
+	  os << "requeues " << requeues();
+	  if (hasOverflows()) {
+		os << ", rejected " << overflows(Overflow::Rejected) << ", dropped " << overflows(Overflow::Dropped)
+		   << ", blocked " << overflows(Overflow::Blocked);
+	  }
+	  os << std::endl;
+	}
+	// JSONで出力する
+	void writeJson(std::ostream& os) const {
+	  os << "{\"update_ns\":";
+	  writeJson(os, frameTime());
+	  os << ",\"queue_depth\":";
+	  writeJson(os, queueDepth());
+	  os << ",\"requeues\":" << requeues();
+	  if (hasOverflows()) {
+		os << ",\"rejected\":" << overflows(Overflow::Rejected) << ",\"dropped\":" << overflows(Overflow::Dropped)
+		   << ",\"blocked\":" << overflows(Overflow::Blocked);
+	  }
+	  os << ",\"tasks\":[";
+	  bool first = true;
+	  forEachTask([&](const Name& name, const HistogramSnapshot& h, uint64_t requeues) {
+		  if (!first) os << ',';
+		  first = false;
+		  os << "{\"name\":\"";
+		  for (char c : name) {
+			if (c == '"' || c == '\\') os << '\\' << c;
+			else if (uint8_t(c) < 0x20) os << ' ';
+			else os << c;
+		  }
+		  os << "\",\"requeues\":" << requeues << ",\"ns\":";
+		  writeJson(os, h);
+		  os << '}';
+		});
+	  os << "]}" << std::endl;
+	}
+
+  private:
+	bool hasOverflows() const {
+	  return overflows(Overflow::Rejected) || overflows(Overflow::Dropped) || overflows(Overflow::Blocked);
+	}
+
+	enum : uint32_t { Empty, Writing, Ready };
+	struct TaskSlot {
+	  std::atomic<uint32_t> state{ Empty };
+	  uint32_t hash = 0;
+	  Name name;
+	  LatencyHistogram time;
+	  std::atomic<uint64_t> requeues{ 0 };
+	};
+
+	// 名前の枠を探す。無ければ空いている枠をCASで確保する
+	TaskSlot& slot(const Name& name) {
+	  uint32_t h = name.hash();
+	  for (size_t i = 0; i < Capacity; ++i) {
+		TaskSlot& s = slots_[(h + i) & (Capacity - 1)];
+		uint32_t state = s.state.load(std::memory_order_acquire);
+		if (state == Empty) {
+		  if (s.state.compare_exchange_strong(state, Writing, std::memory_order_acquire)) {
+			s.hash = h;
+			s.name = name;
+			s.state.store(Ready, std::memory_order_release);
+			return s;
+		  }
+		}
+		// 他のスレッドが名前を書き込んでいる間は待つ
+		while (state == Writing) state = s.state.load(std::memory_order_acquire);
+		if (s.hash == h && s.name == name) return s;
+	  }
+	  return other_;
+	}
+
+	static void writeJson(std::ostream& os, const HistogramSnapshot& h) {
+	  os << "{\"count\":" << h.count << ",\"mean\":" << uint64_t(h.mean())
+		 << ",\"p50\":" << h.percentile(0.5) << ",\"p90\":" << h.percentile(0.9)
+		 << ",\"p99\":" << h.percentile(0.99) << ",\"p999\":" << h.percentile(0.999)
+		 << ",\"max\":" << h.max << '}';
+	}
+
+	LatencyHistogram frameTime_;
+	LatencyHistogram queueDepth_;
+	std::atomic<uint64_t> requeues_{ 0 };
+	std::atomic<uint64_t> overflows_[3] = {};
+	TaskSlot slots_[Capacity];
+	TaskSlot other_;
+  };
+
+  // TaskMetricsを一定間隔で出力するスレッド
+  class MetricsReporter {
+  public:
+	enum class Format { Text, Json };
+
+	MetricsReporter(const TaskMetrics& metrics, std::chrono::milliseconds interval,
+					std::function<void(const std::string&)> output, Format format = Format::Text)
+	  : metrics_(metrics), interval_(interval), output_(std::move(output)), format_(format)
+	  , thread_([this] { run(); })
+	{}
+	~MetricsReporter() { stop(); }
+	MetricsReporter(const MetricsReporter&) = delete;
+	MetricsReporter& operator = (const MetricsReporter&) = delete;
+
+	// スレッドを止める。止める前に最後の出力をする
+	void stop() {
+	  {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (stop_) return;
+		stop_ = true;
+	  }
+	  cond_.notify_all();
+	  thread_.join();
+	}
+
+  private:
+	void run() {
+	  std::unique_lock<std::mutex> lock(mutex_);
+	  for (;;) {
+		bool stopping = cond_.wait_for(lock, interval_, [this] { return stop_; });
+		lock.unlock();
+		report();
+		lock.lock();
+		if (stopping) return;
+	  }
+	}
+	void report() {
+	  std::ostringstream os;
+	  if (format_ == Format::Json) metrics_.writeJson(os);
+	  else metrics_.writeText(os);
+	  output_(os.str());
+	}
+
+	const TaskMetrics& metrics_;
+	std::chrono::milliseconds interval_;
+	std::function<void(const std::string&)> output_;
+	Format format_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	bool stop_ = false;
+	std::thread thread_;
+  };
+
+}} // ts::namedobj
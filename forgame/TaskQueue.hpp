@@ -6,37 +6,282 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include "AsyncIO.hpp"
+#include "IdleWaiter.hpp"
+#include "InputEvents.hpp"
+#include "Lazy.hpp"
+#include "LocalRef.hpp"
+#include "Reclaimer.hpp"
+#include "TaskMetrics.hpp"
+
 namespace ts {
 namespace namedobj {
 
   
 class TaskQueue {
-  using Task = TaskT<TaskQueue>;
+public:
+  // タスク名の型。リテラルで書いた名前のハッシュはコンパイル時に計算される
+  using TaskName = FixedString<31>;
+  static_assert(std::is_same<TaskName, TaskMetrics::Name>::value, "TaskMetrics::Name must be TaskName");
+
+  // update()の動作を記録・再生するためのフック
+  // predicateとinputは、waitPredの条件や外部からの入力を評価する時に呼ばれる
+  // 既定の動作は関数をそのまま呼ぶだけ
+  struct Trace {
+	virtual ~Trace() = default;
+	virtual void frameBegin() {}
+	virtual void taskDone(const TaskName& /*name*/, TaskStatus /*status*/) {}
+	virtual void frameEnd() {}
+	virtual bool predicate(const std::function<bool()>& pred) { return pred(); }
+	virtual int input(const std::function<int()>& f) { return f(); }
+  };
+
+  // RemoveTaskを返したタスクの破棄の方法
+  // Keep以外では、タスクと引数のタスクの名前の登録を外すので、終わったタスクを名前で参照しないこと
+  enum class Reclaim {
+	Keep,       // trash_に残して破棄しない(既定)
+	Inline,     // update()の中で、タスクが終わった時に破棄する
+	EndOfFrame, // update()の終わりに破棄する。予算(ns)を超えたら、残りは次のフレームに回す
+	Background, // update()の終わりにReclaimerのスレッドに渡して破棄する
+	            // Task::bindToThread()したタスクは、update()の終わりにこのスレッドで破棄する
+	            // 注意: このスレッドにLocalRefが1つでも残っている間(localRefObjects() != 0)は、
+	            // どのタスクがLocalRefをキャプチャしているか分からないので、すべてこのスレッドで破棄する
+	            // (TaskGroupを使っている間はEndOfFrameと同じで、予算も使わない)
+  };
+
+  // 有界モード(setCapacity)で、キューが一杯の時に追加しようとした時の動作
+  enum class Overflow {
+	Reject,     // 追加しようとしたタスクを捨てる
+	DropOldest, // 優先度が同じか低い追加待ちのタスクのうち、最も古いものを捨てて追加する
+	Block,      // post()したスレッドを、空きができるまで待たせる
+	            // キューのスレッドでのaddTask()は待てないので、Rejectと同じ
+  };
+  // 追加するタスクの優先度。有界モードでだけ使い、高いものから次のフレームに並べる
+  enum class Priority : uint8_t { Low, Normal, High };
+  static constexpr size_t PriorityCount = 3;
+  // 有界モードで受け付けたタスクの数
+  struct AdmissionStats {
+	uint64_t accepted = 0; // 受け付けた
+	uint64_t rejected = 0; // 一杯で捨てた
+	uint64_t dropped = 0;  // DropOldestで、後から来たタスクのために捨てた
+	uint64_t blocked = 0;  // Blockで、post()したスレッドを待たせた
+  };
+  // runUntilFinished()の設定
+  struct RunOptions {
+	uint64_t frameNs = 0;       // フレームの間隔。0なら、実行できるタスクがある間は待たずに次のupdate()を呼ぶ
+	uint64_t ioPollNs = 1000000; // 完了を通知できない読み込み(io_uring)を待つ間、完了を調べに起きる間隔
+  };
+private:
+  using Task = TaskT<TaskQueue, TaskName>;
   using TaskArgs = Task::TaskArgs;
   
+  // タスクが持つLocalRefが外れた時に使うので、タスクより後に破棄する
+  RefReleaser refs_;
   std::deque<Task> queue_;
   std::deque<Task> nextqueue_;
-  std::vector<Task> trash_; // for debug
+  std::vector<Task> trash_; // RemoveTaskを返したタスク。Reclaim::Keepの時は残しておく(for debug)
   bool finished_ = false; // 終了フラグ
+  Trace* trace_ = nullptr;
+  TaskMetrics* metrics_ = nullptr;
+  // park()したタスク。wake()でキューに戻す
+  std::unordered_map<uint64_t, Task> parked_;
+  uint64_t parkToken_ = 0;
+  uint64_t lastToken_ = 0;
+  // sleepFrames()で眠っているタスク。起こすフレームとpark()の番号
+  std::multimap<uint64_t, uint64_t> sleeping_;
+  // sleepFor()で眠っているタスク。起こす時刻とpark()の番号
+  std::multimap<std::chrono::steady_clock::time_point, uint64_t> timers_;
+  uint64_t frame_ = 0;
+  LazyEpoch epoch_;
+  InputEvents* input_ = nullptr;
+  Reclaim reclaim_ = Reclaim::Keep;
+  uint64_t reclaimBudget_ = 0;
+  std::unique_ptr<Reclaimer<Task>> reclaimer_;
+  // 有界モード。0は無制限
+  size_t capacity_ = 0;
+  Overflow overflow_ = Overflow::Reject;
+  // 有界モードで受け付けた、次のフレームで実行するタスク(優先度ごと)
+  std::deque<Task> admitted_[PriorityCount];
+  size_t admittedCount_ = 0;
+  std::deque<Task> held_[PriorityCount]; // drainInbox()の間、admitted_を預かる
+  uint64_t accepted_ = 0;
+  // TaskMetrics::Overflowごとの数。post()したスレッドからも数える
+  std::atomic<uint64_t> overflows_[3] = {};
+  // post()で他のスレッドから受け取った、タスクを作る関数
+  using Factory = std::function<Task()>;
+  std::mutex inboxMutex_;
+  std::condition_variable inboxSpace_;
+  std::deque<std::pair<Factory, Priority>> inbox_;
+  std::deque<std::pair<Factory, Priority>> draining_;
+  // Blockで待っているスレッドが見る、update()の終わりのキューの長さ
+  std::atomic<size_t> publishedDepth_{ 0 };
+  std::atomic<int> blockedProducers_{ 0 };
+  // runUntilFinished()で、仕事が無い間眠る。post()、入力、読み込みの完了で起こされる
+  IdleWaiter idle_;
+  bool ioNotifies_ = false; // 読み込みの完了でidle_を起こせる
+  // 読み込み先のバッファを持つタスクより先に破棄して、読み込みの完了を待つ
+  std::unique_ptr<AsyncIO> io_;
+  friend class TaskSnapshot;
 public:
   // 外からupdate()を呼んでもらう
   TaskQueue() = default;
   // updateで呼ばれる関数を呼び出し元に通知する
   TaskQueue(std::function<void()>& func) {
 	func = [this]{
-	  cerr << "update" << endl;
+	  TS_TASK_LOG("update");
 	  update();
 	};
   }
+  // 残っているタスクの登録を外してから破棄する
+  ~TaskQueue() {
+	for (auto& t : queue_) t.retire();
+	for (auto& t : nextqueue_) t.retire();
+	for (auto& t : trash_) t.retire();
+	for (auto& p : parked_) p.second.retire();
+	for (auto& q : admitted_) {
+	  for (auto& t : q) t.retire();
+	}
+	if (reclaimer_) postToReclaimer();
+	detachInput();
+  }
   
-  void addTask(Task&& task) {
-	cerr << "addTask: " << task.name() << endl;
-	task.valid("addtask");
-	nextqueue_.emplace_back(move(task));
+  // 次のフレームで実行するタスクを追加する
+  // 有界モードで一杯の時は、Overflowに従って捨てることがあり、追加しなかったらfalseを返す
+  bool addTask(Task&& task, Priority priority = Priority::Normal) {
+	if (!capacity_) {
+	  enqueue(std::move(task));
+	  return true;
+	}
+	return admit(std::move(task), priority);
+  }
+
+  // 他のスレッドからタスクを追加する。makeは次のupdate()の始めに、このキューのスレッドで呼ばれ、
+  // 作ったタスクはそのupdate()で実行する
+  // (タスクの名前の登録先はスレッドごとなので、タスクはこのキューのスレッドで作る)
+  // 有界モードでは、受け取ったまま作っていない分も上限に数え、一杯ならOverflowに従う(捨てたらfalseを返す)
+  // Blockでは空きができるまで待つので、このキューのスレッドから呼んではいけない
+  // setCapacity()はpost()を呼ぶスレッドを動かす前に呼ぶこと
+  bool post(Factory make, Priority priority = Priority::Normal) {
+	std::unique_lock<std::mutex> lock(inboxMutex_);
+	auto hasSpace = [this] {
+	  return inbox_.size() + publishedDepth_.load() < capacity_;
+	};
+	if (capacity_ && !hasSpace()) {
+	  switch (overflow_) {
+	  case Overflow::Reject:
+		overflowed(TaskMetrics::Overflow::Rejected);
+		return false;
+	  case Overflow::DropOldest: {
+		// まだ作っていないものから捨てる。無ければupdate()で、受け付けたタスクから捨てる
+		auto it = std::find_if(inbox_.begin(), inbox_.end(),
+							   [priority](const std::pair<Factory, Priority>& e) { return e.second <= priority; });
+		if (it != inbox_.end()) {
+		  inbox_.erase(it);
+		  overflowed(TaskMetrics::Overflow::Dropped);
+		}
+		else if (inbox_.size() >= capacity_) {
+		  overflowed(TaskMetrics::Overflow::Rejected);
+		  return false;
+		}
+		break;
+	  }
+	  case Overflow::Block:
+		overflowed(TaskMetrics::Overflow::Blocked);
+		blockedProducers_.fetch_add(1);
+		inboxSpace_.wait(lock, hasSpace);
+		blockedProducers_.fetch_sub(1);
+		break;
+	  }
+	}
+	inbox_.emplace_back(std::move(make), priority);
+	lock.unlock();
+	idle_.notify();
+	return true;
   }
+  // post()で受け取って、まだ作っていないタスクがある。どのスレッドからでも呼べる
+  bool hasPosted() {
+	std::lock_guard<std::mutex> lock(inboxMutex_);
+	return !inbox_.empty();
+  }
+
+  // 有界モードにする。capacityは、実行を待つタスク(このフレームの残り、次のフレーム、追加待ち)の上限。0で無制限に戻す
+  // ContinueTaskで残るタスクや、waitPredなどで再開するタスクは上限を超えても捨てない
+  void setCapacity(size_t capacity, Overflow overflow = Overflow::Reject) {
+	capacity_ = capacity;
+	overflow_ = overflow;
+	if (!capacity) {
+	  // 追加待ちのタスクは、そのまま次のフレームに回す
+	  moveAdmitted(nextqueue_);
+	}
+	publishDepth();
+  }
+  size_t capacity() const { return capacity_; }
+  // 実行を待っているタスクの数。park()で待っているタスクは含まない
+  size_t depth() const { return queue_.size() + nextqueue_.size() + admittedCount_; }
+  AdmissionStats admissionStats() const {
+	AdmissionStats s;
+	s.accepted = accepted_;
+	s.rejected = overflows_[size_t(TaskMetrics::Overflow::Rejected)].load(std::memory_order_relaxed);
+	s.dropped = overflows_[size_t(TaskMetrics::Overflow::Dropped)].load(std::memory_order_relaxed);
+	s.blocked = overflows_[size_t(TaskMetrics::Overflow::Blocked)].load(std::memory_order_relaxed);
+	return s;
+  }
+
+  // 1フレームの処理の上限。0は無制限
+  struct Budget {
+	uint64_t ns = 0;    // 処理時間。少なくとも1つのタスクは実行する
+	size_t tasks = 0;   // 実行するタスクの数
+  };
+  struct FrameResult {
+	size_t ran = 0;      // 実行したタスクの数
+	size_t deferred = 0; // 上限を超えたため、次のフレームに回したタスクの数
+  };
 
-  void update() {
+  void update() { update(Budget()); }
+
+  // budgetを超えたら、残りのタスクは次のフレームの先頭で実行する
+  FrameResult update(const Budget& budget) {
+	using Clock = std::chrono::steady_clock;
+	if (trace_) trace_->frameBegin();
+	++frame_;
+	epoch_.advance();
+	// 他のスレッドからpost()されたタスクを作る
+	drainInbox();
+	// 計測する時は、時刻の取得をタスクごとに1回にするため、前のタスクの終わりを次のタスクの始まりとする
+	bool timed = metrics_ || budget.ns;
+	Clock::time_point frameStart, last;
+	if (timed) frameStart = last = Clock::now();
+	// 眠っていたタスクと、完了した読み込みを待っていたタスクを起こす
+	while (!sleeping_.empty() && sleeping_.begin()->first <= frame_) {
+	  wake(sleeping_.begin()->second);
+	  sleeping_.erase(sleeping_.begin());
+	}
+	if (!timers_.empty()) {
+	  auto now = Clock::now();
+	  while (!timers_.empty() && timers_.begin()->first <= now) {
+		wake(timers_.begin()->second);
+		timers_.erase(timers_.begin());
+	  }
+	}
+	if (io_) io_->poll();
+	// 入力イベントを待っていたタスクを起こす
+	if (input_) input_->dispatch(this, [this](uint64_t token) { wake(token); });
+	size_t depth = queue_.size();
+	FrameResult result;
 	while (!queue_.empty()) {
+	  if (budget.tasks && result.ran >= budget.tasks) break;
+	  if (budget.ns && result.ran > 0 && nanoseconds(last - frameStart) >= budget.ns) break;
+	  ++result.ran;
 	  Task task(std::move(queue_.front()));
 	  queue_.pop_front();
 	  //cerr << "taskname: " << task.name() << endl;
@@ -47,27 +292,182 @@ public:
 	  body->valid("get");
 	  //cerr << "update do task()" << endl;
 	  auto ret = body.get()(*this);
-	  cerr << "update: task '" << body->name() << "' done" << endl;
+	  uint64_t park = parkToken_;
+	  parkToken_ = 0;
+	  TS_TASK_LOG("update: task '" << body->name() << "' done");
+	  if (trace_) trace_->taskDone(body->name(), ret);
+	  if (timed) {
+		auto now = Clock::now();
+		if (metrics_) metrics_->recordTask(body->name(), nanoseconds(now - last), ret == TaskStatus::ContinueTask);
+		last = now;
+	  }
 	  switch (ret) {
 	  case TaskStatus::RemoveTask:
 		if (!task.isReferenceObject()) {
-		  trash_.emplace_back(move(task));
+		  if (reclaim_ == Reclaim::Keep) trash_.emplace_back(move(task));
+		  else {
+			task.retire();
+			if (reclaim_ != Reclaim::Inline) trash_.emplace_back(move(task));
+		  }
 		}
 		break;
 	  case TaskStatus::ContinueTask:
 		body.get().valid("continue");
-		addTask(std::move(task));
+		if (park) parked_.emplace(park, std::move(task));
+		else enqueue(std::move(task));
 		break;
 	  default:
 		break;
 	  }
 	}
-	swap(queue_, nextqueue_);
+	result.deferred = queue_.size();
+	if (queue_.empty()) swap(queue_, nextqueue_);
+	else {
+	  // 上限で残ったタスクの後ろに、次のフレームのタスクを並べる
+	  for (auto& t : nextqueue_) queue_.emplace_back(std::move(t));
+	  nextqueue_.clear();
+	}
+	// 有界モードで受け付けたタスクを、優先度の高いものから並べる
+	moveAdmitted(queue_);
+	publishDepth();
+	// このフレームで投入した読み込みをまとめて実行する
+	if (io_) io_->flush();
+	reclaimTrash();
+	// このフレームで参照が無くなったオブジェクトを破棄する
+	refs_.flush();
+	if (metrics_) metrics_->recordFrame(nanoseconds(Clock::now() - frameStart), depth);
+	if (trace_) trace_->frameEnd();
+	return result;
+  }
+
+  // 終わったタスクの破棄の方法を設定する。budgetNsはEndOfFrameの1フレームの予算(0は無制限)
+  void setReclaim(Reclaim reclaim, uint64_t budgetNs = 0) {
+	// Keepで残していたタスクも、新しい方法で破棄する
+	if (reclaim_ == Reclaim::Keep && reclaim != Reclaim::Keep) {
+	  for (auto& t : trash_) t.retire();
+	}
+	reclaim_ = reclaim;
+	reclaimBudget_ = budgetNs;
+	if (reclaim == Reclaim::Background && !reclaimer_) reclaimer_.reset(new Reclaimer<Task>);
+  }
+  Reclaim reclaimPolicy() const { return reclaim_; }
+  // 破棄を待っているタスクの数(Keepでは残しているタスクの数)
+  size_t trashSize() const { return trash_.size(); }
+  // Backgroundで渡したタスクが、すべて破棄されるまで待つ
+  void drainReclaimer() {
+	if (reclaimer_) reclaimer_->drain();
+  }
+
+  // 計測を設定する。nullptrで解除。metricsは解除するまで破棄しないこと
+  void setMetrics(TaskMetrics* metrics) { metrics_ = metrics; }
+
+  // 記録・再生のフックを設定する。nullptrで解除
+  void setTrace(Trace* trace) { trace_ = trace; }
+
+  // 非同期の読み込み。最初に呼んだ時に作る
+  AsyncIO& io() {
+	if (!io_) setIO(std::unique_ptr<AsyncIO>(new AsyncIO));
+	return *io_;
+  }
+  // makeLocalRef()に渡すと、参照が無くなったオブジェクトをupdate()の終わりにまとめて破棄する
+  RefReleaser& refs() { return refs_; }
+
+  // 読み込みの方式を指定する時は、io()を呼ぶ前に設定する
+  void setIO(std::unique_ptr<AsyncIO> io) {
+	io_ = std::move(io);
+	ioNotifies_ = io_ && io_->setNotify([this] { idle_.notify(); });
+  }
+
+  // 実行中のタスクを、ContinueTaskを返した後にキューから外して待たせる
+  // 戻り値を渡してwake()を呼ぶと、キューに戻って実行される。タスクがRemoveTaskを返した場合は何もしない
+  uint64_t park() {
+	parkToken_ = ++lastToken_;
+	return parkToken_;
+  }
+  void wake(uint64_t token) {
+	auto it = parked_.find(token);
+	if (it == parked_.end()) return;
+	queue_.emplace_back(std::move(it->second));
+	parked_.erase(it);
+  }
+  // park()で待っているタスクの数
+  size_t parkedCount() const { return parked_.size(); }
+  // park()と同じく実行中のタスクを待たせ、framesフレーム後のupdate()の先頭で起こす
+  // 戻り値でwake()を呼べば、それより前に起こせる
+  uint64_t sleepFrames(uint64_t frames) {
+	uint64_t token = park();
+	sleeping_.emplace(frame_ + std::max<uint64_t>(frames, 1), token);
+	return token;
+  }
+  // park()と同じく実行中のタスクを待たせ、ns経った後のupdate()の先頭で起こす
+  // runUntilFinished()では、その時刻まで他に仕事が無ければ眠って待つ
+  uint64_t sleepFor(uint64_t ns) {
+	uint64_t token = park();
+	timers_.emplace(std::chrono::steady_clock::now() + std::chrono::nanoseconds(ns), token);
+	return token;
+  }
+  // update()を呼んだ回数
+  uint64_t frame() const { return frame_; }
+  // update()ごとに進むエポック。Lazyに渡すと、フレームごとに1回だけ評価する値になる
+  const LazyEpoch& epoch() const { return epoch_; }
+
+  // batchの読み込みがすべて終わったらnextを実行する
+  void waitIO(Task& next, std::shared_ptr<IoBatch> batch) {
+	TS_TASK_LOG("waitIO(" << next.name() << ")");
+	next.valid("waitIO");
+	auto ref = next.clone().name();
+	io().submit(std::move(batch), [this, ref] { enqueue(Task(ref)); });
+  }
+  // batchの読み込みがすべて終わるまで、実行中のタスクを待たせる
+  // タスクはContinueTaskを返すこと。読み込みが終わったフレームで、もう一度呼ばれる
+  void awaitIO(std::shared_ptr<IoBatch> batch) {
+	uint64_t token = park();
+	io().submit(std::move(batch), [this, token] { wake(token); });
+  }
+
+  // 入力イベントをupdate()で配る。nullptrで解除。inputは解除するまで破棄しないこと
+  // runUntilFinished()で眠っている時は、イベントが来たら起こされる
+  // 解除すると、awaitInput()の登録は外れる。待っていたタスクはpark()したまま残り、起こされない
+  void setInput(InputEvents* input) {
+	detachInput();
+	input_ = input;
+	if (input_) input_->setWaiter(&idle_);
+  }
+  // edgeに合う入力イベントが来るまで、実行中のタスクを待たせる。outがあれば来たイベントを書く
+  // タスクはContinueTaskを返すこと。イベントが来たフレームで、もう一度呼ばれる
+  void awaitInput(const InputEdge& edge, InputEvent* out = nullptr) {
+	assert(input_);
+	input_->subscribe(this, edge, park(), out);
+  }
+  // edgeに合う入力イベントが来たらnextを実行する
+  void waitInput(Task& next, const InputEdge& edge) {
+	TS_TASK_LOG("waitInput(" << next.name() << ")");
+	next.valid("waitInput");
+	auto ref = next.clone().name();
+	bool waiting = false;
+	enqueue(Task([ref, edge, waiting](TaskQueue& tq, TaskArgs&) mutable {
+		if (!waiting) {
+		  waiting = true;
+		  tq.awaitInput(edge);
+		  return TaskStatus::ContinueTask;
+		}
+		tq.enqueue(Task(ref));
+		return TaskStatus::RemoveTask;
+	  }));
+  }
+
+  // 条件を評価する。フックがあれば記録・再生される
+  bool evalPred(const std::function<bool()>& pred) {
+	return trace_ ? trace_->predicate(pred) : pred();
+  }
+  // メニューの番号などの外部からの入力を取得する。フックがあれば記録・再生される
+  int input(const std::function<int()>& f) {
+	return trace_ ? trace_->input(f) : f();
   }
 
   // タスクの実行
   void run(Task&& func) {
-	cerr << "run: " << func.name() << endl;
+	TS_TASK_LOG("run: " << func.name());
 	addTask(move(func));
   }
 
@@ -81,18 +481,73 @@ public:
 	return finished_;
   }
 
+  // finish()が呼ばれるまでupdate()を呼び続ける
+  // while (!tq.finished()) tq.update(); と違い、実行できるタスクが無い間は、次の期限まで眠ってCPUを使わない
+  //   - 他のスレッドからのpost()、入力イベント、読み込みの完了で起きる
+  //   - sleepFor()の時刻と、frameNsがあればsleepFrames()のフレームの時刻に起きる
+  //     frameNsが0の時は、sleepFrames()で眠っているタスクがあれば、そのフレームまで待たずにupdate()を続ける
+  // waitPredで待っているタスクは毎フレーム条件を調べるので、その間は眠らない(awaitInputなどを使うこと)
+  void runUntilFinished() { runUntilFinished(RunOptions()); }
+  void runUntilFinished(const RunOptions& options) {
+	using Clock = std::chrono::steady_clock;
+	using Ns = std::chrono::nanoseconds;
+	auto next = Clock::now(); // 次のフレームの時刻
+	while (!finished_) {
+	  update();
+	  if (finished_) break;
+	  auto now = Clock::now();
+	  if (options.frameNs) {
+		next += Ns(options.frameNs);
+		// 遅れた分を取り戻そうとして、続けてupdate()しない
+		if (next < now) next = now;
+	  }
+	  if (runnable()) {
+		if (options.frameNs) std::this_thread::sleep_until(next);
+		continue;
+	  }
+	  // 実行できるタスクが無いので、最も近い期限まで眠る
+	  bool timed = false;
+	  auto deadline = now;
+	  auto earlier = [&](Clock::time_point t) {
+		if (!timed || t < deadline) deadline = t;
+		timed = true;
+	  };
+	  if (!sleeping_.empty()) {
+		if (!options.frameNs) continue;
+		earlier(next + Ns(options.frameNs) * int64_t(sleeping_.begin()->first - frame_ - 1));
+	  }
+	  if (!timers_.empty()) earlier(timers_.begin()->first);
+	  if (io_ && io_->inFlight() && !ioNotifies_) earlier(now + Ns(options.ioPollNs));
+	  int64_t timeout = -1;
+	  if (timed) {
+		timeout = std::chrono::duration_cast<Ns>(deadline - now).count();
+		if (timeout <= 0) continue;
+	  }
+	  idle_.wait([this] { return hasPendingWork(); }, timeout);
+	  // 起きたらすぐにupdate()し、そこからフレームを数え直す
+	  if (options.frameNs) next = std::max(next, Clock::now());
+	}
+  }
+  // runUntilFinished()で眠った回数と時間
+  const IdleWaiter::Stats& idleStats() const { return idle_.stats(); }
+  // 次のupdate()で実行するタスクも、その次のフレームに登録されたタスクも無い
+  // park()で待っているタスクは含まない
+  bool empty() const {
+	return queue_.empty() && nextqueue_.empty();
+  }
+
   // predがtrueになるまで待ってからnextを実行する
   void waitPred(Task& next, std::function<bool()> pred) {
-	cerr << "waitPred(" << next.name() << ")" << endl;
+	TS_TASK_LOG("waitPred(" << next.name() << ")");
 	next.valid("waitPred");
 	// ラムダ式にムーブでキャプチャできないので名前を渡す
 	auto ref = next.clone().name();
 	Task waittask([this, ref, pred](TaskQueue&, TaskArgs&){
 		Task nh(ref);
-		cerr << "waitPred" << endl;
-		if (pred()) {
+		TS_TASK_LOG("waitPred");
+		if (evalPred(pred)) {
 		  // 条件が成立したのでタスクを実行する
-		  addTask(std::move(nh));
+		  enqueue(std::move(nh));
 		  return TaskStatus::RemoveTask;
 		}
 		else {
@@ -101,11 +556,159 @@ public:
 		}
 	  });
 	// 条件が成立したらタスクを実行するタスクを登録
-	addTask(std::move(waittask));
+	enqueue(std::move(waittask));
+  }
+
+private:
+  // 上限を見ずに、次のフレームのキューに入れる
+  void enqueue(Task&& task) {
+	TS_TASK_LOG("addTask: " << task.name());
+	task.valid("addtask");
+	nextqueue_.emplace_back(move(task));
+  }
+  // 有界モードで受け付ける
+  bool admit(Task&& task, Priority priority) {
+	task.valid("addtask");
+	if (depth() >= capacity_) {
+	  bool dropped = false;
+	  if (overflow_ == Overflow::DropOldest) {
+		for (size_t p = 0; p <= size_t(priority) && !dropped; ++p) {
+		  auto& q = admitted_[p];
+		  if (q.empty()) continue;
+		  q.front().retire();
+		  q.pop_front();
+		  --admittedCount_;
+		  overflowed(TaskMetrics::Overflow::Dropped);
+		  dropped = true;
+		}
+	  }
+	  if (!dropped) {
+		TS_TASK_LOG("addTask: " << task.name() << " rejected");
+		task.retire();
+		overflowed(TaskMetrics::Overflow::Rejected);
+		return false;
+	  }
+	}
+	TS_TASK_LOG("addTask: " << task.name());
+	admitted_[size_t(priority)].emplace_back(std::move(task));
+	++admittedCount_;
+	++accepted_;
+	return true;
+  }
+  void overflowed(TaskMetrics::Overflow kind) {
+	overflows_[size_t(kind)].fetch_add(1, std::memory_order_relaxed);
+	if (metrics_) metrics_->recordOverflow(kind);
+  }
+  void moveAdmitted(std::deque<Task>& to) {
+	if (!admittedCount_) return;
+	for (size_t p = PriorityCount; p-- > 0;) {
+	  for (auto& t : admitted_[p]) to.emplace_back(std::move(t));
+	  admitted_[p].clear();
+	}
+	admittedCount_ = 0;
+  }
+  // post()されたタスクを作り、このフレームのキューに入れる。有界モードでは上限を見て受け付ける
+  void drainInbox() {
+	{
+	  std::lock_guard<std::mutex> lock(inboxMutex_);
+	  if (inbox_.empty()) return;
+	  draining_.swap(inbox_);
+	}
+	if (!capacity_) {
+	  for (auto& e : draining_) {
+		Task task(e.first());
+		TS_TASK_LOG("post: " << task.name());
+		task.valid("post");
+		queue_.emplace_back(std::move(task));
+	  }
+	  draining_.clear();
+	  return;
+	}
+	// 前のupdate()の後にaddTask()したタスクは、これまでどおり次のフレームに回すので分けておく
+	size_t held = admittedCount_;
+	for (size_t p = 0; p < PriorityCount; ++p) held_[p].swap(admitted_[p]);
+	for (auto& e : draining_) admit(e.first(), e.second);
+	draining_.clear();
+	moveAdmitted(queue_);
+	for (size_t p = 0; p < PriorityCount; ++p) held_[p].swap(admitted_[p]);
+	admittedCount_ = held;
+  }
+  // 入力イベントの登録と、眠っている時に起こしてもらう設定を外す
+  void detachInput() {
+	if (!input_) return;
+	input_->unsubscribe(this);
+	input_->setWaiter(nullptr);
+	input_ = nullptr;
+  }
+  // 次のupdate()で実行するタスクがある
+  bool runnable() const {
+	return !queue_.empty() || !nextqueue_.empty() || admittedCount_ || (io_ && io_->ready());
+  }
+  // 他のスレッドから届いた仕事がある。idle_で眠ると宣言した後に呼ぶ
+  bool hasPendingWork() {
+	if ((io_ && io_->ready()) || (input_ && input_->pending())) return true;
+	return hasPosted();
+  }
+  // Blockで待っているスレッドに、キューの長さを知らせる
+  void publishDepth() {
+	if (!capacity_) return;
+	publishedDepth_.store(depth());
+	if (blockedProducers_.load() > 0) {
+	  std::lock_guard<std::mutex> lock(inboxMutex_);
+	  inboxSpace_.notify_all();
+	}
+  }
+
+  // update()の終わりに、終わったタスクを破棄する
+  void reclaimTrash() {
+	if (trash_.empty()) return;
+	switch (reclaim_) {
+	case Reclaim::Keep:
+	  break;
+	case Reclaim::Inline:
+	  trash_.clear();
+	  break;
+	case Reclaim::EndOfFrame:
+	  if (!reclaimBudget_) trash_.clear();
+	  else {
+		// 後ろから破棄し、予算を超えたら残りは次のフレームに回す
+		using Clock = std::chrono::steady_clock;
+		auto start = Clock::now();
+		do {
+		  trash_.pop_back();
+		} while (!trash_.empty() && nanoseconds(Clock::now() - start) < reclaimBudget_);
+	  }
+	  break;
+	case Reclaim::Background:
+	  postToReclaimer();
+	  break;
+	}
+  }
+  // このスレッドで破棄するタスクを除いて、Reclaimerに渡す
+  void postToReclaimer() {
+	// LocalRefをキャプチャしたタスクがあるかもしれない
+	if (localRefObjects()) {
+	  trash_.clear();
+	  return;
+	}
+	size_t keep = 0;
+	for (size_t i = 0; i < trash_.size(); ++i) {
+	  if (trash_[i].threadBound()) continue;
+	  if (keep != i) trash_[keep] = std::move(trash_[i]);
+	  ++keep;
+	}
+	// 残ったタスクと、ムーブした後の空のタスクを破棄する
+	trash_.erase(trash_.begin() + keep, trash_.end());
+	reclaimer_->post(trash_);
+  }
+
+  template <typename D>
+  static uint64_t nanoseconds(D d) {
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
   }
 };
 
-  using Task = TaskT<TaskQueue>;
+  using Task = TaskT<TaskQueue, TaskQueue::TaskName>;
   using TaskArgs = Task::TaskArgs;
 
 }} // ts::namedobj
@@ -0,0 +1,233 @@
+// -*-tab-width:4;c++-*-
+//
+// タスクキューのフレームの記録と再生
+//
+// TaskRecorderはTaskQueue::Traceとして、update()のフレームごとに
+// 実行されたタスクの名前と順番、戻り値、waitPredの条件の結果、input()で取得した値、フレームの処理時間を記録します。
+// TaskReplayerは記録を読み込み、条件と入力を記録の値に置き換えて(元の関数は呼びません)同じ順番でタスクを実行させ、
+// フレームごとの処理時間を測ります。実行されたタスクが記録と異なる場合は不一致として数えます。
+// キー入力などに左右されずに同じフレームの列を再現できるので、フレーム時間の比較に使えます。
+//
+// 記録(TaskTraceLog)は1行1イベントのテキストです。
+//   frame <フレーム番号>
+//   task <名前の長さ> <タスク名> <remove|continue>
+//     名前は空白や改行を含んでもよいように、長さを前に書いてそのまま書く(空の名前は長さ0)
+//   pred <0|1>
+//   input <値>
+//   end <処理時間(ns)>
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+
+namespace ts {
+namespace namedobj {
+
+  struct TraceEvent {
+	enum Kind : uint8_t { Frame, TaskDone, Pred, Input, End };
+	Kind kind;
+	int64_t value; // フレーム番号、戻り値(0:remove 1:continue)、条件、入力値、処理時間
+	TaskQueue::TaskName name;
+  };
+
+  // 記録したイベントの列
+  struct TaskTraceLog {
+	std::vector<TraceEvent> events;
+
+	void write(std::ostream& os) const {
+	  for (auto& e : events) {
+		switch (e.kind) {
+		case TraceEvent::Frame: os << "frame " << e.value << '\n'; break;
+		case TraceEvent::TaskDone:
+		  os << "task " << e.name.size() << ' ' << e.name << (e.value ? " continue" : " remove") << '\n';
+		  break;
+		case TraceEvent::Pred: os << "pred " << e.value << '\n'; break;
+		case TraceEvent::Input: os << "input " << e.value << '\n'; break;
+		case TraceEvent::End: os << "end " << e.value << '\n'; break;
+		}
+	  }
+	}
+	// 読み込む。形式が違う行があればstd::runtime_errorを投げる
+	void read(std::istream& is) {
+	  events.clear();
+	  std::string kind;
+	  size_t line = 0;
+	  while (is >> kind) {
+		++line;
+		TraceEvent e{ TraceEvent::Frame, 0, TaskQueue::TaskName() };
+		bool ok = true;
+		if (kind == "frame") ok = bool(is >> e.value);
+		else if (kind == "task") {
+		  std::string status;
+		  e.kind = TraceEvent::TaskDone;
+		  ok = readName(is, e.name) && bool(is >> status) && (status == "remove" || status == "continue");
+		  e.value = status == "continue";
+		}
+		else if (kind == "pred") { e.kind = TraceEvent::Pred; ok = bool(is >> e.value); }
+		else if (kind == "input") { e.kind = TraceEvent::Input; ok = bool(is >> e.value); }
+		else if (kind == "end") { e.kind = TraceEvent::End; ok = bool(is >> e.value); }
+		else ok = false;
+		if (!ok) throw std::runtime_error("TaskTraceLog: bad event at line " + std::to_string(line));
+		events.push_back(e);
+	  }
+	}
+
+  private:
+	// "<長さ> <名前>"を読む。名前の長さが上限を超えればfalse
+	static bool readName(std::istream& is, TaskQueue::TaskName& name) {
+	  size_t size;
+	  if (!(is >> size) || is.get() != ' ' || size > TaskQueue::TaskName::capacity) return false;
+	  char buf[TaskQueue::TaskName::capacity];
+	  if (!is.read(buf, std::streamsize(size))) return false;
+	  name = TaskQueue::TaskName(buf, size);
+	  return true;
+	}
+  };
+
+  // フレームを記録する
+  class TaskRecorder : public TaskQueue::Trace {
+	using Clock = std::chrono::steady_clock;
+  public:
+	void frameBegin() override {
+	  log_.events.push_back({ TraceEvent::Frame, ++frame_, TaskQueue::TaskName() });
+	  start_ = Clock::now();
+	}
+	void taskDone(const TaskQueue::TaskName& name, TaskStatus status) override {
+	  log_.events.push_back({ TraceEvent::TaskDone, status == TaskStatus::ContinueTask, name });
+	}
+	void frameEnd() override {
+	  int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_).count();
+	  log_.events.push_back({ TraceEvent::End, ns, TaskQueue::TaskName() });
+	}
+	bool predicate(const std::function<bool()>& pred) override {
+	  bool r = pred();
+	  log_.events.push_back({ TraceEvent::Pred, r, TaskQueue::TaskName() });
+	  return r;
+	}
+	int input(const std::function<int()>& f) override {
+	  int r = f();
+	  log_.events.push_back({ TraceEvent::Input, r, TaskQueue::TaskName() });
+	  return r;
+	}
+
+	const TaskTraceLog& log() const { return log_; }
+
+  private:
+	TaskTraceLog log_;
+	int64_t frame_ = 0;
+	Clock::time_point start_;
+  };
+
+  // 記録を再生する
+  class TaskReplayer : public TaskQueue::Trace {
+	using Clock = std::chrono::steady_clock;
+  public:
+	struct FrameTiming {
+	  int64_t frame;
+	  int64_t recordedNs;
+	  int64_t replayNs;
+	};
+
+	// logは再生が終わるまで破棄しないこと
+	explicit TaskReplayer(const TaskTraceLog& log) : events_(log.events) {}
+
+	void frameBegin() override {
+	  // 前のフレームで消費しなかったイベントを読み飛ばして、フレームの先頭に合わせる
+	  while (pos_ < events_.size() && events_[pos_].kind != TraceEvent::Frame) {
+		++pos_;
+		++mismatches_;
+	  }
+	  frame_ = pos_ < events_.size() ? events_[pos_++].value : -1;
+	  if (frame_ < 0) ++mismatches_;
+	  start_ = Clock::now();
+	}
+	void taskDone(const TaskQueue::TaskName& name, TaskStatus status) override {
+	  const TraceEvent* e = next(TraceEvent::TaskDone);
+	  if (e && (e->name != name || e->value != (status == TaskStatus::ContinueTask))) ++mismatches_;
+	}
+	void frameEnd() override {
+	  int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_).count();
+	  const TraceEvent* e = next(TraceEvent::End);
+	  frames_.push_back({ frame_, e ? e->value : 0, ns });
+	}
+	// 条件と入力は記録の値を返す。記録と合わなければfalse/0
+	bool predicate(const std::function<bool()>&) override {
+	  const TraceEvent* e = next(TraceEvent::Pred);
+	  return e && e->value != 0;
+	}
+	int input(const std::function<int()>&) override {
+	  const TraceEvent* e = next(TraceEvent::Input);
+	  return e ? int(e->value) : 0;
+	}
+
+	// 記録をすべて再生した
+	bool finished() const { return pos_ >= events_.size(); }
+	// 記録と異なった回数
+	size_t mismatches() const { return mismatches_; }
+	const std::vector<FrameTiming>& frames() const { return frames_; }
+
+	// フレーム時間の集計を出力する
+	// threshold: 記録の何倍を超えたフレームを遅くなったとみなすか
+	void report(std::ostream& os, double threshold = 2.0) const {
+	  if (frames_.empty()) {
+		os << "no frames replayed" << std::endl;
+		return;
+	  }
+	  std::vector<int64_t> recorded, replay;
+	  for (auto& f : frames_) {
+		recorded.push_back(f.recordedNs);
+		replay.push_back(f.replayNs);
+	  }
+	  os << "frames " << frames_.size() << ", mismatches " << mismatches_ << std::endl;
+	  os << "            mean      p50      p99      max (ns)" << std::endl;
+	  summary(os, "recorded", recorded);
+	  summary(os, "replay  ", replay);
+	  size_t slow = 0;
+	  for (auto& f : frames_) {
+		if (f.recordedNs > 0 && f.replayNs > f.recordedNs * threshold) {
+		  if (++slow <= 10) {
+			os << "  frame " << f.frame << ": " << f.replayNs << " ns (recorded " << f.recordedNs << " ns)" << std::endl;
+		  }
+		}
+	  }
+	  os << slow << " frames slower than " << threshold << "x the recording" << std::endl;
+	}
+
+  private:
+	// 次のイベントがkindなら取り出す。違えば不一致として数え、取り出さない
+	const TraceEvent* next(TraceEvent::Kind kind) {
+	  if (pos_ < events_.size() && events_[pos_].kind == kind) return &events_[pos_++];
+	  ++mismatches_;
+	  return nullptr;
+	}
+	static void summary(std::ostream& os, const char* label, std::vector<int64_t>& ns) {
+	  std::sort(ns.begin(), ns.end());
+	  double mean = 0;
+	  for (auto v : ns) mean += double(v);
+	  mean /= double(ns.size());
+	  auto at = [&](double p) { return ns[std::min(ns.size() - 1, size_t(p * double(ns.size())))]; };
+	  char buf[128];
+	  snprintf(buf, sizeof(buf), "%s %8.0f %8lld %8lld %8lld", label, mean,
+			   (long long)at(0.5), (long long)at(0.99), (long long)ns.back());
+	  os << buf << std::endl;
+	}
+
+	const std::vector<TraceEvent>& events_;
+	size_t pos_ = 0;
+	size_t mismatches_ = 0;
+	int64_t frame_ = 0;
+	Clock::time_point start_;
+	std::vector<FrameTiming> frames_;
+  };
+
+}} // ts::namedobj
@@ -0,0 +1,156 @@
+// -*-tab-width:4-*-
+//
+// フレームの記録と再生のサンプル
+// TaskTest.cppと同じタスクの木を、乱数で決まる入力で動かして記録し、記録を再生してフレーム時間を比べる
+// ./t5 record <記録ファイル> [フレーム数]
+// ./t5 replay <記録ファイル>
+// 記録の時に、空白を含む名前や空の名前が書いて読み戻せることを確かめる
+//
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "NamedObject.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "TaskReplay.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using ts::instrument::checkResult;
+
+// 入力のスタブ。記録の時だけ呼ばれ、再生の時は記録の値が使われる
+static std::mt19937 rng(std::random_device{}());
+static int lastFrame = 0;
+static int frame = 0;
+bool keyWait() { return rng() % 4 == 0; }
+int selectedMenu() { return frame >= lastFrame ? 3 : int(rng() % 3); }
+bool gameOver() { return rng() % 50 == 0; }
+
+// ゲームの1フレーム分の処理のかわり
+static volatile uint64_t sink;
+void simulate(int n) {
+  uint64_t x = 1;
+  for (int i = 0; i < n; ++i) x = x * 6364136223846793005ull + 1442695040888963407ull;
+  sink = x;
+}
+
+Task buildTree() {
+  auto titleLogo = [](TaskQueue& tq, TaskArgs& ar) {
+	tq.waitPred(ar.at(0), [] { return keyWait(); });
+	return TaskStatus::RemoveTask;
+  };
+  auto mainMenu = [](TaskQueue& tq, TaskArgs& ar) {
+	switch (tq.input(selectedMenu)) {
+	default:
+	  return TaskStatus::ContinueTask;
+	case 1:
+	  tq.addTask(ar.at(0).clone());
+	  return TaskStatus::RemoveTask;
+	case 2:
+	  tq.addTask(ar.at(1).clone());
+	  return TaskStatus::RemoveTask;
+	case 3:
+	  tq.finish();
+	  return TaskStatus::RemoveTask;
+	}
+  };
+  auto ending = [](TaskQueue& tq, TaskArgs& ar) {
+	tq.waitPred(ar.at(0), [] { return keyWait(); });
+	return TaskStatus::RemoveTask;
+  };
+  // ゲームの処理は毎フレーム行い、終了の判定だけを入力として記録する
+  auto gameMain = [](TaskQueue& tq, TaskArgs& ar) {
+	simulate(20000);
+	if (tq.evalPred(gameOver)) {
+	  tq.addTask(ar.at(0).clone());
+	  return TaskStatus::RemoveTask;
+	}
+	return TaskStatus::ContinueTask;
+  };
+  auto settingMenu = [](TaskQueue& tq, TaskArgs& ar) {
+	simulate(2000);
+	Task ptask(ar.parent_);
+	tq.waitPred(ptask, [] { return keyWait(); });
+	return TaskStatus::RemoveTask;
+  };
+  return {
+	"titleLogo",
+	  titleLogo, {
+	  "main", mainMenu, {
+		{ gameMain, { ending, { "main" } } },
+		{ settingMenu }
+	  }
+	}
+  };
+}
+
+void check() {
+  TaskTraceLog log;
+  const char* names[] = { "title logo", "", "tab\tand\nnewline", " edge ", "0123456789012345678901234567890" };
+  log.events.push_back({ TraceEvent::Frame, 1, TaskQueue::TaskName() });
+  for (auto n : names) log.events.push_back({ TraceEvent::TaskDone, 1, TaskQueue::TaskName(n, strlen(n)) });
+  log.events.push_back({ TraceEvent::End, 100, TaskQueue::TaskName() });
+  stringstream ss;
+  log.write(ss);
+  TaskTraceLog back;
+  back.read(ss);
+  TS_CHECK_EQ(back.events.size(), log.events.size());
+  for (size_t i = 0; i < back.events.size() && i < log.events.size(); ++i) {
+	TS_CHECK(back.events[i].kind == log.events[i].kind);
+	TS_CHECK_EQ(back.events[i].value, log.events[i].value);
+	TS_CHECK_EQ(back.events[i].name.str(), log.events[i].name.str());
+  }
+  // 名前の長さが上限を超える記録は読まない
+  stringstream bad("frame 1\ntask 40 0123456789012345678901234567890123456789 remove\n");
+  bool thrown = false;
+  try {
+	back.read(bad);
+  }
+  catch (runtime_error&) {
+	thrown = true;
+  }
+  TS_CHECK(thrown);
+}
+
+int main(int ac, char* av[]) {
+  if (ac < 3) {
+	cerr << "usage: " << av[0] << " record|replay <file> [frames]" << endl;
+	return 1;
+  }
+  TaskQueue tq;
+  tq.run(buildTree());
+
+  if (strcmp(av[1], "record") == 0) {
+	lastFrame = ac > 3 ? atoi(av[3]) : 2000;
+	TaskRecorder recorder;
+	tq.setTrace(&recorder);
+	while (!tq.finished()) {
+	  ++frame;
+	  tq.update();
+	}
+	ofstream os(av[2]);
+	recorder.log().write(os);
+	cout << "recorded " << frame << " frames" << endl;
+	check();
+	return checkResult("replay");
+  }
+  else {
+	TaskTraceLog log;
+	ifstream is(av[2]);
+	log.read(is);
+	TaskReplayer replayer(log);
+	tq.setTrace(&replayer);
+	while (!tq.finished() && !replayer.finished()) tq.update();
+	replayer.report(cout);
+	return replayer.mismatches() == 0 ? 0 : 1;
+  }
+}
@@ -0,0 +1,373 @@
+// -*-tab-width:4;c++-*-
+//
+// タスクキューのスナップショット
+//
+// TaskSnapshotは、TaskQueueの状態(queue_/nextqueue_/trash_のタスク、引数のタスクの木構造、名前、関数)を
+// バイナリのイメージに保存し、イメージから復元するクラスです。
+// std::functionは保存できないので、タスクの関数はTaskFuncTableに名前を付けて登録したものに限ります。
+// イメージには関数の名前を保存し、復元する時に同じ名前で登録された関数を使います。
+// waitPredのタスクのように、登録されていない関数を持つタスクがあると保存は例外になります。
+//
+// イメージは、ヘッダ、タスクのレコードの配列、キューに入っているタスクの番号、関数の名前、文字列の順に並びます。
+// 子のタスクのレコードは連続して並ぶので、レコードは最初の子の番号と子の数だけを持ちます。
+// 復元はイメージをmmapして、タスクを最終的な位置に直接構築します(ムーブのたびに登録し直すことがありません)。
+// 名前はまとめて登録し、Registryの整列した配列に一度に並べます。
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+
+namespace ts {
+namespace namedobj {
+
+  class TaskFuncTable;
+
+  // TaskFuncTableに登録された関数
+  // std::function::targetで取り出して、関数の番号を調べる
+  struct RegisteredFunc {
+	const TaskFuncTable* table;
+	uint32_t id;
+	inline TaskStatus operator () (TaskQueue& tq, TaskArgs& args) const;
+  };
+
+  // 名前を付けたタスクの関数の表
+  class TaskFuncTable {
+  public:
+	using TaskFunc = Task::TaskFunc;
+	static constexpr uint32_t NoFunc = UINT32_MAX;
+
+	TaskFuncTable() = default;
+	// 登録した関数はこの表を参照するので、コピーとムーブは禁止
+	TaskFuncTable(const TaskFuncTable&) = delete;
+	TaskFuncTable& operator = (const TaskFuncTable&) = delete;
+
+	// 関数を名前で登録し、タスクに渡す関数を返す
+	TaskFunc add(const std::string& name, TaskFunc f) {
+	  if (name.size() > 255) throw std::invalid_argument("TaskFuncTable: function name is too long: " + name);
+	  auto found = ids_.find(name);
+	  uint32_t id;
+	  if (found != ids_.end()) {
+		id = found->second;
+		funcs_[id].second = std::move(f);
+	  }
+	  else {
+		id = uint32_t(funcs_.size());
+		funcs_.emplace_back(name, std::move(f));
+		ids_.emplace(name, id);
+	  }
+	  return RegisteredFunc{ this, id };
+	}
+	// 登録済みの関数
+	TaskFunc get(uint32_t id) const { return RegisteredFunc{ this, id }; }
+	// 名前から関数の番号を調べる。無ければNoFunc
+	uint32_t find(const std::string& name) const {
+	  auto found = ids_.find(name);
+	  return found != ids_.end() ? found->second : NoFunc;
+	}
+	// タスクの関数の番号を調べる。この表に登録された関数でなければNoFunc
+	uint32_t idOf(const TaskFunc& f) const {
+	  auto r = f.target<RegisteredFunc>();
+	  return r && r->table == this ? r->id : NoFunc;
+	}
+	const std::string& name(uint32_t id) const { return funcs_.at(id).first; }
+	size_t size() const { return funcs_.size(); }
+
+	TaskStatus call(uint32_t id, TaskQueue& tq, TaskArgs& args) const { return funcs_[id].second(tq, args); }
+
+  private:
+	std::vector<std::pair<std::string, TaskFunc>> funcs_;
+	std::unordered_map<std::string, uint32_t> ids_;
+  };
+
+  TaskStatus RegisteredFunc::operator () (TaskQueue& tq, TaskArgs& args) const {
+	return table->call(id, tq, args);
+  }
+
+  // イメージのヘッダ
+  struct TaskImageHeader {
+	char magic[8];         // "TSTASK01"
+	uint32_t version;
+	uint32_t taskCount;    // レコードの数
+	uint32_t rootCount[3]; // queue_/nextqueue_/trash_のタスクの数
+	uint32_t funcCount;    // 関数の名前の数
+	uint32_t stringSize;   // 文字列の領域のバイト数
+	uint32_t finished;     // 終了フラグ
+  };
+
+  // タスクのレコード。文字列は文字列の領域の位置(長さ1バイト+文字)
+  struct TaskRecord {
+	enum : uint32_t { Reference = 1 };
+	uint32_t name;
+	uint32_t self;
+	uint32_t parent;
+	uint32_t func;       // 関数の名前の番号。関数が無ければTaskFuncTable::NoFunc
+	uint32_t firstChild; // 最初の子のレコードの番号
+	uint32_t childCount;
+	uint32_t flags;
+  };
+
+  class TaskSnapshot {
+  public:
+	static const char* magic() { return "TSTASK01"; }
+	static constexpr uint32_t Version = 1;
+
+	// タスクキューの状態をイメージにする
+	static std::vector<uint8_t> save(const TaskQueue& tq, const TaskFuncTable& table) {
+	  Builder b(table);
+	  for (auto& t : tq.queue_) b.addTree(t);
+	  for (auto& t : tq.nextqueue_) b.addTree(t);
+	  for (auto& t : tq.trash_) b.addTree(t);
+
+	  TaskImageHeader header;
+	  memcpy(header.magic, magic(), sizeof(header.magic));
+	  header.version = Version;
+	  header.taskCount = uint32_t(b.records.size());
+	  header.rootCount[0] = uint32_t(tq.queue_.size());
+	  header.rootCount[1] = uint32_t(tq.nextqueue_.size());
+	  header.rootCount[2] = uint32_t(tq.trash_.size());
+	  header.funcCount = uint32_t(b.funcNames.size());
+	  header.stringSize = uint32_t(b.strings.size());
+	  header.finished = tq.finished_;
+
+	  std::vector<uint8_t> image;
+	  image.reserve(imageSize(header));
+	  append(image, &header, sizeof(header));
+	  append(image, b.records.data(), b.records.size() * sizeof(TaskRecord));
+	  append(image, b.roots.data(), b.roots.size() * sizeof(uint32_t));
+	  append(image, b.funcNames.data(), b.funcNames.size() * sizeof(uint32_t));
+	  append(image, b.strings.data(), b.strings.size());
+	  return image;
+	}
+	static void saveFile(const std::string& path, const TaskQueue& tq, const TaskFuncTable& table) {
+	  auto image = save(tq, table);
+	  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	  if (fd < 0) throw std::system_error(errno, std::generic_category(), "open " + path);
+	  size_t done = 0;
+	  while (done < image.size()) {
+		ssize_t n = ::write(fd, image.data() + done, image.size() - done);
+		if (n < 0) {
+		  if (errno == EINTR) continue;
+		  int e = errno;
+		  ::close(fd);
+		  throw std::system_error(e, std::generic_category(), "write " + path);
+		}
+		done += size_t(n);
+	  }
+	  ::close(fd);
+	}
+
+	// イメージからタスクキューを復元する。復元したタスクはキューの後ろに追加される
+	// イメージが壊れている場合や、関数が関数表に無い場合はstd::runtime_errorを投げる
+	static void restore(TaskQueue& tq, const void* data, size_t size, const TaskFuncTable& table) {
+	  Reader r(data, size, table);
+	  const uint32_t* roots = r.roots;
+	  for (uint32_t i = 0; i < r.header.rootCount[0]; ++i) {
+		tq.queue_.emplace_back();
+		r.fill(tq.queue_.back(), *roots++);
+	  }
+	  for (uint32_t i = 0; i < r.header.rootCount[1]; ++i) {
+		tq.nextqueue_.emplace_back();
+		r.fill(tq.nextqueue_.back(), *roots++);
+	  }
+	  tq.trash_.reserve(tq.trash_.size() + r.header.rootCount[2]);
+	  for (uint32_t i = 0; i < r.header.rootCount[2]; ++i) {
+		tq.trash_.emplace_back();
+		r.fill(tq.trash_.back(), *roots++);
+	  }
+	  tq.finished_ = r.header.finished != 0;
+	  Task::registerAll(std::move(r.entries));
+	}
+	// イメージファイルをmmapして復元する
+	static void restoreFile(TaskQueue& tq, const std::string& path, const TaskFuncTable& table) {
+	  int fd = ::open(path.c_str(), O_RDONLY);
+	  if (fd < 0) throw std::system_error(errno, std::generic_category(), "open " + path);
+	  struct stat st;
+	  if (::fstat(fd, &st) < 0) {
+		int e = errno;
+		::close(fd);
+		throw std::system_error(e, std::generic_category(), "fstat " + path);
+	  }
+	  size_t size = size_t(st.st_size);
+#ifdef MAP_POPULATE
+	  const int flags = MAP_PRIVATE | MAP_POPULATE; // 復元の途中でページフォールトしないように先に読む
+#else
+	  const int flags = MAP_PRIVATE;
+#endif
+	  void* p = size > 0 ? ::mmap(nullptr, size, PROT_READ, flags, fd, 0) : MAP_FAILED;
+	  int e = errno;
+	  ::close(fd);
+	  if (p == MAP_FAILED) throw std::system_error(size > 0 ? e : EINVAL, std::generic_category(), "mmap " + path);
+	  try {
+		restore(tq, p, size, table);
+	  }
+	  catch (...) {
+		::munmap(p, size);
+		throw;
+	  }
+	  ::munmap(p, size);
+	}
+
+  private:
+	static size_t imageSize(const TaskImageHeader& h) {
+	  return sizeof(TaskImageHeader) + size_t(h.taskCount) * sizeof(TaskRecord)
+		+ (size_t(h.rootCount[0]) + h.rootCount[1] + h.rootCount[2] + h.funcCount) * sizeof(uint32_t)
+		+ h.stringSize;
+	}
+	static void append(std::vector<uint8_t>& image, const void* p, size_t n) {
+	  auto b = static_cast<const uint8_t*>(p);
+	  image.insert(image.end(), b, b + n);
+	}
+
+	// イメージを作る
+	struct Builder {
+	  const TaskFuncTable& table;
+	  std::vector<TaskRecord> records;
+	  std::vector<const Task*> tasks;
+	  std::vector<uint32_t> roots;
+	  std::vector<uint32_t> funcNames;
+	  std::unordered_map<uint32_t, uint32_t> funcIndex;
+	  std::string strings;
+	  std::unordered_map<std::string, uint32_t> stringIndex;
+
+	  explicit Builder(const TaskFuncTable& t) : table(t) {}
+
+	  // rootを先頭に、子のタスクを幅優先で並べる
+	  void addTree(const Task& root) {
+		uint32_t first = addRecord(root);
+		roots.push_back(first);
+		for (size_t i = first; i < tasks.size(); ++i) {
+		  auto& args = tasks[i]->args_;
+		  uint32_t firstChild = uint32_t(records.size());
+		  for (auto& child : args) addRecord(child);
+		  records[i].firstChild = firstChild;
+		  records[i].childCount = uint32_t(args.size());
+		}
+	  }
+	  uint32_t addRecord(const Task& t) {
+		TaskRecord rec;
+		rec.name = addString(t.name().data(), t.name().size());
+		rec.self = addString(t.args_.self_.data(), t.args_.self_.size());
+		rec.parent = addString(t.args_.parent_.data(), t.args_.parent_.size());
+		rec.func = TaskFuncTable::NoFunc;
+		if (t.func_) {
+		  uint32_t id = table.idOf(t.func_);
+		  if (id == TaskFuncTable::NoFunc) {
+			throw std::runtime_error(strCat("TaskSnapshot: task '", t.name(), "' has an unregistered function").str());
+		  }
+		  auto found = funcIndex.find(id);
+		  if (found == funcIndex.end()) {
+			const std::string& name = table.name(id);
+			found = funcIndex.emplace(id, uint32_t(funcNames.size())).first;
+			funcNames.push_back(addString(name.data(), name.size()));
+		  }
+		  rec.func = found->second;
+		}
+		rec.firstChild = 0;
+		rec.childCount = 0;
+		rec.flags = t.isReferenceObject() ? uint32_t(TaskRecord::Reference) : uint32_t(0);
+		records.push_back(rec);
+		tasks.push_back(&t);
+		return uint32_t(records.size() - 1);
+	  }
+	  uint32_t addString(const char* s, size_t n) {
+		std::string str(s, n);
+		auto found = stringIndex.find(str);
+		if (found != stringIndex.end()) return found->second;
+		uint32_t pos = uint32_t(strings.size());
+		strings += char(uint8_t(n));
+		strings += str;
+		stringIndex.emplace(std::move(str), pos);
+		return pos;
+	  }
+	};
+
+	// イメージを検査してタスクを復元する
+	struct Reader {
+	  TaskImageHeader header;
+	  const TaskRecord* records;
+	  const uint32_t* roots;
+	  const uint8_t* strings;
+	  const TaskFuncTable& table;
+	  std::vector<uint32_t> funcs; // イメージの関数の番号から関数表の番号への変換
+	  std::vector<std::pair<Task::name_type, Task*>> entries;
+
+	  Reader(const void* data, size_t size, const TaskFuncTable& t) : table(t) {
+		auto p = static_cast<const uint8_t*>(data);
+		if (size < sizeof(TaskImageHeader)) fail("image is too small");
+		memcpy(&header, p, sizeof(header));
+		if (memcmp(header.magic, magic(), sizeof(header.magic)) != 0) fail("bad magic");
+		if (header.version != Version) fail("unsupported version");
+		if (imageSize(header) > size) fail("image is truncated");
+		records = reinterpret_cast<const TaskRecord*>(p + sizeof(TaskImageHeader));
+		roots = reinterpret_cast<const uint32_t*>(records + header.taskCount);
+		const uint32_t* funcNames = roots + header.rootCount[0] + header.rootCount[1] + header.rootCount[2];
+		strings = reinterpret_cast<const uint8_t*>(funcNames + header.funcCount);
+
+		for (uint32_t i = 0; i < header.funcCount; ++i) {
+		  auto s = stringAt(funcNames[i]);
+		  uint32_t id = table.find(std::string(s.first, s.second));
+		  if (id == TaskFuncTable::NoFunc) fail(strCat("function '", boost::string_view(s.first, s.second), "' is not registered").str());
+		  funcs.push_back(id);
+		}
+		for (uint32_t i = 0; i < header.taskCount; ++i) {
+		  const TaskRecord& rec = records[i];
+		  stringAt(rec.name);
+		  stringAt(rec.self);
+		  stringAt(rec.parent);
+		  if (rec.func != TaskFuncTable::NoFunc && rec.func >= header.funcCount) fail("bad function index");
+		  // 子は親より後ろにあるので、木が循環することはない
+		  if (rec.childCount > 0 &&
+			  (rec.firstChild <= i || rec.firstChild > header.taskCount ||
+			   rec.childCount > header.taskCount - rec.firstChild)) fail("bad child index");
+		}
+		uint32_t rootCount = header.rootCount[0] + header.rootCount[1] + header.rootCount[2];
+		for (uint32_t i = 0; i < rootCount; ++i) {
+		  if (roots[i] >= header.taskCount) fail("bad root index");
+		}
+		entries.reserve(header.taskCount);
+	  }
+
+	  // レコードiの内容でタスクを構築する
+	  void fill(Task& t, uint32_t i) {
+		const TaskRecord& rec = records[i];
+		bool ref = (rec.flags & TaskRecord::Reference) != 0;
+		t.restoreName(name(rec.name), ref);
+		if (rec.func != TaskFuncTable::NoFunc) t.func_ = table.get(funcs[rec.func]);
+		t.args_.self_ = name(rec.self);
+		t.args_.parent_ = name(rec.parent);
+		t.args_.args_.reserve(rec.childCount);
+		for (uint32_t c = 0; c < rec.childCount; ++c) {
+		  t.args_.args_.emplace_back();
+		  fill(t.args_.args_.back(), rec.firstChild + c);
+		}
+		if (!ref && !t.name().empty()) entries.emplace_back(t.name(), &t);
+	  }
+
+	  Task::name_type name(uint32_t pos) const {
+		auto s = stringAt(pos);
+		return Task::name_type(s.first, s.second);
+	  }
+	  std::pair<const char*, size_t> stringAt(uint32_t pos) const {
+		if (pos >= header.stringSize || strings[pos] > header.stringSize - pos - 1) fail("bad string offset");
+		return std::make_pair(reinterpret_cast<const char*>(strings + pos + 1), size_t(strings[pos]));
+	  }
+	  [[noreturn]] static void fail(const std::string& msg) {
+		throw std::runtime_error("TaskSnapshot: " + msg);
+	  }
+	};
+  };
+
+}} // ts::namedobj
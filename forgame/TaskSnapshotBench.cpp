@@ -0,0 +1,86 @@
+// -*-tab-width:4-*-
+//
+// タスクの木を起動時に構築する場合と、スナップショットのイメージから復元する場合の比較
+// ./t4 cold [分岐数 深さ]    木を構築してイメージを保存する
+// ./t4 restore              イメージから復元し、保存し直したイメージと比べる
+//
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <string>
+#include "NamedObject.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "TaskSnapshot.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using Clock = chrono::steady_clock;
+
+static const char* imagePath = "tasktree.img";
+
+// ゲームのタスクのかわりの関数
+void registerFuncs(TaskFuncTable& table) {
+  table.add("scene", [](TaskQueue&, TaskArgs&) { return TaskStatus::ContinueTask; });
+  table.add("actor", [](TaskQueue&, TaskArgs&) { return TaskStatus::RemoveTask; });
+}
+
+// 分岐数fanout、深さdepthの木をTaskのコンストラクタで構築する
+// 葉以外の各ノードは、木の根への参照も引数に持つ
+Task buildTree(const TaskFuncTable& table, int fanout, int depth, uint32_t& serial) {
+  char name[32];
+  int n = snprintf(name, sizeof(name), "node_%u", serial++);
+  TaskArgs args;
+  if (depth > 0) {
+	for (int i = 0; i < fanout; ++i) args.args_.emplace_back(buildTree(table, fanout, depth - 1, serial));
+	args.args_.emplace_back(Task("node_0"));
+  }
+  auto func = table.get(table.find(depth > 0 ? "scene" : "actor"));
+  return Task(Task::name_type(name, size_t(n)), func, move(args));
+}
+
+double msSince(Clock::time_point start) {
+  return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+int main(int ac, char* av[]) {
+  TaskFuncTable table;
+  registerFuncs(table);
+  TaskQueue tq;
+
+  if (ac > 1 && strcmp(av[1], "restore") == 0) {
+	auto start = Clock::now();
+	TaskSnapshot::restoreFile(tq, imagePath, table);
+	double ms = msSince(start);
+	printf("restore    %8.1f ms\n", ms);
+
+	// 復元した状態を保存し直して、元のイメージと一致することを確かめる
+	ifstream in(imagePath, ios::binary);
+	vector<uint8_t> original((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+	bool same = TaskSnapshot::save(tq, table) == original;
+	printf("verify     %s, lookup node_1: %s\n", same ? "ok" : "MISMATCH", Task::lookup("node_1") ? "found" : "missing");
+	remove(imagePath);
+	return same ? 0 : 1;
+  }
+
+  int fanout = ac > 3 ? atoi(av[2]) : 8;
+  int depth = ac > 3 ? atoi(av[3]) : 6;
+  uint32_t serial = 0;
+  auto start = Clock::now();
+  tq.run(buildTree(table, fanout, depth, serial));
+  double ms = msSince(start);
+  printf("cold start %8.1f ms (%u named tasks)\n", ms, serial);
+
+  start = Clock::now();
+  TaskSnapshot::saveFile(imagePath, tq, table);
+  ms = msSince(start);
+  ifstream in(imagePath, ios::binary | ios::ate);
+  printf("save       %8.1f ms (%lld bytes)\n", ms, (long long)in.tellg());
+  return 0;
+}
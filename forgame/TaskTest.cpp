@@ -106,6 +106,12 @@ int main() {
 	  }
 	}
 	});
+  // 起動時のタスクの登録が終わったので、名前の検索を整列した配列で行う
+  Task::freezeRegistry();
+
+  // フレーム時間とタスクごとの処理時間を計測する
+  auto metrics = make_unique<TaskMetrics>();
+  taskqueue.setMetrics(metrics.get());
 
   // ゲームのメインループ
   uint32_t frame = 0;
@@ -114,6 +120,8 @@ int main() {
 	taskqueue.update();
 	//draw(); // ゲームの場合レンダリングの処理が入る
   }
+  taskqueue.setMetrics(nullptr);
+  metrics->writeText(cerr);
 }
 
 // 以下、ありがちな処理のスタブクラス
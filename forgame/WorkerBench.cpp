@@ -0,0 +1,152 @@
+// -*-tab-width:4-*-
+//
+// ワーカーのCPU固定とaffinityの効果の計測
+// データのブロックをワーカーのアリーナに置き(ブロックを持つワーカーのノードに置かれる)、
+// ブロックごとのタスクが毎フレームブロックを読み書きする。次の3通りで比べる
+//   pinned + affinity : ワーカーをCPUに固定し、タスクをブロックを持つワーカーで動かす
+//   pinned, random    : ワーカーをCPUに固定し、タスクを適当なワーカーで動かす
+//   unpinned, random  : CPUを固定せず、タスクを適当なワーカーで動かす
+// 他のノードのブロックを触ったバイト数を、ノード間の転送量として数える
+// ノードが1つしかないマシンでは、CPUを2つのノードに分けて模擬する(メモリは実際には分かれない)
+// 最初に、待っているタスクだけが残ったワーカーが、空回りせずに眠ることを確かめる
+// ./t9 [ワーカー数] [ブロック数] [ブロックのKB] [フレーム数]
+//
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "NamedObject.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "WorkerPool.hpp"
+#include "../instrument/Check.hpp"
+
+using namespace std;
+using namespace ts::namedobj;
+using ts::instrument::checkResult;
+using Clock = chrono::steady_clock;
+
+void check() {
+  WorkerPool pool(vector<WorkerConfig>(2));
+  atomic<int> woke{ 0 };
+  // 50ms眠るタスク。待っている間、ワーカーはupdate()を呼び続けない
+  for (int i = 0; i < 2; ++i) {
+	pool.post(i, [&woke] {
+		bool slept = false;
+		return Task([&woke, slept](TaskQueue& tq, TaskArgs&) mutable {
+			if (!slept) {
+			  slept = true;
+			  tq.sleepFor(50000000);
+			  return TaskStatus::ContinueTask;
+			}
+			++woke;
+			return TaskStatus::RemoveTask;
+		  });
+	  });
+  }
+  auto start = Clock::now();
+  pool.waitIdle();
+  TS_CHECK_EQ(woke.load(), 2);
+  TS_CHECK(Clock::now() - start >= chrono::milliseconds(50));
+  for (size_t i = 0; i < pool.size(); ++i) {
+	TS_CHECK_EQ(pool.stats(i).posted, 1u);
+	TS_CHECK_LE(pool.stats(i).frames, 10u);
+  }
+  // 止めた後のpost()は捨てる
+  pool.stop();
+  pool.post(0, [] { return Task([](TaskQueue&, TaskArgs&) { return TaskStatus::RemoveTask; }); });
+  TS_CHECK_EQ(pool.stats(0).posted, 1u);
+}
+
+struct Block {
+  uint64_t* data = nullptr;
+  int owner = 0;
+  int node = 0;
+};
+
+size_t workers = 4, blockCount = 32, blockSize = 256 * 1024, passes = 50;
+
+void run(const char* label, const vector<WorkerConfig>& config, bool affinity) {
+  size_t perWorker = (blockCount + workers - 1) / workers;
+  WorkerPool pool(config, perWorker * (blockSize + 64) + 4096);
+  vector<Block> blocks(blockCount);
+
+  // ブロックを持ち主のワーカーのアリーナに置く
+  for (size_t b = 0; b < blockCount; ++b) {
+	blocks[b].owner = int(b % workers);
+	blocks[b].node = config[b % workers].node;
+	pool.post(blocks[b].owner, [&blocks, b] {
+		return Task([&blocks, b](TaskQueue&, TaskArgs&) {
+			blocks[b].data = static_cast<uint64_t*>(WorkerPool::arena().allocate(blockSize, 64));
+			memset(blocks[b].data, int(b), blockSize);
+			return TaskStatus::RemoveTask;
+		  });
+	  });
+  }
+  pool.waitIdle();
+
+  atomic<uint64_t> crossBytes{ 0 };
+  atomic<uint64_t> checksum{ 0 };
+  mt19937 rng(1);
+  auto start = Clock::now();
+  for (size_t b = 0; b < blockCount; ++b) {
+	int target = affinity ? blocks[b].owner : int(rng() % workers);
+	pool.post(target, [&, b] {
+		size_t left = passes;
+		return Task([&, b, left](TaskQueue&, TaskArgs&) mutable {
+			Block& block = blocks[b];
+			if (config[size_t(WorkerPool::currentWorker())].node != block.node) {
+			  crossBytes.fetch_add(blockSize, memory_order_relaxed);
+			}
+			uint64_t sum = 0;
+			for (size_t i = 0; i < blockSize / sizeof(uint64_t); ++i) {
+			  sum += block.data[i];
+			  block.data[i] = sum;
+			}
+			checksum.fetch_add(sum, memory_order_relaxed);
+			return --left > 0 ? TaskStatus::ContinueTask : TaskStatus::RemoveTask;
+		  });
+	  });
+  }
+  pool.waitIdle();
+  double sec = chrono::duration<double>(Clock::now() - start).count();
+  double total = double(blockCount) * double(blockSize) * double(passes);
+
+  cout << label << (total / sec / 1e9) << " GB/s, cross-node " << (double(crossBytes) / 1e6) << " MB ("
+	   << (100.0 * double(crossBytes) / total) << "%), frames";
+  bool pinned = true;
+  for (size_t i = 0; i < pool.size(); ++i) {
+	cout << ' ' << pool.stats(i).frames;
+	pinned = pinned && pool.stats(i).pinned;
+  }
+  cout << (pinned ? ", pinned" : "") << endl;
+}
+
+int main(int ac, char* av[]) {
+  check();
+  if (ac > 1) workers = size_t(atol(av[1]));
+  if (ac > 2) blockCount = size_t(atol(av[2]));
+  if (ac > 3) blockSize = size_t(atol(av[3])) * 1024;
+  if (ac > 4) passes = size_t(atol(av[4]));
+
+  CpuTopology topology = CpuTopology::detect();
+  bool simulated = topology.nodeCount() < 2;
+  if (simulated) topology = CpuTopology::simulate(2);
+  cout << (simulated ? "simulated " : "") << topology.nodeCount() << " nodes:";
+  for (auto& node : topology.nodes) {
+	cout << " {";
+	for (size_t i = 0; i < node.size(); ++i) cout << (i ? "," : "") << node[i];
+	cout << '}';
+  }
+  cout << endl << workers << " workers, " << blockCount << " blocks x " << blockSize / 1024 << " KB, "
+	   << passes << " frames" << endl;
+
+  run("pinned + affinity  ", WorkerPool::pinned(topology, workers), true);
+  run("pinned, random     ", WorkerPool::pinned(topology, workers), false);
+  run("unpinned, random   ", WorkerPool::unpinned(topology, workers), false);
+  return checkResult("worker");
+}
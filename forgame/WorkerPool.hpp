@@ -0,0 +1,361 @@
+// -*-tab-width:4;c++-*-
+//
+// 複数のスレッドでタスクを実行するワーカーのプール
+//
+// WorkerPoolは、ワーカーごとにスレッドとTaskQueueを持ち、それぞれのスレッドでupdate()を繰り返します。
+// タスクの名前の登録先(Registry)はワーカーごとに分け(NamedObject::RegistryScope)、スレッドの間で共有しません。
+// そのため、タスクはワーカーの間を移動せず、ワーカーの上で作ります。
+// post()には、タスクそのものではなく、タスクを作る関数を渡します(ワーカーのTaskQueue::post)。
+// 関数はワーカーのスレッドで呼ばれるので、タスクのメモリもワーカーのスレッドで確保されます。
+// ワーカーはTaskQueue::runUntilFinished()で動くので、読み込みなどを待つタスクだけが残っている間は眠ります。
+// ワーカーのタスクでfinish()を呼ぶと、そのワーカーが止まるので呼ばないこと。
+//
+// WorkerConfigで、ワーカーを固定するCPUを指定できます。
+// ワーカーのTaskQueue、名前の登録先、アリーナ(WorkerArena)は、CPUを固定した後にワーカーのスレッドで確保します。
+// Linuxのファーストタッチの方針により、これらのメモリはワーカーのCPUのNUMAノードに置かれます。
+// post()のaffinityでワーカーを指定すると、データを持つワーカーでタスクを動かし続けられます。
+//
+// CpuTopologyは/sys/devices/system/nodeからCPUとノードの対応を読みます。
+// simulate()で、1ノードのマシンでも複数ノードの構成を模擬できます(CPUを分けるだけで、メモリは分かれません)。
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+
+namespace ts {
+namespace namedobj {
+
+  // CPUとNUMAノードの対応
+  struct CpuTopology {
+	std::vector<std::vector<int>> nodes; // ノードごとのCPU番号
+
+	size_t nodeCount() const { return nodes.size(); }
+	// cpuが属するノード。見つからなければ-1
+	int nodeOf(int cpu) const {
+	  for (size_t n = 0; n < nodes.size(); ++n) {
+		if (std::find(nodes[n].begin(), nodes[n].end(), cpu) != nodes[n].end()) return int(n);
+	  }
+	  return -1;
+	}
+
+	// このプロセスが使えるCPU。Linux以外では、0からhardware_concurrency()-1まで
+	static std::vector<int> available() {
+	  std::vector<int> cpus;
+#ifdef __linux__
+	  cpu_set_t set;
+	  CPU_ZERO(&set);
+	  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int i = 0; i < CPU_SETSIZE; ++i) {
+		  if (CPU_ISSET(i, &set)) cpus.push_back(i);
+		}
+	  }
+#else
+	  for (unsigned i = 0; i < std::thread::hardware_concurrency(); ++i) cpus.push_back(int(i));
+#endif
+	  if (cpus.empty()) cpus.push_back(0);
+	  return cpus;
+	}
+	// "0-3,8-11"の形式を読む
+	static std::vector<int> parseCpuList(const std::string& s) {
+	  std::vector<int> cpus;
+	  size_t pos = 0;
+	  while (pos < s.size()) {
+		size_t end = s.find(',', pos);
+		if (end == std::string::npos) end = s.size();
+		std::string range = s.substr(pos, end - pos);
+		size_t dash = range.find('-');
+		try {
+		  int first = std::stoi(range.substr(0, dash));
+		  int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+		  for (int c = first; c <= last; ++c) cpus.push_back(c);
+		}
+		catch (...) {
+		}
+		pos = end + 1;
+	  }
+	  return cpus;
+	}
+	// 実際の構成を読む。読めなければ、使えるCPUをすべて1つのノードとする
+	static CpuTopology detect() {
+	  CpuTopology t;
+	  std::vector<int> usable = available();
+	  for (int n = 0;; ++n) {
+		std::ifstream is("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+		std::string line;
+		if (!is || !std::getline(is, line)) break;
+		std::vector<int> cpus;
+		for (int c : parseCpuList(line)) {
+		  if (std::find(usable.begin(), usable.end(), c) != usable.end()) cpus.push_back(c);
+		}
+		if (!cpus.empty()) t.nodes.push_back(cpus);
+	  }
+	  if (t.nodes.empty()) t.nodes.push_back(usable);
+	  return t;
+	}
+	// 使えるCPUをnodes個のノードに分けた構成を作る
+	// CPUがノードより少なければ、同じCPUを複数のノードに入れる
+	static CpuTopology simulate(size_t nodes) {
+	  CpuTopology t;
+	  std::vector<int> cpus = available();
+	  nodes = std::max<size_t>(nodes, 1);
+	  t.nodes.resize(nodes);
+	  size_t per = std::max<size_t>(cpus.size() / nodes, 1);
+	  for (size_t n = 0; n < nodes; ++n) {
+		for (size_t i = 0; i < per; ++i) t.nodes[n].push_back(cpus[(n * per + i) % cpus.size()]);
+	  }
+	  // 割り切れずに残ったCPUは最後のノードに入れる
+	  for (size_t i = nodes * per; i < cpus.size(); ++i) t.nodes.back().push_back(cpus[i]);
+	  return t;
+	}
+  };
+
+  struct WorkerConfig {
+	int cpu = -1;  // 固定するCPU。-1なら固定しない
+	int node = -1; // ワーカーが属するノード。affinityを決める目安
+  };
+
+  // ワーカーのスレッドで確保し、ワーカーが使うメモリ
+  // 単純に前から切り出すだけで、reset()でまとめて解放する
+  class WorkerArena {
+  public:
+	explicit WorkerArena(size_t size) : size_(size) {
+	  void* p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	  if (p == MAP_FAILED) throw std::bad_alloc();
+	  base_ = static_cast<char*>(p);
+	  // 確保したスレッドで書き込んで、このスレッドのノードにページを置く
+	  long page = sysconf(_SC_PAGESIZE);
+	  for (size_t i = 0; i < size_; i += size_t(page)) base_[i] = 0;
+	}
+	~WorkerArena() { munmap(base_, size_); }
+	WorkerArena(const WorkerArena&) = delete;
+	WorkerArena& operator = (const WorkerArena&) = delete;
+
+	// 足りなければnullptr
+	void* allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+	  size_t p = (used_ + align - 1) & ~(align - 1);
+	  if (p + size > size_) return nullptr;
+	  used_ = p + size;
+	  return base_ + p;
+	}
+	void reset() { used_ = 0; }
+	size_t used() const { return used_; }
+	size_t capacity() const { return size_; }
+
+  private:
+	char* base_;
+	size_t size_;
+	size_t used_ = 0;
+  };
+
+  class WorkerPool {
+  public:
+	using Factory = std::function<Task()>;
+
+	struct Stats {
+	  uint64_t frames;  // update()を呼んだ回数
+	  uint64_t posted;  // post()で受け取ったタスクの数
+	  bool pinned;      // CPUの固定に成功した
+	};
+
+	// arenaSize: ワーカーごとのアリーナの大きさ
+	// ワーカーがTaskQueueを作るまで待つ
+	explicit WorkerPool(std::vector<WorkerConfig> config, size_t arenaSize = 1 << 20) : arenaSize_(arenaSize) {
+	  for (auto& c : config) workers_.emplace_back(new Worker(c));
+	  for (size_t i = 0; i < workers_.size(); ++i) {
+		workers_[i]->thread = std::thread([this, i] { run(i); });
+	  }
+	  for (auto& w : workers_) {
+		std::unique_lock<std::mutex> lock(w->mutex);
+		w->cond.wait(lock, [&] { return w->queue != nullptr; });
+	  }
+	}
+	// 残っているタスクは実行せずに破棄する
+	~WorkerPool() { stop(); }
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator = (const WorkerPool&) = delete;
+
+	// ノードごとに順にCPUを割り当てた設定。ワーカーはノードに均等に分かれる
+	static std::vector<WorkerConfig> pinned(const CpuTopology& topology, size_t workers) {
+	  std::vector<WorkerConfig> config(workers);
+	  for (size_t i = 0; i < workers; ++i) {
+		size_t node = i % topology.nodeCount();
+		auto& cpus = topology.nodes[node];
+		config[i].node = int(node);
+		config[i].cpu = cpus[(i / topology.nodeCount()) % cpus.size()];
+	  }
+	  return config;
+	}
+	// pinnedと同じノードの割り当てで、CPUを固定しない設定
+	static std::vector<WorkerConfig> unpinned(const CpuTopology& topology, size_t workers) {
+	  auto config = pinned(topology, workers);
+	  for (auto& c : config) c.cpu = -1;
+	  return config;
+	}
+
+	size_t size() const { return workers_.size(); }
+	const WorkerConfig& config(size_t worker) const { return workers_.at(worker)->config; }
+	Stats stats(size_t worker) const {
+	  const Worker& w = *workers_.at(worker);
+	  return { w.frames.load(std::memory_order_relaxed), w.posted.load(std::memory_order_relaxed),
+			   w.pinned.load(std::memory_order_relaxed) };
+	}
+
+	// makeで作ったタスクを、affinityのワーカーで実行する。affinityが負なら順に割り振る
+	void post(int affinity, Factory make) {
+	  size_t i = affinity >= 0 ? size_t(affinity) % workers_.size()
+		: next_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+	  Worker& w = *workers_[i];
+	  // waitIdle()が、受け取ったまま作っていないタスクを見落とさないように、ロックを持ったまま渡す
+	  std::lock_guard<std::mutex> lock(w.mutex);
+	  if (w.stop) return;
+	  w.idle = false;
+	  w.posted.fetch_add(1, std::memory_order_relaxed);
+	  w.queue->post(std::move(make));
+	}
+	// ノードを指定して、そのノードのワーカーに順に割り振る
+	void postToNode(int node, Factory make) {
+	  std::vector<int> candidates;
+	  for (size_t i = 0; i < workers_.size(); ++i) {
+		if (workers_[i]->config.node == node) candidates.push_back(int(i));
+	  }
+	  if (candidates.empty()) post(-1, std::move(make));
+	  else post(candidates[next_.fetch_add(1, std::memory_order_relaxed) % candidates.size()], std::move(make));
+	}
+
+	// 投入したタスクがすべて終わるまで待つ
+	// park()で待っているタスクがあるワーカーは、それが終わるまで待つ
+	void waitIdle() {
+	  for (auto& w : workers_) {
+		std::unique_lock<std::mutex> lock(w->mutex);
+		w->cond.wait(lock, [&] { return w->stop || w->idle; });
+	  }
+	}
+	// すべてのワーカーを止める。実行中のフレームは最後まで実行する
+	void stop() {
+	  for (auto& w : workers_) {
+		std::lock_guard<std::mutex> lock(w->mutex);
+		if (w->stop) continue;
+		w->stop = true;
+		w->cond.notify_all();
+		// 眠っているワーカーを起こす。フレームの終わりにstopを見て終わる
+		w->queue->post([] { return Task([](TaskQueue&, TaskArgs&) { return TaskStatus::RemoveTask; }); });
+	  }
+	  for (auto& w : workers_) {
+		if (w->thread.joinable()) w->thread.join();
+	  }
+	}
+
+	// 実行中のワーカーの番号。ワーカーの外では-1
+	static int currentWorker() { return currentIndex(); }
+	// 実行中のワーカーのアリーナ。ワーカーの外で呼んではいけない
+	static WorkerArena& arena() { return *currentArena(); }
+	// 呼んだスレッドをcpuに固定する。cpuが負か、固定できなければfalse
+	// Linux以外では固定しない(常にfalse)
+	static bool pin(int cpu) {
+	  if (cpu < 0) return false;
+#ifdef __linux__
+	  cpu_set_t set;
+	  CPU_ZERO(&set);
+	  CPU_SET(cpu, &set);
+	  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	  return false;
+#endif
+	}
+
+  private:
+	struct Worker {
+	  explicit Worker(const WorkerConfig& c) : config(c) {}
+	  WorkerConfig config;
+	  std::thread thread;
+	  std::mutex mutex;
+	  std::condition_variable cond;
+	  TaskQueue* queue = nullptr; // ワーカーのスレッドで作る
+	  bool idle = true;
+	  bool stop = false;
+	  std::atomic<uint64_t> frames{ 0 };
+	  std::atomic<uint64_t> posted{ 0 };
+	  std::atomic<bool> pinned{ false };
+	};
+
+	// フレームの終わりに、ワーカーが空いたかを知らせ、stop()されていれば終わる
+	struct Monitor : TaskQueue::Trace {
+	  Monitor(Worker& w, TaskQueue& tq) : w_(w), tq_(tq) {}
+	  void frameEnd() override {
+		w_.frames.fetch_add(1, std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lock(w_.mutex);
+		if (w_.stop) {
+		  tq_.finish();
+		  return;
+		}
+		bool idle = tq_.empty() && tq_.parkedCount() == 0 && !tq_.hasPosted();
+		if (idle != w_.idle) {
+		  w_.idle = idle;
+		  if (idle) w_.cond.notify_all();
+		}
+	  }
+	  Worker& w_;
+	  TaskQueue& tq_;
+	};
+
+	static int& currentIndex() {
+	  thread_local int index = -1;
+	  return index;
+	}
+	static WorkerArena*& currentArena() {
+	  thread_local WorkerArena* arena = nullptr;
+	  return arena;
+	}
+
+	void run(size_t index) {
+	  Worker& w = *workers_[index];
+	  w.pinned = pin(w.config.cpu);
+	  currentIndex() = int(index);
+	  // CPUを固定した後に確保するので、ファーストタッチでワーカーのノードに置かれる
+	  Task::registry_type registry;
+	  Task::RegistryScope scope(registry);
+	  WorkerArena arena(arenaSize_);
+	  currentArena() = &arena;
+	  std::unique_ptr<TaskQueue> tq(new TaskQueue);
+	  Monitor monitor(w, *tq);
+	  tq->setTrace(&monitor);
+	  {
+		std::lock_guard<std::mutex> lock(w.mutex);
+		w.queue = tq.get();
+	  }
+	  w.cond.notify_all();
+	  // 仕事が無い間は、post()か読み込みの完了まで眠る
+	  tq->runUntilFinished();
+	  // タスクは、名前の登録先を切り替えている間に破棄する
+	  tq->setTrace(nullptr);
+	  tq.reset();
+	  currentArena() = nullptr;
+	  currentIndex() = -1;
+	}
+
+	size_t arenaSize_;
+	std::vector<std::unique_ptr<Worker>> workers_;
+	std::atomic<size_t> next_{ 0 };
+  };
+
+}} // ts::namedobj
@@ -0,0 +1,95 @@
+// -*-tab-width:4;c++-*-
+//
+// メモリ確保の回数を数える
+//
+// TS_INSTRUMENT_NEWを定義してからインクルードすると、グローバルなoperator new/deleteを置き換えて、
+// スレッドごとに確保・解放の回数と確保したバイト数を数えます。
+// 置き換えはプログラムに1つしか置けないので、TS_INSTRUMENT_NEWはmainのあるファイルでだけ定義してください。
+// posix_memalignやmallocで直接確保したメモリは数えません。
+//
+// AllocScopeは、作ってからの今のスレッドの確保回数を返します。
+//
+//   AllocScope scope;
+//   tq.addTask(Task(...));
+//   TS_CHECK_EQ(scope.news(), 1);
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace ts {
+namespace instrument {
+
+  struct AllocStats {
+	uint64_t news = 0;     // operator new(配列も含む)の回数
+	uint64_t deletes = 0;  // operator delete(nullptrは除く)の回数
+	uint64_t bytes = 0;    // 確保したバイト数の合計
+
+	AllocStats operator - (const AllocStats& rhs) const {
+	  AllocStats s;
+	  s.news = news - rhs.news;
+	  s.deletes = deletes - rhs.deletes;
+	  s.bytes = bytes - rhs.bytes;
+	  return s;
+	}
+  };
+
+  // 今のスレッドの累計
+  inline AllocStats& threadAllocStats() {
+	static thread_local AllocStats stats;
+	return stats;
+  }
+
+  // 作ってからの今のスレッドの確保回数
+  class AllocScope {
+  public:
+	AllocScope() : start_(threadAllocStats()) {}
+	AllocStats get() const { return threadAllocStats() - start_; }
+	uint64_t news() const { return get().news; }
+	uint64_t deletes() const { return get().deletes; }
+	uint64_t bytes() const { return get().bytes; }
+	// 確保したまま解放していない数
+	int64_t live() const { return int64_t(news()) - int64_t(deletes()); }
+	void restart() { start_ = threadAllocStats(); }
+  private:
+	AllocStats start_;
+  };
+
+  namespace detail {
+	inline void* countedAlloc(std::size_t size) noexcept {
+	  AllocStats& s = threadAllocStats();
+	  ++s.news;
+	  s.bytes += size;
+	  return std::malloc(size ? size : 1);
+	}
+	// インライン展開されると、operator newの戻り値をfree()しているとgccが警告する
+	__attribute__((noinline)) inline void countedFree(void* p) noexcept {
+	  if (p == nullptr) return;
+	  ++threadAllocStats().deletes;
+	  std::free(p);
+	}
+  }
+
+}} // ts::instrument
+
+#ifdef TS_INSTRUMENT_NEW
+// 置き換えるoperator new/deleteはinlineにできないので、ここで定義する
+void* operator new(std::size_t size) {
+  if (void* p = ts::instrument::detail::countedAlloc(size)) return p;
+  throw std::bad_alloc();
+}
+void* operator new[](std::size_t size) {
+  if (void* p = ts::instrument::detail::countedAlloc(size)) return p;
+  throw std::bad_alloc();
+}
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return ts::instrument::detail::countedAlloc(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return ts::instrument::detail::countedAlloc(size); }
+void operator delete(void* p) noexcept { ts::instrument::detail::countedFree(p); }
+void operator delete[](void* p) noexcept { ts::instrument::detail::countedFree(p); }
+void operator delete(void* p, std::size_t) noexcept { ts::instrument::detail::countedFree(p); }
+void operator delete[](void* p, std::size_t) noexcept { ts::instrument::detail::countedFree(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { ts::instrument::detail::countedFree(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { ts::instrument::detail::countedFree(p); }
+#endif
@@ -0,0 +1,63 @@
+// -*-tab-width:4;c++-*-
+//
+// テストの検査
+//
+// TS_CHECK_EQ(actual, expected)は、値が違うとファイル名・行番号と両方の値を表示して、失敗の数を増やします。
+// 検査は失敗しても続けるので、1回の実行ですべての違いがわかります。
+// mainの最後でcheckResult()の値を返すと、失敗があった時に終了コードが1になり、makeが止まります。
+
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+
+#define TS_CHECK(cond) \
+  ::ts::instrument::check((cond), #cond, __FILE__, __LINE__)
+#define TS_CHECK_EQ(actual, expected) \
+  ::ts::instrument::checkEqual((actual), (expected), #actual, __FILE__, __LINE__)
+#define TS_CHECK_LE(actual, limit) \
+  ::ts::instrument::checkLessEqual((actual), (limit), #actual, __FILE__, __LINE__)
+
+namespace ts {
+namespace instrument {
+
+  inline int& checkFailures() {
+	static int failures = 0;
+	return failures;
+  }
+
+  inline bool check(bool ok, const char* expr, const char* file, int line) {
+	if (ok) return true;
+	++checkFailures();
+	std::cerr << file << ":" << line << ": failed: " << expr << std::endl;
+	return false;
+  }
+
+  template <typename A, typename E>
+  bool checkEqual(const A& actual, const E& expected, const char* expr, const char* file, int line) {
+	if (actual == static_cast<A>(expected)) return true;
+	++checkFailures();
+	std::cerr << file << ":" << line << ": " << expr << " is " << actual << ", expected " << expected << std::endl;
+	return false;
+  }
+
+  // 確保回数の上限のように、正確な値が環境で変わる時に使う
+  template <typename A, typename L>
+  bool checkLessEqual(const A& actual, const L& limit, const char* expr, const char* file, int line) {
+	if (actual <= static_cast<A>(limit)) return true;
+	++checkFailures();
+	std::cerr << file << ":" << line << ": " << expr << " is " << actual << ", expected at most " << limit << std::endl;
+	return false;
+  }
+
+  // 結果を表示して、mainの戻り値を返す
+  inline int checkResult(const char* name) {
+	if (checkFailures() == 0) {
+	  std::cout << name << ": ok" << std::endl;
+	  return 0;
+	}
+	std::cout << name << ": " << checkFailures() << " checks failed" << std::endl;
+	return 1;
+  }
+
+}} // ts::instrument
@@ -0,0 +1,76 @@
+// -*-tab-width:4;c++-*-
+//
+// コピーとムーブの回数を数える
+//
+// Counted<Tag>は、構築・コピー・ムーブ・破棄されるたびに、Tagごとの(今のスレッドの)回数を数える空のクラスです。
+// 調べたいクラスのメンバーにしたり、ラムダ式でキャプチャすると、そのクラスやクロージャがコピー・ムーブされた回数がわかります。
+// コピーコンストラクタを自分で書いているクラスでは、メンバーのCountedも初期化子でコピー・ムーブしてください。
+//
+//   struct Tag {};
+//   Counted<Tag> c;
+//   CountedScope<Tag> scope;
+//   tq.addTask(Task([c](TaskQueue&, TaskArgs&) { ... }));
+//   TS_CHECK_EQ(scope.copies(), 0);
+
+#pragma once
+
+#include <cstdint>
+
+namespace ts {
+namespace instrument {
+
+  struct CopyMoveStats {
+	uint64_t constructs = 0;   // コピー・ムーブ以外のコンストラクタ
+	uint64_t copies = 0;       // コピーコンストラクタ
+	uint64_t moves = 0;        // ムーブコンストラクタ
+	uint64_t copyAssigns = 0;  // コピー代入
+	uint64_t moveAssigns = 0;  // ムーブ代入
+	uint64_t destructs = 0;
+
+	CopyMoveStats operator - (const CopyMoveStats& rhs) const {
+	  CopyMoveStats s;
+	  s.constructs = constructs - rhs.constructs;
+	  s.copies = copies - rhs.copies;
+	  s.moves = moves - rhs.moves;
+	  s.copyAssigns = copyAssigns - rhs.copyAssigns;
+	  s.moveAssigns = moveAssigns - rhs.moveAssigns;
+	  s.destructs = destructs - rhs.destructs;
+	  return s;
+	}
+	// 生きているインスタンスの増減
+	int64_t live() const { return int64_t(constructs + copies + moves) - int64_t(destructs); }
+  };
+
+  template <typename Tag = void>
+  class Counted {
+  public:
+	// 今のスレッドの累計
+	static CopyMoveStats& stats() {
+	  static thread_local CopyMoveStats s;
+	  return s;
+	}
+
+	Counted() noexcept { ++stats().constructs; }
+	Counted(const Counted&) noexcept { ++stats().copies; }
+	Counted(Counted&&) noexcept { ++stats().moves; }
+	Counted& operator = (const Counted&) noexcept { ++stats().copyAssigns; return *this; }
+	Counted& operator = (Counted&&) noexcept { ++stats().moveAssigns; return *this; }
+	~Counted() { ++stats().destructs; }
+  };
+
+  // 作ってからのCounted<Tag>の回数
+  template <typename Tag = void>
+  class CountedScope {
+  public:
+	CountedScope() : start_(Counted<Tag>::stats()) {}
+	CopyMoveStats get() const { return Counted<Tag>::stats() - start_; }
+	uint64_t constructs() const { return get().constructs; }
+	uint64_t copies() const { return get().copies + get().copyAssigns; }
+	uint64_t moves() const { return get().moves + get().moveAssigns; }
+	uint64_t destructs() const { return get().destructs; }
+	void restart() { start_ = Counted<Tag>::stats(); }
+  private:
+	CopyMoveStats start_;
+  };
+
+}} // ts::instrument